@@ -0,0 +1,83 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "captureBowlerServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "mockBowlerServer.hpp"
+#include "noopPacket.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t REQUESTS_PER_ITERATION = 64;
+
+/**
+ * The cost of one request through DefaultBowlerComs over a CaptureBowlerServer, which captures the
+ * request and its reply. The argument turns capture off (`0`) or on (`1`); build with
+ * `BOWLER_DISABLE_CAPTURE` to measure the pass-through alone.
+ */
+void captureComsLoop(bowlerbench::State &state) {
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  auto *capture = new CaptureBowlerServer<DEFAULT_PACKET_SIZE>(
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server), 256);
+  capture->setEnabled(state.getArg() != 0);
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<CaptureBowlerServer<DEFAULT_PACKET_SIZE>>(capture)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < REQUESTS_PER_ITERATION; i++) {
+      server->readsToSend.push(request);
+      coms.loop();
+      server->writesReceived.pop();
+    }
+  }
+
+  state.setItemsProcessed(state.getIterations() * REQUESTS_PER_ITERATION);
+  state.setCounter("captured", double(capture->getStats().captured));
+}
+
+/**
+ * The cost of streaming a full ring out as pcap.
+ */
+void captureReadPcap(bowlerbench::State &state) {
+  const std::size_t capacity = 256;
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  CaptureBowlerServer<DEFAULT_PACKET_SIZE> capture{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server), capacity};
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> frame{2};
+  std::array<std::uint8_t, 512> buffer;
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < capacity; i++) {
+      capture.write(frame);
+    }
+    std::int32_t length;
+    for (std::uint32_t offset = 0;
+         (length = capture.readPcap(offset, buffer.data(), buffer.size())) > 0;
+         offset += length) {
+    }
+    server->writesReceived = {};
+  }
+
+  state.setItemsProcessed(state.getIterations() * capacity);
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(captureComsLoop, 0, 1);
+BOWLER_BENCHMARK(captureReadPcap);
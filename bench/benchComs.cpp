@@ -0,0 +1,243 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "defaultBowlerComs.hpp"
+#include "mockBowlerServer.hpp"
+#include "noopPacket.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t REQUESTS_PER_ITERATION = 64;
+
+/**
+ * Runs `Bench<N>::run` for the frame size given as the argument of the run.
+ */
+template <template <std::size_t> class Bench> void byFrameSize(bowlerbench::State &state) {
+  switch (state.getArg()) {
+  case 4:
+    Bench<4>::run(state);
+    break;
+  case 16:
+    Bench<16>::run(state);
+    break;
+  case 64:
+    Bench<64>::run(state);
+    break;
+  case 256:
+    Bench<256>::run(state);
+    break;
+  case 512:
+    Bench<512>::run(state);
+    break;
+  case 1400:
+    Bench<1400>::run(state);
+    break;
+  }
+}
+
+/**
+ * Feeds requests through DefaultBowlerComs, one per loop, and drops the replies.
+ */
+template <std::size_t N>
+void runRequests(bowlerbench::State &state,
+                 MockBowlerServer<N> *server,
+                 DefaultBowlerComs<N> &coms,
+                 const std::vector<std::array<std::uint8_t, N>> &requests) {
+  std::size_t next = 0;
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < REQUESTS_PER_ITERATION; i++) {
+      server->readsToSend.push(requests[next]);
+      next = next + 1 == requests.size() ? 0 : next + 1;
+      coms.loop();
+      server->writesReceived.pop();
+    }
+  }
+
+  state.setItemsProcessed(state.getIterations() * REQUESTS_PER_ITERATION);
+}
+
+/**
+ * An unreliable request to a NoopPacket.
+ */
+template <std::size_t N> struct Unreliable {
+  static void run(bowlerbench::State &state) {
+    auto *server = new MockBowlerServer<N>();
+    DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server)};
+    coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, false)));
+
+    std::array<std::uint8_t, N> request{};
+    request[0] = 2;
+    runRequests<N>(state, server, coms, {request});
+  }
+};
+
+/**
+ * A reliable request to a NoopPacket, alternating seqnums so that each one is new.
+ */
+template <std::size_t N> struct Reliable {
+  static void run(bowlerbench::State &state) {
+    auto *server = new MockBowlerServer<N>();
+    DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server)};
+    coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, true)));
+
+    std::array<std::uint8_t, N> request{};
+    request[0] = 2;
+    std::array<std::uint8_t, N> next = request;
+    next[1] = 1;
+    runRequests<N>(state, server, coms, {request, next});
+  }
+};
+
+/**
+ * A reliable request which repeats the last seqnum, as a retransmission does, so it is ACKed
+ * without running the event.
+ */
+template <std::size_t N> struct Duplicate {
+  static void run(bowlerbench::State &state) {
+    auto *server = new MockBowlerServer<N>();
+    DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server)};
+    coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, true)));
+
+    std::array<std::uint8_t, N> request{};
+    request[0] = 2;
+    server->readsToSend.push(request);
+    coms.loop();
+    server->writesReceived.pop();
+    runRequests<N>(state, server, coms, {request});
+  }
+};
+
+void comsUnreliable(bowlerbench::State &state) {
+  byFrameSize<Unreliable>(state);
+}
+
+void comsReliable(bowlerbench::State &state) {
+  byFrameSize<Reliable>(state);
+}
+
+void comsDuplicate(bowlerbench::State &state) {
+  byFrameSize<Duplicate>(state);
+}
+
+/**
+ * Unreliable requests spread over the argument's number of registered packets, to show what
+ * looking up the handler costs as the device grows.
+ */
+void comsDispatch(bowlerbench::State &state) {
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server)};
+
+  std::vector<std::array<std::uint8_t, DEFAULT_PACKET_SIZE>> requests;
+  for (std::int64_t i = 0; i < state.getArg(); i++) {
+    const std::uint8_t id = 2 + i;
+    coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(id, false)));
+    requests.push_back({id});
+  }
+
+  runRequests<DEFAULT_PACKET_SIZE>(state, server, coms, requests);
+}
+
+/**
+ * A request for an id with no packet, which is answered with a cleared payload. The error it logs
+ * is part of the cost, so stderr is sent to /dev/null for the run.
+ */
+void comsUnknownId(bowlerbench::State &state) {
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server)};
+
+  std::fflush(stderr);
+  const int savedStderr = dup(STDERR_FILENO);
+  const int devNull = open("/dev/null", O_WRONLY);
+  dup2(devNull, STDERR_FILENO);
+  runRequests<DEFAULT_PACKET_SIZE>(state, server, coms, {{42}});
+  std::fflush(stderr);
+  dup2(savedStderr, STDERR_FILENO);
+  close(devNull);
+  close(savedStderr);
+}
+
+/**
+ * addEnsuredPackets() with the argument's number of ensured packets, which allocates each of them.
+ * Removing them again is not measured.
+ */
+void comsAddEnsuredPackets(bowlerbench::State &state) {
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server)};
+  for (std::int64_t i = 0; i < state.getArg(); i++) {
+    const std::uint8_t id = 2 + i;
+    coms.addEnsuredPacket(
+      [id]() { return std::shared_ptr<NoopPacket>(new NoopPacket(id, true)); });
+  }
+
+  while (state.keepRunning()) {
+    coms.addEnsuredPackets();
+
+    state.pauseTiming();
+    for (auto &&id : coms.getAllPacketIDs()) {
+      coms.removePacket(id);
+    }
+    state.resumeTiming();
+  }
+
+  state.setItemsProcessed(state.getIterations() * state.getArg());
+}
+
+/**
+ * OPERATION_DISCONNECT_ID through the coms with the argument's number of packets attached. Adding
+ * them back is not measured.
+ */
+void comsDisconnect(bowlerbench::State &state) {
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server)};
+  for (std::int64_t i = 0; i < state.getArg(); i++) {
+    const std::uint8_t id = 2 + i;
+    coms.addEnsuredPacket(
+      [id]() { return std::shared_ptr<NoopPacket>(new NoopPacket(id, true)); });
+  }
+  coms.addEnsuredPackets();
+
+  // A disconnect leaves the management packet waiting for seqnum 0, so every request uses it
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{
+    SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_DISCONNECT_ID};
+  while (state.keepRunning()) {
+    server->readsToSend.push(request);
+    coms.loop();
+
+    state.pauseTiming();
+    server->writesReceived.pop();
+    coms.addEnsuredPackets();
+    state.resumeTiming();
+  }
+
+  state.setItemsProcessed(state.getIterations());
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(comsUnreliable, 4, 16, 64, 256, 512, 1400);
+BOWLER_BENCHMARK_ARGS(comsReliable, 4, 16, 64, 256, 512, 1400);
+BOWLER_BENCHMARK_ARGS(comsDuplicate, 4, 16, 64, 256, 512, 1400);
+BOWLER_BENCHMARK_ARGS(comsDispatch, 1, 16, 64, 254);
+BOWLER_BENCHMARK(comsUnknownId);
+BOWLER_BENCHMARK_ARGS(comsAddEnsuredPackets, 1, 16, 64);
+BOWLER_BENCHMARK_ARGS(comsDisconnect, 1, 16, 64);
@@ -0,0 +1,155 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "busyPacket.hpp"
+#include "deviceSimulator.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t BATCH = 64;
+const std::size_t THREADS = 4;
+// Requests the host has outstanding at each device in a round
+const std::size_t REQUESTS_PER_DEVICE = 4;
+const int TIMEOUT_MS = 100;
+
+/**
+ * A host talking to every device of a DeviceSimulator from one socket.
+ */
+class FleetClient {
+  public:
+  explicit FleetClient(const DeviceSimulator<DEFAULT_PACKET_SIZE> &isimulator) {
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    // Room for the replies of a whole round
+    const int bufferSize = 8 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    for (std::size_t i = 0; i < isimulator.getDeviceCount(); i++) {
+      sockaddr_in address{};
+      address.sin_family = AF_INET;
+      address.sin_port = htons(isimulator.getPort(i));
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      for (std::size_t j = 0; j < REQUESTS_PER_DEVICE; j++) {
+        addresses.push_back(address);
+      }
+    }
+  }
+
+  ~FleetClient() {
+    close(fd);
+  }
+
+  FleetClient(const FleetClient &) = delete;
+  FleetClient &operator=(const FleetClient &) = delete;
+
+  /**
+   * Sends REQUESTS_PER_DEVICE requests to every device, then collects the replies.
+   *
+   * @return The number of replies received before the timeout.
+   */
+  std::size_t round(const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> &irequest) {
+    std::array<mmsghdr, BATCH> messages{};
+    iovec vector{const_cast<std::uint8_t *>(irequest.data()), irequest.size()};
+    for (std::size_t sent = 0; sent < addresses.size();) {
+      const std::size_t count = std::min(BATCH, addresses.size() - sent);
+      for (std::size_t i = 0; i < count; i++) {
+        messages[i].msg_hdr = msghdr{};
+        messages[i].msg_hdr.msg_name = &addresses[sent + i];
+        messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        messages[i].msg_hdr.msg_iov = &vector;
+        messages[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      const int result = sendmmsg(fd, messages.data(), count, 0);
+      if (result > 0) {
+        sent += result;
+      }
+    }
+
+    std::array<std::array<std::uint8_t, DEFAULT_PACKET_SIZE>, BATCH> frames;
+    std::array<iovec, BATCH> vectors;
+    for (std::size_t i = 0; i < BATCH; i++) {
+      vectors[i] = iovec{frames[i].data(), frames[i].size()};
+      messages[i].msg_hdr = msghdr{};
+      messages[i].msg_hdr.msg_iov = &vectors[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t received = 0;
+    pollfd pollFd{fd, POLLIN, 0};
+    while (received < addresses.size() && poll(&pollFd, 1, TIMEOUT_MS) > 0) {
+      const int result = recvmmsg(fd, messages.data(), BATCH, MSG_DONTWAIT, nullptr);
+      if (result > 0) {
+        received += result;
+      }
+    }
+    return received;
+  }
+
+  private:
+  int fd;
+  std::vector<sockaddr_in> addresses;
+};
+
+/**
+ * Aggregate packets per second through a DeviceSimulator of `idevices` devices on THREADS threads,
+ * each with a BusyPacket of the given cost in microseconds. The host sends REQUESTS_PER_DEVICE
+ * unreliable requests to every device from one thread, then waits for the replies, so the rate
+ * includes the host's half of every round trip.
+ */
+void runFleet(bowlerbench::State &state, std::size_t idevices, time_t icost) {
+  DeviceSimulator<DEFAULT_PACKET_SIZE> simulator(THREADS);
+  auto setup = [icost](std::size_t, DefaultBowlerComs<DEFAULT_PACKET_SIZE> &icoms) {
+    icoms.addPacket(std::shared_ptr<BusyPacket>(new BusyPacket(2, false, icost)));
+  };
+  for (std::size_t i = 0; i < idevices; i++) {
+    simulator.addDevice(htonl(INADDR_LOOPBACK), 0, setup);
+  }
+  simulator.start();
+
+  FleetClient client(simulator);
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  const std::size_t requests = idevices * REQUESTS_PER_DEVICE;
+  std::size_t replies = 0;
+  while (state.keepRunning()) {
+    replies += client.round(request);
+  }
+  simulator.stop();
+
+  const DeviceSimulatorStats stats = simulator.getStats();
+  state.setItemsProcessed(replies);
+  state.setCounter("lost", double(state.getIterations() * requests - replies));
+  state.setCounter("requestsPerWakeup", double(stats.requests) / stats.wakeups);
+}
+
+/**
+ * The argument is the number of devices, with free handlers.
+ */
+void simulatedFleet(bowlerbench::State &state) {
+  runFleet(state, state.getArg(), 0);
+}
+
+/**
+ * 128 devices, with handlers costing the argument in microseconds.
+ */
+void simulatedFleetHandlerCost(bowlerbench::State &state) {
+  runFleet(state, 128, state.getArg());
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(simulatedFleet, 16, 128, 512);
+BOWLER_BENCHMARK_ARGS(simulatedFleetHandlerCost, 0, 10, 100);
@@ -0,0 +1,89 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "defaultBowlerComs.hpp"
+#include "mockBowlerServer.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+/**
+ * A Packet whose event busy-waits for a fixed time, standing in for a handler doing real work.
+ */
+class SpinPacket : public Packet {
+  public:
+  SpinPacket(std::uint8_t iid, time_t icost, bool iisIndependent)
+    : Packet(iid, false, iisIndependent), cost(icost) {
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    const time_t start = getTime();
+    while (getTime() - start < cost) {
+    }
+    return 1;
+  }
+
+  private:
+  time_t cost;
+};
+
+const std::size_t REQUESTS_PER_ITERATION = 64;
+const std::uint8_t FIRST_ID = 2;
+const std::uint8_t SLOW_IDS = 4;
+const std::uint8_t FAST_IDS = 12;
+const time_t SLOW_COST = 200;
+const time_t FAST_COST = 10;
+
+/**
+ * Mixed handler costs: a few slow ids and many fast ones, requested round-robin. The argument is
+ * the number of executor workers, where `0` runs every event inline in loop().
+ */
+void executorMixedCosts(bowlerbench::State &state) {
+  const std::size_t workers = state.getArg();
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  std::unique_ptr<PacketExecutor<DEFAULT_PACKET_SIZE>> executor;
+  if (workers > 0) {
+    executor.reset(new PacketExecutor<DEFAULT_PACKET_SIZE>(workers));
+  }
+
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server), std::move(executor)};
+
+  for (std::uint8_t i = 0; i < SLOW_IDS + FAST_IDS; i++) {
+    const time_t cost = i < SLOW_IDS ? SLOW_COST : FAST_COST;
+    coms.addPacket(std::shared_ptr<SpinPacket>(new SpinPacket(FIRST_ID + i, cost, true)));
+  }
+
+  std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{};
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < REQUESTS_PER_ITERATION; i++) {
+      request[0] = FIRST_ID + i % (SLOW_IDS + FAST_IDS);
+      server->readsToSend.push(request);
+    }
+
+    while (server->writesReceived.size() < REQUESTS_PER_ITERATION) {
+      coms.loop();
+    }
+
+    std::queue<std::array<std::uint8_t, DEFAULT_PACKET_SIZE>>().swap(server->writesReceived);
+  }
+
+  state.setItemsProcessed(state.getIterations() * REQUESTS_PER_ITERATION);
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(executorMixedCosts, 0, 2, 3, 4, 6, 8);
@@ -0,0 +1,259 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerGateway.hpp"
+#include "bowlerLinuxUdpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t BURST = 64;
+const std::size_t FRAME_LENGTH = DEFAULT_PACKET_SIZE + 1;
+
+/**
+ * A device simulated with a coms on its own loopback UDP port.
+ */
+struct SimulatedDevice {
+  SimulatedDevice() : server(new LinuxUDPServer<DEFAULT_PACKET_SIZE>(0)) {
+    server->begin(htonl(INADDR_LOOPBACK));
+    coms.reset(new DefaultBowlerComs<DEFAULT_PACKET_SIZE>(
+      std::unique_ptr<LinuxUDPServer<DEFAULT_PACKET_SIZE>>(server)));
+    coms->addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+  }
+
+  LinuxUDPServer<DEFAULT_PACKET_SIZE> *server;
+  std::unique_ptr<DefaultBowlerComs<DEFAULT_PACKET_SIZE>> coms;
+};
+
+/**
+ * A host socket connected to the gateway on loopback.
+ */
+class GatewayClient {
+  public:
+  explicit GatewayClient(std::uint16_t iport) {
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(iport);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  }
+
+  ~GatewayClient() {
+    close(fd);
+  }
+
+  /**
+   * Sends a burst of requests spread round-robin over the devices at addresses `0` to
+   * `ideviceCount - 1`.
+   */
+  void sendBurst(std::size_t ideviceCount, std::size_t icount = BURST) {
+    std::array<std::array<std::uint8_t, FRAME_LENGTH>, BURST> requests{};
+    std::array<iovec, BURST> vectors;
+    std::array<mmsghdr, BURST> messages{};
+    for (std::size_t i = 0; i < BURST; i++) {
+      requests[i][0] = i % ideviceCount;
+      requests[i][1] = 2;
+      vectors[i] = iovec{requests[i].data(), FRAME_LENGTH};
+      messages[i].msg_hdr.msg_iov = &vectors[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t sent = 0;
+    while (sent < icount) {
+      const int result = sendmmsg(fd, messages.data() + sent, icount - sent, 0);
+      if (result > 0) {
+        sent += result;
+      }
+    }
+  }
+
+  /**
+   * @return The number of replies that were waiting.
+   */
+  std::size_t receiveAll() {
+    std::array<std::array<std::uint8_t, FRAME_LENGTH>, BURST> frames;
+    std::array<iovec, BURST> vectors;
+    std::array<mmsghdr, BURST> messages{};
+    for (std::size_t i = 0; i < BURST; i++) {
+      vectors[i] = iovec{frames[i].data(), FRAME_LENGTH};
+      messages[i].msg_hdr.msg_iov = &vectors[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t received = 0;
+    int result;
+    while ((result = recvmmsg(fd, messages.data(), BURST, MSG_DONTWAIT, nullptr)) > 0) {
+      received += result;
+    }
+    return received;
+  }
+
+  int getFd() const {
+    return fd;
+  }
+
+  private:
+  int fd;
+};
+
+/**
+ * Requests per second forwarded through a BowlerGateway to simulated devices and back, all on
+ * one thread. The argument is the number of devices the bursts are spread over.
+ */
+void gatewayForwarding(bowlerbench::State &state) {
+  const std::size_t deviceCount = state.getArg();
+  std::vector<std::unique_ptr<SimulatedDevice>> devices;
+  auto *upstream = new LinuxUDPServer<FRAME_LENGTH>(0);
+  upstream->begin(htonl(INADDR_LOOPBACK));
+  GatewayClient client(upstream->getPort());
+  BowlerGateway<DEFAULT_PACKET_SIZE> gateway{
+    std::unique_ptr<LinuxUDPServer<FRAME_LENGTH>>(upstream)};
+
+  for (std::size_t i = 0; i < deviceCount; i++) {
+    devices.emplace_back(new SimulatedDevice());
+    auto *link = new UDPDeviceLink<DEFAULT_PACKET_SIZE>();
+    link->begin(htonl(INADDR_LOOPBACK), devices.back()->server->getPort());
+    gateway.addDevice(i, std::unique_ptr<UDPDeviceLink<DEFAULT_PACKET_SIZE>>(link));
+  }
+
+  std::size_t replies = 0;
+  while (state.keepRunning()) {
+    client.sendBurst(deviceCount);
+
+    // Pump until the gateway has nothing left to move in either direction
+    std::size_t received = 0;
+    for (std::size_t idle = 0; received < BURST && idle < 1000;) {
+      const std::size_t moved = gateway.poll();
+      for (auto &&device : devices) {
+        device->coms->loop();
+        device->server->flush();
+      }
+      received += client.receiveAll();
+      idle = moved == 0 ? idle + 1 : 0;
+    }
+    replies += received;
+  }
+
+  const auto &stats = gateway.getStats();
+  state.setItemsProcessed(state.getIterations() * BURST);
+  state.setCounter("lost", double(state.getIterations() * BURST - replies));
+  state.setCounter("unknownDevice", double(stats.unknownDevice));
+}
+
+/**
+ * Requests per second through GatewayShards. The shards share one port with `SO_REUSEPORT` and
+ * each has its own links to the devices, which run on one extra thread. The argument is the number
+ * of shards; the bursts come from eight host sockets, which the kernel spreads over the shards.
+ * Only meaningful with at least as many cores as threads.
+ */
+void gatewaySharded(bowlerbench::State &state) {
+  const std::size_t deviceCount = 8;
+  const std::size_t clientCount = 8;
+  // Small enough that the requests in flight fit in the socket buffers
+  const std::size_t clientBurst = 8;
+  std::vector<std::unique_ptr<SimulatedDevice>> devices;
+  for (std::size_t i = 0; i < deviceCount; i++) {
+    devices.emplace_back(new SimulatedDevice());
+  }
+
+  // The first shard picks a free port and the others bind to it
+  std::atomic<std::uint16_t> port{0};
+  std::atomic<std::size_t> ready{0};
+  GatewayShards<DEFAULT_PACKET_SIZE> shards(
+    state.getArg(),
+    [&](std::size_t ishard, std::vector<int> &ifds) {
+      while (ishard > 0 && port.load() == 0) {
+        std::this_thread::yield();
+      }
+
+      auto *upstream = new LinuxUDPServer<FRAME_LENGTH>(port.load());
+      upstream->begin(htonl(INADDR_LOOPBACK), true);
+      port.store(upstream->getPort());
+      ifds.push_back(upstream->getFd());
+
+      std::unique_ptr<BowlerGateway<DEFAULT_PACKET_SIZE>> gateway(
+        new BowlerGateway<DEFAULT_PACKET_SIZE>(
+          std::unique_ptr<LinuxUDPServer<FRAME_LENGTH>>(upstream)));
+      for (std::size_t i = 0; i < deviceCount; i++) {
+        auto *link = new UDPDeviceLink<DEFAULT_PACKET_SIZE>();
+        link->begin(htonl(INADDR_LOOPBACK), devices[i]->server->getPort());
+        ifds.push_back(link->getFd());
+        gateway->addDevice(i, std::unique_ptr<UDPDeviceLink<DEFAULT_PACKET_SIZE>>(link));
+      }
+
+      ready++;
+      return gateway;
+    },
+    1);
+  shards.start();
+  while (ready.load() < shards.getShardCount()) {
+    std::this_thread::yield();
+  }
+
+  std::atomic<bool> stopping{false};
+  std::thread deviceThread([&] {
+    std::vector<pollfd> pollFds;
+    for (auto &&device : devices) {
+      pollFds.push_back(pollfd{device->server->getFd(), POLLIN, 0});
+    }
+
+    while (!stopping.load()) {
+      ::poll(pollFds.data(), pollFds.size(), 1);
+      for (auto &&device : devices) {
+        device->coms->loop();
+        device->server->flush();
+      }
+    }
+  });
+
+  std::vector<std::unique_ptr<GatewayClient>> clients;
+  std::vector<pollfd> clientFds;
+  for (std::size_t i = 0; i < clientCount; i++) {
+    clients.emplace_back(new GatewayClient(port.load()));
+    clientFds.push_back(pollfd{clients.back()->getFd(), POLLIN, 0});
+  }
+
+  std::size_t replies = 0;
+  while (state.keepRunning()) {
+    for (auto &&client : clients) {
+      client->sendBurst(deviceCount, clientBurst);
+    }
+
+    std::size_t received = 0;
+    while (received < clientCount * clientBurst &&
+           ::poll(clientFds.data(), clientFds.size(), 100) > 0) {
+      for (auto &&client : clients) {
+        received += client->receiveAll();
+      }
+    }
+    replies += received;
+  }
+
+  shards.stop();
+  stopping = true;
+  deviceThread.join();
+
+  state.setItemsProcessed(state.getIterations() * clientCount * clientBurst);
+  state.setCounter("lost", double(state.getIterations() * clientCount * clientBurst - replies));
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(gatewayForwarding, 1, 8, 64);
+BOWLER_BENCHMARK_ARGS(gatewaySharded, 1, 2, 4);
@@ -0,0 +1,140 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "defaultBowlerComs.hpp"
+#include "impairedBowlerServer.hpp"
+#include "mockBowlerServer.hpp"
+#include "noopPacket.hpp"
+#include <cstring>
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t N = DEFAULT_PACKET_SIZE;
+// A WiFi link to a device a room away, in microseconds of the VirtualClock, each way
+const time_t LINK_DELAY = 2000;
+const time_t LINK_JITTER = 1000;
+const double MEAN_BURST_LENGTH = 2;
+const double DUPLICATE = 0.001;
+const double REORDER = 0.01;
+const time_t REORDER_DELAY = 3000;
+// How often the device runs its loop, and how long the host waits for a reply before giving up on
+// a request or sending it again
+const time_t LOOP_PERIOD = 100;
+const time_t RETRANSMIT_TIMEOUT = 20000;
+const std::uint64_t SEED = 0x5EED;
+const std::int64_t HIGHEST_NS = 10LL * 1000 * 1000 * 1000;
+
+/**
+ * A host polling a NoopPacket over a link with the argument's loss rate in percent, bursty with a
+ * mean of MEAN_BURST_LENGTH frames lost in a row, both ways. The link runs on a VirtualClock, so
+ * the run is the same on every machine and the time per iteration is only the cost of simulating
+ * it; what matters are the counters, which are in simulated time:
+ * - goodputBps: payload bytes of completed requests per second.
+ * - p50us and the rest: the time from first sending a request to receiving its reply.
+ * - retransmits: requests sent again, per completed request (reliable).
+ * - lostPct: requests which never got a reply (unreliable).
+ *
+ * The host waits for each reply before sending the next request. Reliable requests are sent again
+ * with the same seqnum until they are ACKed; unreliable ones are given up on after the same
+ * timeout. Each unreliable request carries a counter in its payload, which the NoopPacket leaves
+ * in the reply, so that a late reply is not taken for that of the next request.
+ */
+template <bool Reliable> void impairedLink(bowlerbench::State &state) {
+  VirtualClock clock(0);
+  ImpairmentConfig config = ImpairmentConfig::bursty(state.getArg() / 100.0, MEAN_BURST_LENGTH);
+  config.delay = LINK_DELAY;
+  config.jitter = LINK_JITTER;
+  config.duplicate = DUPLICATE;
+  config.reorder = REORDER;
+  config.reorderDelay = REORDER_DELAY;
+
+  auto *server = new MockBowlerServer<N>();
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(
+                              new ImpairedBowlerServer<N>(std::unique_ptr<BowlerServer<N>>(server),
+                                                          config,
+                                                          SEED,
+                                                          clock)),
+                            clock};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, Reliable)));
+
+  bowlerbench::HdrHistogram latencies(HIGHEST_NS);
+  std::uint64_t requests = 0;
+  std::uint64_t completed = 0;
+  std::uint64_t retransmits = 0;
+  std::array<std::uint8_t, N> request{};
+  request[0] = 2;
+  while (state.keepRunning()) {
+    const std::uint32_t tag = std::uint32_t(requests++);
+    std::memcpy(request.data() + HEADER_LENGTH, &tag, sizeof(tag));
+    const time_t start = clock.now();
+    time_t sent = start;
+    server->readsToSend.push(request);
+
+    bool replied = false;
+    while (!replied) {
+      clock.advance(LOOP_PERIOD);
+      coms.loop();
+      for (; !server->writesReceived.empty(); server->writesReceived.pop()) {
+        const auto &reply = server->writesReceived.front();
+        if (Reliable) {
+          replied |= reply[0] == request[0] && reply[2] == request[1];
+        } else {
+          replied |= std::memcmp(reply.data(), request.data(), HEADER_LENGTH + sizeof(tag)) == 0;
+        }
+      }
+
+      if (replied) {
+        latencies.record((clock.now() - start) * 1000);
+        completed++;
+      } else if (clock.now() - sent >= RETRANSMIT_TIMEOUT) {
+        if (!Reliable) {
+          break;
+        }
+        server->readsToSend.push(request);
+        sent = clock.now();
+        retransmits++;
+      }
+    }
+
+    if (Reliable) {
+      request[1] ^= 1;
+    }
+  }
+
+  const double seconds = clock.now() / 1e6;
+  state.setItemsProcessed(completed);
+  state.setLatencyPercentiles(latencies);
+  state.setCounter("goodputBps", completed * (N - HEADER_LENGTH) / seconds);
+  if (Reliable) {
+    state.setCounter("retransmits", double(retransmits) / completed);
+  } else {
+    state.setCounter("lostPct", 100.0 * (requests - completed) / requests);
+  }
+}
+
+void impairedReliable(bowlerbench::State &state) {
+  impairedLink<true>(state);
+}
+
+void impairedUnreliable(bowlerbench::State &state) {
+  impairedLink<false>(state);
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(impairedReliable, 0, 1, 2, 5, 10, 20, 30);
+BOWLER_BENCHMARK_ARGS(impairedUnreliable, 0, 1, 2, 5, 10, 20, 30);
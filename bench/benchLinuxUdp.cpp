@@ -0,0 +1,123 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerLinuxUdpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t BURST = 64;
+
+/**
+ * A client socket connected to a server on loopback.
+ */
+class LoopbackClient {
+  public:
+  explicit LoopbackClient(std::uint16_t iport) {
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(iport);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  }
+
+  ~LoopbackClient() {
+    close(fd);
+  }
+
+  void sendBurst(const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> &irequest) {
+    std::array<mmsghdr, BURST> messages{};
+    iovec vector{const_cast<std::uint8_t *>(irequest.data()), irequest.size()};
+    for (auto &&message : messages) {
+      message.msg_hdr.msg_iov = &vector;
+      message.msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t sent = 0;
+    while (sent < BURST) {
+      const int result = sendmmsg(fd, messages.data() + sent, BURST - sent, 0);
+      if (result > 0) {
+        sent += result;
+      }
+    }
+  }
+
+  /**
+   * @return The number of replies that were waiting.
+   */
+  std::size_t receiveAll() {
+    std::array<std::array<std::uint8_t, DEFAULT_PACKET_SIZE>, BURST> frames;
+    std::array<iovec, BURST> vectors;
+    std::array<mmsghdr, BURST> messages{};
+    for (std::size_t i = 0; i < BURST; i++) {
+      vectors[i] = iovec{frames[i].data(), frames[i].size()};
+      messages[i].msg_hdr.msg_iov = &vectors[i];
+      messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t received = 0;
+    int result;
+    while ((result = recvmmsg(fd, messages.data(), BURST, MSG_DONTWAIT, nullptr)) > 0) {
+      received += result;
+    }
+    return received;
+  }
+
+  private:
+  int fd;
+};
+
+/**
+ * Packets per second through DefaultBowlerComs over loopback UDP. The client and the server share
+ * one thread: the client sends a burst, the coms handles it, and the client collects the replies.
+ * The argument is the server's batch size, so `1` is one syscall per datagram.
+ */
+void linuxUdpLoopback(bowlerbench::State &state) {
+  auto *server = new LinuxUDPServer<DEFAULT_PACKET_SIZE>(0, state.getArg());
+  server->begin(htonl(INADDR_LOOPBACK));
+  LoopbackClient client(server->getPort());
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<LinuxUDPServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  std::size_t replies = 0;
+  while (state.keepRunning()) {
+    client.sendBurst(request);
+
+    const auto target = coms.getRequestCount() + BURST;
+    while (coms.getRequestCount() != target) {
+      coms.loop();
+    }
+
+    // The replies of the last batch are sent once the coms finds no more data
+    server->flush();
+    replies += client.receiveAll();
+  }
+
+  const auto &stats = server->getStats();
+  state.setItemsProcessed(state.getIterations() * BURST);
+  state.setCounter("lost", double(state.getIterations() * BURST - replies));
+  state.setCounter("datagramsPerRecv", double(stats.datagramsReceived) / stats.receiveCalls);
+  state.setCounter("datagramsPerSend", double(stats.datagramsSent) / stats.sendCalls);
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(linuxUdpLoopback, 1, 8, 32, 64);
@@ -0,0 +1,71 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "binaryLog.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t CALLS_PER_ITERATION = 16;
+
+/**
+ * The cost of one log call with the arguments of a typical error, recorded in the ring. The ring
+ * is emptied between iterations, without formatting, so that no call is dropped.
+ */
+void binaryLogCall(bowlerbench::State &state) {
+  BinaryLog log;
+  const std::uint16_t format = log.intern(__FILE__, __LINE__, "Error writing: %d %s\n");
+
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < CALLS_PER_ITERATION; i++) {
+      log.log(format, int(i), "Resource temporarily unavailable");
+    }
+    while (log.peek()) {
+      log.pop();
+    }
+  }
+
+  state.setItemsProcessed(state.getIterations() * CALLS_PER_ITERATION);
+  state.setCounter("dropped", double(log.getDropped()));
+}
+
+/**
+ * The cost of formatting the same call on the spot, the floor of any synchronous logger before it
+ * writes a byte.
+ */
+void formattedLogCall(bowlerbench::State &state) {
+  char message[128];
+  volatile char sink = 0;
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < CALLS_PER_ITERATION; i++) {
+      const int prefix = std::snprintf(message, sizeof(message), "%s:%d: ", __FILE__, __LINE__);
+      std::snprintf(message + prefix,
+                    sizeof(message) - prefix,
+                    "Error writing: %d %s\n",
+                    int(i),
+                    "Resource temporarily unavailable");
+      sink = message[prefix];
+    }
+  }
+
+  (void)sink;
+  state.setItemsProcessed(state.getIterations() * CALLS_PER_ITERATION);
+}
+} // namespace
+
+BOWLER_BENCHMARK(binaryLogCall);
+BOWLER_BENCHMARK(formattedLogCall);
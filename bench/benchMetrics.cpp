@@ -0,0 +1,69 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "comsMetrics.hpp"
+#include "defaultBowlerComs.hpp"
+#include "mockBowlerServer.hpp"
+#include "noopPacket.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t REQUESTS_PER_ITERATION = 64;
+
+/**
+ * The cost of one request through DefaultBowlerComs with a no-op handler. Build with and without
+ * `BOWLER_DISABLE_METRICS` to measure what collecting metrics costs per request.
+ */
+void metricsComsLoop(bowlerbench::State &state) {
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < REQUESTS_PER_ITERATION; i++) {
+      server->readsToSend.push(request);
+      coms.loop();
+      server->writesReceived.pop();
+    }
+  }
+
+  state.setItemsProcessed(state.getIterations() * REQUESTS_PER_ITERATION);
+}
+
+/**
+ * The cost of recording one handler time, including reading the clock twice.
+ */
+void metricsRecordHandlerTime(bowlerbench::State &state) {
+  ComsMetrics metrics;
+  metrics.addPacket(2);
+
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < REQUESTS_PER_ITERATION; i++) {
+      const time_t start = ComsMetrics::now();
+      metrics.onHandled(2, ComsMetrics::now() - start + i);
+    }
+  }
+
+  state.setItemsProcessed(state.getIterations() * REQUESTS_PER_ITERATION);
+}
+} // namespace
+
+BOWLER_BENCHMARK(metricsComsLoop);
+BOWLER_BENCHMARK(metricsRecordHandlerTime);
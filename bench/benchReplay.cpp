@@ -0,0 +1,137 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "defaultBowlerComs.hpp"
+#include "mockBowlerServer.hpp"
+#include "mockByteStream.hpp"
+#include "noopPacket.hpp"
+#include "trafficRecording.hpp"
+#include <cstdlib>
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t REQUESTS_PER_ITERATION = 64;
+const std::size_t SYNTHETIC_FRAMES = 4096;
+
+/**
+ * The recording named by the `BOWLER_REPLAY` environment variable, or a synthetic one which mixes
+ * unreliable requests to ids 2, 3 and 4 with payloads of different lengths.
+ */
+const std::vector<std::uint8_t> &getRecording() {
+  static std::vector<std::uint8_t> recording;
+  if (!recording.empty()) {
+    return recording;
+  }
+
+  const char *path = std::getenv("BOWLER_REPLAY");
+  if (path && loadRecording(path, recording) != BOWLER_ERROR) {
+    return recording;
+  }
+
+  VirtualClock clock;
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  auto *sink = new MockByteStream();
+  RecordingBowlerServer<DEFAULT_PACKET_SIZE> recorder{
+    std::unique_ptr<BowlerServer<DEFAULT_PACKET_SIZE>>(server),
+    std::unique_ptr<ByteStream>(sink),
+    SYNTHETIC_FRAMES * (traffic::MAX_RECORD_HEADER_LENGTH + DEFAULT_PACKET_SIZE),
+    clock};
+
+  std::array<std::uint8_t, DEFAULT_PACKET_SIZE> frame;
+  for (std::size_t i = 0; i < SYNTHETIC_FRAMES; i++) {
+    frame.fill(0);
+    frame[0] = 2 + i % 3;
+    std::fill_n(frame.begin() + HEADER_LENGTH, 4 + 12 * (i % 3), std::uint8_t(i | 1));
+    server->readsToSend.push(frame);
+    recorder.read(frame);
+    clock.advance(500);
+  }
+
+  recorder.flush();
+  recording.assign(sink->bytesWritten.begin(), sink->bytesWritten.end());
+  return recording;
+}
+
+/**
+ * The cost of one request through DefaultBowlerComs over a RecordingBowlerServer.
+ */
+void recordComsLoop(bowlerbench::State &state) {
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  auto *sink = new MockByteStream();
+  auto *recorder = new RecordingBowlerServer<DEFAULT_PACKET_SIZE>(
+    std::unique_ptr<BowlerServer<DEFAULT_PACKET_SIZE>>(server), std::unique_ptr<ByteStream>(sink));
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<RecordingBowlerServer<DEFAULT_PACKET_SIZE>>(recorder)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2, 0, 0, 1, 2, 3, 4};
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < REQUESTS_PER_ITERATION; i++) {
+      server->readsToSend.push(request);
+      coms.loop();
+      server->writesReceived.pop();
+    }
+    sink->bytesWritten.clear();
+  }
+
+  state.setItemsProcessed(state.getIterations() * REQUESTS_PER_ITERATION);
+  state.setCounter("dropped", double(recorder->getStats().dropped));
+}
+
+/**
+ * Replays a recording as fast as possible through DefaultBowlerComs, with a NoopPacket for each id
+ * in it. Reports the latency of the busiest id in microseconds.
+ */
+void replayRecording(bowlerbench::State &state) {
+  const std::vector<std::uint8_t> &recording = getRecording();
+  const auto ids = ReplayBowlerServer<DEFAULT_PACKET_SIZE>::getPacketIds(recording);
+
+  std::uint64_t frames = 0;
+  std::uint32_t busiest = 0;
+  time_t p50 = 0, p99 = 0;
+  while (state.keepRunning()) {
+    auto *replay = new ReplayBowlerServer<DEFAULT_PACKET_SIZE>(recording);
+    DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+      std::unique_ptr<ReplayBowlerServer<DEFAULT_PACKET_SIZE>>(replay)};
+    for (auto &&id : ids) {
+      coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(id)));
+    }
+
+    while (!replay->isFinished()) {
+      coms.loop();
+    }
+
+    frames += replay->getFramesRead();
+    for (auto &&id : ids) {
+      const ReplayLatency &latency = replay->getLatency(id);
+      if (latency.replies >= busiest) {
+        busiest = latency.replies;
+        p50 = latency.histogram.getPercentile(0.5);
+        p99 = latency.histogram.getPercentile(0.99);
+      }
+    }
+  }
+
+  state.setItemsProcessed(frames);
+  state.setCounter("p50_us", double(p50));
+  state.setCounter("p99_us", double(p99));
+}
+} // namespace
+
+BOWLER_BENCHMARK(recordComsLoop);
+BOWLER_BENCHMARK(replayRecording);
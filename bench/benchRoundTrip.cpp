@@ -0,0 +1,220 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerLinuxUdpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+
+using namespace bowlerserver;
+
+namespace {
+// Round trips each client makes before anything is measured, to fill caches, fault in pages and
+// let the CPU settle on a frequency
+const std::size_t WARMUP_ROUND_TRIPS = 2000;
+const int TIMEOUT_MS = 100;
+// Round trips longer than this are counted as it
+const std::int64_t HIGHEST_NS = 1000LL * 1000 * 1000;
+
+/**
+ * Pins the calling thread to one CPU, counting modulo the number of CPUs. Does nothing on a single
+ * CPU, where pinning would only put the server and its clients on top of each other.
+ */
+void pinToCpu(unsigned icpu) {
+  const unsigned cpus = std::thread::hardware_concurrency();
+  if (cpus < 2) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(icpu % cpus, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/**
+ * A host client with a blocking socket, which waits for the reply to each request before sending
+ * the next, as a host polling a device does.
+ */
+template <std::size_t N> class RoundTripClient {
+  public:
+  RoundTripClient(std::uint16_t iport, bool ireliable) : reliable(ireliable) {
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    timeval timeout{0, TIMEOUT_MS * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(iport);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+
+    request.fill(0);
+    request[0] = 2;
+  }
+
+  ~RoundTripClient() {
+    close(fd);
+  }
+
+  RoundTripClient(const RoundTripClient &) = delete;
+  RoundTripClient &operator=(const RoundTripClient &) = delete;
+
+  /**
+   * Sends a request and waits for its reply. A request which times out is sent again with the same
+   * seqnum next time, as a host retransmits.
+   *
+   * @return The round trip in nanoseconds, or `-1` on timeout.
+   */
+  std::int64_t roundTrip() {
+    const auto start = std::chrono::steady_clock::now();
+    send(fd, request.data(), N, 0);
+    while (recv(fd, reply.data(), N, 0) == ssize_t(N)) {
+      // Skip the late reply to a request that timed out
+      if (reply[0] == request[0] && (!reliable || reply[2] == request[1])) {
+        if (reliable) {
+          request[1] ^= 1;
+        }
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now() - start)
+          .count();
+      }
+    }
+
+    timeouts++;
+    return -1;
+  }
+
+  std::uint64_t timeouts{0};
+
+  private:
+  int fd;
+  bool reliable;
+  std::array<std::uint8_t, N> request;
+  std::array<std::uint8_t, N> reply;
+};
+
+/**
+ * Round trips through DefaultBowlerComs over loopback UDP, with the coms spinning on its own thread
+ * pinned to CPU 0 and the argument's number of clients, each on its own thread pinned to the CPUs
+ * after it. The benchmark's own thread is the first client and sets the pace; the others keep
+ * sending for as long as it runs. Every client warms up before measuring starts, and the latencies
+ * of all of them go into one HdrHistogram, so the percentiles are those a host sees under that
+ * much concurrency.
+ */
+template <std::size_t N, bool Reliable> void udpRoundTrip(bowlerbench::State &state) {
+  const unsigned clients = std::max<std::int64_t>(state.getArg(), 1);
+  auto *server = new LinuxUDPServer<N>(0, 8);
+  server->begin(htonl(INADDR_LOOPBACK));
+  const std::uint16_t port = server->getPort();
+  DefaultBowlerComs<N> coms{std::unique_ptr<LinuxUDPServer<N>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, Reliable)));
+
+  std::atomic<bool> stopServer{false};
+  std::thread serverThread([&] {
+    pinToCpu(0);
+    while (!stopServer.load(std::memory_order_relaxed)) {
+      coms.loop();
+    }
+  });
+
+  std::vector<bowlerbench::HdrHistogram> histograms(clients, bowlerbench::HdrHistogram(HIGHEST_NS));
+  std::vector<std::uint64_t> timeouts(clients);
+  std::atomic<unsigned> warmedUp{0};
+  std::atomic<bool> measuring{false};
+  std::atomic<bool> stopClients{false};
+
+  std::vector<std::thread> background;
+  for (unsigned i = 1; i < clients; i++) {
+    background.emplace_back([&, i] {
+      pinToCpu(1 + i);
+      RoundTripClient<N> client(port, Reliable);
+      for (std::size_t j = 0; j < WARMUP_ROUND_TRIPS; j++) {
+        client.roundTrip();
+      }
+      warmedUp++;
+
+      while (!stopClients.load(std::memory_order_relaxed)) {
+        const std::int64_t latency = client.roundTrip();
+        if (measuring.load(std::memory_order_relaxed) && latency >= 0) {
+          histograms[i].record(latency);
+        }
+      }
+      timeouts[i] = client.timeouts;
+    });
+  }
+
+  // Measure from a pinned thread, and put the benchmark thread back where it was afterwards
+  cpu_set_t affinity;
+  pthread_getaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+  pinToCpu(1);
+  {
+    RoundTripClient<N> client(port, Reliable);
+    for (std::size_t j = 0; j < WARMUP_ROUND_TRIPS; j++) {
+      client.roundTrip();
+    }
+    while (warmedUp.load() != clients - 1) {
+      std::this_thread::yield();
+    }
+
+    measuring = true;
+    client.timeouts = 0;
+    while (state.keepRunning()) {
+      const std::int64_t latency = client.roundTrip();
+      if (latency >= 0) {
+        histograms[0].record(latency);
+      }
+    }
+    measuring = false;
+    timeouts[0] = client.timeouts;
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity);
+
+  stopClients = true;
+  for (auto &&thread : background) {
+    thread.join();
+  }
+  stopServer = true;
+  serverThread.join();
+
+  bowlerbench::HdrHistogram all(HIGHEST_NS);
+  std::uint64_t totalTimeouts = 0;
+  for (unsigned i = 0; i < clients; i++) {
+    all.add(histograms[i]);
+    totalTimeouts += timeouts[i];
+  }
+
+  state.setItemsProcessed(all.getTotal());
+  state.setLatencyPercentiles(all);
+  state.setCounter("timeouts", double(totalTimeouts));
+}
+
+#define ROUND_TRIP_CONCURRENCY 1, 4, 16
+
+bowlerbench::Registrar registrars[] = {
+  {"udpRoundTripUnreliable/16", udpRoundTrip<16, false>, {ROUND_TRIP_CONCURRENCY}},
+  {"udpRoundTripUnreliable/64", udpRoundTrip<64, false>, {ROUND_TRIP_CONCURRENCY}},
+  {"udpRoundTripUnreliable/256", udpRoundTrip<256, false>, {ROUND_TRIP_CONCURRENCY}},
+  {"udpRoundTripUnreliable/1400", udpRoundTrip<1400, false>, {ROUND_TRIP_CONCURRENCY}},
+  {"udpRoundTripReliable/16", udpRoundTrip<16, true>, {ROUND_TRIP_CONCURRENCY}},
+  {"udpRoundTripReliable/64", udpRoundTrip<64, true>, {ROUND_TRIP_CONCURRENCY}},
+  {"udpRoundTripReliable/256", udpRoundTrip<256, true>, {ROUND_TRIP_CONCURRENCY}},
+  {"udpRoundTripReliable/1400", udpRoundTrip<1400, true>, {ROUND_TRIP_CONCURRENCY}}};
+} // namespace
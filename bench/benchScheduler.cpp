@@ -0,0 +1,49 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerScheduler.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t LOOPS_PER_ITERATION = 64;
+
+/**
+ * The cost of one Scheduler::loop() on the system clock, profiling included, with as many empty
+ * tasks due on every loop as the argument. The overhead of the profiler is the difference from a
+ * build of the scheduler without it.
+ */
+void schedulerLoop(bowlerbench::State &state) {
+  Scheduler scheduler;
+  scheduler.setTargetPeriod(500);
+  std::uint64_t runs = 0;
+  for (std::int64_t i = 0; i < state.getArg(); i++) {
+    scheduler.addTask("task", [&runs] { runs++; }, 0, 1000);
+  }
+
+  while (state.keepRunning()) {
+    for (std::size_t i = 0; i < LOOPS_PER_ITERATION; i++) {
+      scheduler.loop();
+    }
+  }
+
+  state.setItemsProcessed(state.getIterations() * LOOPS_PER_ITERATION);
+  state.setCounter("taskRuns", double(runs));
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(schedulerLoop, 1, 4);
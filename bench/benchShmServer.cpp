@@ -0,0 +1,157 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerLinuxUdpServer.hpp"
+#include "bowlerShmServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+#include <atomic>
+#include <thread>
+
+using namespace bowlerserver;
+
+namespace {
+const char *const CHANNEL_NAME = "/bowlerBench";
+
+double microsecondsSince(std::chrono::steady_clock::time_point istart) {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - istart)
+    .count();
+}
+
+/**
+ * Runs the coms on its own thread the way a simulator would: sleep until a request arrives, then
+ * handle it.
+ */
+template <typename Server> class ServerThread {
+  public:
+  ServerThread(Server *iserver, DefaultBowlerComs<DEFAULT_PACKET_SIZE> &icoms)
+    : thread([this, iserver, &icoms] {
+        while (running.load(std::memory_order_relaxed)) {
+          iserver->waitForData(10);
+          icoms.loop();
+        }
+      }) {
+  }
+
+  ~ServerThread() {
+    running = false;
+    thread.join();
+  }
+
+  private:
+  std::atomic<bool> running{true};
+  std::thread thread;
+};
+
+/**
+ * The latency of one request at a time through DefaultBowlerComs over shared memory, with the host
+ * and the coms on the same thread. Compare with udpRoundTrip.
+ */
+void shmRoundTrip(bowlerbench::State &state) {
+  auto *server = new ShmServer<DEFAULT_PACKET_SIZE>(CHANNEL_NAME);
+  server->begin();
+  ShmClient<DEFAULT_PACKET_SIZE> client(CHANNEL_NAME);
+  client.begin();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<ShmServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  std::array<std::uint8_t, DEFAULT_PACKET_SIZE> reply;
+  std::vector<double> samples;
+  samples.reserve(state.getIterations());
+  while (state.keepRunning()) {
+    const auto start = std::chrono::steady_clock::now();
+    client.write(request);
+    coms.loop();
+    client.read(reply);
+    samples.push_back(microsecondsSince(start));
+  }
+
+  state.setLatencyPercentiles(samples);
+}
+
+/**
+ * The latency of one request at a time over shared memory with the coms on its own thread, so
+ * every request and reply wakes a sleeping thread through the futex.
+ */
+void shmThreadedRoundTrip(bowlerbench::State &state) {
+  auto *server = new ShmServer<DEFAULT_PACKET_SIZE>(CHANNEL_NAME);
+  server->begin();
+  ShmClient<DEFAULT_PACKET_SIZE> client(CHANNEL_NAME);
+  client.begin();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<ShmServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  std::array<std::uint8_t, DEFAULT_PACKET_SIZE> reply;
+  std::vector<double> samples;
+  samples.reserve(state.getIterations());
+  {
+    ServerThread<ShmServer<DEFAULT_PACKET_SIZE>> thread(server, coms);
+    while (state.keepRunning()) {
+      const auto start = std::chrono::steady_clock::now();
+      client.write(request);
+      client.read(reply, -1);
+      samples.push_back(microsecondsSince(start));
+    }
+  }
+
+  state.setLatencyPercentiles(samples);
+  state.setCounter("wakeupsPerReply", double(server->getStats().wakeups) / state.getIterations());
+}
+
+/**
+ * The same as shmThreadedRoundTrip over loopback UDP, with a blocking client socket.
+ */
+void udpThreadedRoundTrip(bowlerbench::State &state) {
+  auto *server = new LinuxUDPServer<DEFAULT_PACKET_SIZE>(0);
+  server->begin(htonl(INADDR_LOOPBACK));
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<LinuxUDPServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(server->getPort());
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  std::array<std::uint8_t, DEFAULT_PACKET_SIZE> reply;
+  std::vector<double> samples;
+  samples.reserve(state.getIterations());
+  {
+    ServerThread<LinuxUDPServer<DEFAULT_PACKET_SIZE>> thread(server, coms);
+    while (state.keepRunning()) {
+      const auto start = std::chrono::steady_clock::now();
+      send(fd, request.data(), request.size(), 0);
+      recv(fd, reply.data(), reply.size(), 0);
+      samples.push_back(microsecondsSince(start));
+    }
+  }
+
+  close(fd);
+  state.setLatencyPercentiles(samples);
+}
+} // namespace
+
+BOWLER_BENCHMARK(shmRoundTrip);
+BOWLER_BENCHMARK(shmThreadedRoundTrip);
+BOWLER_BENCHMARK(udpThreadedRoundTrip);
@@ -0,0 +1,111 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerScheduler.hpp"
+#include "defaultBowlerComs.hpp"
+#include "mockBowlerServer.hpp"
+#include "traceEvents.hpp"
+#include <cstdlib>
+
+using namespace bowlerserver;
+
+namespace {
+/**
+ * A Packet whose event costs a fixed amount of simulated time.
+ */
+class SimulatedPacket : public Packet {
+  public:
+  SimulatedPacket(std::uint8_t iid, VirtualClock &iclock, time_t icost)
+    : Packet(iid, true), clock(iclock), cost(icost) {
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    clock.advance(cost);
+    return 1;
+  }
+
+  private:
+  VirtualClock &clock;
+  time_t cost;
+};
+
+// Simulated microseconds per iteration
+const time_t SIMULATED_MINUTE = 60LL * 1000 * 1000;
+
+/**
+ * One minute of a controller-shaped workload on a VirtualClock: a host sending a reliable request
+ * every millisecond, a sensor task every 2 ms which costs 200 us, and an adaptive coms task.
+ * Reports how many simulated seconds run per wall-clock second.
+ *
+ * Built with `BOWLER_TRACE`, writes a trace of the first run in simulated time to the file named by
+ * the `BOWLER_TRACE_FILE` environment variable.
+ */
+void simulatedMinute(bowlerbench::State &state) {
+  VirtualClock clock;
+#if defined(BOWLER_TRACE)
+  getTraceLog().setClock(clock);
+  getTraceLog().reset();
+#endif
+  Scheduler scheduler{clock};
+  auto *server = new MockBowlerServer<DEFAULT_PACKET_SIZE>();
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<MockBowlerServer<DEFAULT_PACKET_SIZE>>(server), clock};
+  coms.addPacket(std::shared_ptr<SimulatedPacket>(new SimulatedPacket(2, clock, 50)));
+
+  std::uint8_t seqNum = 0;
+  scheduler.addTask("host",
+                    [&] {
+                      server->readsToSend.push({2, seqNum, 0});
+                      seqNum ^= 1;
+                      std::queue<std::array<std::uint8_t, DEFAULT_PACKET_SIZE>>().swap(
+                        server->writesReceived);
+                    },
+                    1000,
+                    1000,
+                    2);
+  scheduler.addTask("sensor", [&clock] { clock.advance(200); }, 2000, 250);
+  scheduler.addAdaptiveTask("coms",
+                            [&coms] {
+                              const auto requestCount = coms.getRequestCount();
+                              coms.loop();
+                              return coms.getRequestCount() != requestCount;
+                            },
+                            0,
+                            2000,
+                            1000,
+                            0);
+
+  std::uint64_t loops = 0;
+  while (state.keepRunning()) {
+    loops += simulate(scheduler, clock, SIMULATED_MINUTE);
+  }
+
+  state.setItemsProcessed(coms.getRequestCount());
+  state.setCounter("loops", loops);
+
+#if defined(BOWLER_TRACE)
+  const char *tracePath = std::getenv("BOWLER_TRACE_FILE");
+  if (tracePath) {
+    getTraceLog().writeJson(tracePath);
+  }
+  state.setCounter("traceDropped", getTraceLog().getDropped());
+  getTraceLog().setClock(getSystemClock());
+#endif
+}
+} // namespace
+
+BOWLER_BENCHMARK(simulatedMinute);
@@ -0,0 +1,119 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerStreamServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+#include <ctime>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+using namespace bowlerserver;
+
+namespace {
+/**
+ * Request/reply round trips of N byte frames through a StreamServer over a socketpair, standing in
+ * for a serial port. The host end also uses a StreamServer to frame its requests. Reports the
+ * framed bytes moved per second (both directions) and the CPU time per round trip.
+ */
+template <std::size_t N> void streamServerSocketpair(bowlerbench::State &state) {
+  int fds[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+  auto *server = new StreamServer<N>(std::unique_ptr<ByteStream>(new FdByteStream(fds[0])));
+  DefaultBowlerComs<N> coms{std::unique_ptr<StreamServer<N>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+  StreamServer<N> host{std::unique_ptr<ByteStream>(new FdByteStream(fds[1]))};
+
+  std::array<std::uint8_t, N> request{2, 0, 0, 1, 2, 3};
+  std::array<std::uint8_t, N> reply;
+  const std::clock_t cpuStart = std::clock();
+  while (state.keepRunning()) {
+    host.write(request);
+
+    bool available = false;
+    while (!available) {
+      coms.loop();
+      host.isDataAvailable(available);
+    }
+
+    host.read(reply);
+  }
+  const double cpuSeconds = double(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+
+  // Both directions carry one delimited frame per round trip
+  std::array<std::uint8_t, StreamServer<N>::FRAME_LENGTH> frame{};
+  std::array<std::uint8_t, StreamServer<N>::MAX_ENCODED_LENGTH> encoded;
+  std::copy(request.begin(), request.end(), frame.begin());
+  const std::size_t wireBytes = cobsEncode(frame.data(), frame.size(), encoded.data()) + 2;
+
+  state.setItemsProcessed(state.getIterations() * wireBytes * 2);
+  state.setCounter("cpuNsPerRoundTrip", cpuSeconds * 1e9 / state.getIterations());
+  state.setCounter("crcErrors", server->getStats().crcErrors + host.getStats().crcErrors);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void streamServerSocketpair64(bowlerbench::State &state) {
+  streamServerSocketpair<64>(state);
+}
+
+void streamServerSocketpair1400(bowlerbench::State &state) {
+  streamServerSocketpair<1400>(state);
+}
+
+/**
+ * Bytes per second through crc32(). The argument is the buffer length.
+ */
+void crc32Throughput(bowlerbench::State &state) {
+  std::vector<std::uint8_t> data(state.getArg(), 0xA5);
+  std::uint32_t crc = 0;
+  while (state.keepRunning()) {
+    crc = crc32(data.data(), data.size(), crc);
+  }
+
+  state.setItemsProcessed(state.getIterations() * data.size());
+  state.setCounter("crc", crc & 1);
+}
+
+/**
+ * Bytes per second through cobsEncode(). The argument is the buffer length.
+ */
+void cobsEncodeThroughput(bowlerbench::State &state) {
+  std::vector<std::uint8_t> data(state.getArg());
+  for (std::size_t i = 0; i < data.size(); i++) {
+    data[i] = i % 17;
+  }
+
+  std::vector<std::uint8_t> encoded(cobsMaxEncodedLength(data.size()));
+  std::size_t length = 0;
+  while (state.keepRunning()) {
+    length += cobsEncode(data.data(), data.size(), encoded.data());
+  }
+
+  state.setItemsProcessed(state.getIterations() * data.size());
+  state.setCounter("overhead", double(length) / (state.getIterations() * data.size()));
+}
+} // namespace
+
+BOWLER_BENCHMARK(streamServerSocketpair64);
+BOWLER_BENCHMARK(streamServerSocketpair1400);
+BOWLER_BENCHMARK_ARGS(crc32Throughput, 64, 1400);
+BOWLER_BENCHMARK_ARGS(cobsEncodeThroughput, 64, 1400);
@@ -0,0 +1,182 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "bowlerLinuxUdpServer.hpp"
+#include "bowlerTcpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+
+using namespace bowlerserver;
+
+namespace {
+const std::size_t BURST = 64;
+const std::size_t FRAME_LENGTH =
+  TCPServer<DEFAULT_PACKET_SIZE>::PREFIX_LENGTH + DEFAULT_PACKET_SIZE;
+
+/**
+ * A blocking client socket connected to a server on loopback.
+ */
+class LoopbackClient {
+  public:
+  LoopbackClient(int itype, std::uint16_t iport) {
+    fd = socket(AF_INET, itype, 0);
+    const int flag = 1;
+    if (itype == SOCK_STREAM) {
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(iport);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  }
+
+  ~LoopbackClient() {
+    close(fd);
+  }
+
+  void sendAll(const std::uint8_t *idata, std::size_t ilength) {
+    while (ilength > 0) {
+      const ssize_t written = ::write(fd, idata, ilength);
+      if (written > 0) {
+        idata += written;
+        ilength -= written;
+      }
+    }
+  }
+
+  void receiveAll(std::uint8_t *idata, std::size_t ilength) {
+    while (ilength > 0) {
+      const ssize_t count = ::read(fd, idata, ilength);
+      if (count > 0) {
+        idata += count;
+        ilength -= count;
+      }
+    }
+  }
+
+  private:
+  int fd;
+};
+
+std::array<std::uint8_t, FRAME_LENGTH> makeTcpRequest() {
+  std::array<std::uint8_t, FRAME_LENGTH> request{DEFAULT_PACKET_SIZE, 0, 2};
+  return request;
+}
+
+template <typename Server>
+void roundTrip(bowlerbench::State &state,
+               Server *server,
+               LoopbackClient &client,
+               DefaultBowlerComs<DEFAULT_PACKET_SIZE> &coms,
+               const std::uint8_t *irequest,
+               std::uint8_t *ireply,
+               std::size_t ilength) {
+  std::vector<double> samples;
+  samples.reserve(state.getIterations());
+  while (state.keepRunning()) {
+    const auto start = std::chrono::steady_clock::now();
+    client.sendAll(irequest, ilength);
+
+    const auto target = coms.getRequestCount() + 1;
+    while (coms.getRequestCount() != target) {
+      coms.loop();
+    }
+
+    server->flush();
+    client.receiveAll(ireply, ilength);
+    samples.push_back(
+      std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+  }
+
+  state.setLatencyPercentiles(samples);
+}
+
+/**
+ * Packets per second through DefaultBowlerComs over a loopback TCP connection, sending bursts of
+ * requests from a client on the same thread. The argument is the server's batch size. Compare with
+ * linuxUdpLoopback.
+ */
+void tcpLoopback(bowlerbench::State &state) {
+  auto *server = new TCPServer<DEFAULT_PACKET_SIZE>(0, true, state.getArg());
+  server->begin(htonl(INADDR_LOOPBACK));
+  LoopbackClient client(SOCK_STREAM, server->getPort());
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<TCPServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const auto request = makeTcpRequest();
+  std::vector<std::uint8_t> requests;
+  for (std::size_t i = 0; i < BURST; i++) {
+    requests.insert(requests.end(), request.begin(), request.end());
+  }
+  std::vector<std::uint8_t> replies(requests.size());
+
+  while (state.keepRunning()) {
+    client.sendAll(requests.data(), requests.size());
+
+    const auto target = coms.getRequestCount() + BURST;
+    while (coms.getRequestCount() != target) {
+      coms.loop();
+    }
+
+    server->flush();
+    client.receiveAll(replies.data(), replies.size());
+  }
+
+  const auto &stats = server->getStats();
+  state.setItemsProcessed(state.getIterations() * BURST);
+  state.setCounter("framesPerWritev", double(stats.framesSent) / stats.writevCalls);
+}
+
+/**
+ * The latency of one request at a time over a loopback TCP connection, as percentiles.
+ */
+void tcpRoundTrip(bowlerbench::State &state) {
+  auto *server = new TCPServer<DEFAULT_PACKET_SIZE>(0, true);
+  server->begin(htonl(INADDR_LOOPBACK));
+  LoopbackClient client(SOCK_STREAM, server->getPort());
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<TCPServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const auto request = makeTcpRequest();
+  std::array<std::uint8_t, FRAME_LENGTH> reply;
+  roundTrip(state, server, client, coms, request.data(), reply.data(), request.size());
+}
+
+/**
+ * The latency of one request at a time over loopback UDP, as percentiles.
+ */
+void udpRoundTrip(bowlerbench::State &state) {
+  auto *server = new LinuxUDPServer<DEFAULT_PACKET_SIZE>(0);
+  server->begin(htonl(INADDR_LOOPBACK));
+  LoopbackClient client(SOCK_DGRAM, server->getPort());
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<LinuxUDPServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  std::array<std::uint8_t, DEFAULT_PACKET_SIZE> reply;
+  roundTrip(state, server, client, coms, request.data(), reply.data(), request.size());
+}
+} // namespace
+
+BOWLER_BENCHMARK_ARGS(tcpLoopback, 1, 8, 32, 64);
+BOWLER_BENCHMARK(tcpRoundTrip);
+BOWLER_BENCHMARK(udpRoundTrip);
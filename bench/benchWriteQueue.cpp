@@ -0,0 +1,118 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include "defaultBowlerComs.hpp"
+#include "mockBowlerServer.hpp"
+#include "noopPacket.hpp"
+#include "queuedBowlerServer.hpp"
+#include <chrono>
+#include <thread>
+
+using namespace bowlerserver;
+
+namespace {
+/**
+ * A MockBowlerServer whose writes block for a fixed time, standing in for the time lwIP and the
+ * radio take to send a datagram.
+ */
+template <std::size_t N> class SlowBowlerServer : public MockBowlerServer<N> {
+  public:
+  explicit SlowBowlerServer(std::chrono::microseconds iwriteTime) : writeTime(iwriteTime) {
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    std::this_thread::sleep_for(writeTime);
+    return 1;
+  }
+
+  private:
+  std::chrono::microseconds writeTime;
+};
+
+const std::chrono::microseconds SLOW_WRITE_TIME(200);
+
+// The rest of the application loop, during which the sender task can drain the queue
+const std::chrono::microseconds APPLICATION_TIME(300);
+
+/**
+ * Runs one request through the coms and then the rest of the application loop.
+ *
+ * @return The time spent in the coms loop.
+ */
+template <typename T>
+time_t runIteration(DefaultBowlerComs<DEFAULT_PACKET_SIZE> &coms, T *server) {
+  const std::array<std::uint8_t, DEFAULT_PACKET_SIZE> request{2};
+  server->readsToSend.push(request);
+
+  const time_t start = getTime();
+  coms.loop();
+  const time_t loopTime = getTime() - start;
+
+  std::this_thread::sleep_for(APPLICATION_TIME);
+  return loopTime;
+}
+
+/**
+ * Time spent in loop() per request when every reply is written synchronously.
+ */
+void writeInline(bowlerbench::State &state) {
+  auto *server = new SlowBowlerServer<DEFAULT_PACKET_SIZE>(SLOW_WRITE_TIME);
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<SlowBowlerServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+
+  time_t loopTime = 0;
+  while (state.keepRunning()) {
+    loopTime += runIteration(coms, server);
+  }
+
+  state.setCounter("loopUs", double(loopTime) / state.getIterations());
+}
+
+/**
+ * Time spent in loop() per request when replies go through a QueuedBowlerServer drained by its
+ * sender task. The argument is the queue capacity. Frames that do not fit are dropped, which is
+ * reported along with the enqueue-to-sent latency.
+ */
+void writeQueued(bowlerbench::State &state) {
+  auto *server = new SlowBowlerServer<DEFAULT_PACKET_SIZE>(SLOW_WRITE_TIME);
+  auto *queue = new QueuedBowlerServer<DEFAULT_PACKET_SIZE>(
+    std::unique_ptr<SlowBowlerServer<DEFAULT_PACKET_SIZE>>(server),
+    state.getArg(),
+    QueuedBowlerServer<DEFAULT_PACKET_SIZE>::dropNewest);
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<QueuedBowlerServer<DEFAULT_PACKET_SIZE>>(queue)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2)));
+  queue->startSenderTask();
+
+  time_t loopTime = 0;
+  while (state.keepRunning()) {
+    loopTime += runIteration(coms, server);
+  }
+
+  queue->stopSenderTask();
+  const auto stats = queue->getStats();
+  state.setCounter("loopUs", double(loopTime) / state.getIterations());
+  state.setCounter("dropped", stats.dropped);
+  state.setCounter("maxDepth", stats.maxDepth);
+  state.setCounter("maxLatencyUs", stats.maxLatency);
+  state.setCounter("meanLatencyUs", stats.sent > 0 ? stats.totalLatency / stats.sent : 0);
+}
+} // namespace
+
+BOWLER_BENCHMARK(writeInline);
+BOWLER_BENCHMARK_ARGS(writeQueued, 16, 256);
@@ -0,0 +1,207 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "hdrHistogram.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace bowlerbench {
+/**
+ * The state of one benchmark run. The benchmark body loops while keepRunning() returns true and
+ * only the time spent inside that loop is measured.
+ */
+class State {
+  public:
+  State(std::int64_t iarg, std::uint64_t iiterations) : arg(iarg), iterations(iiterations) {
+  }
+
+  bool keepRunning() {
+    if (completed == 0 && !started) {
+      started = true;
+      start = std::chrono::steady_clock::now();
+      cpuStart = std::clock();
+    }
+
+    if (completed < iterations) {
+      completed++;
+      return true;
+    }
+
+    stop = std::chrono::steady_clock::now();
+    cpuStop = std::clock();
+    return false;
+  }
+
+  /**
+   * Stops the timer, to leave setup inside the loop out of the measurement. Costs two reads of each
+   * clock, so only use it around work much longer than that.
+   */
+  void pauseTiming() {
+    pauseStart = std::chrono::steady_clock::now();
+    cpuPauseStart = std::clock();
+  }
+
+  /**
+   * Restarts the timer after pauseTiming().
+   */
+  void resumeTiming() {
+    paused += std::chrono::steady_clock::now() - pauseStart;
+    cpuPaused += std::clock() - cpuPauseStart;
+  }
+
+  /**
+   * @return The argument this run was registered with, or `0` if there was none.
+   */
+  std::int64_t getArg() const {
+    return arg;
+  }
+
+  std::uint64_t getIterations() const {
+    return iterations;
+  }
+
+  /**
+   * Sets the total number of items processed by the run, used to report a per-second rate.
+   */
+  void setItemsProcessed(std::uint64_t iitems) {
+    items = iitems;
+  }
+
+  /**
+   * Sets a named value to report alongside the timing.
+   */
+  void setCounter(const std::string &iname, double ivalue) {
+    counters[iname] = ivalue;
+  }
+
+  /**
+   * Reports the 50th, 99th, and 99.9th percentile of latency samples (in microseconds) as counters.
+   */
+  void setLatencyPercentiles(std::vector<double> &isamples) {
+    if (isamples.empty()) {
+      return;
+    }
+
+    std::sort(isamples.begin(), isamples.end());
+    auto percentile = [&isamples](double ifraction) {
+      return isamples[std::min(isamples.size() - 1, std::size_t(ifraction * isamples.size()))];
+    };
+    setCounter("p50us", percentile(0.5));
+    setCounter("p99us", percentile(0.99));
+    setCounter("p99.9us", percentile(0.999));
+  }
+
+  /**
+   * Reports the 50th, 99th, 99.9th percentile and the maximum of a histogram of latencies in
+   * nanoseconds, in microseconds, as counters, and keeps the histogram so that the runner can write
+   * its distribution (see runBenchmarks).
+   */
+  void setLatencyPercentiles(const HdrHistogram &ihistogram) {
+    setCounter("p50us", ihistogram.getValueAtPercentile(50) / 1e3);
+    setCounter("p99us", ihistogram.getValueAtPercentile(99) / 1e3);
+    setCounter("p99.9us", ihistogram.getValueAtPercentile(99.9) / 1e3);
+    setCounter("maxus", ihistogram.getMax() / 1e3);
+    histogram = std::make_shared<HdrHistogram>(ihistogram);
+  }
+
+  /**
+   * @return The histogram given to setLatencyPercentiles(), or nullptr.
+   */
+  const HdrHistogram *getHistogram() const {
+    return histogram.get();
+  }
+
+  double getSeconds() const {
+    return std::chrono::duration<double>(stop - start - paused).count();
+  }
+
+  double getCpuSeconds() const {
+    return double(cpuStop - cpuStart - cpuPaused) / CLOCKS_PER_SEC;
+  }
+
+  std::uint64_t getItemsProcessed() const {
+    return items;
+  }
+
+  const std::map<std::string, double> &getCounters() const {
+    return counters;
+  }
+
+  private:
+  std::int64_t arg;
+  std::uint64_t iterations;
+  std::uint64_t completed{0};
+  std::uint64_t items{0};
+  bool started{false};
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point stop;
+  std::chrono::steady_clock::time_point pauseStart;
+  std::chrono::steady_clock::duration paused{0};
+  std::clock_t cpuStart{0};
+  std::clock_t cpuStop{0};
+  std::clock_t cpuPauseStart{0};
+  std::clock_t cpuPaused{0};
+  std::map<std::string, double> counters;
+  std::shared_ptr<HdrHistogram> histogram;
+};
+
+struct Benchmark {
+  std::string name;
+  std::function<void(State &)> function;
+  std::vector<std::int64_t> args;
+};
+
+inline std::vector<Benchmark> &getBenchmarks() {
+  static std::vector<Benchmark> benchmarks;
+  return benchmarks;
+}
+
+struct Registrar {
+  Registrar(const char *iname,
+            std::function<void(State &)> ifunction,
+            std::vector<std::int64_t> iargs = {}) {
+    getBenchmarks().push_back(Benchmark{iname, std::move(ifunction), std::move(iargs)});
+  }
+};
+
+/**
+ * Runs every registered benchmark whose name contains `ifilter`.
+ *
+ * @param ijsonPath If not empty, where to also write the results as JSON in the format of Google
+ * Benchmark's `--benchmark_out`, so that runs of two versions can be compared with its
+ * tools/compare.py.
+ *
+ * If the `BOWLER_HGRM_DIR` environment variable is set, the latency histogram of each run that has
+ * one is written there as `<name>.hgrm`, with `/` in the name replaced by `_`.
+ * @return `0` on success.
+ */
+int runBenchmarks(const std::string &ifilter, const std::string &ijsonPath = "");
+} // namespace bowlerbench
+
+#define BOWLER_BENCHMARK(function)                                                                 \
+  static bowlerbench::Registrar function##Registrar(#function, function)
+
+#define BOWLER_BENCHMARK_ARGS(function, ...)                                                       \
+  static bowlerbench::Registrar function##Registrar(#function, function, {__VA_ARGS__})
@@ -0,0 +1,200 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace bowlerbench {
+/**
+ * A High Dynamic Range histogram of non-negative integers, such as latencies in nanoseconds, with
+ * three significant digits: every value is counted in a bucket no wider than a thousandth of it, so
+ * percentiles are exact to 0.1% however long the tail is. The layout is that of HdrHistogram (two
+ * halves of 1024 linear sub-buckets per power of two), and writePercentileDistribution() writes its
+ * `.hgrm` text format, which its plotter reads.
+ *
+ * Unlike bowlerserver::LatencyHistogram, which is small enough for a device, this takes a few
+ * hundred kilobytes and is meant for the host. Not thread safe; give each thread its own and add()
+ * them together.
+ */
+class HdrHistogram {
+  public:
+  static const int SUB_BUCKET_HALF_COUNT_MAGNITUDE = 10;
+  static const std::int64_t SUB_BUCKET_HALF_COUNT = 1 << SUB_BUCKET_HALF_COUNT_MAGNITUDE;
+  static const std::int64_t SUB_BUCKET_MASK = 2 * SUB_BUCKET_HALF_COUNT - 1;
+
+  /**
+   * @param ihighest The highest value to track. Larger values are counted as this.
+   */
+  explicit HdrHistogram(std::int64_t ihighest = 60LL * 1000 * 1000 * 1000) : highest(ihighest) {
+    std::int64_t smallestUntrackable = 2 * SUB_BUCKET_HALF_COUNT;
+    int buckets = 1;
+    while (smallestUntrackable <= highest) {
+      smallestUntrackable <<= 1;
+      buckets++;
+    }
+    counts.resize((buckets + 1) * SUB_BUCKET_HALF_COUNT);
+  }
+
+  void record(std::int64_t ivalue) {
+    const std::int64_t value = std::min(std::max<std::int64_t>(ivalue, 0), highest);
+    counts[getIndex(value)]++;
+    total++;
+    min = std::min(min, value);
+    max = std::max(max, value);
+    sum += double(value);
+    sumOfSquares += double(value) * double(value);
+  }
+
+  void add(const HdrHistogram &iother) {
+    const std::size_t length = std::min(counts.size(), iother.counts.size());
+    for (std::size_t i = 0; i < length; i++) {
+      counts[i] += iother.counts[i];
+    }
+    total += iother.total;
+    min = std::min(min, iother.min);
+    max = std::max(max, iother.max);
+    sum += iother.sum;
+    sumOfSquares += iother.sumOfSquares;
+  }
+
+  std::uint64_t getTotal() const {
+    return total;
+  }
+
+  std::int64_t getMax() const {
+    return total == 0 ? 0 : max;
+  }
+
+  double getMean() const {
+    return total == 0 ? 0 : sum / double(total);
+  }
+
+  double getStdDeviation() const {
+    if (total == 0) {
+      return 0;
+    }
+
+    const double mean = getMean();
+    return std::sqrt(std::max(0.0, sumOfSquares / double(total) - mean * mean));
+  }
+
+  /**
+   * @param ipercentile The percentile, from 0 to 100.
+   * @return The highest value equivalent to the one at that percentile, or `0` if there are none.
+   */
+  std::int64_t getValueAtPercentile(double ipercentile) const {
+    if (total == 0) {
+      return 0;
+    }
+
+    const double fraction = std::min(std::max(ipercentile, 0.0), 100.0) / 100;
+    const std::uint64_t rank =
+      std::max<std::uint64_t>(1, std::uint64_t(std::ceil(fraction * double(total))));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(getHighestEquivalent(getValue(i)), max);
+      }
+    }
+    return max;
+  }
+
+  /**
+   * Writes the percentile distribution in HdrHistogram's `.hgrm` format.
+   *
+   * @param iscale What to divide values by, such as `1000` to write nanoseconds as microseconds.
+   */
+  void writePercentileDistribution(std::FILE *ifile, double iscale = 1) const {
+    std::fprintf(ifile, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+                 "1/(1-Percentile)");
+
+    // Five ticks each time the distance to 100% halves, as HdrHistogram does
+    const int ticksPerHalfDistance = 5;
+    double percentile = 0;
+    while (total > 0) {
+      const std::int64_t value = getValueAtPercentile(percentile);
+      std::uint64_t count = 0;
+      for (std::size_t i = 0; i < counts.size() && getValue(i) <= value; i++) {
+        count += counts[i];
+      }
+
+      if (percentile >= 100) {
+        std::fprintf(ifile, "%12.3f %14.12f %10llu\n", value / iscale, 1.0,
+                     (unsigned long long)count);
+        break;
+      }
+
+      std::fprintf(ifile, "%12.3f %14.12f %10llu %14.2f\n", value / iscale, percentile / 100,
+                   (unsigned long long)count, 1 / (1 - percentile / 100));
+
+      const double halfDistance = std::pow(2, std::floor(std::log2(100 / (100 - percentile))) + 1);
+      percentile += 100 / (halfDistance * ticksPerHalfDistance);
+      if (count == total) {
+        percentile = 100;
+      }
+    }
+
+    std::fprintf(ifile, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", getMean() / iscale,
+                 getStdDeviation() / iscale);
+    std::fprintf(ifile, "#[Max     = %12.3f, Total count    = %12llu]\n", getMax() / iscale,
+                 (unsigned long long)total);
+    std::fprintf(ifile, "#[Buckets = %12llu, SubBuckets     = %12lld]\n",
+                 (unsigned long long)(counts.size() / SUB_BUCKET_HALF_COUNT - 1),
+                 (long long)(2 * SUB_BUCKET_HALF_COUNT));
+  }
+
+  protected:
+  static int getBucket(std::int64_t ivalue) {
+    // The position of the highest bit above the first bucket's sub-buckets
+    return 63 - __builtin_clzll(std::uint64_t(ivalue | SUB_BUCKET_MASK)) -
+           SUB_BUCKET_HALF_COUNT_MAGNITUDE;
+  }
+
+  static std::size_t getIndex(std::int64_t ivalue) {
+    const int bucket = getBucket(ivalue);
+    const std::int64_t subBucket = ivalue >> bucket;
+    return ((bucket + 1) << SUB_BUCKET_HALF_COUNT_MAGNITUDE) + (subBucket - SUB_BUCKET_HALF_COUNT);
+  }
+
+  static std::int64_t getValue(std::size_t iindex) {
+    int bucket = int(iindex >> SUB_BUCKET_HALF_COUNT_MAGNITUDE) - 1;
+    std::int64_t subBucket = (iindex & (SUB_BUCKET_HALF_COUNT - 1)) + SUB_BUCKET_HALF_COUNT;
+    if (bucket < 0) {
+      subBucket -= SUB_BUCKET_HALF_COUNT;
+      bucket = 0;
+    }
+    return subBucket << bucket;
+  }
+
+  static std::int64_t getHighestEquivalent(std::int64_t ivalue) {
+    return ivalue + (std::int64_t(1) << getBucket(ivalue)) - 1;
+  }
+
+  std::int64_t highest;
+  std::vector<std::uint64_t> counts;
+  std::uint64_t total{0};
+  std::int64_t min{INT64_MAX};
+  std::int64_t max{0};
+  double sum{0};
+  double sumOfSquares{0};
+};
+} // namespace bowlerbench
@@ -0,0 +1,178 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include "benchmark.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace bowlerbench {
+// Each run is repeated with ten times the iterations until it takes at least this long
+static const double MIN_SECONDS = 0.2;
+
+static State runOnce(const Benchmark &ibenchmark, std::int64_t iarg) {
+  std::uint64_t iterations = 1;
+  while (true) {
+    State state(iarg, iterations);
+    ibenchmark.function(state);
+    if (state.getSeconds() >= MIN_SECONDS || iterations >= 1000000000) {
+      return state;
+    }
+
+    iterations *= 10;
+  }
+}
+
+static void report(const std::string &iname, const State &istate) {
+  const double nsPerIteration = istate.getSeconds() * 1e9 / istate.getIterations();
+  std::printf("%-48s %14.0f ns %12llu",
+              iname.c_str(),
+              nsPerIteration,
+              (unsigned long long)istate.getIterations());
+
+  if (istate.getItemsProcessed() > 0) {
+    std::printf(" %12.0f items/s", istate.getItemsProcessed() / istate.getSeconds());
+  }
+
+  for (auto &&counter : istate.getCounters()) {
+    std::printf(" %s=%g", counter.first.c_str(), counter.second);
+  }
+
+  std::printf("\n");
+}
+
+static void appendJsonNumber(std::string &ijson, const char *iname, double ivalue) {
+  char buffer[128];
+  // JSON has no infinities or NaNs
+  if (std::isfinite(ivalue)) {
+    std::snprintf(buffer, sizeof(buffer), ",\n      \"%s\": %.17g", iname, ivalue);
+  } else {
+    std::snprintf(buffer, sizeof(buffer), ",\n      \"%s\": null", iname);
+  }
+  ijson += buffer;
+}
+
+static void appendJson(std::string &ijson, const std::string &iname, const State &istate) {
+  if (ijson.back() == '}') {
+    ijson += ",";
+  }
+
+  const double iterations = istate.getIterations();
+  ijson += "\n    {\n      \"name\": \"" + iname + "\",\n      \"run_name\": \"" + iname +
+           "\",\n      \"run_type\": \"iteration\"";
+  appendJsonNumber(ijson, "iterations", iterations);
+  appendJsonNumber(ijson, "real_time", istate.getSeconds() * 1e9 / iterations);
+  appendJsonNumber(ijson, "cpu_time", istate.getCpuSeconds() * 1e9 / iterations);
+  ijson += ",\n      \"time_unit\": \"ns\"";
+  if (istate.getItemsProcessed() > 0) {
+    appendJsonNumber(ijson, "items_per_second", istate.getItemsProcessed() / istate.getSeconds());
+  }
+
+  for (auto &&counter : istate.getCounters()) {
+    appendJsonNumber(ijson, counter.first.c_str(), counter.second);
+  }
+  ijson += "\n    }";
+}
+
+static void writeHistogram(const std::string &iname, const State &istate) {
+  const char *directory = std::getenv("BOWLER_HGRM_DIR");
+  if (!directory || !istate.getHistogram()) {
+    return;
+  }
+
+  std::string fileName = iname;
+  std::replace(fileName.begin(), fileName.end(), '/', '_');
+  const std::string path = std::string(directory) + "/" + fileName + ".hgrm";
+  std::FILE *file = std::fopen(path.c_str(), "w");
+  if (!file) {
+    std::fprintf(stderr, "Could not write %s\n", path.c_str());
+    return;
+  }
+
+  // Nanoseconds, written as microseconds like the counters
+  istate.getHistogram()->writePercentileDistribution(file, 1e3);
+  std::fclose(file);
+}
+
+int runBenchmarks(const std::string &ifilter, const std::string &ijsonPath) {
+  char date[32];
+  const std::time_t now = std::time(nullptr);
+  std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+  std::string json = std::string("{\n  \"context\": {\n    \"date\": \"") + date +
+                     "\",\n    \"library_build_type\": " +
+#if defined(NDEBUG)
+                     "\"release\"" +
+#else
+                     "\"debug\"" +
+#endif
+                     "\n  },\n  \"benchmarks\": [";
+
+  std::printf("%-48s %17s %12s\n", "Benchmark", "Time", "Iterations");
+  for (auto &&benchmark : getBenchmarks()) {
+    if (benchmark.name.find(ifilter) == std::string::npos) {
+      continue;
+    }
+
+    std::vector<std::int64_t> args = benchmark.args;
+    if (args.empty()) {
+      args.push_back(0);
+    }
+
+    for (auto &&arg : args) {
+      const std::string name =
+        benchmark.args.empty() ? benchmark.name : benchmark.name + "/" + std::to_string(arg);
+      const State state = runOnce(benchmark, arg);
+      report(name, state);
+      appendJson(json, name, state);
+      writeHistogram(name, state);
+    }
+  }
+
+  json += "\n  ]\n}\n";
+  if (!ijsonPath.empty()) {
+    std::FILE *file = std::fopen(ijsonPath.c_str(), "w");
+    if (!file || std::fwrite(json.data(), 1, json.size(), file) != json.size()) {
+      std::fprintf(stderr, "Could not write %s\n", ijsonPath.c_str());
+      if (file) {
+        std::fclose(file);
+      }
+      return 1;
+    }
+    std::fclose(file);
+  }
+
+  return 0;
+}
+} // namespace bowlerbench
+
+/**
+ * Usage: `bench [filter] [--json=<path>]`.
+ */
+int main(int argc, char **argv) {
+  std::string filter;
+  std::string jsonPath;
+  for (int i = 1; i < argc; i++) {
+    if (std::strncmp(argv[i], "--json=", 7) == 0) {
+      jsonPath = argv[i] + 7;
+    } else {
+      filter = argv[i];
+    }
+  }
+
+  return bowlerbench::runBenchmarks(filter, jsonPath);
+}
@@ -0,0 +1,773 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+
+#if defined(PLATFORM_NATIVE)
+#include <iterator>
+#include <string>
+#include <vector>
+#endif
+
+#if !defined(BOWLER_LOG_CAPACITY)
+#define BOWLER_LOG_CAPACITY 64
+#endif
+
+namespace bowlerserver {
+// The type of each argument in a log record, which precedes its value
+const std::uint8_t LOG_ARGUMENT_INT32 = 0;
+const std::uint8_t LOG_ARGUMENT_UINT32 = 1;
+const std::uint8_t LOG_ARGUMENT_INT64 = 2;
+const std::uint8_t LOG_ARGUMENT_UINT64 = 3;
+const std::uint8_t LOG_ARGUMENT_DOUBLE = 4;
+const std::uint8_t LOG_ARGUMENT_STRING = 5;
+const std::uint8_t LOG_ARGUMENT_POINTER = 6;
+
+/**
+ * Appends the arguments of a log call to a record. An argument which does not fit is dropped along
+ * with the ones after it, except that strings are cut short first.
+ */
+class LogArgumentWriter {
+  public:
+  LogArgumentWriter(std::uint8_t *idata, std::size_t icapacity)
+    : data(idata), capacity(icapacity) {
+  }
+
+  void putInteger(std::uint8_t itype, std::uint64_t ivalue, std::size_t ilength) {
+    if (full || length + 1 + ilength > capacity) {
+      full = true;
+      return;
+    }
+
+    data[length++] = itype;
+    for (std::size_t i = 0; i < ilength; i++) {
+      data[length++] = ivalue >> (8 * i);
+    }
+  }
+
+  void putDouble(double ivalue) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &ivalue, sizeof(bits));
+    putInteger(LOG_ARGUMENT_DOUBLE, bits, 8);
+  }
+
+  void putString(const char *ivalue) {
+    if (full || length + 2 > capacity) {
+      full = true;
+      return;
+    }
+
+    if (!ivalue) {
+      ivalue = "(null)";
+    }
+
+    const std::size_t room = capacity - length - 2;
+    std::size_t count = 0;
+    while (count < room && ivalue[count] != '\0') {
+      count++;
+    }
+
+    data[length++] = LOG_ARGUMENT_STRING;
+    data[length++] = count;
+    std::memcpy(data + length, ivalue, count);
+    length += count;
+  }
+
+  std::size_t getLength() const {
+    return length;
+  }
+
+  private:
+  std::uint8_t *data;
+  std::size_t capacity;
+  std::size_t length{0};
+  bool full{false};
+};
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+encodeLogArgument(LogArgumentWriter &iwriter, T ivalue) {
+  const bool isSigned = std::is_signed<T>::value;
+  if (sizeof(T) <= 4) {
+    iwriter.putInteger(isSigned ? LOG_ARGUMENT_INT32 : LOG_ARGUMENT_UINT32,
+                       static_cast<std::uint64_t>(ivalue),
+                       4);
+  } else {
+    iwriter.putInteger(isSigned ? LOG_ARGUMENT_INT64 : LOG_ARGUMENT_UINT64,
+                       static_cast<std::uint64_t>(ivalue),
+                       8);
+  }
+}
+
+inline void encodeLogArgument(LogArgumentWriter &iwriter, double ivalue) {
+  iwriter.putDouble(ivalue);
+}
+
+inline void encodeLogArgument(LogArgumentWriter &iwriter, const char *ivalue) {
+  iwriter.putString(ivalue);
+}
+
+template <typename T> void encodeLogArgument(LogArgumentWriter &iwriter, const T *ivalue) {
+  iwriter.putInteger(
+    LOG_ARGUMENT_POINTER, static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(ivalue)), 8);
+}
+
+inline void encodeLogArguments(LogArgumentWriter &) {
+}
+
+template <typename T, typename... Args>
+void encodeLogArguments(LogArgumentWriter &iwriter, T ifirst, Args... irest) {
+  encodeLogArgument(iwriter, ifirst);
+  encodeLogArguments(iwriter, irest...);
+}
+
+/**
+ * Formats a log message from its format string and the encoded arguments of its record, like
+ * snprintf. Each conversion takes the next argument whatever the length modifier says, so a record
+ * made on a device with 32-bit `long` formats the same on a 64-bit host. A conversion without an
+ * argument, because it was dropped or its type does not fit the conversion, is written as `?`.
+ *
+ * @return The length of the message written, which is cut short to fit `isize - 1` characters.
+ */
+inline std::size_t formatLogMessage(const char *iformat,
+                                    const std::uint8_t *iarguments,
+                                    std::size_t ilength,
+                                    char *ibuffer,
+                                    std::size_t isize) {
+  struct Argument {
+    std::uint8_t type;
+    std::uint64_t bits;
+    const char *string;
+    std::size_t stringLength;
+  };
+
+  const std::uint8_t *next = iarguments;
+  const std::uint8_t *end = iarguments + ilength;
+  const auto readArgument = [&](Argument &argument) {
+    if (next >= end) {
+      return false;
+    }
+
+    argument.type = *next++;
+    if (argument.type == LOG_ARGUMENT_STRING) {
+      if (next >= end || std::size_t(end - next - 1) < *next) {
+        next = end;
+        return false;
+      }
+
+      argument.stringLength = *next++;
+      argument.string = reinterpret_cast<const char *>(next);
+      next += argument.stringLength;
+      return true;
+    }
+
+    const std::size_t length =
+      argument.type == LOG_ARGUMENT_INT32 || argument.type == LOG_ARGUMENT_UINT32 ? 4 : 8;
+    if (std::size_t(end - next) < length) {
+      next = end;
+      return false;
+    }
+
+    argument.bits = 0;
+    for (std::size_t i = 0; i < length; i++) {
+      argument.bits |= std::uint64_t(*next++) << (8 * i);
+    }
+    return true;
+  };
+
+  const auto toSigned = [](const Argument &argument) -> long long {
+    if (argument.type == LOG_ARGUMENT_DOUBLE) {
+      double value;
+      std::memcpy(&value, &argument.bits, sizeof(value));
+      return (long long)value;
+    }
+
+    return argument.type == LOG_ARGUMENT_INT32 ? std::int32_t(argument.bits)
+                                               : std::int64_t(argument.bits);
+  };
+
+  std::size_t length = 0;
+  const auto append = [&](int iwritten) {
+    if (iwritten > 0) {
+      length = std::min(length + std::size_t(iwritten), isize > 0 ? isize - 1 : 0);
+    }
+  };
+  if (isize > 0) {
+    ibuffer[0] = '\0';
+  }
+
+  for (const char *c = iformat; *c != '\0' && length + 1 < isize; c++) {
+    if (*c != '%') {
+      ibuffer[length++] = *c;
+      ibuffer[length] = '\0';
+      continue;
+    }
+
+    if (c[1] == '%') {
+      ibuffer[length++] = '%';
+      ibuffer[length] = '\0';
+      c++;
+      continue;
+    }
+
+    // Rebuild the conversion with the argument's own length modifier
+    char spec[32] = "%";
+    std::size_t specLength = 1;
+    const auto specAppend = [&](const char *itext) {
+      const std::size_t count = std::min(std::strlen(itext), sizeof(spec) - 1 - specLength);
+      std::memcpy(spec + specLength, itext, count);
+      specLength += count;
+      spec[specLength] = '\0';
+    };
+
+    c++;
+    while (*c != '\0' && std::strchr("-+ #0123456789.*", *c)) {
+      if (*c == '*') {
+        Argument argument;
+        char digits[24];
+        std::snprintf(
+          digits, sizeof(digits), "%lld", readArgument(argument) ? toSigned(argument) : 0LL);
+        specAppend(digits);
+      } else {
+        const char text[2] = {*c, '\0'};
+        specAppend(text);
+      }
+      c++;
+    }
+    while (*c != '\0' && std::strchr("hlLjztq", *c)) {
+      c++;
+    }
+    if (*c == '\0') {
+      break;
+    }
+
+    char *out = ibuffer + length;
+    const std::size_t room = isize - length;
+    Argument argument;
+    const bool found = *c != 'n' && readArgument(argument);
+    const bool isString = found && argument.type == LOG_ARGUMENT_STRING;
+    const bool isDouble = found && argument.type == LOG_ARGUMENT_DOUBLE;
+    switch (*c) {
+    case 'd':
+    case 'i':
+    case 'c': {
+      if (!found || isString) {
+        append(std::snprintf(out, room, "?"));
+        break;
+      }
+
+      const long long value = toSigned(argument);
+      if (*c == 'c') {
+        specAppend("c");
+        append(std::snprintf(out, room, spec, int(value)));
+      } else {
+        specAppend("lld");
+        append(std::snprintf(out, room, spec, value));
+      }
+      break;
+    }
+
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': {
+      if (!found || isString || isDouble) {
+        append(std::snprintf(out, room, "?"));
+        break;
+      }
+
+      // A negative 32-bit value prints as its 32-bit two's complement, as it would on the device
+      const unsigned long long value =
+        argument.type == LOG_ARGUMENT_INT32 ? std::uint32_t(argument.bits) : argument.bits;
+      const char conversion[4] = {'l', 'l', *c, '\0'};
+      specAppend(conversion);
+      append(std::snprintf(out, room, spec, value));
+      break;
+    }
+
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A': {
+      if (!found || isString) {
+        append(std::snprintf(out, room, "?"));
+        break;
+      }
+
+      double value;
+      if (isDouble) {
+        std::memcpy(&value, &argument.bits, sizeof(value));
+      } else {
+        value = double(toSigned(argument));
+      }
+      const char conversion[2] = {*c, '\0'};
+      specAppend(conversion);
+      append(std::snprintf(out, room, spec, value));
+      break;
+    }
+
+    case 's': {
+      if (!isString) {
+        append(std::snprintf(out, room, "?"));
+        break;
+      }
+
+      specAppend(".*s");
+      // The record's strings are not terminated, so the precision bounds them
+      append(std::snprintf(out, room, spec, int(argument.stringLength), argument.string));
+      break;
+    }
+
+    case 'p': {
+      if (!found || isString || isDouble) {
+        append(std::snprintf(out, room, "?"));
+        break;
+      }
+
+      append(std::snprintf(out, room, "0x%llx", (unsigned long long)argument.bits));
+      break;
+    }
+
+    case 'n':
+      break;
+
+    default:
+      append(std::snprintf(out, room, "%%%c", *c));
+      break;
+    }
+  }
+
+  return length;
+}
+
+/**
+ * Where a log call is and what it prints.
+ */
+struct LogFormat {
+  const char *file;
+  std::uint16_t line;
+  const char *format;
+};
+
+/**
+ * A log record as it sits in the ring. The arguments are encoded by LogArgumentWriter.
+ */
+struct LogRecord {
+  static const std::size_t ARGUMENTS_LENGTH = 32;
+
+  std::uint16_t format;
+  std::uint8_t length;
+  // The low 32 bits of getTime() when it was logged
+  std::uint32_t time;
+  std::array<std::uint8_t, ARGUMENTS_LENGTH> arguments;
+};
+
+/**
+ * The backend of BOWLER_LOG, which defers formatting and printing so that logging does not stall
+ * the coms. A log call stores the id of its format string, the time and its raw arguments in a
+ * lock-free ring of `BOWLER_LOG_CAPACITY` records, and returns; any thread, task or interrupt may
+ * log. When the ring is full, new records are dropped and counted. Formatting happens when the
+ * ring is drained: drain() prints the records on the device, at a time which suits it, and
+ * readRecords() hands them to the host (see OPERATION_READ_LOG), which formats them with a
+ * BinaryLogDecoder. Only one thread may drain at a time.
+ *
+ * Records are numbered in the order they are read out. The host reads them by number, and a record
+ * leaves the ring only once the host asks for one after it, so a reply which never reached the host
+ * can be asked for again.
+ *
+ * Each call site interns its format string once, the first time it runs, and gets a 16-bit id.
+ * The host fetches the string for an id with OPERATION_GET_LOG_FORMAT, so only ids and arguments
+ * ever cross the link.
+ *
+ * Records from different threads are in the order they claimed a slot, and a record that is still
+ * being written holds up the ones after it until it is done.
+ */
+class BinaryLog {
+  public:
+  static const std::size_t CAPACITY = BOWLER_LOG_CAPACITY;
+  static const std::size_t MAX_FORMATS = 256;
+  // The id of every call site past MAX_FORMATS; its records are dropped
+  static const std::uint16_t NO_FORMAT = 0xFFFF;
+  // The length of what readRecords() writes before the records
+  static const std::size_t READ_HEADER_LENGTH = 9;
+  // The length of a record in the form written by readRecords(), not counting its arguments
+  static const std::size_t RECORD_HEADER_LENGTH = 7;
+
+  static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0,
+                "BOWLER_LOG_CAPACITY must be a power of two.");
+
+  BinaryLog() {
+    for (std::size_t i = 0; i < CAPACITY; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  BinaryLog(const BinaryLog &) = delete;
+  BinaryLog &operator=(const BinaryLog &) = delete;
+
+  /**
+   * Gives a call site the id of its format string. BOWLER_LOG calls this once per call site.
+   *
+   * @return The id, or NO_FORMAT if there are too many call sites.
+   */
+  std::uint16_t intern(const char *ifile, std::uint16_t iline, const char *iformat) {
+    const std::size_t id = formatCount.fetch_add(1, std::memory_order_relaxed);
+    if (id >= MAX_FORMATS) {
+      return NO_FORMAT;
+    }
+
+    formats[id] = LogFormat{ifile, iline, iformat};
+    published[id].store(true, std::memory_order_release);
+    return id;
+  }
+
+  /**
+   * Records a log call. Never blocks.
+   *
+   * @return Whether it was recorded, rather than dropped.
+   */
+  template <typename... Args> bool log(std::uint16_t iformat, Args... iarguments) {
+    if (iformat == NO_FORMAT) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    std::size_t position = enqueuePosition.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+      slot = &slots[position & (CAPACITY - 1)];
+      const std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      const std::ptrdiff_t difference = std::ptrdiff_t(sequence) - std::ptrdiff_t(position);
+      if (difference == 0) {
+        if (enqueuePosition.compare_exchange_weak(
+              position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (difference < 0) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        position = enqueuePosition.load(std::memory_order_relaxed);
+      }
+    }
+
+    LogArgumentWriter writer(slot->record.arguments.data(), LogRecord::ARGUMENTS_LENGTH);
+    encodeLogArguments(writer, iarguments...);
+    slot->record.format = iformat;
+    slot->record.length = writer.getLength();
+    slot->record.time = std::uint32_t(getTime());
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @param iindex The index of the record from the oldest one.
+   * @return The record, or nullptr if there is none. It stays in the ring until pop().
+   */
+  const LogRecord *peek(std::size_t iindex = 0) const {
+    const std::size_t position = dequeuePosition + iindex;
+    const Slot &slot = slots[position & (CAPACITY - 1)];
+    if (iindex >= CAPACITY || slot.sequence.load(std::memory_order_acquire) != position + 1) {
+      return nullptr;
+    }
+    return &slot.record;
+  }
+
+  /**
+   * Removes the oldest record. Must only follow a peek() which found one.
+   */
+  void pop() {
+    Slot &slot = slots[dequeuePosition & (CAPACITY - 1)];
+    slot.sequence.store(dequeuePosition + CAPACITY, std::memory_order_release);
+    dequeuePosition++;
+  }
+
+  /**
+   * Formats and removes up to `imaxRecords` records.
+   *
+   * @param iprint Called with each message as `<file>:<line>: <message>`.
+   * @return The number of records removed.
+   */
+  std::size_t drain(const std::function<void(const char *)> &iprint, std::size_t imaxRecords) {
+    char message[128];
+    std::size_t count = 0;
+    for (const LogRecord *record; count < imaxRecords && (record = peek()); count++) {
+      const LogFormat *format = getFormat(record->format);
+      if (!format) {
+        pop();
+        continue;
+      }
+
+      const int prefix = std::snprintf(message, sizeof(message), "%s:%u: ", format->file,
+                                       unsigned(format->line));
+      const std::size_t offset = std::min(std::size_t(std::max(prefix, 0)), sizeof(message) - 1);
+      formatLogMessage(format->format,
+                       record->arguments.data(),
+                       record->length,
+                       message + offset,
+                       sizeof(message) - offset);
+      pop();
+      iprint(message);
+    }
+    return count;
+  }
+
+  /**
+   * Copies as many records as fit into a buffer, starting at the oldest one the host has not
+   * acknowledged, as `<Dropped (4 bytes)> <First number (4 bytes)> <Record count (1 byte)>`
+   * followed by the records, each `<Format id (2 bytes)> <Time (4 bytes)> <Length (1 byte)>
+   * <Arguments>`. Numbers are little endian and the dropped count is the total since start.
+   *
+   * @param inext The number of the first record the host has not received yet; the records before
+   * it are removed. Numbers wrap around.
+   * @return The number of bytes written, or BOWLER_ERROR with ENOBUFS if the buffer is too small
+   * for the counts.
+   */
+  std::int32_t readRecords(std::uint32_t inext, std::uint8_t *ibuffer, std::size_t ilength) {
+    if (ilength < READ_HEADER_LENGTH) {
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    // A host which is behind, such as one which just started, gets the oldest record there is
+    while (std::int32_t(inext - std::uint32_t(dequeuePosition)) > 0 && peek()) {
+      pop();
+    }
+
+    const std::uint32_t droppedCount = dropped.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < 4; i++) {
+      ibuffer[i] = droppedCount >> (8 * i);
+      ibuffer[4 + i] = std::uint32_t(dequeuePosition) >> (8 * i);
+    }
+
+    std::size_t length = READ_HEADER_LENGTH;
+    std::uint8_t count = 0;
+    for (const LogRecord *record; count < 0xFF && (record = peek(count));) {
+      if (length + RECORD_HEADER_LENGTH + record->length > ilength) {
+        break;
+      }
+
+      ibuffer[length++] = record->format & 0xFF;
+      ibuffer[length++] = record->format >> 8;
+      for (std::size_t i = 0; i < 4; i++) {
+        ibuffer[length++] = record->time >> (8 * i);
+      }
+      ibuffer[length++] = record->length;
+      std::memcpy(ibuffer + length, record->arguments.data(), record->length);
+      length += record->length;
+      count++;
+    }
+
+    ibuffer[8] = count;
+    return length;
+  }
+
+  /**
+   * @return The format string of an id, or nullptr if no call site has it.
+   */
+  const LogFormat *getFormat(std::uint16_t iformat) const {
+    if (iformat >= MAX_FORMATS || !published[iformat].load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    return &formats[iformat];
+  }
+
+  /**
+   * @return The number of records dropped because the ring was full, since start.
+   */
+  std::uint32_t getDropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+  protected:
+  struct Slot {
+    std::atomic<std::size_t> sequence;
+    LogRecord record;
+  };
+
+  std::array<Slot, CAPACITY> slots;
+  std::atomic<std::size_t> enqueuePosition{0};
+  std::size_t dequeuePosition{0};
+  std::atomic<std::uint32_t> dropped{0};
+
+  std::array<LogFormat, MAX_FORMATS> formats;
+  std::array<std::atomic<bool>, MAX_FORMATS> published{};
+  std::atomic<std::size_t> formatCount{0};
+};
+
+/**
+ * @return The log BOWLER_LOG records into.
+ */
+inline BinaryLog &getBinaryLog() {
+  static BinaryLog log;
+  return log;
+}
+
+#if defined(PLATFORM_NATIVE)
+/**
+ * Turns the replies to OPERATION_READ_LOG and OPERATION_GET_LOG_FORMAT back into messages on the
+ * host. Records whose format has not been fetched yet can be kept and formatted later.
+ */
+class BinaryLogDecoder {
+  public:
+  struct Record {
+    std::uint16_t format;
+    std::uint32_t time;
+    std::vector<std::uint8_t> arguments;
+  };
+
+  /**
+   * Parses the payload of an OPERATION_READ_LOG reply, after the status. Records the host already
+   * has, from a request sent again, are skipped.
+   *
+   * @param orecords The records are appended to this.
+   * @return The number of records dropped on the device since start, or BOWLER_ERROR with EBADMSG
+   * if the payload is malformed.
+   */
+  std::int32_t parseRecords(const std::uint8_t *ipayload,
+                            std::size_t ilength,
+                            std::vector<Record> &orecords) {
+    if (ilength < BinaryLog::READ_HEADER_LENGTH) {
+      errno = EBADMSG;
+      return BOWLER_ERROR;
+    }
+
+    std::uint32_t droppedCount = 0;
+    std::uint32_t first = 0;
+    for (std::size_t i = 0; i < 4; i++) {
+      droppedCount |= std::uint32_t(ipayload[i]) << (8 * i);
+      first |= std::uint32_t(ipayload[4 + i]) << (8 * i);
+    }
+
+    std::vector<Record> records;
+    std::size_t offset = BinaryLog::READ_HEADER_LENGTH;
+    for (std::size_t i = 0; i < ipayload[8]; i++) {
+      if (offset + BinaryLog::RECORD_HEADER_LENGTH > ilength ||
+          offset + BinaryLog::RECORD_HEADER_LENGTH + ipayload[offset + 6] > ilength) {
+        errno = EBADMSG;
+        return BOWLER_ERROR;
+      }
+
+      Record record;
+      record.format = ipayload[offset] | (ipayload[offset + 1] << 8);
+      record.time = 0;
+      for (std::size_t j = 0; j < 4; j++) {
+        record.time |= std::uint32_t(ipayload[offset + 2 + j]) << (8 * j);
+      }
+      const std::uint8_t length = ipayload[offset + 6];
+      offset += BinaryLog::RECORD_HEADER_LENGTH;
+      record.arguments.assign(ipayload + offset, ipayload + offset + length);
+      offset += length;
+      records.push_back(std::move(record));
+    }
+
+    // Records before the cursor were in a reply already; a gap after it was freed on the device
+    // before this host asked for it
+    const std::uint32_t end = first + std::uint32_t(records.size());
+    const std::uint32_t skipped =
+      std::int32_t(next - first) > 0 ? std::min<std::uint32_t>(next - first, records.size()) : 0;
+    std::move(records.begin() + skipped, records.end(), std::back_inserter(orecords));
+    next = std::int32_t(end - next) > 0 ? end : next;
+    return droppedCount;
+  }
+
+  /**
+   * @return The number to pass with the next OPERATION_READ_LOG request, which acknowledges the
+   * records parsed so far.
+   */
+  std::uint32_t getNextRecord() const {
+    return next;
+  }
+
+  /**
+   * Learns a format string from the payload of an OPERATION_GET_LOG_FORMAT reply, after the
+   * status.
+   *
+   * @param iformat The id it was fetched for.
+   */
+  void addFormat(std::uint16_t iformat, const std::uint8_t *ipayload, std::size_t ilength) {
+    if (ilength < 3 || std::size_t(3) + ipayload[2] > ilength) {
+      return;
+    }
+
+    Format format;
+    format.line = ipayload[0] | (ipayload[1] << 8);
+    format.file.assign(reinterpret_cast<const char *>(ipayload + 3), ipayload[2]);
+    const char *text = reinterpret_cast<const char *>(ipayload + 3 + ipayload[2]);
+    std::size_t textLength = 0;
+    while (3 + ipayload[2] + textLength < ilength && text[textLength] != '\0') {
+      textLength++;
+    }
+    format.text.assign(text, textLength);
+
+    if (formats.size() <= iformat) {
+      formats.resize(iformat + 1);
+    }
+    formats[iformat] = std::move(format);
+  }
+
+  bool hasFormat(std::uint16_t iformat) const {
+    return iformat < formats.size() && formats[iformat].line != 0;
+  }
+
+  /**
+   * @return The message as `<file>:<line>: <message>`, or an empty string if its format is unknown.
+   */
+  std::string format(const Record &irecord) const {
+    if (!hasFormat(irecord.format)) {
+      return std::string();
+    }
+
+    const Format &format = formats[irecord.format];
+    char message[512];
+    const int prefix = std::snprintf(
+      message, sizeof(message), "%s:%u: ", format.file.c_str(), unsigned(format.line));
+    const std::size_t offset = std::min(std::size_t(std::max(prefix, 0)), sizeof(message) - 1);
+    formatLogMessage(format.text.c_str(),
+                     irecord.arguments.data(),
+                     irecord.arguments.size(),
+                     message + offset,
+                     sizeof(message) - offset);
+    return message;
+  }
+
+  protected:
+  struct Format {
+    std::string file;
+    std::uint16_t line{0};
+    std::string text;
+  };
+
+  std::vector<Format> formats;
+  std::uint32_t next{0};
+};
+#endif
+} // namespace bowlerserver
@@ -0,0 +1,78 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+
+namespace bowlerserver {
+/**
+ * A source of time, in the units of getTime(). Anything time-based takes a Clock so it can be run
+ * on a VirtualClock in tests and simulations.
+ */
+class Clock {
+  public:
+  virtual ~Clock() = default;
+
+  /**
+   * @return The current time.
+   */
+  virtual time_t now() = 0;
+};
+
+/**
+ * A Clock which reads getTime().
+ */
+class SystemClock : public Clock {
+  public:
+  time_t now() override {
+    return getTime();
+  }
+};
+
+/**
+ * A Clock which only moves when it is told to. Simulated work advances it by its simulated cost,
+ * so a simulation runs as fast as the host can execute it and gives the same result every run.
+ */
+class VirtualClock : public Clock {
+  public:
+  explicit VirtualClock(time_t istart = 0) : time(istart) {
+  }
+
+  time_t now() override {
+    return time;
+  }
+
+  void set(time_t itime) {
+    time = itime;
+  }
+
+  void advance(time_t iduration) {
+    time += iduration;
+  }
+
+  private:
+  time_t time;
+};
+
+/**
+ * @return The clock used when none is given.
+ */
+inline Clock &getSystemClock() {
+  static SystemClock clock;
+  return clock;
+}
+} // namespace bowlerserver
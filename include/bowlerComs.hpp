@@ -17,12 +17,16 @@
 #pragma once
 
 #include "bowlerPacket.hpp"
+#include "comsMetrics.hpp"
 #include <array>
 #include <functional>
 #include <memory>
 #include <vector>
 
 namespace bowlerserver {
+class Scheduler;
+template <std::size_t N> class CaptureBowlerServer;
+
 template <std::size_t N> class BowlerComs {
   public:
   virtual ~BowlerComs() = default;
@@ -51,6 +55,59 @@ template <std::size_t N> class BowlerComs {
    */
   virtual std::vector<std::uint8_t> getAllPacketIDs() = 0;
 
+  /**
+   * @return The per-id counters and handler time histograms, or nullptr if they are not kept.
+   */
+  virtual const ComsMetrics *getMetrics() const {
+    return nullptr;
+  }
+
+  /**
+   * @return The scheduler the coms runs on, for OPERATION_GET_PROFILE, or nullptr if it is not
+   * known.
+   */
+  virtual Scheduler *getScheduler() {
+    return nullptr;
+  }
+
+  /**
+   * @return The server capturing the frames of the coms, for OPERATION_READ_CAPTURE, or nullptr if
+   * there is none.
+   */
+  virtual CaptureBowlerServer<N> *getCapture() {
+    return nullptr;
+  }
+
+  /**
+   * @return The time the request being handled was read, on the clock of the coms.
+   */
+  virtual time_t getRequestTime() const {
+    return getTime();
+  }
+
+  /**
+   * @return The current time on the clock of the coms.
+   */
+  virtual time_t getCurrentTime() {
+    return getTime();
+  }
+
+  /**
+   * Turns timestamp mode on or off. In timestamp mode, the last TIMESTAMP_LENGTH bytes of the
+   * frames of every packet which leaves them free (see Packet::leavesTimestampFree) carry a
+   * timestamp instead of payload. The frames of other packets are untouched.
+   *
+   * @param ienabled Whether to turn it on.
+   * @param ioffset The device time minus the host time, as estimated with OPERATION_CLOCK_SYNC.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t setTimestampMode(bool ienabled, std::int64_t ioffset) {
+    (void)ienabled;
+    (void)ioffset;
+    errno = ENOTSUP;
+    return BOWLER_ERROR;
+  }
+
   /**
    * Run an iteration of coms.
    *
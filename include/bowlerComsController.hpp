@@ -17,63 +17,187 @@
 #pragma once
 
 #include "bowlerDeviceServerUtil.hpp"
+#include "bowlerScheduler.hpp"
+#include "bowlerStreamServer.hpp"
 #include "bowlerUdpServer.hpp"
+#include "captureBowlerServer.hpp"
 #include "defaultBowlerComs.hpp"
+#include "multiBowlerServer.hpp"
 #include "noopPacket.hpp"
 #include <Arduino.h>
 #include <Esp32WifiManager.h>
 
+// Serial carries the frames of a StreamServer in these builds, and BOWLER_LOG output printed
+// between them would corrupt them
+#if ((!defined(USE_WIFI) && !defined(USE_HID)) || defined(USE_SERIAL_LINK)) &&                    \
+  !defined(BOWLER_LOG_QUERY_ONLY)
+#error "Serial carries frames in this build: add -D BOWLER_LOG_QUERY_ONLY to its build_flags"
+#endif
+
 namespace bowlerserver {
+/**
+ * Runs the connection state machine and the coms as tasks of a Scheduler. Application tasks (sensor
+ * reads, control updates) should be added to getScheduler() too. They run at
+ * Scheduler::DEFAULT_PRIORITY, after the state machine and before the coms tasks, because the time
+ * it takes to send a UDP reply makes time-sensitive work such as I2C reads time out if it runs
+ * after.
+ *
+ * With `USE_WIFI`, defining `USE_SERIAL_LINK` also serves a wired maintenance link on Serial at
+ * the same time, using the same packets. The wired link works while WiFi is down.
+ *
+ * Every task, including those of the application, is profiled by the scheduler, and so is the time
+ * spent outside of loop(); the host reads the profiles with OPERATION_GET_PROFILE.
+ *
+ * Defining `USE_CAPTURE` records the frames of the coms in a CaptureBowlerServer, which the host
+ * pulls as a pcap file with OPERATION_READ_CAPTURE.
+ *
+ * BOWLER_LOG output is printed to Serial by a task of its own, unless the build defines
+ * `BOWLER_LOG_QUERY_ONLY`. It is then left in the BinaryLog for the host to read with
+ * OPERATION_READ_LOG. Builds in which Serial carries frames (those without `USE_WIFI` or `USE_HID`,
+ * and those with `USE_SERIAL_LINK`) must define it in their build flags.
+ */
 template <std::size_t N> class BowlerComsController {
   public:
-  void loop() {
-    time_t time = getTime();
-
-    // Ensure 0.5 ms spacing *between* reads for Wifi to transact. Also check for the wrapover case
-    if (time - lastLoopTime > 500 || time < lastLoopTime) {
-      switch (state) {
-      case startup: {
-        setup();
-        state = waitForConnection;
-        break;
-      }
+  /**
+   * @param iclock The clock to pace the tasks with.
+   */
+  explicit BowlerComsController(Clock &iclock = getSystemClock()) : scheduler(iclock) {
+    // The host profiles the tasks and the loop with OPERATION_GET_PROFILE
+    scheduler.setTargetPeriod(LOOP_PERIOD);
+    coms.setScheduler(&scheduler);
+    coms.setCapture(capture);
+
+    scheduler.addTask("state",
+                      std::bind(&BowlerComsController::updateState, this),
+                      STATE_PERIOD,
+                      STATE_BUDGET,
+                      STATE_PRIORITY);
 
-      case waitForConnection: {
 #if defined(USE_WIFI)
-        if (manager.getState() == Connected) {
-          state = run;
-        }
+    scheduler.addTask("wifi",
+                      [this] {
+                        if (state != startup) {
+                          manager.loop();
+                        }
+                      },
+                      0,
+                      WIFI_BUDGET,
+                      COMS_PRIORITY);
+
+    // Poll the coms on every loop while requests are arriving, and back off while it is idle so the
+    // radio has time to transact
+    scheduler.addAdaptiveTask("coms",
+                              [this] {
+                                if (state == startup) {
+                                  return false;
+                                }
+
+#if !defined(USE_SERIAL_LINK)
+                                if (manager.getState() != Connected) {
+                                  return false;
+                                }
+#endif
+
+                                const auto requestCount = coms.getRequestCount();
+                                coms.loop();
+                                return coms.getRequestCount() != requestCount;
+                              },
+                              COMS_MIN_PERIOD,
+                              COMS_MAX_PERIOD,
+                              COMS_BUDGET,
+                              COMS_PRIORITY);
 #elif defined(USE_HID)
-        state = run;
+#else
+    scheduler.addAdaptiveTask("coms",
+                              [this] {
+                                if (state == startup) {
+                                  return false;
+                                }
+
+                                const auto requestCount = coms.getRequestCount();
+                                coms.loop();
+                                return coms.getRequestCount() != requestCount;
+                              },
+                              COMS_MIN_PERIOD,
+                              COMS_MAX_PERIOD,
+                              COMS_BUDGET,
+                              COMS_PRIORITY);
 #endif
-        break;
-      }
 
-      default:
-        break;
-      }
+#if !defined(BOWLER_LOG_QUERY_ONLY)
+    // Print what BOWLER_LOG recorded a few records at a time, after everything else has run
+    scheduler.addTask("log",
+                      [] {
+                        getBinaryLog().drain([](const char *imessage) { Serial.print(imessage); },
+                                             LOG_BATCH);
+                      },
+                      LOG_PERIOD,
+                      LOG_BUDGET,
+                      COMS_PRIORITY);
+#endif
+  }
+
+  void loop() {
+    scheduler.loop();
+  }
+
+  BowlerComs<N> &getComs() {
+    return coms;
+  }
 
-      lastLoopTime = getTime();
+  Scheduler &getScheduler() {
+    return scheduler;
+  }
+
+  // The priority of the state machine, above every other task so that setup() runs before the
+  // application's tasks do
+  static const std::uint8_t STATE_PRIORITY = 255;
+  // The priority of the wifi, coms and log tasks
+  static const std::uint8_t COMS_PRIORITY = 0;
+
+  // Times are in the units of getTime()
+  // How often loop() is meant to be called; the loop jitter is measured against it
+  static const time_t LOOP_PERIOD = 500;
+  static const time_t STATE_PERIOD = 500;
+  static const time_t STATE_BUDGET = 100;
+  static const time_t WIFI_BUDGET = 500;
+  static const time_t COMS_MIN_PERIOD = 0;
+  static const time_t COMS_MAX_PERIOD = 2000;
+  static const time_t COMS_BUDGET = 1000;
+  static const time_t LOG_PERIOD = 10000;
+  static const time_t LOG_BUDGET = 2000;
+
+  // The most log records printed per run of the log task
+  static const std::size_t LOG_BATCH = 4;
+
+  // The number of frames kept with `USE_CAPTURE`
+  static const std::size_t CAPTURE_CAPACITY = 32;
+
+  protected:
+  void updateState() {
+    switch (state) {
+    case startup: {
+      setup();
+      state = waitForConnection;
+      break;
     }
 
-    if (state != startup) {
-// If this is run before the sensor reads, the I2C will fail because the time it takes to send
-// the UDP causes a timeout
+    case waitForConnection: {
 #if defined(USE_WIFI)
-      manager.loop();
       if (manager.getState() == Connected) {
-        coms.loop();
+        state = run;
       }
-#elif defined(USE_HID)
+#else
+      state = run;
 #endif
+      break;
     }
-  }
 
-  BowlerComs<N> &getComs() {
-    return coms;
+    default:
+      break;
+    }
   }
 
-  protected:
   void setup() {
     if (state != startup) {
       return;
@@ -83,6 +207,9 @@ template <std::size_t N> class BowlerComsController {
 
 #if defined(USE_WIFI)
     manager.setupAP();
+#if defined(USE_SERIAL_LINK)
+    Serial.begin(115200);
+#endif
 #elif defined(USE_HID)
 #else
     Serial.begin(115200);
@@ -92,14 +219,50 @@ template <std::size_t N> class BowlerComsController {
   private:
   enum state_t { startup, waitForConnection, run };
 
-  state_t state;
-  time_t lastLoopTime{0};
+  state_t state{startup};
+  Scheduler scheduler;
+  // Set while the coms is built, so it comes first
+  CaptureBowlerServer<N> *capture{nullptr};
+
+  /**
+   * @return The server the coms uses, wrapped in a capture with `USE_CAPTURE`.
+   */
+  std::unique_ptr<BowlerServer<N>> withCapture(std::unique_ptr<BowlerServer<N>> iserver) {
+#if defined(USE_CAPTURE)
+    capture =
+      new CaptureBowlerServer<N>(std::move(iserver), CAPTURE_CAPACITY, scheduler.getClock());
+    return std::unique_ptr<BowlerServer<N>>(capture);
+#else
+    return iserver;
+#endif
+  }
 
 #if defined(USE_WIFI)
   WifiManager manager;
-  DefaultBowlerComs<N> coms{std::unique_ptr<UDPServer<N>>(new UDPServer<N>())};
+  DefaultBowlerComs<N> coms{withCapture(makeServer()), scheduler.getClock()};
+
+  std::unique_ptr<BowlerServer<N>> makeServer() {
+    // Hosts find devices and send them fan-out commands through the multicast group
+    std::unique_ptr<UDPServer<N>> udpServer(new UDPServer<N>());
+    udpServer->joinMulticastGroup();
+
+#if defined(USE_SERIAL_LINK)
+    std::unique_ptr<MultiBowlerServer<N>> server(
+      new MultiBowlerServer<N>(COMS_MAX_PERIOD, scheduler.getClock()));
+    server->addServer(std::move(udpServer));
+    server->addServer(std::unique_ptr<StreamServer<N>>(
+      new StreamServer<N>(std::unique_ptr<ByteStream>(new ArduinoByteStream(Serial)))));
+    return std::move(server);
+#else
+    return std::move(udpServer);
+#endif
+  }
 #elif defined(USE_HID)
 #error "BowlerServerController not implemented for HID yet."
+#else
+  DefaultBowlerComs<N> coms{withCapture(std::unique_ptr<StreamServer<N>>(new StreamServer<N>(
+                              std::unique_ptr<ByteStream>(new ArduinoByteStream(Serial))))),
+                            scheduler.getClock()};
 #endif
 };
 } // namespace bowlerserver
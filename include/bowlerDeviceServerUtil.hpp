@@ -17,23 +17,67 @@
 #pragma once
 
 #include "errno.h"
+
+#if defined(PLATFORM_NATIVE)
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#else
 #include <Arduino.h>
+#endif
 
+#if defined(PLATFORM_NATIVE) && !defined(BOWLER_BINARY_LOG)
 #define BOWLER_LOG(...)                                                                            \
-  Serial.printf("%s:%d: ", __FILE__, __LINE__);                                                    \
-  Serial.printf(__VA_ARGS__)
+  do {                                                                                             \
+    std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                                           \
+    std::fprintf(stderr, __VA_ARGS__);                                                             \
+  } while (0)
+#else
+// Records the call in the BinaryLog instead of printing it, which takes well under a microsecond.
+// BowlerComsController prints the log to Serial, or leaves it for the host to read with
+// `BOWLER_LOG_QUERY_ONLY`. Builds without the controller must drain getBinaryLog() themselves, or
+// the log keeps only its newest records and nothing is printed. Native builds log synchronously to
+// stderr unless `BOWLER_BINARY_LOG` is defined, because nothing drains the log there.
+#define BOWLER_LOG(iformat, ...)                                                                   \
+  do {                                                                                             \
+    static const std::uint16_t bowlerLogFormat =                                                   \
+      ::bowlerserver::getBinaryLog().intern(__FILE__, __LINE__, iformat);                          \
+    ::bowlerserver::getBinaryLog().log(bowlerLogFormat, ##__VA_ARGS__);                            \
+  } while (0)
+#endif
 
 namespace bowlerserver {
 const std::int32_t BOWLER_ERROR = INT32_MAX;
 
+// Returned by a DeferredPacket event whose reply will be completed later
+const std::int32_t BOWLER_PENDING = INT32_MAX - 1;
+
 const std::int32_t DEFAULT_PACKET_SIZE = 64;
 const std::int32_t HEADER_LENGTH = 3;
 const std::int32_t DEFAULT_PAYLOAD_SIZE = DEFAULT_PACKET_SIZE - HEADER_LENGTH;
 
+const std::uint16_t BOWLER_SERVER_UDP_PORT = 1866;
+
+// The multicast group (239.255.18.66, in host byte order) and port used for discovery and
+// fan-out commands
+const std::uint32_t BOWLER_SERVER_MULTICAST_GROUP = 0xEFFF1242;
+const std::uint16_t BOWLER_SERVER_MULTICAST_PORT = 1867;
+
 const std::uint8_t SERVER_MANAGEMENT_PACKET_ID = 1;
 
 const std::uint8_t OPERATION_DISCONNECT_ID = 1;
 const std::uint8_t OPERATION_ADD_ENSURED_PACKETS = 2;
+const std::uint8_t OPERATION_DISCOVER = 3;
+const std::uint8_t OPERATION_GET_METRICS = 4;
+const std::uint8_t OPERATION_CLOCK_SYNC = 5;
+const std::uint8_t OPERATION_SET_TIMESTAMP_MODE = 6;
+const std::uint8_t OPERATION_GET_LATENCY = 7;
+const std::uint8_t OPERATION_READ_LOG = 8;
+const std::uint8_t OPERATION_GET_LOG_FORMAT = 9;
+const std::uint8_t OPERATION_GET_PROFILE = 10;
+const std::uint8_t OPERATION_READ_CAPTURE = 11;
+const std::uint8_t OPERATION_GET_HEAP = 12;
 
 const std::uint8_t STATUS_ACCEPTED = 1;
 const std::uint8_t STATUS_REJECTED_GENERIC = 2;
@@ -42,7 +86,12 @@ const std::uint8_t STATUS_REJECTED_GENERIC = 2;
 using time_t = int64_t;
 #elif defined(PLATFORM_TEENSY)
 using time_t = uint32_t;
+#elif defined(PLATFORM_NATIVE)
+using time_t = int64_t;
 #endif
 
 time_t getTime();
 } // namespace bowlerserver
+
+// Last, because it needs the definitions above
+#include "binaryLog.hpp"
@@ -0,0 +1,372 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#if defined(PLATFORM_NATIVE)
+#include <arpa/inet.h>
+#include <atomic>
+#include <functional>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#endif
+
+namespace bowlerserver {
+/**
+ * Counters kept by BowlerGateway.
+ */
+struct GatewayStats {
+  std::uint64_t requestsForwarded{0};
+  std::uint64_t repliesForwarded{0};
+  // Requests for an address no device is attached at
+  std::uint64_t unknownDevice{0};
+  // Frames a device or the upstream server failed to write
+  std::uint64_t writeErrors{0};
+};
+
+/**
+ * Bridges many devices behind one BowlerServer, so that a host can reach a whole fleet through one
+ * socket.
+ *
+ * Frames from the host carry the address of a device in front of the normal Bowler frame:
+ * `<Device (1 byte)> <ID (1 byte)> <Seq Num (1 byte)> <ACK num (1 byte)> <Payload>`. The gateway
+ * strips the address and writes the rest to the device attached at it, and prefixes the replies of
+ * that device with its address before writing them back. A device is reached through a
+ * BowlerServer whose peer is the device, such as a StreamServer on a serial port or a
+ * UDPDeviceLink. The gateway is stateless apart from remembering, for each device and packet id,
+ * the route (see BowlerServer::getRoute) of the last request, which is where the reply goes.
+ *
+ * Frames are forwarded by poll(); nothing is queued inside the gateway, so backpressure is that of
+ * the transports.
+ */
+template <std::size_t N> class BowlerGateway {
+  public:
+  static const std::size_t MAX_DEVICES = 256;
+
+  /**
+   * @param iupstream The server the host connects to. Its frames are one byte longer than the
+   * devices' frames.
+   * @param ibatchSize The maximum number of frames read from each server per poll().
+   */
+  explicit BowlerGateway(std::unique_ptr<BowlerServer<N + 1>> iupstream,
+                         std::size_t ibatchSize = 32)
+    : upstream(std::move(iupstream)),
+      batchSize(std::max<std::size_t>(ibatchSize, 1)),
+      devices(MAX_DEVICES) {
+  }
+
+  BowlerGateway(const BowlerGateway &) = delete;
+  BowlerGateway &operator=(const BowlerGateway &) = delete;
+
+  /**
+   * Attaches a device.
+   *
+   * @param iaddress The address the host reaches the device at.
+   * @param idevice The link to the device.
+   * @return `1` on success or BOWLER_ERROR with EADDRINUSE if a device is already attached there.
+   */
+  std::int32_t addDevice(std::uint8_t iaddress, std::unique_ptr<BowlerServer<N>> idevice) {
+    Device &device = devices[iaddress];
+    if (device.link) {
+      errno = EADDRINUSE;
+      return BOWLER_ERROR;
+    }
+
+    device.link = std::move(idevice);
+    device.routes.assign(256, 0);
+    attached.push_back(iaddress);
+    return 1;
+  }
+
+  /**
+   * Detaches a device. Its replies that have not been forwarded yet are lost.
+   */
+  void removeDevice(std::uint8_t iaddress) {
+    devices[iaddress].link.reset();
+    attached.erase(std::remove(attached.begin(), attached.end(), iaddress), attached.end());
+  }
+
+  /**
+   * Forwards up to a batch of requests from the host to the devices, then up to a batch of replies
+   * from each device to the host.
+   *
+   * @return The number of frames moved.
+   */
+  std::size_t poll() {
+    std::size_t moved = 0;
+
+    std::array<std::uint8_t, N + 1> request;
+    std::array<std::uint8_t, N> frame;
+    for (std::size_t i = 0; i < batchSize && isAvailable(*upstream); i++) {
+      if (upstream->read(request) == BOWLER_ERROR) {
+        break;
+      }
+
+      moved++;
+      Device &device = devices[request[0]];
+      if (!device.link) {
+        stats.unknownDevice++;
+        continue;
+      }
+
+      device.routes[request[1]] = upstream->getRoute();
+      std::copy(request.begin() + 1, request.end(), frame.begin());
+      if (device.link->write(frame) == BOWLER_ERROR) {
+        stats.writeErrors++;
+      } else {
+        stats.requestsForwarded++;
+      }
+    }
+
+    std::array<std::uint8_t, N + 1> reply;
+    for (auto &&address : attached) {
+      Device &device = devices[address];
+      for (std::size_t i = 0; i < batchSize && isAvailable(*device.link); i++) {
+        if (device.link->read(frame) == BOWLER_ERROR) {
+          break;
+        }
+
+        moved++;
+        reply[0] = address;
+        std::copy(frame.begin(), frame.end(), reply.begin() + 1);
+        upstream->setRoute(device.routes[frame[0]]);
+        if (upstream->write(reply) == BOWLER_ERROR) {
+          stats.writeErrors++;
+        } else {
+          stats.repliesForwarded++;
+        }
+      }
+    }
+
+    return moved;
+  }
+
+  /**
+   * @return The number of attached devices.
+   */
+  std::size_t getDeviceCount() const {
+    return attached.size();
+  }
+
+  const GatewayStats &getStats() const {
+    return stats;
+  }
+
+  protected:
+  struct Device {
+    std::unique_ptr<BowlerServer<N>> link;
+    // The route of the last request for each packet id
+    std::vector<std::uint32_t> routes;
+  };
+
+  template <std::size_t M> static bool isAvailable(BowlerServer<M> &iserver) {
+    bool available = false;
+    return iserver.isDataAvailable(available) != BOWLER_ERROR && available;
+  }
+
+  std::unique_ptr<BowlerServer<N + 1>> upstream;
+  std::size_t batchSize;
+  std::vector<Device> devices;
+  std::vector<std::uint8_t> attached;
+  GatewayStats stats;
+};
+
+#if defined(PLATFORM_NATIVE)
+/**
+ * A BowlerServer whose peer is one device reached over UDP, for use as a link of a BowlerGateway.
+ * Writes send requests to the device and reads return its replies.
+ */
+template <std::size_t N> class UDPDeviceLink : public BowlerServer<N> {
+  public:
+  UDPDeviceLink() = default;
+
+  virtual ~UDPDeviceLink() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  UDPDeviceLink(const UDPDeviceLink &) = delete;
+  UDPDeviceLink &operator=(const UDPDeviceLink &) = delete;
+
+  /**
+   * Opens a socket connected to the device, so that only its datagrams are received.
+   *
+   * @param iaddress The IPv4 address of the device, in network byte order.
+   * @param iport The port of the device.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t begin(std::uint32_t iaddress, std::uint16_t iport = BOWLER_SERVER_UDP_PORT) {
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return BOWLER_ERROR;
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(iport);
+    address.sin_addr.s_addr = iaddress;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+      const int error = errno;
+      close(fd);
+      fd = -1;
+      errno = error;
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    return send(fd, payload.data(), N, 0) == ssize_t(N) ? 1 : BOWLER_ERROR;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    if (!hasFrame) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    payload = frame;
+    hasFrame = false;
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (!hasFrame) {
+      const ssize_t length = recv(fd, frame.data(), N, MSG_DONTWAIT);
+      if (length >= 0) {
+        // Short datagrams are zero-padded
+        std::fill(frame.begin() + length, frame.end(), 0);
+        hasFrame = true;
+      }
+    }
+
+    available = hasFrame;
+    return 1;
+  }
+
+  /**
+   * @return The socket, for use with poll or epoll.
+   */
+  int getFd() const {
+    return fd;
+  }
+
+  protected:
+  int fd{-1};
+  std::array<std::uint8_t, N> frame;
+  bool hasFrame{false};
+};
+
+/**
+ * Runs several BowlerGateways, one per thread, so that forwarding scales across cores. Each shard
+ * usually listens on the same port with its own LinuxUDPServer opened with `SO_REUSEPORT` (see
+ * LinuxUDPServer::begin), and the kernel spreads hosts over the shards by their address. A host
+ * therefore always reaches the same shard, and every shard needs its own link to each device it
+ * forwards to; serial devices, which only one shard can own, are best served by a single shard.
+ */
+template <std::size_t N> class GatewayShards {
+  public:
+  /**
+   * Builds the gateway of a shard and lists the file descriptors its thread waits on when idle.
+   * A shard without descriptors polls continuously.
+   */
+  using Factory = std::function<std::unique_ptr<BowlerGateway<N>>(std::size_t ishard,
+                                                                  std::vector<int> &ifds)>;
+
+  /**
+   * @param ishardCount The number of shards.
+   * @param ifactory Builds each shard. Called on the shard's thread.
+   * @param iidleTimeout How long an idle shard waits for data before checking whether it has to
+   * stop, in milliseconds.
+   */
+  GatewayShards(std::size_t ishardCount, Factory ifactory, int iidleTimeout = 10)
+    : shardCount(std::max<std::size_t>(ishardCount, 1)),
+      factory(std::move(ifactory)),
+      idleTimeout(iidleTimeout) {
+  }
+
+  virtual ~GatewayShards() {
+    stop();
+  }
+
+  GatewayShards(const GatewayShards &) = delete;
+  GatewayShards &operator=(const GatewayShards &) = delete;
+
+  void start() {
+    if (!threads.empty()) {
+      return;
+    }
+
+    stopping = false;
+    for (std::size_t i = 0; i < shardCount; i++) {
+      threads.emplace_back([this, i] { run(i); });
+    }
+  }
+
+  /**
+   * Stops every shard and destroys its gateway.
+   */
+  void stop() {
+    stopping = true;
+    for (auto &&thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+  }
+
+  std::size_t getShardCount() const {
+    return shardCount;
+  }
+
+  protected:
+  void run(std::size_t ishard) {
+    std::vector<int> fds;
+    std::unique_ptr<BowlerGateway<N>> gateway = factory(ishard, fds);
+    if (!gateway) {
+      return;
+    }
+
+    std::vector<pollfd> pollFds;
+    for (auto &&fd : fds) {
+      pollFds.push_back(pollfd{fd, POLLIN, 0});
+    }
+
+    while (!stopping.load(std::memory_order_relaxed)) {
+      if (gateway->poll() == 0 && !pollFds.empty()) {
+        ::poll(pollFds.data(), pollFds.size(), idleTimeout);
+      }
+    }
+  }
+
+  std::size_t shardCount;
+  Factory factory;
+  int idleTimeout;
+  std::vector<std::thread> threads;
+  std::atomic<bool> stopping{false};
+};
+#endif
+} // namespace bowlerserver
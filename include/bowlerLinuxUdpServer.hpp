@@ -0,0 +1,487 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include "traceEvents.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <bitset>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Counters kept by LinuxUDPServer.
+ */
+struct LinuxUDPServerStats {
+  std::uint64_t datagramsReceived{0};
+  // Of datagramsReceived, those that arrived through the multicast group
+  std::uint64_t multicastReceived{0};
+  std::uint64_t datagramsSent{0};
+  std::uint64_t receiveCalls{0};
+  std::uint64_t sendCalls{0};
+  std::uint64_t sendErrors{0};
+};
+
+/**
+ * A BowlerServer which uses a non-blocking UDP socket on Linux, so the stack can run on a host as a
+ * device simulator or load-test target. Listens on port BOWLER_SERVER_UDP_PORT by default.
+ *
+ * Datagrams are moved in batches to save syscalls: isDataAvailable() receives up to `batchSize`
+ * datagrams with one `recvmmsg` once the previous batch has been read, and replies are collected
+ * and sent with one `sendmmsg` before the next batch is received (or when the batch is full, or on
+ * flush()). Each reply goes to the address the last read request came from. Replies the socket
+ * buffer has no room for wait for the next flush.
+ *
+ * Client addresses are kept in a table of up to MAX_PEERS entries, and a route (see
+ * BowlerServer::getRoute) is an index into it. When the table is full, the oldest entry is reused,
+ * so a reply held back for longer than it takes MAX_PEERS other clients to show up may go astray.
+ *
+ * After joinMulticastGroup(), datagrams sent to the group are received on a second socket and
+ * take priority over unicast ones, so a fan-out command such as an e-stop is not stuck behind a
+ * backlog. Replies always leave from the unicast socket, so a host that discovers devices through
+ * the group learns their unicast addresses from the replies.
+ */
+template <std::size_t N> class LinuxUDPServer : public BowlerServer<N> {
+  public:
+  static const std::size_t MAX_PEERS = 64;
+
+  /**
+   * @param iport The port to listen on. `0` picks a free port (see getPort()).
+   * @param ibatchSize The maximum number of datagrams moved per syscall.
+   */
+  explicit LinuxUDPServer(std::uint16_t iport = BOWLER_SERVER_UDP_PORT,
+                          std::size_t ibatchSize = 32)
+    : port(iport),
+      batchSize(std::max<std::size_t>(ibatchSize, 1)),
+      rxFrames(batchSize),
+      rxAddresses(batchSize),
+      rxMessages(batchSize),
+      rxVectors(batchSize),
+      txFrames(batchSize),
+      txAddresses(batchSize),
+      txAddressLengths(batchSize),
+      txMessages(batchSize),
+      txVectors(batchSize) {
+  }
+
+  virtual ~LinuxUDPServer() {
+    if (fd >= 0) {
+      flush();
+      close(fd);
+    }
+
+    if (multicastFd >= 0) {
+      close(multicastFd);
+    }
+  }
+
+  LinuxUDPServer(const LinuxUDPServer &) = delete;
+  LinuxUDPServer &operator=(const LinuxUDPServer &) = delete;
+
+  /**
+   * Opens and binds the socket.
+   *
+   * @param iaddress The IPv4 address to bind to, in network byte order.
+   * @param ireusePort Whether to set `SO_REUSEPORT`, so that several servers (one per thread) can
+   * listen on the same port and the kernel spreads the clients over them.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t begin(std::uint32_t iaddress = htonl(INADDR_ANY), bool ireusePort = false) {
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return BOWLER_ERROR;
+    }
+
+    const int reuse = 1;
+    if (port != 0) {
+      // With SO_REUSEADDR, the kernel may pick a port another such socket is bound to
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    }
+    if (ireusePort) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = iaddress;
+    socklen_t addressLength = sizeof(address);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), addressLength) < 0 ||
+        getsockname(fd, reinterpret_cast<sockaddr *>(&address), &addressLength) < 0) {
+      const int error = errno;
+      close(fd);
+      fd = -1;
+      errno = error;
+      return BOWLER_ERROR;
+    }
+
+    port = ntohs(address.sin_port);
+    return 1;
+  }
+
+  /**
+   * Joins a multicast group. Any number of servers on one host can join the same group and port,
+   * and each receives every datagram sent to it.
+   *
+   * @param igroup The IPv4 address of the group, in network byte order.
+   * @param iport The port datagrams are sent to the group on.
+   * @param iinterface The IPv4 address of the interface to join on, in network byte order, or
+   * `INADDR_ANY` to let the kernel choose.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t joinMulticastGroup(std::uint32_t igroup = htonl(BOWLER_SERVER_MULTICAST_GROUP),
+                                  std::uint16_t iport = BOWLER_SERVER_MULTICAST_PORT,
+                                  std::uint32_t iinterface = htonl(INADDR_ANY)) {
+    if (multicastFd >= 0) {
+      errno = EALREADY;
+      return BOWLER_ERROR;
+    }
+
+    multicastFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (multicastFd < 0) {
+      return BOWLER_ERROR;
+    }
+
+    const int reuse = 1;
+    setsockopt(multicastFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Bind to the group so that only its datagrams arrive on this socket
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(iport);
+    address.sin_addr.s_addr = igroup;
+    ip_mreq request{};
+    request.imr_multiaddr.s_addr = igroup;
+    request.imr_interface.s_addr = iinterface;
+    if (bind(multicastFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+        setsockopt(multicastFd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) < 0) {
+      const int error = errno;
+      close(multicastFd);
+      multicastFd = -1;
+      errno = error;
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    BOWLER_TRACE_SCOPE("transport", "LinuxUDPServer::write");
+    if (fd < 0) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    if (replyPeer >= peers.size()) {
+      // Nothing has been read yet, so there is nobody to reply to
+      errno = EDESTADDRREQ;
+      return BOWLER_ERROR;
+    }
+
+    if (txCount == batchSize) {
+      // The last batch was kept for want of room in the socket buffer
+      flush();
+      if (txCount == batchSize) {
+        stats.sendErrors++;
+        errno = ENOBUFS;
+        return BOWLER_ERROR;
+      }
+    }
+
+    txFrames[txCount] = payload;
+    txAddresses[txCount] = peers[replyPeer].address;
+    txAddressLengths[txCount] = peers[replyPeer].length;
+    txCount++;
+
+    if (txCount == batchSize) {
+      return flush();
+    }
+
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    BOWLER_TRACE_SCOPE("transport", "LinuxUDPServer::read");
+    if (fd < 0) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    if (rxIndex == rxCount) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    // Short datagrams are zero-padded, long ones are truncated
+    const std::size_t length = std::min<std::size_t>(rxMessages[rxIndex].msg_len, N);
+    std::copy_n(rxFrames[rxIndex].begin(), length, payload.begin());
+    std::fill(std::next(payload.begin(), length), payload.end(), 0);
+
+    replyPeer = findPeer(rxAddresses[rxIndex], rxMessages[rxIndex].msg_hdr.msg_namelen);
+    lastMulticast = rxMulticast;
+    rxIndex++;
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (fd < 0) {
+      errno = ENOTCONN;
+      available = false;
+      return BOWLER_ERROR;
+    }
+
+    if (rxIndex < rxCount) {
+      available = true;
+      return 1;
+    }
+
+    // The batch has been handled, so send its replies before receiving the next one
+    flush();
+
+    for (std::size_t i = 0; i < batchSize; i++) {
+      rxVectors[i].iov_base = rxFrames[i].data();
+      rxVectors[i].iov_len = N;
+      rxMessages[i].msg_hdr = msghdr{};
+      rxMessages[i].msg_hdr.msg_name = &rxAddresses[i];
+      rxMessages[i].msg_hdr.msg_namelen = sizeof(rxAddresses[i]);
+      rxMessages[i].msg_hdr.msg_iov = &rxVectors[i];
+      rxMessages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = -1;
+    rxMulticast = multicastFd >= 0;
+    if (rxMulticast) {
+      received = recvmmsg(multicastFd, rxMessages.data(), batchSize, MSG_DONTWAIT, nullptr);
+      stats.receiveCalls++;
+    }
+
+    if (received <= 0) {
+      rxMulticast = false;
+      received = recvmmsg(fd, rxMessages.data(), batchSize, MSG_DONTWAIT, nullptr);
+      stats.receiveCalls++;
+    }
+
+    rxIndex = 0;
+    if (received <= 0) {
+      // recvmmsg sets errno, which is EWOULDBLOCK when there is no data
+      rxCount = 0;
+      available = false;
+      return BOWLER_ERROR;
+    }
+
+    rxCount = received;
+    stats.datagramsReceived += received;
+    if (rxMulticast) {
+      stats.multicastReceived += received;
+    }
+
+    available = true;
+    return 1;
+  }
+
+  std::uint32_t getRoute() const override {
+    return replyPeer;
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    replyPeer = iroute;
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    if (evicted.none()) {
+      return false;
+    }
+
+    for (std::size_t i = 0; i < MAX_PEERS; i++) {
+      if (evicted.test(i)) {
+        evicted.reset(i);
+        iroute = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool isMulticast() const override {
+    return lastMulticast;
+  }
+
+  /**
+   * Sends every collected reply. Replies the socket has no room for are kept for the next flush; a
+   * reply which cannot be sent to its address is dropped.
+   *
+   * @return `1` on success or BOWLER_ERROR if any reply was dropped.
+   */
+  std::int32_t flush() {
+    for (std::size_t i = 0; i < txCount; i++) {
+      txVectors[i].iov_base = txFrames[i].data();
+      txVectors[i].iov_len = N;
+      txMessages[i].msg_hdr = msghdr{};
+      txMessages[i].msg_hdr.msg_name = &txAddresses[i];
+      txMessages[i].msg_hdr.msg_namelen = txAddressLengths[i];
+      txMessages[i].msg_hdr.msg_iov = &txVectors[i];
+      txMessages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    std::size_t sent = 0;
+    bool failed = false;
+    while (sent < txCount) {
+      const int result = sendmmsg(fd, txMessages.data() + sent, txCount - sent, 0);
+      stats.sendCalls++;
+      if (result > 0) {
+        stats.datagramsSent += result;
+        sent += result;
+      } else if (result < 0 && errno == EINTR) {
+        continue;
+      } else if (result < 0 && (errno == EWOULDBLOCK || errno == ENOBUFS)) {
+        // The socket buffer is full for now
+        break;
+      } else {
+        // Skip the datagram that failed so one bad address does not block the others
+        stats.sendErrors++;
+        failed = true;
+        sent++;
+      }
+    }
+
+    std::copy(txFrames.begin() + sent, txFrames.begin() + txCount, txFrames.begin());
+    std::copy(txAddresses.begin() + sent, txAddresses.begin() + txCount, txAddresses.begin());
+    std::copy(txAddressLengths.begin() + sent,
+              txAddressLengths.begin() + txCount,
+              txAddressLengths.begin());
+    txCount -= sent;
+    return failed ? BOWLER_ERROR : 1;
+  }
+
+  /**
+   * Blocks until a datagram can be read or the timeout passes.
+   *
+   * @param itimeout The timeout in milliseconds, or `-1` to wait forever.
+   * @return Whether data is available.
+   */
+  bool waitForData(int itimeout) {
+    if (rxIndex < rxCount) {
+      return true;
+    }
+
+    flush();
+    pollfd pollFds[] = {{fd, POLLIN, 0}, {multicastFd, POLLIN, 0}};
+    return poll(pollFds, multicastFd >= 0 ? 2 : 1, itimeout) > 0;
+  }
+
+  /**
+   * @return The socket, for use with poll or epoll.
+   */
+  int getFd() const {
+    return fd;
+  }
+
+  /**
+   * @return The multicast socket, or `-1` if no group was joined.
+   */
+  int getMulticastFd() const {
+    return multicastFd;
+  }
+
+  /**
+   * @return The port the socket is bound to.
+   */
+  std::uint16_t getPort() const {
+    return port;
+  }
+
+  const LinuxUDPServerStats &getStats() const {
+    return stats;
+  }
+
+  protected:
+  struct Peer {
+    sockaddr_storage address;
+    socklen_t length;
+  };
+
+  /**
+   * @return The index of the address in the peer table, which it is added to if it is new.
+   */
+  std::size_t findPeer(const sockaddr_storage &iaddress, socklen_t ilength) {
+    auto matches = [&](const Peer &peer) {
+      return peer.length == ilength && std::memcmp(&peer.address, &iaddress, ilength) == 0;
+    };
+
+    // Usually the same client sends several requests in a row
+    if (replyPeer < peers.size() && matches(peers[replyPeer])) {
+      return replyPeer;
+    }
+
+    for (std::size_t i = 0; i < peers.size(); i++) {
+      if (matches(peers[i])) {
+        return i;
+      }
+    }
+
+    if (peers.size() < MAX_PEERS) {
+      peers.push_back(Peer{iaddress, ilength});
+      return peers.size() - 1;
+    }
+
+    const std::size_t index = nextEvicted;
+    nextEvicted = (nextEvicted + 1) % MAX_PEERS;
+    // Whatever the coms kept for the old peer must not be applied to the new one
+    evicted.set(index);
+    peers[index] = Peer{iaddress, ilength};
+    return index;
+  }
+
+  int fd{-1};
+  int multicastFd{-1};
+  std::uint16_t port;
+  std::size_t batchSize;
+
+  std::vector<std::array<std::uint8_t, N>> rxFrames;
+  std::vector<sockaddr_storage> rxAddresses;
+  std::vector<mmsghdr> rxMessages;
+  std::vector<iovec> rxVectors;
+  std::size_t rxCount{0};
+  std::size_t rxIndex{0};
+  // Whether the current batch came from the multicast socket
+  bool rxMulticast{false};
+  bool lastMulticast{false};
+
+  std::vector<std::array<std::uint8_t, N>> txFrames;
+  std::vector<sockaddr_storage> txAddresses;
+  std::vector<socklen_t> txAddressLengths;
+  std::vector<mmsghdr> txMessages;
+  std::vector<iovec> txVectors;
+  std::size_t txCount{0};
+
+  std::vector<Peer> peers;
+  std::size_t nextEvicted{0};
+  // Peer table entries given to a new peer since the last takeClosedRoute()
+  std::bitset<MAX_PEERS> evicted;
+  std::size_t replyPeer{SIZE_MAX};
+
+  LinuxUDPServerStats stats;
+};
+} // namespace bowlerserver
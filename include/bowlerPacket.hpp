@@ -6,7 +6,14 @@
 namespace bowlerserver {
 class Packet {
   public:
-  Packet(std::uint8_t iid, bool iisReliable = false) : id(iid), m_isReliable(iisReliable) {
+  /**
+   * @param iid The packet id.
+   * @param iisReliable Whether the packet uses reliable transport.
+   * @param iisIndependent Whether the event may run concurrently with the events of other packet
+   * ids (see PacketExecutor). Events for the same id are never run concurrently.
+   */
+  Packet(std::uint8_t iid, bool iisReliable = false, bool iisIndependent = false)
+    : id(iid), m_isReliable(iisReliable), m_isIndependent(iisIndependent) {
   }
 
   virtual ~Packet() = default;
@@ -27,8 +34,31 @@ class Packet {
     return m_isReliable;
   }
 
+  bool isIndependent() const {
+    return m_isIndependent;
+  }
+
+  /**
+   * @return Whether this is a DeferredPacket, whose reply may be completed after the event returns.
+   */
+  bool isDeferred() const {
+    return m_isDeferred;
+  }
+
+  /**
+   * @return Whether the event leaves the last TIMESTAMP_LENGTH bytes of the payload alone, so that
+   * the frames of this packet can carry a timestamp in timestamp mode (see
+   * BowlerComs::setTimestampMode).
+   */
+  bool leavesTimestampFree() const {
+    return m_leavesTimestampFree;
+  }
+
   protected:
   std::uint8_t id;
   bool m_isReliable;
+  bool m_isIndependent;
+  bool m_isDeferred{false};
+  bool m_leavesTimestampFree{false};
 };
 } // namespace bowlerserver
@@ -0,0 +1,476 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include "comsMetrics.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Counters kept for each Scheduler task, in the units of getTime().
+ */
+struct TaskStats {
+  std::uint32_t runs{0};
+  // Runs which took longer than the task's budget
+  std::uint32_t overruns{0};
+  time_t lastRuntime{0};
+  time_t minRuntime{0};
+  time_t maxRuntime{0};
+  time_t totalRuntime{0};
+  // How long after its period elapsed the task started, at worst
+  time_t maxLateness{0};
+};
+
+/**
+ * Counters kept for Scheduler::loop() as a whole, in the units of getTime(). The interval is the
+ * time from the start of one loop to the start of the next, the jitter is how far an interval is
+ * from the target period, and the gap is the time spent outside of loop() between two loops,
+ * which is the time taken by whatever code calls it.
+ */
+struct LoopStats {
+  std::uint32_t loops{0};
+  time_t minInterval{0};
+  time_t maxInterval{0};
+  time_t maxJitter{0};
+  time_t maxGap{0};
+  // The time from the first loop to the start of the last one
+  time_t elapsed{0};
+  // The time spent in tasks over the same span
+  time_t busy{0};
+};
+
+/**
+ * A cooperative scheduler. Tasks run to completion inside loop(), so a task that overruns its
+ * budget delays everything after it; the overrun is counted and reported to the overrun callback
+ * instead.
+ *
+ * Tasks are run highest priority first, and in the order they were added within a priority. An
+ * adaptive task shortens its period to the minimum while it reports that it did work and doubles it
+ * up to the maximum while it is idle.
+ *
+ * Profiling is always on: besides the counters of TaskStats and LoopStats, the scheduler keeps a
+ * histogram of the runtimes of each task and of the jitter and gap of its loops, which cost one
+ * relaxed increment each per run. serializeStats() reports them in compact form (see
+ * OPERATION_GET_PROFILE).
+ */
+class Scheduler {
+  public:
+  using OverrunCallback = std::function<void(std::size_t task, time_t runtime)>;
+
+  /**
+   * @param iclock The clock to pace and time the tasks with.
+   */
+  explicit Scheduler(Clock &iclock = getSystemClock()) : clock(&iclock) {
+  }
+
+  /**
+   * Adds a periodic task.
+   *
+   * @param iname The name of the task, for reporting.
+   * @param ifunction The task.
+   * @param iperiod The time between the starts of two runs. `0` runs the task on every loop.
+   * @param ibudget The time a run is expected to take at most.
+   * @param ipriority Higher priority tasks run first.
+   * @return The task's index, for getStats().
+   */
+  std::size_t addTask(const char *iname,
+                      std::function<void(void)> ifunction,
+                      time_t iperiod,
+                      time_t ibudget,
+                      std::uint8_t ipriority = DEFAULT_PRIORITY) {
+    return add(iname,
+               [ifunction] {
+                 ifunction();
+                 return true;
+               },
+               iperiod,
+               iperiod,
+               ibudget,
+               ipriority);
+  }
+
+  /**
+   * Adds a task whose period adapts to how busy it is.
+   *
+   * @param iname The name of the task, for reporting.
+   * @param ifunction The task. Returns whether it did work.
+   * @param iminPeriod The period used while the task is busy.
+   * @param imaxPeriod The period the task backs off to while it is idle.
+   * @param ibudget The time a run is expected to take at most.
+   * @param ipriority Higher priority tasks run first.
+   * @return The task's index, for getStats().
+   */
+  std::size_t addAdaptiveTask(const char *iname,
+                              std::function<bool(void)> ifunction,
+                              time_t iminPeriod,
+                              time_t imaxPeriod,
+                              time_t ibudget,
+                              std::uint8_t ipriority = DEFAULT_PRIORITY) {
+    return add(iname, std::move(ifunction), iminPeriod, imaxPeriod, ibudget, ipriority);
+  }
+
+  /**
+   * Runs every task that is due.
+   *
+   * @return The number of tasks that ran.
+   */
+  std::size_t loop() {
+    const time_t loopStart = clock->now();
+    if (loopStats.loops > 0) {
+      const time_t interval = loopStart - lastLoopStart;
+      const time_t jitter = interval > targetPeriod ? interval - targetPeriod
+                                                    : targetPeriod - interval;
+      const time_t gap = loopStart - lastLoopEnd;
+      loopStats.minInterval =
+        loopStats.loops == 1 ? interval : std::min(loopStats.minInterval, interval);
+      loopStats.maxInterval = std::max(loopStats.maxInterval, interval);
+      loopStats.maxJitter = std::max(loopStats.maxJitter, jitter);
+      loopStats.maxGap = std::max(loopStats.maxGap, gap);
+      loopStats.elapsed += interval;
+      loopStats.busy += lastLoopBusy;
+      jitterHistogram.record(jitter);
+      gapHistogram.record(gap);
+    }
+    loopStats.loops++;
+    lastLoopStart = loopStart;
+
+    std::size_t ran = 0;
+    time_t busy = 0;
+    // The clock is only read again after a task ran, so the profile costs no extra reads
+    time_t now = loopStart;
+    for (auto &&index : order) {
+      Task &task = tasks[index];
+      const time_t start = now;
+      const time_t elapsed = start - task.lastStart;
+      if (task.hasRun && elapsed < task.period) {
+        continue;
+      }
+
+      if (task.hasRun) {
+        task.stats.maxLateness = std::max(task.stats.maxLateness, time_t(elapsed - task.period));
+      }
+
+      task.lastStart = start;
+      task.hasRun = true;
+      const bool didWork = task.function();
+      now = clock->now();
+      const time_t runtime = now - start;
+      ran++;
+      busy += runtime;
+
+      task.stats.runs++;
+      task.stats.lastRuntime = runtime;
+      task.stats.minRuntime =
+        task.stats.runs == 1 ? runtime : std::min(task.stats.minRuntime, runtime);
+      task.stats.maxRuntime = std::max(task.stats.maxRuntime, runtime);
+      task.stats.totalRuntime += runtime;
+      task.runtimes->record(runtime);
+      if (runtime > task.budget) {
+        task.stats.overruns++;
+        if (overrunCallback) {
+          overrunCallback(index, runtime);
+        }
+      }
+
+      if (task.minPeriod != task.maxPeriod) {
+        if (didWork) {
+          task.period = task.minPeriod;
+        } else {
+          task.period = std::min(task.maxPeriod, std::max(time_t(1), time_t(task.period * 2)));
+        }
+      }
+    }
+
+    lastLoopBusy = busy;
+    lastLoopEnd = now;
+    return ran;
+  }
+
+  /**
+   * @return How long until the next task is due, or `0` if one is due now.
+   */
+  time_t getTimeUntilNextTask() {
+    const time_t now = clock->now();
+    time_t next = 0;
+    bool first = true;
+    for (auto &&task : tasks) {
+      if (!task.hasRun) {
+        return 0;
+      }
+
+      const time_t elapsed = now - task.lastStart;
+      const time_t remaining = elapsed >= task.period ? 0 : task.period - elapsed;
+      if (first || remaining < next) {
+        next = remaining;
+        first = false;
+      }
+    }
+
+    return next;
+  }
+
+  /**
+   * Sets the function called after a task overran its budget.
+   */
+  void setOverrunCallback(OverrunCallback icallback) {
+    overrunCallback = std::move(icallback);
+  }
+
+  const TaskStats &getStats(std::size_t itask) const {
+    return tasks.at(itask).stats;
+  }
+
+  /**
+   * @return The histogram of the runtimes of a task.
+   */
+  const LatencyHistogram &getRuntimes(std::size_t itask) const {
+    return *tasks.at(itask).runtimes;
+  }
+
+  const LoopStats &getLoopStats() const {
+    return loopStats;
+  }
+
+  const LatencyHistogram &getJitter() const {
+    return jitterHistogram;
+  }
+
+  const LatencyHistogram &getGaps() const {
+    return gapHistogram;
+  }
+
+  /**
+   * Sets the period loop() is meant to be called at, which the jitter is measured against.
+   */
+  void setTargetPeriod(time_t iperiod) {
+    targetPeriod = iperiod;
+  }
+
+  /**
+   * Clears the profile of every task and of the loop, to start a new measurement window. The
+   * periods and schedule of the tasks are unchanged.
+   */
+  void resetStats() {
+    for (auto &&task : tasks) {
+      task.stats = TaskStats();
+      task.runtimes->reset();
+    }
+    loopStats = LoopStats();
+    jitterHistogram.reset();
+    gapHistogram.reset();
+  }
+
+  /**
+   * Writes the profile of a task or of the loop. Times are 4 bytes little endian, saturated, and
+   * percentiles are bucket lower bounds (see LatencyHistogram::getPercentile). Utilisation is the
+   * share of the elapsed time spent in the task, or in all tasks, in thousandths (2 bytes).
+   *
+   * A task is written as `<runs> <overruns> <min runtime> <max runtime> <p50> <p90> <p99>
+   * <max lateness> <utilisation> <name length (1 byte)> <name>`, the name cut short to fit. The
+   * loop (LOOP_PROFILE) is written as `<task count (1 byte)> <loops> <utilisation> <elapsed>
+   * <min interval> <max interval> <max jitter> <jitter p50> <jitter p99> <max gap> <gap p50>
+   * <gap p99>`.
+   *
+   * @param itask The index of a task, or LOOP_PROFILE.
+   * @return The number of bytes written, or BOWLER_ERROR with EINVAL for an unknown task or ENOBUFS
+   * if the buffer is too small.
+   */
+  std::int32_t
+  serializeStats(std::uint8_t itask, std::uint8_t *ibuffer, std::size_t ilength) const {
+    std::size_t offset = 0;
+    const auto put = [&](std::uint32_t ivalue, std::size_t ibytes) {
+      for (std::size_t i = 0; i < ibytes; i++) {
+        ibuffer[offset++] = ivalue >> (8 * i);
+      }
+    };
+    const auto putTime = [&](time_t ivalue) {
+      put(ivalue < 0 ? 0 : std::uint32_t(std::min<std::uint64_t>(ivalue, UINT32_MAX)), 4);
+    };
+    const auto share = [&](time_t ipart) {
+      const time_t elapsed = loopStats.elapsed;
+      return elapsed <= 0 ? 0 : std::uint32_t(std::min<time_t>(1000, ipart * 1000 / elapsed));
+    };
+
+    if (itask == LOOP_PROFILE) {
+      if (ilength < LOOP_PROFILE_LENGTH) {
+        errno = ENOBUFS;
+        return BOWLER_ERROR;
+      }
+
+      put(tasks.size(), 1);
+      put(loopStats.loops, 4);
+      put(share(loopStats.busy), 2);
+      putTime(loopStats.elapsed);
+      putTime(loopStats.minInterval);
+      putTime(loopStats.maxInterval);
+      putTime(loopStats.maxJitter);
+      putTime(jitterHistogram.getPercentile(0.5));
+      putTime(jitterHistogram.getPercentile(0.99));
+      putTime(loopStats.maxGap);
+      putTime(gapHistogram.getPercentile(0.5));
+      putTime(gapHistogram.getPercentile(0.99));
+      return offset;
+    }
+
+    if (itask >= tasks.size()) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    if (ilength < TASK_PROFILE_LENGTH) {
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    const Task &task = tasks[itask];
+    put(task.stats.runs, 4);
+    put(task.stats.overruns, 4);
+    putTime(task.stats.minRuntime);
+    putTime(task.stats.maxRuntime);
+    putTime(task.runtimes->getPercentile(0.5));
+    putTime(task.runtimes->getPercentile(0.9));
+    putTime(task.runtimes->getPercentile(0.99));
+    putTime(task.stats.maxLateness);
+    put(share(task.stats.totalRuntime), 2);
+
+    const std::size_t nameLength = std::min(std::strlen(task.name), ilength - offset - 1);
+    put(nameLength, 1);
+    std::copy_n(task.name, nameLength, ibuffer + offset);
+    return offset + nameLength;
+  }
+
+  const char *getName(std::size_t itask) const {
+    return tasks.at(itask).name;
+  }
+
+  /**
+   * @return The current period of a task (which changes for adaptive tasks).
+   */
+  time_t getPeriod(std::size_t itask) const {
+    return tasks.at(itask).period;
+  }
+
+  Clock &getClock() const {
+    return *clock;
+  }
+
+  std::size_t getTaskCount() const {
+    return tasks.size();
+  }
+
+  static const std::uint8_t DEFAULT_PRIORITY = 1;
+
+  // Selects the loop rather than a task in serializeStats()
+  static const std::uint8_t LOOP_PROFILE = 0xFF;
+  static const std::size_t LOOP_PROFILE_LENGTH = 47;
+  // Not counting the name
+  static const std::size_t TASK_PROFILE_LENGTH = 35;
+
+  protected:
+  struct Task {
+    const char *name;
+    std::function<bool(void)> function;
+    time_t period;
+    time_t minPeriod;
+    time_t maxPeriod;
+    time_t budget;
+    std::uint8_t priority;
+    time_t lastStart;
+    bool hasRun;
+    TaskStats stats;
+    // Behind a pointer because the histogram cannot move with the vector
+    std::unique_ptr<LatencyHistogram> runtimes;
+  };
+
+  std::size_t add(const char *iname,
+                  std::function<bool(void)> ifunction,
+                  time_t iminPeriod,
+                  time_t imaxPeriod,
+                  time_t ibudget,
+                  std::uint8_t ipriority) {
+    const std::size_t index = tasks.size();
+    tasks.push_back(Task{iname,
+                         std::move(ifunction),
+                         iminPeriod,
+                         iminPeriod,
+                         imaxPeriod,
+                         ibudget,
+                         ipriority,
+                         0,
+                         false,
+                         TaskStats(),
+                         std::unique_ptr<LatencyHistogram>(new LatencyHistogram())});
+
+    // Keep the run order sorted by priority, after any tasks of the same priority
+    auto position = std::upper_bound(
+      order.begin(), order.end(), index, [this](std::size_t lhs, std::size_t rhs) {
+        return tasks[lhs].priority > tasks[rhs].priority;
+      });
+    order.insert(position, index);
+    return index;
+  }
+
+  Clock *clock;
+  std::vector<Task> tasks;
+  std::vector<std::size_t> order;
+  OverrunCallback overrunCallback;
+
+  time_t targetPeriod{0};
+  LoopStats loopStats;
+  time_t lastLoopStart{0};
+  time_t lastLoopEnd{0};
+  // The time spent in tasks by the last loop, counted once the next one starts
+  time_t lastLoopBusy{0};
+  LatencyHistogram jitterHistogram;
+  LatencyHistogram gapHistogram;
+};
+
+/**
+ * Runs a Scheduler on a VirtualClock for a span of simulated time, as fast as possible. Between
+ * loops the clock jumps straight to the next task that is due, or moves by `istep` if a task is
+ * due on every loop. Tasks simulate their own cost by advancing the clock.
+ *
+ * @param iduration How much simulated time to run for.
+ * @param istep How far to move the clock after a loop if nothing advanced it.
+ * @return The number of loops that were run.
+ */
+inline std::uint64_t
+simulate(Scheduler &ischeduler, VirtualClock &iclock, time_t iduration, time_t istep = 1) {
+  const time_t end = iclock.now() + iduration;
+  std::uint64_t loops = 0;
+  while (iclock.now() < end) {
+    const time_t before = iclock.now();
+    ischeduler.loop();
+    loops++;
+
+    const time_t wait = ischeduler.getTimeUntilNextTask();
+    if (wait > 0) {
+      iclock.advance(wait);
+    } else if (iclock.now() == before) {
+      iclock.advance(istep);
+    }
+  }
+
+  return loops;
+}
+} // namespace bowlerserver
@@ -50,5 +50,56 @@ template <std::size_t N> class BowlerServer {
    * @return `1` on success or BOWLER_ERROR on error.
    */
   virtual std::int32_t isDataAvailable(bool &iavailable) = 0;
+
+  /**
+   * @return Whether every frame is delivered exactly once and in order (for example over TCP). The
+   * coms then skips the ACK state machine for reliable packets and echoes each sequence number as
+   * the ACK.
+   */
+  virtual bool isLossless() const {
+    return false;
+  }
+
+  /**
+   * @return Whether the last frame read arrived through a multicast group, so that every device in
+   * the group received it too.
+   */
+  virtual bool isMulticast() const {
+    return false;
+  }
+
+  /**
+   * A route identifies the peer (client address, connection, or transport) a request came from.
+   * Servers with a single peer only ever use route `0`.
+   *
+   * @return The route of the last frame read.
+   */
+  virtual std::uint32_t getRoute() const {
+    return 0;
+  }
+
+  /**
+   * Directs the following writes to a route returned by an earlier call to getRoute(). Used to
+   * send replies which are written after other requests have been read. Reading a frame resets the
+   * route to the one the frame came from.
+   *
+   * @param iroute The route to write to.
+   */
+  virtual void setRoute(std::uint32_t iroute) {
+    (void)iroute;
+  }
+
+  /**
+   * Reports a route which no longer leads to the peer it used to, because the peer disconnected or
+   * the server gave the route to a new peer, so that the coms can forget what it kept for that
+   * peer. The coms calls this until it returns false after each read and each poll.
+   *
+   * @param iroute The route to write the closed route to.
+   * @return Whether a closed route was written.
+   */
+  virtual bool takeClosedRoute(std::uint32_t &iroute) {
+    (void)iroute;
+    return false;
+  }
 };
 } // namespace bowlerserver
@@ -0,0 +1,402 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include "traceEvents.hpp"
+#include <atomic>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace bowlerserver {
+/**
+ * A lock-free single-producer single-consumer ring of frames, laid out to live in memory shared
+ * between two processes. The consumer can sleep on a futex until the producer pushes a frame; the
+ * producer only pays for the wake syscall when the consumer is actually asleep.
+ *
+ * @tparam N The frame length.
+ * @tparam Slots The number of frames the ring holds. Must be a power of two.
+ */
+template <std::size_t N, std::size_t Slots> struct ShmFrameRing {
+  static_assert(Slots > 0 && (Slots & (Slots - 1)) == 0,
+                "Ring slot count must be a power of two.");
+  static_assert(ATOMIC_INT_LOCK_FREE == 2, "Futex words must be lock-free atomics.");
+
+  /**
+   * Called by the producer.
+   *
+   * @return Whether the frame fit.
+   * @param iwoke Set to whether the consumer had to be woken up.
+   */
+  bool push(const std::array<std::uint8_t, N> &iframe, bool &iwoke) {
+    iwoke = false;
+    const std::uint32_t writeIndex = head.load(std::memory_order_relaxed);
+    if (writeIndex - tail.load(std::memory_order_acquire) == Slots) {
+      return false;
+    }
+
+    frames[writeIndex & (Slots - 1)] = iframe;
+
+    // Sequentially consistent so that either the consumer sees the new head before it sleeps or
+    // this sees that it is sleeping
+    head.store(writeIndex + 1, std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_seq_cst) != 0) {
+      syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&head), FUTEX_WAKE, 1, nullptr, nullptr,
+              0);
+      iwoke = true;
+    }
+
+    return true;
+  }
+
+  /**
+   * Called by the consumer.
+   *
+   * @return Whether a frame was written into `iframe`.
+   */
+  bool pop(std::array<std::uint8_t, N> &iframe) {
+    const std::uint32_t readIndex = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == readIndex) {
+      return false;
+    }
+
+    iframe = frames[readIndex & (Slots - 1)];
+    tail.store(readIndex + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Called by the consumer. Sleeps until the ring is not empty, the timeout passes, or a signal
+   * arrives.
+   *
+   * @param itimeout The timeout in milliseconds, or `-1` to wait forever.
+   * @return Whether the ring is not empty.
+   */
+  bool wait(int itimeout) {
+    const std::uint32_t observed = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) != observed) {
+      return true;
+    }
+
+    sleeping.store(1, std::memory_order_seq_cst);
+    if (head.load(std::memory_order_seq_cst) == observed && itimeout != 0) {
+      // The kernel only puts this to sleep if head still equals `observed`, so a push between the
+      // check and the syscall is not missed
+      timespec timeout{itimeout / 1000, (itimeout % 1000) * 1000000L};
+      syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&head), FUTEX_WAIT, observed,
+              itimeout < 0 ? nullptr : &timeout, nullptr, 0);
+    }
+    sleeping.store(0, std::memory_order_relaxed);
+
+    return !empty();
+  }
+
+  // Written by the producer; also the futex word
+  alignas(64) std::atomic<std::uint32_t> head{0};
+  // Written by the consumer
+  alignas(64) std::atomic<std::uint32_t> tail{0};
+  std::atomic<std::uint32_t> sleeping{0};
+  alignas(64) std::array<std::array<std::uint8_t, N>, Slots> frames;
+};
+
+/**
+ * The contents of the shared memory object: one ring per direction.
+ */
+template <std::size_t N, std::size_t Slots> struct ShmChannel {
+  static const std::uint32_t MAGIC = 0x42534d31; // "BSM1"
+
+  // Set last by the creator, so a peer which sees it also sees initialized rings
+  std::atomic<std::uint32_t> magic{0};
+  std::uint32_t frameLength{N};
+  std::uint32_t slots{Slots};
+  ShmFrameRing<N, Slots> requests;
+  ShmFrameRing<N, Slots> replies;
+};
+
+/**
+ * Counters kept by ShmServer.
+ */
+struct ShmServerStats {
+  std::uint64_t framesReceived{0};
+  std::uint64_t framesSent{0};
+  // Replies that were dropped because the host was not reading them
+  std::uint64_t framesDropped{0};
+  std::uint64_t wakeups{0};
+};
+
+/**
+ * Maps a shared memory object holding a ShmChannel. Used by both ends of the channel.
+ */
+template <std::size_t N, std::size_t Slots> class ShmMapping {
+  public:
+  explicit ShmMapping(std::string iname) : name(std::move(iname)) {
+  }
+
+  virtual ~ShmMapping() {
+    if (channel != nullptr) {
+      munmap(channel, sizeof(ShmChannel<N, Slots>));
+    }
+
+    if (owner) {
+      shm_unlink(name.c_str());
+    }
+  }
+
+  ShmMapping(const ShmMapping &) = delete;
+  ShmMapping &operator=(const ShmMapping &) = delete;
+
+  const std::string &getName() const {
+    return name;
+  }
+
+  protected:
+  /**
+   * Creates (or replaces) the shared memory object and initializes the channel in it.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t create() {
+    shm_unlink(name.c_str());
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      return BOWLER_ERROR;
+    }
+
+    owner = true;
+    if (ftruncate(fd, sizeof(ShmChannel<N, Slots>)) < 0 || map(fd) == BOWLER_ERROR) {
+      const int error = errno;
+      close(fd);
+      errno = error;
+      return BOWLER_ERROR;
+    }
+
+    close(fd);
+    new (channel) ShmChannel<N, Slots>();
+    channel->magic.store(ShmChannel<N, Slots>::MAGIC, std::memory_order_release);
+    return 1;
+  }
+
+  /**
+   * Maps a channel that another process created.
+   *
+   * @return `1` on success or BOWLER_ERROR on error. `errno` is `EPROTO` if the channel was created
+   * with a different frame length or slot count.
+   */
+  std::int32_t attach() {
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+      return BOWLER_ERROR;
+    }
+
+    struct stat status;
+    if (fstat(fd, &status) < 0 || map(fd) == BOWLER_ERROR) {
+      const int error = errno;
+      close(fd);
+      errno = error;
+      return BOWLER_ERROR;
+    }
+
+    close(fd);
+    if (std::size_t(status.st_size) != sizeof(ShmChannel<N, Slots>) ||
+        channel->magic.load(std::memory_order_acquire) != ShmChannel<N, Slots>::MAGIC ||
+        channel->frameLength != N || channel->slots != Slots) {
+      munmap(channel, sizeof(ShmChannel<N, Slots>));
+      channel = nullptr;
+      errno = EPROTO;
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  std::int32_t map(int ifd) {
+    void *memory = mmap(nullptr, sizeof(ShmChannel<N, Slots>), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, ifd, 0);
+    if (memory == MAP_FAILED) {
+      return BOWLER_ERROR;
+    }
+
+    channel = static_cast<ShmChannel<N, Slots> *>(memory);
+    return 1;
+  }
+
+  std::string name;
+  ShmChannel<N, Slots> *channel{nullptr};
+  bool owner{false};
+};
+
+/**
+ * A BowlerServer for a device simulator running on the same machine as the host software. Frames
+ * move through a pair of lock-free rings in POSIX shared memory instead of the network stack, so a
+ * round trip needs no syscalls while both sides are busy. A side that is idle sleeps on a futex
+ * (see waitForData()) and is woken by the next frame.
+ *
+ * The server creates the shared memory object named `name` in begin() and removes it when
+ * destroyed; the host connects to it with ShmClient. Replies are dropped if the host lets the reply
+ * ring fill up, like datagrams are, so reliable packets still use the ACK state machine.
+ *
+ * @tparam Slots The number of frames each ring holds. Must be a power of two.
+ */
+template <std::size_t N, std::size_t Slots = 64>
+class ShmServer : public BowlerServer<N>, public ShmMapping<N, Slots> {
+  public:
+  /**
+   * @param iname The name of the shared memory object, starting with a slash, like `/bowler`.
+   */
+  explicit ShmServer(std::string iname) : ShmMapping<N, Slots>(std::move(iname)) {
+  }
+
+  /**
+   * Creates the shared memory object. A stale object with the same name is replaced.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t begin() {
+    return this->create();
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    BOWLER_TRACE_SCOPE("transport", "ShmServer::write");
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    bool woke;
+    if (!this->channel->replies.push(payload, woke)) {
+      stats.framesDropped++;
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    stats.framesSent++;
+    stats.wakeups += woke;
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    BOWLER_TRACE_SCOPE("transport", "ShmServer::read");
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    if (!this->channel->requests.pop(payload)) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    stats.framesReceived++;
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (this->channel == nullptr) {
+      errno = ENOTCONN;
+      available = false;
+      return BOWLER_ERROR;
+    }
+
+    available = !this->channel->requests.empty();
+    return 1;
+  }
+
+  /**
+   * Blocks until the host sends a request or the timeout passes.
+   *
+   * @param itimeout The timeout in milliseconds, or `-1` to wait forever.
+   * @return Whether there is a request to read.
+   */
+  bool waitForData(int itimeout) {
+    return this->channel != nullptr && this->channel->requests.wait(itimeout);
+  }
+
+  const ShmServerStats &getStats() const {
+    return stats;
+  }
+
+  protected:
+  ShmServerStats stats;
+};
+
+/**
+ * The host side of a ShmServer channel.
+ */
+template <std::size_t N, std::size_t Slots = 64> class ShmClient : public ShmMapping<N, Slots> {
+  public:
+  /**
+   * @param iname The name the ShmServer was created with.
+   */
+  explicit ShmClient(std::string iname) : ShmMapping<N, Slots>(std::move(iname)) {
+  }
+
+  /**
+   * Connects to the server's shared memory object, which must already exist.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t begin() {
+    return this->attach();
+  }
+
+  /**
+   * Sends a request.
+   *
+   * @return `1` on success or BOWLER_ERROR on error. `errno` is `ENOBUFS` if the request ring is
+   * full.
+   */
+  std::int32_t write(const std::array<std::uint8_t, N> &ipayload) {
+    bool woke;
+    if (!this->channel->requests.push(ipayload, woke)) {
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    return 1;
+  }
+
+  /**
+   * Receives a reply, waiting for one if there is none yet.
+   *
+   * @param itimeout The timeout in milliseconds, `0` to not wait, or `-1` to wait forever.
+   * @return `1` on success or BOWLER_ERROR on error. `errno` is `EWOULDBLOCK` if no reply arrived.
+   */
+  std::int32_t read(std::array<std::uint8_t, N> &ipayload, int itimeout = 0) {
+    auto &replies = this->channel->replies;
+    while (!replies.pop(ipayload)) {
+      if (itimeout == 0 || !replies.wait(itimeout)) {
+        errno = EWOULDBLOCK;
+        return BOWLER_ERROR;
+      }
+    }
+
+    return 1;
+  }
+};
+} // namespace bowlerserver
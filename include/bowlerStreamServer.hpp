@@ -0,0 +1,237 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include "byteStream.hpp"
+#include "cobs.hpp"
+#include "crc32.hpp"
+#include "ringBuffer.hpp"
+#include "traceEvents.hpp"
+#include <memory>
+
+namespace bowlerserver {
+/**
+ * Counters kept by StreamServer.
+ */
+struct StreamServerStats {
+  std::uint32_t framesReceived{0};
+  std::uint32_t framesSent{0};
+  // Frames dropped because their CRC did not match
+  std::uint32_t crcErrors{0};
+  // Frames dropped because they were malformed or the wrong length
+  std::uint32_t framingErrors{0};
+  // Frames not written because the transmit ring was full
+  std::uint32_t txOverflows{0};
+};
+
+/**
+ * A BowlerServer over a ByteStream such as a serial port.
+ *
+ * Wire format: `0x00 COBS(<frame (N bytes)> <CRC-32 of the frame, little endian>) 0x00`. The
+ * leading delimiter isolates each frame from any other bytes on the stream (such as log text), and
+ * frames that fail to decode or whose CRC does not match are dropped. Bytes move between the
+ * stream and a receive ring and a transmit ring without blocking whenever the server is used.
+ */
+template <std::size_t N> class StreamServer : public BowlerServer<N> {
+  public:
+  static constexpr std::size_t FRAME_LENGTH = N + 4;
+  static constexpr std::size_t MAX_ENCODED_LENGTH = cobsMaxEncodedLength(FRAME_LENGTH);
+  // Room for a few frames in each direction
+  static constexpr std::size_t RING_CAPACITY = nextPowerOfTwo(4 * (MAX_ENCODED_LENGTH + 2));
+
+  explicit StreamServer(std::unique_ptr<ByteStream> istream) : stream(std::move(istream)) {
+  }
+
+  /**
+   * Queues a frame and sends as much of it as the stream takes now. The rest is sent by later
+   * calls; errors of the stream are reported by pump() and isDataAvailable().
+   *
+   * @return `1` once the frame is queued, or BOWLER_ERROR with ENOBUFS if there is no room for it.
+   */
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    BOWLER_TRACE_SCOPE("transport", "StreamServer::write");
+    std::array<std::uint8_t, FRAME_LENGTH> frame;
+    std::copy(payload.begin(), payload.end(), frame.begin());
+    const std::uint32_t crc = crc32(payload.data(), N);
+    for (std::size_t i = 0; i < 4; i++) {
+      frame[N + i] = crc >> (8 * i);
+    }
+
+    std::array<std::uint8_t, MAX_ENCODED_LENGTH + 2> encoded;
+    encoded[0] = 0;
+    const std::size_t length = cobsEncode(frame.data(), FRAME_LENGTH, encoded.data() + 1) + 2;
+    encoded[length - 1] = 0;
+
+    if (tx.available() < length) {
+      // Make room by sending what is already queued
+      pump();
+      if (tx.available() < length) {
+        stats.txOverflows++;
+        errno = ENOBUFS;
+        return BOWLER_ERROR;
+      }
+    }
+
+    tx.write(encoded.data(), length);
+    stats.framesSent++;
+    pump();
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    BOWLER_TRACE_SCOPE("transport", "StreamServer::read");
+    if (!hasFrame) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    std::copy_n(decoded.begin(), N, payload.begin());
+    hasFrame = false;
+    return 1;
+  }
+
+  /**
+   * Moves bytes on (see pump()) and decodes the next frame received.
+   *
+   * @return `1` on success or BOWLER_ERROR if the stream failed. Frames received before it failed
+   * are still available.
+   */
+  std::int32_t isDataAvailable(bool &available) override {
+    const auto error = pump();
+    if (!hasFrame) {
+      decodeNext();
+    }
+
+    available = hasFrame;
+    return error;
+  }
+
+  /**
+   * Moves bytes from the stream into the receive ring and from the transmit ring into the stream,
+   * as many as fit without blocking. An error in one direction does not stop the other.
+   *
+   * @return `1` on success or BOWLER_ERROR with the `errno` of the stream if it failed.
+   */
+  std::int32_t pump() {
+    std::uint8_t chunk[256];
+    std::size_t count = 1;
+    std::int32_t result = 1;
+    int error = 0;
+
+    while (tx.size() > 0 && count > 0) {
+      const std::size_t length = tx.peek(chunk, sizeof(chunk));
+      if (stream->write(chunk, length, count) == BOWLER_ERROR) {
+        result = BOWLER_ERROR;
+        error = errno;
+        break;
+      }
+      tx.skip(count);
+    }
+
+    count = 1;
+    while (rx.available() > 0 && count > 0) {
+      if (stream->read(chunk, std::min(sizeof(chunk), rx.available()), count) == BOWLER_ERROR) {
+        result = BOWLER_ERROR;
+        error = errno;
+        break;
+      }
+      rx.write(chunk, count);
+    }
+
+    if (result == BOWLER_ERROR) {
+      errno = error;
+    }
+    return result;
+  }
+
+  /**
+   * @return The number of bytes waiting to be written to the stream.
+   */
+  std::size_t getPendingTxBytes() const {
+    return tx.size();
+  }
+
+  const StreamServerStats &getStats() const {
+    return stats;
+  }
+
+  protected:
+  /**
+   * Consumes bytes from the receive ring until a whole valid frame has been decoded or the ring is
+   * empty.
+   */
+  void decodeNext() {
+    std::uint8_t chunk[256];
+    std::size_t length;
+    while (!hasFrame && (length = rx.peek(chunk, sizeof(chunk))) > 0) {
+      std::size_t consumed = 0;
+      while (consumed < length && !hasFrame) {
+        const std::uint8_t byte = chunk[consumed++];
+        if (byte == 0) {
+          finishFrame();
+        } else if (encodedLength < encoded.size()) {
+          encoded[encodedLength++] = byte;
+        } else {
+          // Too long to be a frame; drop everything up to the next delimiter
+          overflowed = true;
+        }
+      }
+
+      rx.skip(consumed);
+    }
+  }
+
+  void finishFrame() {
+    if (overflowed) {
+      stats.framingErrors++;
+    } else if (encodedLength > 0) {
+      const std::size_t length =
+        cobsDecode(encoded.data(), encodedLength, decoded.data(), decoded.size());
+      if (length != FRAME_LENGTH) {
+        stats.framingErrors++;
+      } else {
+        std::uint32_t crc = 0;
+        for (std::size_t i = 0; i < 4; i++) {
+          crc |= std::uint32_t(decoded[N + i]) << (8 * i);
+        }
+
+        if (crc == crc32(decoded.data(), N)) {
+          stats.framesReceived++;
+          hasFrame = true;
+        } else {
+          stats.crcErrors++;
+        }
+      }
+    }
+
+    encodedLength = 0;
+    overflowed = false;
+  }
+
+  std::unique_ptr<ByteStream> stream;
+  RingBuffer<RING_CAPACITY> rx;
+  RingBuffer<RING_CAPACITY> tx;
+  std::array<std::uint8_t, MAX_ENCODED_LENGTH> encoded;
+  std::size_t encodedLength{0};
+  bool overflowed{false};
+  std::array<std::uint8_t, FRAME_LENGTH> decoded;
+  bool hasFrame{false};
+  StreamServerStats stats;
+};
+} // namespace bowlerserver
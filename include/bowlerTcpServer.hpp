@@ -0,0 +1,444 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include "traceEvents.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <deque>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Counters kept by TCPServer.
+ */
+struct TCPServerStats {
+  std::uint64_t framesReceived{0};
+  std::uint64_t framesSent{0};
+  std::uint64_t writevCalls{0};
+  std::uint64_t connectionsAccepted{0};
+  // Frames whose length prefix was larger than N
+  std::uint64_t framingErrors{0};
+  // Connections dropped because their client did not read its replies
+  std::uint64_t txOverflows{0};
+};
+
+/**
+ * A lossless BowlerServer over TCP on Linux, for wired or bridged links and bulk transfers.
+ * Reliable packets skip the ACK state machine on this server (see BowlerServer::isLossless).
+ *
+ * Wire format: `<length (2 bytes, little endian)> <frame (length bytes)>`. Shorter frames are
+ * zero-padded to N when read; replies are always N bytes. Several clients may be connected; each
+ * reply goes to the connection the last read request came from. Replies are collected and sent
+ * with one `writev` per connection before the next receive, when `batchSize` replies are waiting,
+ * or on flush(). A connection whose client leaves more than `maxQueued` replies unread is dropped,
+ * as the server cannot lose replies.
+ */
+template <std::size_t N> class TCPServer : public BowlerServer<N> {
+  static_assert(N <= UINT16_MAX, "Frames must fit the 2 byte length prefix.");
+
+  public:
+  static const std::size_t PREFIX_LENGTH = 2;
+  // The most closed connections remembered for takeClosedRoute(), so that a server nobody asks
+  // does not grow
+  static const std::size_t MAX_CLOSED_ROUTES = 4096;
+
+  /**
+   * @param iport The port to listen on. `0` picks a free port (see getPort()).
+   * @param inoDelay Whether to disable Nagle's algorithm (`TCP_NODELAY`), trading bandwidth for
+   * latency.
+   * @param ibatchSize The maximum number of replies collected per connection before they are sent.
+   * @param imaxQueued The maximum number of replies waiting to be sent per connection.
+   */
+  explicit TCPServer(std::uint16_t iport = BOWLER_SERVER_UDP_PORT,
+                     bool inoDelay = true,
+                     std::size_t ibatchSize = 32,
+                     std::size_t imaxQueued = 1024)
+    : port(iport),
+      noDelay(inoDelay),
+      batchSize(std::max<std::size_t>(ibatchSize, 1)),
+      maxQueued(std::max(imaxQueued, batchSize)) {
+  }
+
+  virtual ~TCPServer() {
+    flush();
+    for (auto &&connection : connections) {
+      close(connection.fd);
+    }
+
+    if (listenFd >= 0) {
+      close(listenFd);
+    }
+  }
+
+  TCPServer(const TCPServer &) = delete;
+  TCPServer &operator=(const TCPServer &) = delete;
+
+  /**
+   * Opens the listening socket.
+   *
+   * @param iaddress The IPv4 address to listen on, in network byte order.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t begin(std::uint32_t iaddress = htonl(INADDR_ANY)) {
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+      return BOWLER_ERROR;
+    }
+
+    const int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = iaddress;
+    socklen_t addressLength = sizeof(address);
+    if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), addressLength) < 0 ||
+        listen(listenFd, SOMAXCONN) < 0 ||
+        getsockname(listenFd, reinterpret_cast<sockaddr *>(&address), &addressLength) < 0) {
+      const int error = errno;
+      close(listenFd);
+      listenFd = -1;
+      errno = error;
+      return BOWLER_ERROR;
+    }
+
+    port = ntohs(address.sin_port);
+    return 1;
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    BOWLER_TRACE_SCOPE("transport", "TCPServer::write");
+    Connection *connection = findConnection(replyConnection);
+    if (connection == nullptr) {
+      errno = ENOTCONN;
+      return BOWLER_ERROR;
+    }
+
+    if (connection->tx.size() >= maxQueued) {
+      if (flush(*connection) == BOWLER_ERROR) {
+        return BOWLER_ERROR;
+      }
+
+      if (connection->tx.size() >= maxQueued) {
+        // The client is not reading its replies
+        stats.txOverflows++;
+        connection->failed = true;
+        errno = ENOBUFS;
+        return BOWLER_ERROR;
+      }
+    }
+
+    std::array<std::uint8_t, PREFIX_LENGTH + N> frame;
+    frame[0] = N & 0xFF;
+    frame[1] = N >> 8;
+    std::copy(payload.begin(), payload.end(), frame.begin() + PREFIX_LENGTH);
+    connection->tx.push_back(frame);
+
+    if (connection->tx.size() >= batchSize) {
+      return flush(*connection);
+    }
+
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    BOWLER_TRACE_SCOPE("transport", "TCPServer::read");
+    if (received.empty()) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    payload = received.front().frame;
+    replyConnection = received.front().connection;
+    received.pop_front();
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (listenFd < 0) {
+      errno = ENOTCONN;
+      available = false;
+      return BOWLER_ERROR;
+    }
+
+    if (received.empty()) {
+      // Everything received has been handled, so send the replies before receiving more
+      flush();
+      accept();
+      receive();
+    }
+
+    available = !received.empty();
+    return 1;
+  }
+
+  bool isLossless() const override {
+    return true;
+  }
+
+  /**
+   * @return An id of the connection the last request came from.
+   */
+  std::uint32_t getRoute() const override {
+    return replyConnection;
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    replyConnection = iroute;
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    if (closedRoutes.empty()) {
+      return false;
+    }
+
+    iroute = closedRoutes.front();
+    closedRoutes.pop_front();
+    return true;
+  }
+
+  /**
+   * Sends every collected reply on every connection.
+   *
+   * @return `1` on success or BOWLER_ERROR if a connection failed.
+   */
+  std::int32_t flush() {
+    std::int32_t result = 1;
+    for (auto &&connection : connections) {
+      if (flush(connection) == BOWLER_ERROR) {
+        result = BOWLER_ERROR;
+      }
+    }
+
+    closeFailedConnections();
+    return result;
+  }
+
+  /**
+   * Blocks until a connection has data, a client connects, or the timeout passes.
+   *
+   * @param itimeout The timeout in milliseconds, or `-1` to wait forever.
+   * @return Whether there is something to do.
+   */
+  bool waitForData(int itimeout) {
+    if (!received.empty()) {
+      return true;
+    }
+
+    flush();
+    std::vector<pollfd> pollFds{pollfd{listenFd, POLLIN, 0}};
+    for (auto &&connection : connections) {
+      pollFds.push_back(pollfd{connection.fd, POLLIN, 0});
+    }
+
+    return poll(pollFds.data(), pollFds.size(), itimeout) > 0;
+  }
+
+  std::uint16_t getPort() const {
+    return port;
+  }
+
+  std::size_t getConnectionCount() const {
+    return connections.size();
+  }
+
+  const TCPServerStats &getStats() const {
+    return stats;
+  }
+
+  protected:
+  struct Connection {
+    int fd;
+    std::uint32_t id;
+    std::vector<std::uint8_t> rx;
+    std::deque<std::array<std::uint8_t, PREFIX_LENGTH + N>> tx;
+    // How much of the front of `tx` has already been sent
+    std::size_t txOffset;
+    bool failed;
+  };
+
+  struct ReceivedFrame {
+    std::uint32_t connection;
+    std::array<std::uint8_t, N> frame;
+  };
+
+  void accept() {
+    int fd;
+    while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      const int flag = noDelay ? 1 : 0;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+      connections.push_back(Connection{fd, nextConnectionId, {}, {}, 0, false});
+      // Connection ids are routes, which must fit in 24 bits to be used in a MultiBowlerServer
+      nextConnectionId = (nextConnectionId + 1) & 0xFFFFFF;
+      stats.connectionsAccepted++;
+    }
+  }
+
+  void receive() {
+    std::uint8_t chunk[4096];
+    for (auto &&connection : connections) {
+      ssize_t count;
+      while ((count = ::read(connection.fd, chunk, sizeof(chunk))) > 0 ||
+             (count < 0 && errno == EINTR)) {
+        if (count > 0) {
+          connection.rx.insert(connection.rx.end(), chunk, chunk + count);
+        }
+      }
+
+      if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        // Closed by the peer or broken
+        connection.failed = true;
+      }
+
+      parseFrames(connection);
+    }
+
+    closeFailedConnections();
+  }
+
+  void parseFrames(Connection &connection) {
+    std::size_t offset = 0;
+    while (connection.rx.size() - offset >= PREFIX_LENGTH) {
+      const std::size_t length = connection.rx[offset] | connection.rx[offset + 1] << 8;
+      if (length > N) {
+        // The stream cannot be resynchronised after a bad length, so drop the connection
+        stats.framingErrors++;
+        connection.failed = true;
+        return;
+      }
+
+      if (connection.rx.size() - offset < PREFIX_LENGTH + length) {
+        break;
+      }
+
+      ReceivedFrame frame{connection.id, {}};
+      std::copy_n(connection.rx.begin() + offset + PREFIX_LENGTH, length, frame.frame.begin());
+      received.push_back(frame);
+      stats.framesReceived++;
+      offset += PREFIX_LENGTH + length;
+    }
+
+    connection.rx.erase(connection.rx.begin(), connection.rx.begin() + offset);
+  }
+
+  std::int32_t flush(Connection &connection) {
+    while (!connection.tx.empty() && !connection.failed) {
+      std::array<iovec, 64> vectors;
+      std::size_t count = 0;
+      for (auto frame = connection.tx.begin();
+           frame != connection.tx.end() && count < vectors.size();
+           ++frame, ++count) {
+        const std::size_t skip = count == 0 ? connection.txOffset : 0;
+        vectors[count] = iovec{frame->data() + skip, frame->size() - skip};
+      }
+
+      ssize_t written = writev(connection.fd, vectors.data(), count);
+      stats.writevCalls++;
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          // The socket buffer is full; try again on the next flush
+          return 1;
+        }
+
+        connection.failed = true;
+        return BOWLER_ERROR;
+      }
+
+      // Drop the frames that were written completely and remember how far into the next one it got
+      written += connection.txOffset;
+      connection.txOffset = 0;
+      while (written > 0) {
+        const ssize_t frameLength = connection.tx.front().size();
+        if (written < frameLength) {
+          connection.txOffset = written;
+          break;
+        }
+
+        written -= frameLength;
+        connection.tx.pop_front();
+        stats.framesSent++;
+      }
+    }
+
+    return 1;
+  }
+
+  Connection *findConnection(std::uint32_t iid) {
+    for (auto &&connection : connections) {
+      if (connection.id == iid && !connection.failed) {
+        return &connection;
+      }
+    }
+
+    return nullptr;
+  }
+
+  void closeFailedConnections() {
+    for (auto &&connection : connections) {
+      if (!connection.failed) {
+        continue;
+      }
+
+      close(connection.fd);
+      if (closedRoutes.size() == MAX_CLOSED_ROUTES) {
+        closedRoutes.pop_front();
+      }
+      closedRoutes.push_back(connection.id);
+
+      // Their replies have nowhere to go, and reading them would bring back what the coms kept for
+      // the closed route
+      const std::uint32_t id = connection.id;
+      received.erase(
+        std::remove_if(received.begin(),
+                       received.end(),
+                       [id](const ReceivedFrame &frame) { return frame.connection == id; }),
+        received.end());
+    }
+
+    auto end = std::remove_if(connections.begin(), connections.end(), [](Connection &connection) {
+      return connection.failed;
+    });
+    connections.erase(end, connections.end());
+  }
+
+  int listenFd{-1};
+  std::uint16_t port;
+  bool noDelay;
+  std::size_t batchSize;
+  std::size_t maxQueued;
+  std::vector<Connection> connections;
+  std::uint32_t nextConnectionId{0};
+  std::deque<ReceivedFrame> received;
+  std::deque<std::uint32_t> closedRoutes;
+  std::uint32_t replyConnection{UINT32_MAX};
+  TCPServerStats stats;
+};
+} // namespace bowlerserver
@@ -18,18 +18,27 @@
 
 #include "bowlerDeviceServerUtil.hpp"
 #include "bowlerServer.hpp"
+#include "traceEvents.hpp"
 #include <WiFi.h>
 #include <WiFiUdp.h>
+#include <bitset>
 #include <functional>
+#include <vector>
 
 namespace bowlerserver {
-const std::uint16_t BOWLER_SERVER_UDP_PORT = 1866;
-
 /**
  * A BowlerServer which uses UDP. Listens on port BOWLER_SERVER_UDP_PORT.
+ *
+ * Replies go to the client the last read request came from. The last MAX_PEERS client addresses
+ * are remembered so that replies written later (see BowlerServer::setRoute) reach the right client.
+ *
+ * After joinMulticastGroup(), datagrams sent to the group are received too, ahead of unicast ones.
+ * Replies always leave from the unicast port.
  */
 template <std::size_t N> class UDPServer : public BowlerServer<N> {
   public:
+  static const std::size_t MAX_PEERS = 8;
+
   UDPServer() {
     event = WiFi.onEvent(std::bind(&UDPServer::callback, this, std::placeholders::_1));
   }
@@ -38,13 +47,40 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
     WiFi.removeEvent(event);
   }
 
+  /**
+   * Joins a multicast group for discovery and fan-out commands, now or as soon as there is a
+   * connection.
+   *
+   * @param igroup The group.
+   * @param iport The port datagrams are sent to the group on.
+   */
+  void joinMulticastGroup(IPAddress igroup = IPAddress(BOWLER_SERVER_MULTICAST_GROUP >> 24,
+                                                       (BOWLER_SERVER_MULTICAST_GROUP >> 16) & 0xFF,
+                                                       (BOWLER_SERVER_MULTICAST_GROUP >> 8) & 0xFF,
+                                                       BOWLER_SERVER_MULTICAST_GROUP & 0xFF),
+                          std::uint16_t iport = BOWLER_SERVER_MULTICAST_PORT) {
+    multicastGroup = igroup;
+    multicastPort = iport;
+    useMulticast = true;
+    if (connected) {
+      multicastUdp.beginMulticast(multicastGroup, multicastPort);
+    }
+  }
+
   std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    BOWLER_TRACE_SCOPE("transport", "UDPServer::write");
     if (!connected) {
       errno = ENOTCONN;
       return BOWLER_ERROR;
     }
 
-    if (!udp.beginPacket()) {
+    if (replyPeer >= peers.size()) {
+      // Nothing has been read yet, so there is nobody to reply to
+      errno = EDESTADDRREQ;
+      return BOWLER_ERROR;
+    }
+
+    if (!udp.beginPacket(peers[replyPeer].address, peers[replyPeer].port)) {
       // beginPacket will set errno
       return BOWLER_ERROR;
     }
@@ -59,12 +95,15 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
   }
 
   std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    BOWLER_TRACE_SCOPE("transport", "UDPServer::read");
     if (!connected) {
       errno = ENOTCONN;
       return BOWLER_ERROR;
     }
 
-    udp.read(payload.data(), payload.size());
+    source->read(payload.data(), payload.size());
+    replyPeer = findPeer(source->remoteIP(), source->remotePort());
+    lastMulticast = source == &multicastUdp;
     return 1;
   }
 
@@ -75,22 +114,88 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
       return BOWLER_ERROR;
     }
 
-    if (!udp.parsePacket()) {
+    source = &udp;
+    if (useMulticast && multicastUdp.parsePacket()) {
+      source = &multicastUdp;
+    } else if (!udp.parsePacket()) {
       available = false;
       // parsePacket will set errno
       return BOWLER_ERROR;
     }
 
-    available = udp.available() > 0;
+    available = source->available() > 0;
     return 1;
   }
 
+  std::uint32_t getRoute() const override {
+    return replyPeer;
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    replyPeer = iroute;
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    if (evicted.none()) {
+      return false;
+    }
+
+    for (std::size_t i = 0; i < MAX_PEERS; i++) {
+      if (evicted.test(i)) {
+        evicted.reset(i);
+        iroute = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool isMulticast() const override {
+    return lastMulticast;
+  }
+
   protected:
+  struct Peer {
+    IPAddress address;
+    std::uint16_t port;
+  };
+
+  /**
+   * @return The index of the client in the peer table, which it is added to if it is new.
+   */
+  std::size_t findPeer(const IPAddress &iaddress, std::uint16_t iport) {
+    for (std::size_t i = 0; i < peers.size(); i++) {
+      if (peers[i].port == iport && peers[i].address == iaddress) {
+        return i;
+      }
+    }
+
+    if (peers.size() < MAX_PEERS) {
+      peers.push_back(Peer{iaddress, iport});
+      return peers.size() - 1;
+    }
+
+    // Reuse the oldest entry
+    const std::size_t index = nextEvicted;
+    nextEvicted = (nextEvicted + 1) % MAX_PEERS;
+    // Whatever the coms kept for the old peer must not be applied to the new one
+    evicted.set(index);
+    peers[index] = Peer{iaddress, iport};
+    return index;
+  }
+
+  void beginMulticast() {
+    if (useMulticast) {
+      multicastUdp.beginMulticast(multicastGroup, multicastPort);
+    }
+  }
+
   void callback(WiFiEvent_t event) {
     switch (event) {
     case SYSTEM_EVENT_STA_GOT_IP:
       // ESP32 station got IP from connected AP
       udp.begin(WiFi.localIP(), BOWLER_SERVER_UDP_PORT);
+      beginMulticast();
       connected = true;
       break;
 
@@ -103,6 +208,7 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
       // A station connected to ESP32 soft-AP
       if (!connected) {
         udp.begin(WiFi.softAPIP(), BOWLER_SERVER_UDP_PORT);
+        beginMulticast();
         connected = true;
       }
       break;
@@ -114,7 +220,19 @@ template <std::size_t N> class UDPServer : public BowlerServer<N> {
 
   private:
   WiFiUDP udp;
+  WiFiUDP multicastUdp;
+  // The socket the last parsed datagram is on
+  WiFiUDP *source{&udp};
+  bool useMulticast{false};
+  bool lastMulticast{false};
+  IPAddress multicastGroup;
+  std::uint16_t multicastPort{BOWLER_SERVER_MULTICAST_PORT};
   wifi_event_id_t event;
   bool connected{false};
+  std::vector<Peer> peers;
+  std::size_t nextEvicted{0};
+  // Peer table entries given to a new peer since the last takeClosedRoute()
+  std::bitset<MAX_PEERS> evicted;
+  std::size_t replyPeer{SIZE_MAX};
 };
 } // namespace bowlerserver
@@ -0,0 +1,54 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerPacket.hpp"
+
+namespace bowlerserver {
+/**
+ * A Packet which keeps the CPU busy for a fixed time and leaves the payload as it is, so that the
+ * reply echoes the request. Stands in for a handler of that cost in simulations and load tests.
+ */
+class BusyPacket : public Packet {
+  public:
+  /**
+   * @param icost How long each event spins for, in the units of the clock.
+   * @param iclock A clock which moves on its own; on a VirtualClock, the spin would never end.
+   */
+  BusyPacket(std::uint8_t iid,
+             bool iisReliable = false,
+             time_t icost = 0,
+             Clock &iclock = getSystemClock())
+    : Packet(iid, iisReliable), cost(icost), clock(&iclock) {
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    if (cost > 0) {
+      const time_t start = clock->now();
+      while (clock->now() - start < cost) {
+      }
+    }
+    return 1;
+  }
+
+  protected:
+  time_t cost;
+  Clock *clock;
+};
+} // namespace bowlerserver
@@ -0,0 +1,123 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(PLATFORM_NATIVE)
+#include <unistd.h>
+#endif
+
+namespace bowlerserver {
+/**
+ * A non-blocking byte stream, such as a serial port.
+ */
+class ByteStream {
+  public:
+  virtual ~ByteStream() = default;
+
+  /**
+   * Reads the bytes that are available now, without waiting for more.
+   *
+   * @param idata The buffer to read into.
+   * @param ilength The size of the buffer.
+   * @param icount The number of bytes that were read.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t read(std::uint8_t *idata, std::size_t ilength, std::size_t &icount) = 0;
+
+  /**
+   * Writes the bytes that fit now, without waiting for room.
+   *
+   * @param idata The bytes to write.
+   * @param ilength The number of bytes to write.
+   * @param icount The number of bytes that were written.
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  virtual std::int32_t
+  write(const std::uint8_t *idata, std::size_t ilength, std::size_t &icount) = 0;
+};
+
+#if defined(PLATFORM_NATIVE)
+/**
+ * A ByteStream over a non-blocking file descriptor, such as a pty or one end of a socketpair. Does
+ * not take ownership of the descriptor.
+ */
+class FdByteStream : public ByteStream {
+  public:
+  explicit FdByteStream(int ifd) : fd(ifd) {
+  }
+
+  std::int32_t read(std::uint8_t *idata, std::size_t ilength, std::size_t &icount) override {
+    const ssize_t result = ::read(fd, idata, ilength);
+    return finish(result, icount);
+  }
+
+  std::int32_t write(const std::uint8_t *idata, std::size_t ilength, std::size_t &icount) override {
+    const ssize_t result = ::write(fd, idata, ilength);
+    return finish(result, icount);
+  }
+
+  protected:
+  std::int32_t finish(ssize_t iresult, std::size_t &icount) {
+    if (iresult >= 0) {
+      icount = iresult;
+      return 1;
+    }
+
+    icount = 0;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // Nothing to move right now, which is not an error for a non-blocking stream
+      return 1;
+    }
+
+    return BOWLER_ERROR;
+  }
+
+  int fd;
+};
+#else
+/**
+ * A ByteStream over an Arduino Stream, such as Serial.
+ */
+class ArduinoByteStream : public ByteStream {
+  public:
+  explicit ArduinoByteStream(Stream &istream) : stream(istream) {
+  }
+
+  std::int32_t read(std::uint8_t *idata, std::size_t ilength, std::size_t &icount) override {
+    icount = 0;
+    while (icount < ilength && stream.available() > 0) {
+      idata[icount++] = stream.read();
+    }
+    return 1;
+  }
+
+  std::int32_t write(const std::uint8_t *idata, std::size_t ilength, std::size_t &icount) override {
+    const int room = stream.availableForWrite();
+    icount = stream.write(idata, std::min<std::size_t>(ilength, room > 0 ? room : 0));
+    return 1;
+  }
+
+  private:
+  Stream &stream;
+};
+#endif
+} // namespace bowlerserver
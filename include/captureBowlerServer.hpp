@@ -0,0 +1,392 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#if defined(PLATFORM_NATIVE)
+#include <cstdio>
+#endif
+
+namespace bowlerserver {
+// The pcap link type of a capture, LINKTYPE_USER0. Wireshark decodes it with the dissector in
+// tools/bowler.lua once it is mapped to DLT_USER0.
+const std::uint32_t BOWLER_PCAP_LINKTYPE = 147;
+
+// The direction byte in front of each captured frame
+const std::uint8_t CAPTURE_IN = 0;
+const std::uint8_t CAPTURE_OUT = 1;
+
+/**
+ * Counters kept by CaptureBowlerServer.
+ */
+struct CaptureStats {
+  std::uint32_t captured{0};
+  // Frames overwritten before they were read out
+  std::uint32_t overwritten{0};
+  // Dumps abandoned by the host, which timed out or were started over
+  std::uint32_t abandoned{0};
+};
+
+/**
+ * A BowlerServer which records the frames read from and written to another one, with their time
+ * and route, into a bounded ring that always holds the most recent ones. Recording costs a copy of
+ * the frame and a read of the clock while it is enabled, and is compiled out entirely, leaving a
+ * pass-through server, when `BOWLER_DISABLE_CAPTURE` is defined.
+ *
+ * readPcap() streams the ring out as a pcap file, in chunks of any size, so that it can be written
+ * to a file on the host (see writePcap()) or pulled through the coms (see OPERATION_READ_CAPTURE),
+ * where a lost chunk is asked for again.
+ * Each record carries `<Direction (1 byte)> <Route (4 bytes, little endian)>` in front of the whole
+ * Bowler frame, with the link type BOWLER_PCAP_LINKTYPE, and its time is that of the clock in
+ * microseconds. Capture pauses while a dump is in progress, so that a dump through the coms does
+ * not capture itself, and resumes once it ends or the reader stops asking for it.
+ *
+ * Not thread safe: frames must be captured and read out on the thread that uses the server.
+ */
+template <std::size_t N> class CaptureBowlerServer : public BowlerServer<N> {
+  public:
+  static const std::size_t PCAP_HEADER_LENGTH = 24;
+  static const std::size_t PCAP_RECORD_HEADER_LENGTH = 16;
+  // The length of the data of each record
+  static const std::size_t CAPTURE_LENGTH = 5 + N;
+
+  /**
+   * @param iserver The server to capture the frames of.
+   * @param icapacity The number of frames the ring holds.
+   * @param iclock The clock to timestamp the frames with.
+   * @param idumpTimeout How long a dump waits for the next read before it is abandoned and capture
+   * resumes, in the units of the clock.
+   */
+  explicit CaptureBowlerServer(std::unique_ptr<BowlerServer<N>> iserver,
+                               std::size_t icapacity = 32,
+                               Clock &iclock = getSystemClock(),
+                               time_t idumpTimeout = 1000000)
+    : server(std::move(iserver)), clock(&iclock), dumpTimeout(idumpTimeout) {
+#if !defined(BOWLER_DISABLE_CAPTURE)
+    entries.resize(std::max<std::size_t>(icapacity, 1));
+#else
+    (void)icapacity;
+#endif
+  }
+
+  virtual ~CaptureBowlerServer() = default;
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    capture(CAPTURE_OUT, payload, writeRoute);
+    return server->write(payload);
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    const auto error = server->read(payload);
+    if (error != BOWLER_ERROR) {
+      writeRoute = server->getRoute();
+      capture(CAPTURE_IN, payload, writeRoute);
+    }
+
+    return error;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    return server->isDataAvailable(available);
+  }
+
+  bool isLossless() const override {
+    return server->isLossless();
+  }
+
+  bool isMulticast() const override {
+    return server->isMulticast();
+  }
+
+  std::uint32_t getRoute() const override {
+    return server->getRoute();
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    writeRoute = iroute;
+    server->setRoute(iroute);
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    return server->takeClosedRoute(iroute);
+  }
+
+  /**
+   * Turns recording on or off. It is on after construction.
+   */
+  void setEnabled(bool ienabled) {
+    enabled = ienabled;
+  }
+
+  /**
+   * Streams the captured frames out as a pcap file. Reading at offset `0` starts a dump, over any
+   * dump in progress, and each read after that says how far into the stream the reader has got, so
+   * that a chunk which never reached it can be asked for again: a record is removed from the ring
+   * only once a read starts past its end. The read at the end of the stream returns `0` and ends
+   * the dump; asking for the end again also returns `0`.
+   *
+   * @param ioffset The offset in the stream of the dump to read from.
+   * @return The number of bytes written, or BOWLER_ERROR with EINVAL if the offset is not in the
+   * stream of the dump, or with ENOTSUP if capture is compiled out.
+   */
+  std::int32_t readPcap(std::uint32_t ioffset, std::uint8_t *ibuffer, std::size_t ilength) {
+#if defined(BOWLER_DISABLE_CAPTURE)
+    (void)ioffset;
+    (void)ibuffer;
+    (void)ilength;
+    errno = ENOTSUP;
+    return BOWLER_ERROR;
+#else
+    if (ioffset == 0) {
+      abortPcap();
+      dumping = true;
+    } else if (!dumping) {
+      if (ioffset == dumpEnd) {
+        return 0;
+      }
+
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    // Free the records the reader has read the whole of
+    const std::uint32_t start = dumpFreed == 0 ? 0 : streamOffset(dumpFreed);
+    const std::uint32_t end = streamOffset(dumpFreed + count);
+    if (ioffset < start || ioffset > end) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+    while (ioffset >= streamOffset(dumpFreed + 1)) {
+      head = (head + 1) % entries.size();
+      count--;
+      dumpFreed++;
+    }
+
+    if (ioffset == end) {
+      dumping = false;
+      dumpEnd = end;
+      return 0;
+    }
+
+    std::size_t written = 0;
+    std::uint32_t offset = ioffset;
+    while (written < ilength && offset < end) {
+      std::size_t chunkOffset;
+      std::size_t chunkLength;
+      if (offset < PCAP_HEADER_LENGTH) {
+        writePcapHeader();
+        chunkOffset = offset;
+        chunkLength = PCAP_HEADER_LENGTH;
+      } else {
+        const std::size_t record = (offset - PCAP_HEADER_LENGTH) / RECORD_LENGTH;
+        writePcapRecord(entries[(head + record - dumpFreed) % entries.size()]);
+        chunkOffset = offset - streamOffset(record);
+        chunkLength = RECORD_LENGTH;
+      }
+
+      const std::size_t length = std::min(ilength - written, chunkLength - chunkOffset);
+      std::memcpy(ibuffer + written, chunk.data() + chunkOffset, length);
+      offset += length;
+      written += length;
+    }
+
+    lastRead = clock->now();
+    return written;
+#endif
+  }
+
+  /**
+   * Ends the dump in progress, if any, keeping the records not yet freed, and resumes capture.
+   */
+  void abortPcap() {
+#if !defined(BOWLER_DISABLE_CAPTURE)
+    if (dumping) {
+      dumping = false;
+      stats.abandoned++;
+    }
+    dumpFreed = 0;
+    dumpEnd = 0;
+#endif
+  }
+
+#if defined(PLATFORM_NATIVE)
+  /**
+   * Dumps the captured frames into a pcap file.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t writePcap(const char *ipath) {
+    std::FILE *file = std::fopen(ipath, "wb");
+    if (!file) {
+      return BOWLER_ERROR;
+    }
+
+    std::array<std::uint8_t, 512> buffer;
+    std::int32_t result = 1;
+    std::uint32_t offset = 0;
+    for (;;) {
+      const std::int32_t length = readPcap(offset, buffer.data(), buffer.size());
+      if (length == BOWLER_ERROR) {
+        result = BOWLER_ERROR;
+        break;
+      }
+
+      if (length == 0) {
+        break;
+      }
+
+      if (std::fwrite(buffer.data(), 1, length, file) != std::size_t(length)) {
+        result = BOWLER_ERROR;
+        break;
+      }
+      offset += length;
+    }
+
+    if (std::fclose(file) != 0) {
+      result = BOWLER_ERROR;
+    }
+    return result;
+  }
+#endif
+
+  /**
+   * @return The number of frames in the ring.
+   */
+  std::size_t size() const {
+    return count;
+  }
+
+  const CaptureStats &getStats() const {
+    return stats;
+  }
+
+  protected:
+  struct Entry {
+    time_t time;
+    std::uint32_t route;
+    std::uint8_t direction;
+    std::array<std::uint8_t, N> frame;
+  };
+
+  static const std::size_t RECORD_LENGTH = PCAP_RECORD_HEADER_LENGTH + CAPTURE_LENGTH;
+
+  /**
+   * @return The offset in the stream of a dump of the record at an index counted from its start.
+   */
+  static std::uint32_t streamOffset(std::size_t irecord) {
+    return PCAP_HEADER_LENGTH + irecord * RECORD_LENGTH;
+  }
+
+  void capture(std::uint8_t idirection,
+               const std::array<std::uint8_t, N> &iframe,
+               std::uint32_t iroute) {
+#if defined(BOWLER_DISABLE_CAPTURE)
+    (void)idirection;
+    (void)iframe;
+    (void)iroute;
+#else
+    if (!enabled) {
+      return;
+    }
+
+    if (dumping) {
+      if (clock->now() - lastRead < dumpTimeout) {
+        return;
+      }
+      abortPcap();
+    }
+
+    std::size_t index;
+    if (count == entries.size()) {
+      // Keep the most recent frames
+      index = head;
+      head = (head + 1) % entries.size();
+      stats.overwritten++;
+    } else {
+      index = (head + count) % entries.size();
+      count++;
+    }
+
+    Entry &entry = entries[index];
+    entry.time = clock->now();
+    entry.route = iroute;
+    entry.direction = idirection;
+    entry.frame = iframe;
+    stats.captured++;
+#endif
+  }
+
+  void put(std::size_t ioffset, std::uint32_t ivalue, std::size_t ibytes) {
+    for (std::size_t i = 0; i < ibytes; i++) {
+      chunk[ioffset + i] = ivalue >> (8 * i);
+    }
+  }
+
+  void writePcapHeader() {
+    put(0, 0xA1B2C3D4, 4);
+    put(4, 2, 2);
+    put(6, 4, 2);
+    // Time zone and timestamp accuracy
+    put(8, 0, 4);
+    put(12, 0, 4);
+    put(16, CAPTURE_LENGTH, 4);
+    put(20, BOWLER_PCAP_LINKTYPE, 4);
+  }
+
+  void writePcapRecord(const Entry &ientry) {
+    const time_t time = ientry.time < 0 ? 0 : ientry.time;
+    put(0, std::uint32_t(time / 1000000), 4);
+    put(4, std::uint32_t(time % 1000000), 4);
+    put(8, CAPTURE_LENGTH, 4);
+    put(12, CAPTURE_LENGTH, 4);
+    chunk[16] = ientry.direction;
+    put(17, ientry.route, 4);
+    std::copy(ientry.frame.begin(), ientry.frame.end(), chunk.begin() + 21);
+  }
+
+  std::unique_ptr<BowlerServer<N>> server;
+  Clock *clock;
+  std::uint32_t writeRoute{0};
+  bool enabled{true};
+  CaptureStats stats;
+
+  std::vector<Entry> entries;
+  std::size_t head{0};
+  std::size_t count{0};
+
+  // The dump being read out, which owns the records at the head of the ring
+  bool dumping{false};
+  time_t dumpTimeout;
+  time_t lastRead{0};
+  // The number of records freed since the dump started
+  std::size_t dumpFreed{0};
+  // The length of the stream of the last dump which ended
+  std::uint32_t dumpEnd{0};
+  // The header or record being copied out
+  std::array<std::uint8_t,
+             (PCAP_HEADER_LENGTH > RECORD_LENGTH ? PCAP_HEADER_LENGTH : RECORD_LENGTH)>
+    chunk;
+};
+} // namespace bowlerserver
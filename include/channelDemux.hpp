@@ -0,0 +1,294 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace bowlerserver {
+template <std::size_t N> class ChannelServer;
+
+/**
+ * Counters kept by ChannelDemux.
+ */
+struct ChannelDemuxStats {
+  std::uint32_t framesReceived{0};
+  // Frames for a channel nobody opened
+  std::uint32_t unknownChannel{0};
+  // Frames dropped because their channel's queue was full
+  std::uint32_t queueFull{0};
+};
+
+/**
+ * Splits one BowlerServer into independent virtual channels so that several coms instances, each
+ * with its own packets, can share one socket. Each coms can then be run by a different task or at
+ * a different rate.
+ *
+ * Frames on the shared server carry a channel byte in front of the normal Bowler frame:
+ * `<Channel (1 byte)> <ID (1 byte)> <Seq Num (1 byte)> <ACK num (1 byte)> <Payload>`. A coms gets
+ * its channel from openChannel(). Whichever channel runs out of queued requests first reads the
+ * shared server and queues the frames for their channels; frames for channels that are not open
+ * are dropped. Access to the shared server is serialized with a mutex. Each request keeps whether
+ * the shared server received it through a multicast group, so that the coms of its channel does
+ * not reply to it.
+ *
+ * The demux must outlive the channels opened from it.
+ */
+template <std::size_t N> class ChannelDemux {
+  public:
+  /**
+   * @param iserver The shared server. Its frames are one byte longer than the channels' frames.
+   * @param iqueueCapacity The maximum number of requests queued per channel.
+   */
+  ChannelDemux(std::unique_ptr<BowlerServer<N + 1>> iserver, std::size_t iqueueCapacity = 16)
+    : server(std::move(iserver)), queueCapacity(std::max<std::size_t>(iqueueCapacity, 1)) {
+  }
+
+  ChannelDemux(const ChannelDemux &) = delete;
+  ChannelDemux &operator=(const ChannelDemux &) = delete;
+
+  /**
+   * Opens a channel. It is closed when the returned server is destroyed.
+   *
+   * @param ichannel The channel number.
+   * @return The server of the channel, or nullptr with EADDRINUSE if the channel is already open.
+   */
+  std::unique_ptr<ChannelServer<N>> openChannel(std::uint8_t ichannel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (channels.find(ichannel) != channels.end()) {
+      errno = EADDRINUSE;
+      return nullptr;
+    }
+
+    channels[ichannel];
+    return std::unique_ptr<ChannelServer<N>>(new ChannelServer<N>(this, ichannel));
+  }
+
+  ChannelDemuxStats getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+  protected:
+  friend class ChannelServer<N>;
+
+  struct Request {
+    std::array<std::uint8_t, N> frame;
+    std::uint32_t route;
+    // Whether the shared server received it through a multicast group
+    bool multicast;
+  };
+
+  bool isLossless() const {
+    return server->isLossless();
+  }
+
+  void closeChannel(std::uint8_t ichannel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    channels.erase(ichannel);
+    closedRoutes.erase(ichannel);
+  }
+
+  std::int32_t write(std::uint8_t ichannel,
+                     std::uint32_t iroute,
+                     const std::array<std::uint8_t, N> &ipayload) {
+    std::array<std::uint8_t, N + 1> frame;
+    frame[0] = ichannel;
+    std::copy(ipayload.begin(), ipayload.end(), frame.begin() + 1);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    server->setRoute(iroute);
+    return server->write(frame);
+  }
+
+  /**
+   * Takes a route of the shared server which closed. Every channel is told about every closed
+   * route, since each keeps its own state for the peers of the shared server.
+   *
+   * @return Whether a route was written into `iroute`.
+   */
+  bool takeClosedRoute(std::uint8_t ichannel, std::uint32_t &iroute) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::uint32_t route;
+    while (server->takeClosedRoute(route)) {
+      for (auto &&channel : channels) {
+        closedRoutes[channel.first].push_back(route);
+      }
+    }
+
+    auto &routes = closedRoutes[ichannel];
+    if (routes.empty()) {
+      return false;
+    }
+
+    iroute = routes.front();
+    routes.pop_front();
+    return true;
+  }
+
+  /**
+   * @return Whether a request is queued for a channel, after reading the shared server if none
+   * was.
+   */
+  bool hasRequest(std::uint8_t ichannel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &queue = channels[ichannel];
+    if (queue.empty()) {
+      receive();
+    }
+
+    return !queue.empty();
+  }
+
+  /**
+   * Takes a request for a channel, reading the shared server if none is queued.
+   *
+   * @return Whether a request was written into `irequest`.
+   */
+  bool take(std::uint8_t ichannel, Request &irequest) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &queue = channels[ichannel];
+    if (queue.empty()) {
+      receive();
+    }
+
+    if (queue.empty()) {
+      return false;
+    }
+
+    irequest = queue.front();
+    queue.pop_front();
+    return true;
+  }
+
+  /**
+   * Moves the frames waiting on the shared server into the queues of their channels. Reads at most
+   * one queue's worth of frames so that one call takes a bounded time.
+   */
+  void receive() {
+    for (std::size_t i = 0; i < queueCapacity; i++) {
+      bool available = false;
+      if (server->isDataAvailable(available) == BOWLER_ERROR || !available) {
+        return;
+      }
+
+      std::array<std::uint8_t, N + 1> frame;
+      if (server->read(frame) == BOWLER_ERROR) {
+        return;
+      }
+
+      stats.framesReceived++;
+      auto channel = channels.find(frame[0]);
+      if (channel == channels.end()) {
+        stats.unknownChannel++;
+      } else if (channel->second.size() == queueCapacity) {
+        stats.queueFull++;
+      } else {
+        Request request;
+        std::copy(frame.begin() + 1, frame.end(), request.frame.begin());
+        request.route = server->getRoute();
+        request.multicast = server->isMulticast();
+        channel->second.push_back(request);
+      }
+    }
+  }
+
+  std::unique_ptr<BowlerServer<N + 1>> server;
+  std::size_t queueCapacity;
+  std::mutex mutex;
+  std::map<std::uint8_t, std::deque<Request>> channels;
+  std::map<std::uint8_t, std::deque<std::uint32_t>> closedRoutes;
+  ChannelDemuxStats stats;
+};
+
+/**
+ * One channel of a ChannelDemux, used as the server of a coms.
+ */
+template <std::size_t N> class ChannelServer : public BowlerServer<N> {
+  public:
+  virtual ~ChannelServer() {
+    demux->closeChannel(channel);
+  }
+
+  ChannelServer(const ChannelServer &) = delete;
+  ChannelServer &operator=(const ChannelServer &) = delete;
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    return demux->write(channel, route, payload);
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    typename ChannelDemux<N>::Request request;
+    if (!demux->take(channel, request)) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    payload = request.frame;
+    route = request.route;
+    multicast = request.multicast;
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    available = demux->hasRequest(channel);
+    return 1;
+  }
+
+  bool isLossless() const override {
+    return demux->isLossless();
+  }
+
+  bool isMulticast() const override {
+    return multicast;
+  }
+
+  std::uint32_t getRoute() const override {
+    return route;
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    route = iroute;
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    return demux->takeClosedRoute(channel, iroute);
+  }
+
+  std::uint8_t getChannel() const {
+    return channel;
+  }
+
+  protected:
+  friend class ChannelDemux<N>;
+
+  ChannelServer(ChannelDemux<N> *idemux, std::uint8_t ichannel)
+    : demux(idemux), channel(ichannel) {
+  }
+
+  ChannelDemux<N> *demux;
+  std::uint8_t channel;
+  std::uint32_t route{0};
+  // Whether the request last read was multicast
+  bool multicast{false};
+};
+} // namespace bowlerserver
@@ -0,0 +1,154 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+namespace bowlerserver {
+// Timestamps are sent as 8 bytes, little endian, in the units of getTime()
+const std::size_t TIMESTAMP_LENGTH = 8;
+
+inline void writeTimestamp(std::uint8_t *idata, std::int64_t itime) {
+  for (std::size_t i = 0; i < TIMESTAMP_LENGTH; i++) {
+    idata[i] = static_cast<std::uint64_t>(itime) >> (8 * i);
+  }
+}
+
+inline std::int64_t readTimestamp(const std::uint8_t *idata) {
+  std::uint64_t time = 0;
+  for (std::size_t i = 0; i < TIMESTAMP_LENGTH; i++) {
+    time |= std::uint64_t(idata[i]) << (8 * i);
+  }
+  return static_cast<std::int64_t>(time);
+}
+
+/**
+ * Estimates the offset and drift of a device's clock from the host's, for use on the host with the
+ * replies to OPERATION_CLOCK_SYNC. Each exchange gives the four NTP timestamps: `t1` the host sent
+ * the request, `t2` the device read it, `t3` the device replied, and `t4` the host received the
+ * reply (`t1` and `t4` on the host's clock, `t2` and `t3` on the device's).
+ *
+ * The offset is that of the exchange with the smallest round trip among the last `window` ones,
+ * because queueing only ever adds delay and it is rarely symmetric. The drift is the least-squares
+ * slope of the offsets over host time, fitted to the exchanges of the window whose round trip is at
+ * most twice the smallest one, so that a few queued exchanges do not tilt it.
+ */
+class ClockSyncEstimator {
+  public:
+  /**
+   * @param iwindow The number of exchanges to keep.
+   */
+  explicit ClockSyncEstimator(std::size_t iwindow = 16) : window(iwindow > 0 ? iwindow : 1) {
+  }
+
+  void addSample(std::int64_t it1, std::int64_t it2, std::int64_t it3, std::int64_t it4) {
+    Sample sample;
+    sample.hostTime = it1;
+    sample.offset = double((it2 - it1) + (it3 - it4)) / 2;
+    sample.delay = (it4 - it1) - (it3 - it2);
+    samples.push_back(sample);
+    if (samples.size() > window) {
+      samples.pop_front();
+    }
+  }
+
+  /**
+   * @return The device time minus the host time, at the host time of the best exchange.
+   */
+  double getOffset() const {
+    return best().offset;
+  }
+
+  /**
+   * @return The round trip of the best exchange, not counting the time spent on the device.
+   */
+  std::int64_t getDelay() const {
+    return best().delay;
+  }
+
+  /**
+   * @return How much faster the device's clock runs than the host's, in parts per million, or `0`
+   * with fewer than two usable exchanges.
+   */
+  double getDriftPpm() const {
+    if (samples.size() < 2) {
+      return 0;
+    }
+
+    // Relative to the first sample to keep the sums small
+    const double x0 = double(samples.front().hostTime);
+    const std::int64_t maxDelay = 2 * std::max<std::int64_t>(best().delay, 1);
+    double n = 0, sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+    for (auto &&sample : samples) {
+      if (sample.delay > maxDelay) {
+        continue;
+      }
+
+      const double x = double(sample.hostTime) - x0;
+      n++;
+      sumX += x;
+      sumY += sample.offset;
+      sumXX += x * x;
+      sumXY += x * sample.offset;
+    }
+
+    const double denominator = n * sumXX - sumX * sumX;
+    return denominator == 0 ? 0 : (n * sumXY - sumX * sumY) / denominator * 1e6;
+  }
+
+  /**
+   * @param ihostTime A time on the host's clock.
+   * @return The device time minus the host time at that time, extrapolated with the drift.
+   */
+  double getOffsetAt(std::int64_t ihostTime) const {
+    return getOffset() + getDriftPpm() * 1e-6 * double(ihostTime - best().hostTime);
+  }
+
+  std::size_t getSampleCount() const {
+    return samples.size();
+  }
+
+  protected:
+  struct Sample {
+    std::int64_t hostTime;
+    double offset;
+    std::int64_t delay;
+  };
+
+  const Sample &best() const {
+    static const Sample none{0, 0, 0};
+    if (samples.empty()) {
+      return none;
+    }
+
+    const Sample *result = &samples.front();
+    for (auto &&sample : samples) {
+      if (sample.delay < result->delay) {
+        result = &sample;
+      }
+    }
+    return *result;
+  }
+
+  std::size_t window;
+  std::deque<Sample> samples;
+};
+} // namespace bowlerserver
@@ -0,0 +1,99 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bowlerserver {
+/**
+ * @return The largest size `ilength` bytes can take once COBS encoded (without the delimiter).
+ */
+constexpr std::size_t cobsMaxEncodedLength(std::size_t ilength) {
+  return ilength + ilength / 254 + 1;
+}
+
+/**
+ * Encodes with Consistent Overhead Byte Stuffing, so the output contains no zero bytes and a zero
+ * can delimit frames.
+ *
+ * @param iinput The bytes to encode.
+ * @param ilength The number of bytes to encode.
+ * @param ioutput The buffer to encode into, at least cobsMaxEncodedLength(ilength) long.
+ * @return The encoded length.
+ */
+inline std::size_t
+cobsEncode(const std::uint8_t *iinput, std::size_t ilength, std::uint8_t *ioutput) {
+  std::size_t codeIndex = 0;
+  std::size_t outIndex = 1;
+  std::uint8_t code = 1;
+
+  for (std::size_t i = 0; i < ilength; i++) {
+    if (iinput[i] != 0) {
+      ioutput[outIndex++] = iinput[i];
+      code++;
+    }
+
+    if (iinput[i] == 0 || code == 0xFF) {
+      ioutput[codeIndex] = code;
+      codeIndex = outIndex++;
+      code = 1;
+    }
+  }
+
+  ioutput[codeIndex] = code;
+  return outIndex;
+}
+
+/**
+ * Decodes Consistent Overhead Byte Stuffing.
+ *
+ * @param iinput The encoded bytes, without the delimiter.
+ * @param ilength The number of encoded bytes.
+ * @param ioutput The buffer to decode into.
+ * @param icapacity The size of `ioutput`.
+ * @return The decoded length, or `0` if the input is malformed or does not fit.
+ */
+inline std::size_t cobsDecode(const std::uint8_t *iinput,
+                              std::size_t ilength,
+                              std::uint8_t *ioutput,
+                              std::size_t icapacity) {
+  std::size_t inIndex = 0;
+  std::size_t outIndex = 0;
+
+  while (inIndex < ilength) {
+    const std::uint8_t code = iinput[inIndex++];
+    if (code == 0 || inIndex + code - 1 > ilength || outIndex + code - 1 > icapacity) {
+      return 0;
+    }
+
+    for (std::uint8_t i = 1; i < code; i++) {
+      ioutput[outIndex++] = iinput[inIndex++];
+    }
+
+    if (code != 0xFF && inIndex < ilength) {
+      if (outIndex == icapacity) {
+        return 0;
+      }
+
+      ioutput[outIndex++] = 0;
+    }
+  }
+
+  return outIndex;
+}
+} // namespace bowlerserver
@@ -0,0 +1,420 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace bowlerserver {
+/**
+ * A histogram of durations with logarithmic buckets, in the style of HdrHistogram: each power of
+ * two is split into SUB_BUCKETS linear buckets, so the bucket width is at most 1 / SUB_BUCKETS of
+ * the value. Values below SUB_BUCKETS get a bucket each, and values of 2^(MAX_EXPONENT + 1) and
+ * more land in the last bucket. Counts are relaxed atomics, so any thread may record without a
+ * lock.
+ */
+class LatencyHistogram {
+  public:
+  static const std::uint8_t SUB_BUCKET_BITS = 2;
+  static const std::uint32_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const std::uint8_t MAX_EXPONENT = 24;
+  static const std::size_t BUCKET_COUNT = SUB_BUCKETS * (MAX_EXPONENT - SUB_BUCKET_BITS + 2);
+
+  void record(time_t ivalue) {
+    counts[getBucket(ivalue)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::uint32_t getCount(std::size_t ibucket) const {
+    return counts[ibucket].load(std::memory_order_relaxed);
+  }
+
+  /**
+   * @return The number of values recorded.
+   */
+  std::uint64_t getTotal() const {
+    std::uint64_t total = 0;
+    for (auto &&count : counts) {
+      total += count.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  /**
+   * @param ifraction The fraction of values which are at most the result, from `0` to `1`.
+   * @return The lower bound of the bucket the percentile falls in, or `0` if nothing was recorded.
+   */
+  time_t getPercentile(double ifraction) const {
+    const std::uint64_t total = getTotal();
+    if (total == 0) {
+      return 0;
+    }
+
+    // The rank of the value, counting from 1
+    const std::uint64_t rank =
+      std::max<std::uint64_t>(1, std::uint64_t(ifraction * double(total) + 0.5));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; i++) {
+      seen += counts[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return getLowerBound(i);
+      }
+    }
+    return getLowerBound(BUCKET_COUNT - 1);
+  }
+
+  void reset() {
+    for (auto &&count : counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * @return The index of the bucket a value is counted in.
+   */
+  static std::size_t getBucket(time_t ivalue) {
+    if (ivalue < time_t(SUB_BUCKETS)) {
+      return ivalue < 0 ? 0 : std::size_t(ivalue);
+    }
+
+    // The index of the highest set bit
+    const int exponent = 63 - __builtin_clzll(static_cast<unsigned long long>(ivalue));
+    if (exponent > MAX_EXPONENT) {
+      return BUCKET_COUNT - 1;
+    }
+
+    const std::size_t sub = (ivalue >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return SUB_BUCKETS * (exponent - SUB_BUCKET_BITS + 1) + sub;
+  }
+
+  /**
+   * @return The smallest value counted in a bucket.
+   */
+  static time_t getLowerBound(std::size_t ibucket) {
+    if (ibucket < SUB_BUCKETS) {
+      return ibucket;
+    }
+
+    const std::size_t exponent = ibucket / SUB_BUCKETS - 1 + SUB_BUCKET_BITS;
+    const time_t sub = ibucket % SUB_BUCKETS;
+    return (time_t(SUB_BUCKETS) + sub) << (exponent - SUB_BUCKET_BITS);
+  }
+
+  private:
+  std::array<std::atomic<std::uint32_t>, BUCKET_COUNT> counts{};
+};
+
+/**
+ * The counters kept for one packet id. Byte counts are whole frames.
+ */
+struct PacketMetrics {
+  std::atomic<std::uint32_t> requests{0};
+  std::atomic<std::uint32_t> replies{0};
+  // Events that returned BOWLER_ERROR and replies that could not be written
+  std::atomic<std::uint32_t> errors{0};
+  // Requests dropped as retransmissions by the reliable transport or while a reply was pending
+  std::atomic<std::uint32_t> duplicates{0};
+  std::atomic<std::uint32_t> bytesReceived{0};
+  std::atomic<std::uint32_t> bytesSent{0};
+  // How long the event took, in the units of getTime()
+  LatencyHistogram handlerTime;
+};
+
+/**
+ * Per-id counters and handler time histograms kept by DefaultBowlerComs, plus device-wide link
+ * latency histograms filled in timestamp mode (see BowlerComs::setTimestampMode). Entries are
+ * created when a packet is added and kept until the coms is destroyed, so a worker that is still
+ * running an event for a removed packet can record safely. Recording never locks.
+ *
+ * Collection is compiled out when `BOWLER_DISABLE_METRICS` is defined; the methods are then empty
+ * and serialize() fails with ENOTSUP.
+ *
+ * serialize() writes the metrics of one id as: `<ID (1 byte)> <requests> <replies> <errors>
+ * <duplicates> <bytes received> <bytes sent> <next bucket (1 byte)> <pair count (1 byte)>
+ * <pairs>`, where the counters are 4 bytes little endian and each pair is
+ * `<bucket (1 byte)> <count (LEB128)>` for a bucket with a non-zero count. Buckets which do not
+ * fit are left for a follow-up query starting at `next bucket`, which is `0xFF` once every bucket
+ * was written. The bounds of a bucket are given by LatencyHistogram::getLowerBound().
+ */
+class ComsMetrics {
+  public:
+  static const std::uint8_t NO_MORE_BUCKETS = 0xFF;
+
+  // The device-wide histograms, as selected in serializeLatency()
+  static const std::uint8_t UPLINK_LATENCY = 0;
+  static const std::uint8_t RESIDENCE_TIME = 1;
+
+#if !defined(BOWLER_DISABLE_METRICS)
+  /**
+   * Creates the entry of an id if it does not exist yet. Only call from the coms task.
+   */
+  void addPacket(std::uint8_t iid) {
+    if (!packets[iid]) {
+      packets[iid].reset(new PacketMetrics());
+    }
+  }
+
+  void onRequest(std::uint8_t iid, std::size_t ibytes) {
+    if (PacketMetrics *metrics = packets[iid].get()) {
+      metrics->requests.fetch_add(1, std::memory_order_relaxed);
+      metrics->bytesReceived.fetch_add(ibytes, std::memory_order_relaxed);
+    }
+  }
+
+  void onReply(std::uint8_t iid, std::size_t ibytes) {
+    if (PacketMetrics *metrics = packets[iid].get()) {
+      metrics->replies.fetch_add(1, std::memory_order_relaxed);
+      metrics->bytesSent.fetch_add(ibytes, std::memory_order_relaxed);
+    }
+  }
+
+  void onError(std::uint8_t iid) {
+    if (PacketMetrics *metrics = packets[iid].get()) {
+      metrics->errors.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void onDuplicate(std::uint8_t iid) {
+    if (PacketMetrics *metrics = packets[iid].get()) {
+      metrics->duplicates.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void onHandled(std::uint8_t iid, time_t iduration) {
+    if (PacketMetrics *metrics = packets[iid].get()) {
+      metrics->handlerTime.record(iduration);
+    }
+  }
+
+  /**
+   * @return The metrics of an id, or nullptr if no packet with it was ever added.
+   */
+  const PacketMetrics *get(std::uint8_t iid) const {
+    return packets[iid].get();
+  }
+
+  /**
+   * Writes the metrics of an id in the compact form described above.
+   *
+   * @param iid The packet id.
+   * @param ifirstBucket The first histogram bucket to write.
+   * @param ibuffer The buffer to write into.
+   * @param ilength The size of the buffer.
+   * @return The number of bytes written, or BOWLER_ERROR with ENOENT if there are no metrics for
+   * the id or ENOBUFS if the buffer is too small.
+   */
+  std::int32_t serialize(std::uint8_t iid,
+                         std::uint8_t ifirstBucket,
+                         std::uint8_t *ibuffer,
+                         std::size_t ilength) const {
+    const PacketMetrics *metrics = get(iid);
+    if (!metrics) {
+      errno = ENOENT;
+      return BOWLER_ERROR;
+    }
+
+    if (ilength < FIXED_LENGTH) {
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    std::size_t length = 0;
+    ibuffer[length++] = iid;
+    for (auto &&counter : {&metrics->requests,
+                           &metrics->replies,
+                           &metrics->errors,
+                           &metrics->duplicates,
+                           &metrics->bytesReceived,
+                           &metrics->bytesSent}) {
+      const std::uint32_t value = counter->load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < 4; i++) {
+        ibuffer[length++] = value >> (8 * i);
+      }
+    }
+
+    return length + serializeHistogram(
+                      metrics->handlerTime, ifirstBucket, ibuffer + length, ilength - length);
+  }
+
+  void onUplink(time_t ilatency) {
+    uplinkLatency.record(ilatency);
+  }
+
+  void onResidence(time_t iduration) {
+    residenceTime.record(iduration);
+  }
+
+  /**
+   * @return How long requests took from the host to the device, measured in timestamp mode.
+   */
+  const LatencyHistogram *getUplinkLatency() const {
+    return &uplinkLatency;
+  }
+
+  /**
+   * @return How long requests spent on the device, from being read to their reply being written,
+   * measured in timestamp mode.
+   */
+  const LatencyHistogram *getResidenceTime() const {
+    return &residenceTime;
+  }
+
+  /**
+   * Writes a device-wide latency histogram as `<Histogram (1 byte)> <next bucket (1 byte)>
+   * <pair count (1 byte)> <pairs>`, with the pairs as in serialize().
+   *
+   * @param ihistogram UPLINK_LATENCY or RESIDENCE_TIME.
+   * @return The number of bytes written, or BOWLER_ERROR with EINVAL for an unknown histogram or
+   * ENOBUFS if the buffer is too small.
+   */
+  std::int32_t serializeLatency(std::uint8_t ihistogram,
+                                std::uint8_t ifirstBucket,
+                                std::uint8_t *ibuffer,
+                                std::size_t ilength) const {
+    if (ihistogram != UPLINK_LATENCY && ihistogram != RESIDENCE_TIME) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    if (ilength < 3) {
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    ibuffer[0] = ihistogram;
+    return 1 + serializeHistogram(ihistogram == UPLINK_LATENCY ? uplinkLatency : residenceTime,
+                                  ifirstBucket,
+                                  ibuffer + 1,
+                                  ilength - 1);
+  }
+
+  /**
+   * Writes a histogram as `<next bucket (1 byte)> <pair count (1 byte)> <pairs>`, like the end of
+   * serialize().
+   *
+   * @return The number of bytes written. At least two bytes must fit.
+   */
+  static std::size_t serializeHistogram(const LatencyHistogram &ihistogram,
+                                        std::uint8_t ifirstBucket,
+                                        std::uint8_t *ibuffer,
+                                        std::size_t ilength) {
+    std::size_t length = 0;
+    std::uint8_t &next = ibuffer[length++];
+    std::uint8_t &pairs = ibuffer[length++];
+    next = NO_MORE_BUCKETS;
+    pairs = 0;
+
+    for (std::size_t bucket = ifirstBucket; bucket < LatencyHistogram::BUCKET_COUNT; bucket++) {
+      std::uint32_t count = ihistogram.getCount(bucket);
+      if (count == 0) {
+        continue;
+      }
+
+      std::uint8_t pair[6];
+      std::size_t pairLength = 0;
+      pair[pairLength++] = bucket;
+      do {
+        pair[pairLength++] = (count & 0x7F) | (count > 0x7F ? 0x80 : 0);
+        count >>= 7;
+      } while (count != 0);
+
+      if (length + pairLength > ilength) {
+        next = bucket;
+        break;
+      }
+
+      std::copy_n(pair, pairLength, ibuffer + length);
+      length += pairLength;
+      pairs++;
+    }
+
+    return length;
+  }
+#else
+  void addPacket(std::uint8_t) {
+  }
+
+  void onRequest(std::uint8_t, std::size_t) {
+  }
+
+  void onReply(std::uint8_t, std::size_t) {
+  }
+
+  void onError(std::uint8_t) {
+  }
+
+  void onDuplicate(std::uint8_t) {
+  }
+
+  void onHandled(std::uint8_t, time_t) {
+  }
+
+  const PacketMetrics *get(std::uint8_t) const {
+    return nullptr;
+  }
+
+  void onUplink(time_t) {
+  }
+
+  void onResidence(time_t) {
+  }
+
+  const LatencyHistogram *getUplinkLatency() const {
+    return nullptr;
+  }
+
+  const LatencyHistogram *getResidenceTime() const {
+    return nullptr;
+  }
+
+  std::int32_t serializeLatency(std::uint8_t, std::uint8_t, std::uint8_t *, std::size_t) const {
+    errno = ENOTSUP;
+    return BOWLER_ERROR;
+  }
+
+  std::int32_t serialize(std::uint8_t, std::uint8_t, std::uint8_t *, std::size_t) const {
+    errno = ENOTSUP;
+    return BOWLER_ERROR;
+  }
+#endif
+
+  /**
+   * @return The current time if metrics are collected, otherwise `0` without reading the clock.
+   */
+  static time_t now() {
+#if !defined(BOWLER_DISABLE_METRICS)
+    return getTime();
+#else
+    return 0;
+#endif
+  }
+
+  // The id, the six counters, the next bucket, and the pair count
+  static const std::size_t FIXED_LENGTH = 1 + 6 * 4 + 2;
+
+  private:
+#if !defined(BOWLER_DISABLE_METRICS)
+  std::array<std::unique_ptr<PacketMetrics>, 256> packets;
+  LatencyHistogram uplinkLatency;
+  LatencyHistogram residenceTime;
+#endif
+};
+} // namespace bowlerserver
@@ -0,0 +1,80 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bowlerserver {
+/**
+ * Lookup tables for crc32(). Table 0 is the classic byte-at-a-time table; tables 1 to 7 let eight
+ * bytes be folded in per step (slice-by-8). The tables take 8 KiB and are built on first use.
+ */
+struct Crc32Tables {
+  std::uint32_t table[8][256];
+
+  Crc32Tables() {
+    for (std::uint32_t i = 0; i < 256; i++) {
+      std::uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+      }
+      table[0][i] = crc;
+    }
+
+    for (std::uint32_t i = 0; i < 256; i++) {
+      for (int slice = 1; slice < 8; slice++) {
+        table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+      }
+    }
+  }
+};
+
+inline const Crc32Tables &getCrc32Tables() {
+  static const Crc32Tables tables;
+  return tables;
+}
+
+/**
+ * Computes the CRC-32 (IEEE 802.3, the one used by Ethernet and zlib) of a buffer.
+ *
+ * @param idata The bytes to checksum.
+ * @param ilength The number of bytes.
+ * @param icrc The CRC of the preceding bytes, to checksum a buffer in pieces.
+ * @return The CRC.
+ */
+inline std::uint32_t
+crc32(const std::uint8_t *idata, std::size_t ilength, std::uint32_t icrc = 0) {
+  const auto &t = getCrc32Tables().table;
+  std::uint32_t crc = ~icrc;
+
+  while (ilength >= 8) {
+    const std::uint32_t low = crc ^ (std::uint32_t(idata[0]) | std::uint32_t(idata[1]) << 8 |
+                                     std::uint32_t(idata[2]) << 16 | std::uint32_t(idata[3]) << 24);
+    crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+          t[3][idata[4]] ^ t[2][idata[5]] ^ t[1][idata[6]] ^ t[0][idata[7]];
+    idata += 8;
+    ilength -= 8;
+  }
+
+  while (ilength-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *idata++) & 0xFF];
+  }
+
+  return ~crc;
+}
+} // namespace bowlerserver
@@ -16,28 +16,66 @@
  */
 #pragma once
 
+#include "bowlerClock.hpp"
 #include "bowlerComs.hpp"
 #include "bowlerDeviceServerUtil.hpp"
 #include "bowlerServer.hpp"
+#include "clockSync.hpp"
+#include "comsMetrics.hpp"
+#include "deferredPacket.hpp"
+#include "packetExecutor.hpp"
 #include "serverManagementPacket.hpp"
+#include "traceEvents.hpp"
 #include <map>
 
 namespace bowlerserver {
 /**
  * Buffer format is:
  * <ID (1 byte)> <Seq Num (1 byte)> <ACK num (1 byte)> <Payload (N bytes)>.
+ *
+ * In timestamp mode (see setTimestampMode()), the last TIMESTAMP_LENGTH bytes of the payload of
+ * the packets which declare them free (see Packet::leavesTimestampFree) are a timestamp on the
+ * host's clock: in a request, when the host sent it, and in a reply, when the device sent it. The
+ * device records how long each request took to arrive and how long it stayed on the device in the
+ * latency histograms of its metrics. Other packets, such as the server management packet, keep
+ * their whole payload.
  */
 template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
   // The entire packet length must be at least the header length plus one payload byte
   static_assert(N >= HEADER_LENGTH + 1,
                 "Packet length must be at least the header length plus one payload byte.");
 
+  // Whether frames are long enough for timestamp mode. Being a constant, it also keeps the
+  // compiler from seeing out of bounds timestamps in frames which are too short.
+  static const bool TIMESTAMPS_FIT = N >= HEADER_LENGTH + TIMESTAMP_LENGTH;
+
   public:
-  DefaultBowlerComs(std::unique_ptr<BowlerServer<N>> iserver) : server(std::move(iserver)) {
+  /**
+   * @param iserver The server to read requests from and write replies to.
+   * @param iclock The clock to time things with.
+   */
+  DefaultBowlerComs(std::unique_ptr<BowlerServer<N>> iserver, Clock &iclock = getSystemClock())
+    : server(std::move(iserver)), clock(&iclock) {
     // Add the server management packet before anything else gets a chance
     addPacket(std::shared_ptr<ServerManagementPacket<N>>(new ServerManagementPacket<N>(this)));
   }
 
+  /**
+   * @param iserver The server to read requests from and write replies to.
+   * @param iexecutor The executor to run independent packets (see Packet::isIndependent) on. Their
+   * replies are written by a later call to loop().
+   * @param iclock The clock to time things with.
+   */
+  DefaultBowlerComs(std::unique_ptr<BowlerServer<N>> iserver,
+                    std::unique_ptr<PacketExecutor<N>> iexecutor,
+                    Clock &iclock = getSystemClock())
+    : DefaultBowlerComs(std::move(iserver), iclock) {
+    executor = std::move(iexecutor);
+    if (executor) {
+      executor->setMetrics(&metrics);
+    }
+  }
+
   virtual ~DefaultBowlerComs() = default;
 
   void addEnsuredPacket(std::function<std::shared_ptr<Packet>(void)> iaddPacket) override {
@@ -63,10 +101,15 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
   std::int32_t addPacket(std::shared_ptr<Packet> ipacket) override {
     if (packets.find(ipacket->getId()) == packets.end()) {
       if (ipacket->isReliable()) {
-        // Initialize RDT state
-        reliableState[ipacket->getId()] = waitForZero;
+        // Initialize RDT state. Each route starts in waitForZero the first time it uses the id.
+        const std::uint8_t id = ipacket->getId();
+        for (auto state = reliableState.begin(); state != reliableState.end();) {
+          state = state->first.second == id ? reliableState.erase(state) : std::next(state);
+        }
       }
 
+      metrics.addPacket(ipacket->getId());
+
       // Save the packet last so we can `move` it
       packets[ipacket->getId()] = std::move(ipacket);
     } else {
@@ -85,6 +128,11 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
    */
   void removePacket(const std::uint8_t iid) override {
     packets.erase(iid);
+
+    // A reply completed after this point no longer matches anything and is ignored
+    for (auto pending = pendingReplies.begin(); pending != pendingReplies.end();) {
+      pending = pending->first.second == iid ? pendingReplies.erase(pending) : std::next(pending);
+    }
   }
 
   /**
@@ -110,17 +158,34 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
    * @return `1` on success or BOWLER_ERROR on error.
    */
   std::int32_t loop() override {
+    if (executor) {
+      writeCompletedReplies();
+    }
+
+    if (!pendingReplies.empty()) {
+      writeDeferredReplies();
+    }
+
     bool isDataAvailable;
     std::int32_t error = server->isDataAvailable(isDataAvailable);
+    forgetClosedRoutes();
     if (error != BOWLER_ERROR) {
       if (isDataAvailable) {
+        BOWLER_TRACE_SCOPE("coms", "request");
         std::array<std::uint8_t, N> data;
 
         std::int32_t error = server->read(data);
         if (error != BOWLER_ERROR) {
+          // Reading may have given the route of a peer that was evicted to this one
+          forgetClosedRoutes();
+          requestCount++;
+          requestTime = clock->now();
+          readRoute = server->getRoute();
           auto id = getPacketId(data);
           auto packet = packets.find(id);
-          if (packet == packets.end()) {
+          if (packet == packets.end() && server->isMulticast()) {
+            // A fan-out command for packets other devices have; not an error here
+          } else if (packet == packets.end()) {
             BOWLER_LOG("Packet with id %u was not found.\n", id);
 
             // The corresponding packet was not found, meaning there is no handler registered for
@@ -137,8 +202,24 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
             return BOWLER_ERROR;
           } else {
             // The packet handler was found
-            if (packet->second->isReliable()) {
+            metrics.onRequest(id, N);
+            if (isTimestamped(id)) {
+              const std::int64_t sent =
+                readTimestamp(data.data() + N - TIMESTAMP_LENGTH) + hostClockOffset;
+              metrics.onUplink(std::int64_t(requestTime) - sent);
+            }
+
+            if (server->isMulticast()) {
+              handlePacketMulticast(packet, data);
+            } else if (pendingReplies.find(std::make_pair(readRoute, id)) !=
+                       pendingReplies.end()) {
+              // The previous request from this route for this id is still being handled. Its reply
+              // carries the ACK, so drop this one (typically a retransmission).
+              metrics.onDuplicate(id);
+            } else if (packet->second->isReliable() && !server->isLossless()) {
               handlePacketReliable(packet, data);
+            } else if (packet->second->isReliable()) {
+              handlePacketLossless(packet, data);
             } else {
               handlePacketUnreliable(packet, data);
             }
@@ -159,6 +240,73 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
     return 1;
   }
 
+  /**
+   * @return The per-id counters and handler time histograms.
+   */
+  const ComsMetrics *getMetrics() const override {
+    return &metrics;
+  }
+
+  Scheduler *getScheduler() override {
+    return scheduler;
+  }
+
+  /**
+   * Tells the coms which scheduler it runs on, so that the host can profile it.
+   */
+  void setScheduler(Scheduler *ischeduler) {
+    scheduler = ischeduler;
+  }
+
+  CaptureBowlerServer<N> *getCapture() override {
+    return capture;
+  }
+
+  /**
+   * Tells the coms which server captures its frames, usually one it was given, so that the host
+   * can pull the capture.
+   */
+  void setCapture(CaptureBowlerServer<N> *icapture) {
+    capture = icapture;
+  }
+
+  time_t getRequestTime() const override {
+    return requestTime;
+  }
+
+  time_t getCurrentTime() override {
+    return clock->now();
+  }
+
+  std::int32_t setTimestampMode(bool ienabled, std::int64_t ioffset) override {
+    if (ienabled && !TIMESTAMPS_FIT) {
+      errno = EMSGSIZE;
+      return BOWLER_ERROR;
+    }
+
+    timestampMode = ienabled;
+    hostClockOffset = ioffset;
+    return 1;
+  }
+
+  /**
+   * @return The number of requests read since construction. Wraps around.
+   */
+  std::uint32_t getRequestCount() const {
+    return requestCount;
+  }
+
+  /**
+   * @return The number of (route, reliable packet id) pairs the coms keeps ACK state for.
+   */
+  std::size_t getReliableStateCount() const {
+    return reliableState.size();
+  }
+
+  Clock &getClock() const {
+    return *clock;
+  }
+
   protected:
   /**
    * Handles a packet for unreliable transport.
@@ -167,14 +315,61 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
    */
   template <typename T>
   void handlePacketUnreliable(T &ipacket, std::array<std::uint8_t, N> &idata) {
-    auto error = ipacket->second->event(idata.data() + HEADER_LENGTH);
-    if (error == BOWLER_ERROR) {
-      BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
+    BOWLER_TRACE_SCOPE_ID("dispatch", "unreliable", ipacket->first);
+    runEvent(ipacket, idata);
+  }
+
+  /**
+   * Handles a reliable packet when the server is lossless, so there are no duplicates or losses to
+   * detect. The sequence number is ACKed as it is.
+   *
+   * @param idata Data that was just read from the receive buffer.
+   */
+  template <typename T> void handlePacketLossless(T &ipacket, std::array<std::uint8_t, N> &idata) {
+    BOWLER_TRACE_SCOPE_ID("dispatch", "lossless", ipacket->first);
+    setAckNum(idata, getSeqNum(idata));
+    const auto eventError = runEvent(ipacket, idata);
+
+    // Keep the state machine consistent in case the packet is later used over a lossy server
+    if (ipacket->first == SERVER_MANAGEMENT_PACKET_ID && eventError == 2) {
+      getReliableState(ipacket->first) = waitForZero;
+    } else {
+      getReliableState(ipacket->first) = getSeqNum(idata) == 0 ? waitForOne : waitForZero;
     }
+  }
 
-    error = server->write(idata);
-    if (error == BOWLER_ERROR) {
-      BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
+  /**
+   * Handles a request that arrived through a multicast group, such as a synchronized start or an
+   * e-stop sent to many devices at once. There is no ACK state machine because every device sees
+   * the same datagram once, and the event runs inline so that it takes effect as soon as it is
+   * read. Only discovery is answered, so that a fan-out command does not make every device reply.
+   *
+   * @param idata Data that was just read from the receive buffer.
+   */
+  template <typename T> void handlePacketMulticast(T &ipacket, std::array<std::uint8_t, N> &idata) {
+    BOWLER_TRACE_SCOPE_ID("dispatch", "multicast", ipacket->first);
+    const bool isDiscovery = ipacket->first == SERVER_MANAGEMENT_PACKET_ID &&
+                             idata[HEADER_LENGTH] == OPERATION_DISCOVER;
+    if (!isDiscovery && ipacket->first == SERVER_MANAGEMENT_PACKET_ID) {
+      // Only discovery is safe to send to every device at once
+      return;
+    }
+
+    setAckNum(idata, getSeqNum(idata));
+    const time_t start = ComsMetrics::now();
+    std::int32_t eventError;
+    {
+      BOWLER_TRACE_SCOPE_ID("handler", "event", ipacket->first);
+      eventError = ipacket->second->event(idata.data() + HEADER_LENGTH);
+    }
+    metrics.onHandled(ipacket->first, ComsMetrics::now() - start);
+    if (eventError == BOWLER_ERROR) {
+      metrics.onError(ipacket->first);
+      BOWLER_LOG("Error handling multicast packet event: %d %s\n", errno, strerror(errno));
+    }
+
+    if (isDiscovery) {
+      writeReply(idata);
     }
   }
 
@@ -184,22 +379,14 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
    * @param idata Data that was just read from the receive buffer.
    */
   template <typename T> void handlePacketReliable(T &ipacket, std::array<std::uint8_t, N> &idata) {
-    states_t &state = reliableState[ipacket->first];
+    BOWLER_TRACE_SCOPE_ID("dispatch", "reliable", ipacket->first);
+    states_t &state = getReliableState(ipacket->first);
     switch (state) {
     case waitForZero: {
       if (getSeqNum(idata) == 0) {
-        // Right payload. Handle it.
-        const auto eventError = ipacket->second->event(idata.data() + HEADER_LENGTH);
-        if (eventError == BOWLER_ERROR) {
-          BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
-        }
-
-        // ACK it and start waiting for the next packet.
+        // Right payload. Handle it, ACK it, and start waiting for the next packet.
         setAckNum(idata, 0);
-        auto error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
-        }
+        const auto eventError = runEvent(ipacket, idata);
 
         if (ipacket->first == SERVER_MANAGEMENT_PACKET_ID && eventError == 2) {
           // The server management packet processed a disconnection, so force the state into the
@@ -210,48 +397,184 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
         }
       } else {
         // Wrong packet. Clear the payload and ACK 1.
+        metrics.onDuplicate(ipacket->first);
         std::fill(std::next(idata.begin(), HEADER_LENGTH), idata.end(), 0);
         setAckNum(idata, 1);
-        auto error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
-        }
+        writeReply(idata);
       }
       break;
     }
 
     case waitForOne: {
       if (getSeqNum(idata) == 1) {
-        // Right payload. Handle it.
-        auto error = ipacket->second->event(idata.data() + HEADER_LENGTH);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
-        }
-
-        // ACK it and start waiting for the next packet.
+        // Right payload. Handle it, ACK it, and start waiting for the next packet.
         setAckNum(idata, 1);
-        error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
-        }
+        runEvent(ipacket, idata);
 
         // Even if the server management packet processed a disconnection, this returns us to the
         // starting state (which we want)
         state = waitForZero;
       } else {
         // Wrong packet. Clear the payload and ACK 0.
+        metrics.onDuplicate(ipacket->first);
         std::fill(std::next(idata.begin(), HEADER_LENGTH), idata.end(), 0);
         setAckNum(idata, 0);
-        auto error = server->write(idata);
-        if (error == BOWLER_ERROR) {
-          BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
-        }
+        writeReply(idata);
       }
       break;
     }
     }
   }
 
+  /**
+   * Runs a packet's event and writes the reply. Independent packets are handed to the executor
+   * instead, in which case the reply is written by writeCompletedReplies().
+   *
+   * @param idata The request. The payload is replaced with the reply.
+   * @return The return value of the event, or `1` if the event was handed to the executor.
+   */
+  template <typename T> std::int32_t runEvent(T &ipacket, std::array<std::uint8_t, N> &idata) {
+    if (executor && ipacket->second->isIndependent()) {
+      executor->submit(ipacket->second, idata, readRoute);
+      return 1;
+    }
+
+    if (ipacket->second->isDeferred()) {
+      return runDeferredEvent(ipacket, idata);
+    }
+
+    const time_t start = ComsMetrics::now();
+    std::int32_t eventError;
+    {
+      BOWLER_TRACE_SCOPE_ID("handler", "event", ipacket->first);
+      eventError = ipacket->second->event(idata.data() + HEADER_LENGTH);
+    }
+    metrics.onHandled(ipacket->first, ComsMetrics::now() - start);
+    if (eventError == BOWLER_ERROR) {
+      metrics.onError(ipacket->first);
+      BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
+    }
+
+    writeReply(idata);
+
+    return eventError;
+  }
+
+  /**
+   * Writes every reply the executor has finished since the last call.
+   */
+  void writeCompletedReplies() {
+    std::array<std::uint8_t, N> data;
+    std::uint32_t route;
+    while (executor->pollCompleted(data, route)) {
+      server->setRoute(route);
+      writeReply(data, nullptr);
+    }
+  }
+
+  /**
+   * Runs a DeferredPacket's event. The request is copied into a pending slot which the event's
+   * DeferredReply points into. If the event does not return BOWLER_PENDING, the reply is written
+   * immediately, otherwise it is written by writeDeferredReplies() once it is completed.
+   *
+   * @param idata The request.
+   * @return The return value of the event.
+   */
+  template <typename T>
+  std::int32_t runDeferredEvent(T &ipacket, std::array<std::uint8_t, N> &idata) {
+    const std::uint8_t id = ipacket->first;
+    std::shared_ptr<std::array<std::uint8_t, N>> frame =
+      std::make_shared<std::array<std::uint8_t, N>>(idata);
+    std::shared_ptr<std::uint8_t> payload(frame, frame->data() + HEADER_LENGTH);
+
+    const auto key = std::make_pair(readRoute, id);
+    PendingReply &pending = pendingReplies[key];
+    pending.frame = frame;
+    pending.generation = ++replyGeneration;
+    pending.requestTime = requestTime;
+
+    // Only the time until the event returns is measured, not the time until the reply is completed
+    auto deferredPacket = std::static_pointer_cast<DeferredPacket>(ipacket->second);
+    const time_t start = ComsMetrics::now();
+    std::int32_t eventError;
+    {
+      BOWLER_TRACE_SCOPE_ID("handler", "deferredEvent", id);
+      eventError = deferredPacket->event(
+        payload.get(), DeferredReply(replySink, readRoute, id, pending.generation, payload));
+    }
+    metrics.onHandled(id, ComsMetrics::now() - start);
+    if (eventError == BOWLER_PENDING) {
+      return eventError;
+    }
+
+    if (eventError == BOWLER_ERROR) {
+      metrics.onError(id);
+      BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
+    }
+
+    pendingReplies.erase(key);
+    writeReply(*frame);
+
+    return eventError;
+  }
+
+  /**
+   * Writes every deferred reply that was completed since the last call.
+   */
+  void writeDeferredReplies() {
+    replySink->take(completions);
+    for (auto &&completion : completions) {
+      auto pending = pendingReplies.find(std::make_pair(completion.route, completion.id));
+      if (pending == pendingReplies.end() ||
+          pending->second.generation != completion.generation) {
+        // The packet was removed or the route closed while its reply was pending
+        continue;
+      }
+
+      if (completion.status == BOWLER_ERROR) {
+        metrics.onError(completion.id);
+        BOWLER_LOG("Error handling deferred packet event for id %u\n", completion.id);
+      }
+
+      server->setRoute(completion.route);
+      writeReply(*pending->second.frame, &pending->second.requestTime);
+
+      pendingReplies.erase(pending);
+    }
+  }
+
+  /**
+   * Writes the reply to the request being handled.
+   */
+  void writeReply(std::array<std::uint8_t, N> &idata) {
+    writeReply(idata, &requestTime);
+  }
+
+  /**
+   * Writes a reply to the current route and counts it in the metrics of its id. In timestamp mode,
+   * stamps it with the time it is sent.
+   *
+   * @param irequestTime When its request was read, or nullptr if that is not known.
+   */
+  void writeReply(std::array<std::uint8_t, N> &idata, const time_t *irequestTime) {
+    BOWLER_TRACE_SCOPE_ID("coms", "writeReply", getPacketId(idata));
+    if (isTimestamped(getPacketId(idata))) {
+      const time_t now = clock->now();
+      if (irequestTime) {
+        metrics.onResidence(now - *irequestTime);
+      }
+
+      writeTimestamp(idata.data() + N - TIMESTAMP_LENGTH, std::int64_t(now) - hostClockOffset);
+    }
+
+    if (server->write(idata) == BOWLER_ERROR) {
+      metrics.onError(getPacketId(idata));
+      BOWLER_LOG("Error writing: %d %s\n", errno, strerror(errno));
+    } else {
+      metrics.onReply(getPacketId(idata), N);
+    }
+  }
+
   std::uint8_t getPacketId(const std::array<std::uint8_t, N> &idata) const {
     return idata.at(0);
   }
@@ -272,10 +595,72 @@ template <std::size_t N> class DefaultBowlerComs : public BowlerComs<N> {
     idata.at(2) = iackNum;
   }
 
+  /**
+   * @return Whether the frames of an id carry a timestamp: timestamp mode is on, the frames are
+   * long enough and the packet leaves the trailer free.
+   */
+  bool isTimestamped(std::uint8_t iid) const {
+    if (!TIMESTAMPS_FIT || !timestampMode) {
+      return false;
+    }
+
+    const auto packet = packets.find(iid);
+    return packet != packets.end() && packet->second->leavesTimestampFree();
+  }
+
   enum states_t { waitForZero, waitForOne };
+
+  /**
+   * Drops the reliable transport state and pending replies of the routes the server reports
+   * closed, so that they do not pile up as peers come and go and a peer given a reused route starts
+   * afresh.
+   */
+  void forgetClosedRoutes() {
+    std::uint32_t route;
+    while (server->takeClosedRoute(route)) {
+      const auto first = std::make_pair(route, std::uint8_t(0));
+      const auto last = std::make_pair(route, std::uint8_t(255));
+      reliableState.erase(reliableState.lower_bound(first), reliableState.upper_bound(last));
+      pendingReplies.erase(pendingReplies.lower_bound(first), pendingReplies.upper_bound(last));
+    }
+  }
+
+  /**
+   * @return The reliable transport state of an id for the route of the current request. Every
+   * peer has its own sequence numbers.
+   */
+  states_t &getReliableState(std::uint8_t iid) {
+    return reliableState[std::make_pair(readRoute, iid)];
+  }
+
+  struct PendingReply {
+    std::shared_ptr<std::array<std::uint8_t, N>> frame;
+    std::uint32_t generation;
+    time_t requestTime;
+  };
+
   std::unique_ptr<BowlerServer<N>> server;
+  Clock *clock;
+  // Declared before the executor so that its workers can still record while it shuts down
+  ComsMetrics metrics;
+  std::unique_ptr<PacketExecutor<N>> executor;
   std::map<std::uint8_t, std::shared_ptr<Packet>> packets;
-  std::map<std::uint8_t, states_t> reliableState;
+  // Keyed by route and packet id. Missing entries are waitForZero.
+  std::map<std::pair<std::uint32_t, std::uint8_t>, states_t> reliableState;
   std::vector<std::function<std::shared_ptr<Packet>(void)>> ensuredPackets;
+  // Keyed by route and packet id, so the reply goes back where its request came from
+  std::map<std::pair<std::uint32_t, std::uint8_t>, PendingReply> pendingReplies;
+  std::shared_ptr<DeferredReplySink> replySink{std::make_shared<DeferredReplySink>()};
+  std::vector<DeferredReplySink::Completion> completions;
+  std::uint32_t replyGeneration{0};
+  std::uint32_t requestCount{0};
+  // When the request being handled was read
+  time_t requestTime{0};
+  bool timestampMode{false};
+  // The device time minus the host time
+  std::int64_t hostClockOffset{0};
+  Scheduler *scheduler{nullptr};
+  CaptureBowlerServer<N> *capture{nullptr};
+  std::uint32_t readRoute{0};
 };
 } // namespace bowlerserver
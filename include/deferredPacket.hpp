@@ -0,0 +1,239 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerPacket.hpp"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+namespace bowlerserver {
+/**
+ * Collects completed deferred replies until the coms loop writes them. Shared between the coms and
+ * every outstanding DeferredReply so that a reply completed after the coms is gone is harmless.
+ */
+class DeferredReplySink {
+  public:
+  struct Completion {
+    std::uint32_t route;
+    std::uint8_t id;
+    std::uint32_t generation;
+    std::int32_t status;
+  };
+
+  void push(const Completion &icompletion) {
+    std::lock_guard<std::mutex> lock(mutex);
+    completions.push_back(icompletion);
+  }
+
+  /**
+   * Moves every completion into `icompletions`, which is cleared first.
+   */
+  void take(std::vector<Completion> &icompletions) {
+    icompletions.clear();
+    std::lock_guard<std::mutex> lock(mutex);
+    completions.swap(icompletions);
+  }
+
+  private:
+  std::mutex mutex;
+  std::vector<Completion> completions;
+};
+
+/**
+ * A handle to the reply of a DeferredPacket event. The payload stays valid for as long as the
+ * handle (or a copy of it) exists, even if the packet is removed in the meantime.
+ */
+class DeferredReply {
+  public:
+  /**
+   * Makes a detached reply. Completing it does nothing.
+   */
+  DeferredReply() = default;
+
+  DeferredReply(std::shared_ptr<DeferredReplySink> isink,
+                std::uint32_t iroute,
+                std::uint8_t iid,
+                std::uint32_t igeneration,
+                std::shared_ptr<std::uint8_t> ipayload)
+    : sink(std::move(isink)),
+      route(iroute),
+      id(iid),
+      generation(igeneration),
+      payload(std::move(ipayload)) {
+  }
+
+  /**
+   * @return The payload to write the reply into (not including header data).
+   */
+  std::uint8_t *getPayload() const {
+    return payload.get();
+  }
+
+  /**
+   * Marks the reply as finished. It is written by the next coms loop. May be called from any task,
+   * but not from an interrupt. Only the first call has an effect.
+   *
+   * @param istatus `1` on success or BOWLER_ERROR on error.
+   */
+  void complete(std::int32_t istatus = 1) {
+    if (sink) {
+      sink->push(DeferredReplySink::Completion{route, id, generation, istatus});
+      sink.reset();
+    }
+  }
+
+  private:
+  std::shared_ptr<DeferredReplySink> sink;
+  std::uint32_t route{0};
+  std::uint8_t id{0};
+  std::uint32_t generation{0};
+  std::shared_ptr<std::uint8_t> payload;
+};
+
+/**
+ * A Packet whose reply does not have to be ready when its event returns, for example because it
+ * waits on a slow peripheral. The coms keeps serving other ids in the meantime. For a reliable
+ * packet, the sequence slot is held until the reply is completed: retransmissions of the pending
+ * request are dropped because the completed reply carries the ACK. One request per id and route is
+ * pending at a time; new requests from a route for an id with a reply pending to it are dropped.
+ */
+class DeferredPacket : public Packet {
+  public:
+  DeferredPacket(std::uint8_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+    m_isDeferred = true;
+  }
+
+  /**
+   * Processes the payload, possibly finishing later.
+   *
+   * @param payload The payload (not including header data). Same as `reply.getPayload()`.
+   * @param reply The handle used to finish the reply later.
+   * @return `1` on success, BOWLER_ERROR on error, or BOWLER_PENDING if the reply will be finished
+   * by calling `reply.complete()`.
+   */
+  virtual std::int32_t event(std::uint8_t *payload, DeferredReply reply) = 0;
+
+  /**
+   * Runs the event with a detached reply. A pending result is reported as an error because nothing
+   * can complete it.
+   */
+  std::int32_t event(std::uint8_t *payload) override {
+    const auto error = event(payload, DeferredReply());
+    if (error == BOWLER_PENDING) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    return error;
+  }
+};
+
+#if defined(__cpp_impl_coroutine)
+/**
+ * The return type of CoroutinePacket::run. `co_return` the event status.
+ */
+class ReplyTask {
+  public:
+  struct promise_type {
+    DeferredReply reply;
+    std::int32_t status{1};
+
+    ReplyTask get_return_object() {
+      return ReplyTask{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    std::suspend_always initial_suspend() noexcept {
+      return {};
+    }
+
+    std::suspend_never final_suspend() noexcept {
+      // The frame is destroyed after this, so hand the status over first
+      reply.complete(status);
+      return {};
+    }
+
+    void return_value(std::int32_t istatus) {
+      status = istatus;
+    }
+
+    void unhandled_exception() {
+      status = BOWLER_ERROR;
+    }
+  };
+
+  explicit ReplyTask(std::coroutine_handle<promise_type> ihandle) : handle(ihandle) {
+  }
+
+  ReplyTask(ReplyTask &&other) noexcept : handle(other.handle) {
+    other.handle = nullptr;
+  }
+
+  ReplyTask(const ReplyTask &) = delete;
+
+  ~ReplyTask() {
+    // Only a task that was never started still owns its frame
+    if (handle) {
+      handle.destroy();
+    }
+  }
+
+  /**
+   * Runs the coroutine until its first suspension. From then on it owns itself and completes
+   * `ireply` when it finishes.
+   */
+  void start(DeferredReply ireply) {
+    auto started = handle;
+    handle = nullptr;
+    started.promise().reply = std::move(ireply);
+    started.resume();
+  }
+
+  private:
+  std::coroutine_handle<promise_type> handle;
+};
+
+/**
+ * A DeferredPacket written as a C++20 coroutine. The coroutine may `co_await` anything that resumes
+ * it later; its `co_return` value completes the reply.
+ */
+class CoroutinePacket : public DeferredPacket {
+  public:
+  CoroutinePacket(std::uint8_t iid, bool iisReliable = false) : DeferredPacket(iid, iisReliable) {
+  }
+
+  using DeferredPacket::event;
+
+  /**
+   * Processes the payload (not including header data).
+   */
+  virtual ReplyTask run(std::uint8_t *payload) = 0;
+
+  std::int32_t event(std::uint8_t *payload, DeferredReply reply) override {
+    // Even a coroutine that never suspends completes through the reply, so the coms writes it on
+    // the next loop
+    run(payload).start(std::move(reply));
+    return BOWLER_PENDING;
+  }
+};
+#endif
+} // namespace bowlerserver
@@ -0,0 +1,290 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerLinuxUdpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <sys/epoll.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Counters kept by DeviceSimulator, summed over its threads.
+ */
+struct DeviceSimulatorStats {
+  std::uint64_t requests{0};
+  // Returns from epoll_wait
+  std::uint64_t wakeups{0};
+  // Times a device used its whole budget and was run again before waiting
+  std::uint64_t requeued{0};
+};
+
+/**
+ * Runs many virtual devices in one Linux process, so that host software can be tested against a
+ * fleet larger than the hardware on the bench. Each device is a DefaultBowlerComs of its own, with
+ * its own packets, on a LinuxUDPServer bound to its own port and address (any address in
+ * 127.0.0.0/8 works on loopback), so the host cannot tell it from a real one.
+ *
+ * The devices are spread over a small pool of threads, each with its own epoll instance. A thread
+ * sleeps until some of its devices have datagrams, then runs the loop of each of them until it has
+ * read everything or handled `budget` requests, so that one busy device cannot starve the others
+ * on its thread; a device which used its whole budget is run again before the thread waits. A
+ * device stays on one thread, so its coms and packets are never used concurrently. Handlers run
+ * inline on that thread, and BusyPacket emulates one of a given cost.
+ *
+ * Devices only run when datagrams arrive, so deferred replies and packets on a PacketExecutor are
+ * answered the next time their device is woken up; use packets which reply from their event.
+ */
+template <std::size_t N> class DeviceSimulator {
+  public:
+  /**
+   * Adds the packets of a device. Called once for each device, from addDevice().
+   */
+  using Setup = std::function<void(std::size_t idevice, DefaultBowlerComs<N> &icoms)>;
+
+  /**
+   * @param ithreadCount The number of threads to run the devices on.
+   * @param ibudget The number of requests a device handles before the next device gets its turn.
+   * @param iidleTimeout How long an idle thread waits for data before checking whether it has to
+   * stop, in milliseconds.
+   * @param ibatchSize The batch size of each device's LinuxUDPServer.
+   */
+  explicit DeviceSimulator(std::size_t ithreadCount = 4,
+                           std::size_t ibudget = 64,
+                           int iidleTimeout = 10,
+                           std::size_t ibatchSize = 32)
+    : threadCount(std::max<std::size_t>(ithreadCount, 1)),
+      budget(std::max<std::size_t>(ibudget, 1)),
+      idleTimeout(iidleTimeout),
+      batchSize(std::max<std::size_t>(ibatchSize, 1)) {
+  }
+
+  virtual ~DeviceSimulator() {
+    stop();
+  }
+
+  DeviceSimulator(const DeviceSimulator &) = delete;
+  DeviceSimulator &operator=(const DeviceSimulator &) = delete;
+
+  /**
+   * Opens a device. Only call while the simulator is stopped.
+   *
+   * @param iaddress The IPv4 address to bind to, in network byte order.
+   * @param iport The port to listen on. `0` picks a free port (see getPort()).
+   * @param isetup Adds the packets of the device.
+   * @return The index of the device, or BOWLER_ERROR on error (EBUSY if the simulator is running).
+   */
+  std::int32_t addDevice(std::uint32_t iaddress, std::uint16_t iport, const Setup &isetup) {
+    if (!threads.empty()) {
+      errno = EBUSY;
+      return BOWLER_ERROR;
+    }
+
+    std::unique_ptr<LinuxUDPServer<N>> server(new LinuxUDPServer<N>(iport, batchSize));
+    if (server->begin(iaddress) == BOWLER_ERROR) {
+      return BOWLER_ERROR;
+    }
+
+    std::unique_ptr<Device> device(new Device(std::move(server)));
+    isetup(devices.size(), device->coms);
+    devices.push_back(std::move(device));
+    return devices.size() - 1;
+  }
+
+  /**
+   * Starts running the devices.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t start() {
+    if (!threads.empty()) {
+      errno = EALREADY;
+      return BOWLER_ERROR;
+    }
+
+    // Every thread has its own epoll instance, created here so that failing to create one fails
+    // the start rather than leaving some devices unserved
+    const std::size_t count = std::min(threadCount, std::max<std::size_t>(devices.size(), 1));
+    workers.clear();
+    for (auto &&device : devices) {
+      device->requeued = false;
+    }
+    for (std::size_t i = 0; i < count; i++) {
+      std::unique_ptr<Worker> worker(new Worker());
+      worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+      if (worker->epollFd < 0) {
+        workers.clear();
+        return BOWLER_ERROR;
+      }
+
+      for (std::size_t j = i; j < devices.size(); j += count) {
+        LinuxUDPServer<N> &server = *devices[j]->server;
+        for (int fd : {server.getFd(), server.getMulticastFd()}) {
+          epoll_event event{};
+          event.events = EPOLLIN;
+          event.data.u64 = j;
+          if (fd >= 0 && epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            workers.clear();
+            return BOWLER_ERROR;
+          }
+        }
+      }
+      workers.push_back(std::move(worker));
+    }
+
+    stopping = false;
+    for (std::size_t i = 0; i < count; i++) {
+      threads.emplace_back([this, i] { run(*workers[i]); });
+    }
+    return 1;
+  }
+
+  /**
+   * Stops running the devices. They keep their state and can be started again.
+   */
+  void stop() {
+    stopping = true;
+    for (auto &&thread : threads) {
+      thread.join();
+    }
+    threads.clear();
+  }
+
+  std::size_t getDeviceCount() const {
+    return devices.size();
+  }
+
+  /**
+   * @return The port a device is bound to.
+   */
+  std::uint16_t getPort(std::size_t idevice) const {
+    return devices[idevice]->server->getPort();
+  }
+
+  /**
+   * @return The counters of the current or last run. Safe to call while running.
+   */
+  DeviceSimulatorStats getStats() const {
+    DeviceSimulatorStats stats;
+    for (auto &&worker : workers) {
+      stats.requests += worker->requests.load(std::memory_order_relaxed);
+      stats.wakeups += worker->wakeups.load(std::memory_order_relaxed);
+      stats.requeued += worker->requeued.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+  protected:
+  struct Device {
+    explicit Device(std::unique_ptr<LinuxUDPServer<N>> iserver)
+      : server(iserver.get()), coms(std::move(iserver)) {
+    }
+
+    // Owned by the coms
+    LinuxUDPServer<N> *server;
+    DefaultBowlerComs<N> coms;
+    // Whether the device is on its thread's list of devices to run again
+    bool requeued{false};
+  };
+
+  struct Worker {
+    ~Worker() {
+      if (epollFd >= 0) {
+        close(epollFd);
+      }
+    }
+
+    int epollFd{-1};
+    std::atomic<std::uint64_t> requests{0};
+    std::atomic<std::uint64_t> wakeups{0};
+    std::atomic<std::uint64_t> requeued{0};
+  };
+
+  static const int MAX_EVENTS = 64;
+
+  void run(Worker &iworker) {
+    std::array<epoll_event, MAX_EVENTS> events;
+    std::vector<std::size_t> ready;
+    std::vector<std::size_t> again;
+
+    while (!stopping.load(std::memory_order_relaxed)) {
+      const int count =
+        epoll_wait(iworker.epollFd, events.data(), MAX_EVENTS, ready.empty() ? idleTimeout : 0);
+      iworker.wakeups.fetch_add(1, std::memory_order_relaxed);
+      for (int i = 0; i < count; i++) {
+        const std::size_t index = events[i].data.u64;
+        if (!devices[index]->requeued) {
+          ready.push_back(index);
+        }
+      }
+
+      again.clear();
+      std::uint64_t handled = 0;
+      for (auto &&index : ready) {
+        Device &device = *devices[index];
+        device.requeued = false;
+        if (runDevice(device, handled)) {
+          device.requeued = true;
+          again.push_back(index);
+        }
+      }
+
+      iworker.requests.fetch_add(handled, std::memory_order_relaxed);
+      iworker.requeued.fetch_add(again.size(), std::memory_order_relaxed);
+      ready.swap(again);
+    }
+  }
+
+  /**
+   * Runs the loop of a device until it has nothing left to read or has used its budget.
+   *
+   * @return Whether the device used its whole budget, so may have more to read.
+   */
+  bool runDevice(Device &idevice, std::uint64_t &ihandled) {
+    for (std::size_t i = 0; i < budget; i++) {
+      const std::uint32_t before = idevice.coms.getRequestCount();
+      // Once everything is read, this sends the replies and finds the socket empty
+      idevice.coms.loop();
+      if (idevice.coms.getRequestCount() == before) {
+        return false;
+      }
+      ihandled++;
+    }
+
+    // The replies would otherwise wait for the device's next turn
+    idevice.server->flush();
+    return true;
+  }
+
+  std::size_t threadCount;
+  std::size_t budget;
+  int idleTimeout;
+  std::size_t batchSize;
+  std::vector<std::unique_ptr<Device>> devices;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<bool> stopping{false};
+};
+} // namespace bowlerserver
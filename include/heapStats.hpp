@@ -0,0 +1,260 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(PLATFORM_ESP32)
+#include <esp_heap_caps.h>
+#elif defined(PLATFORM_TEENSY) || defined(PLATFORM_NATIVE)
+#include <malloc.h>
+#endif
+
+namespace bowlerserver {
+/**
+ * @return The number of calls to `operator new` since startup, if src/util.cpp was built with
+ * `BOWLER_COUNT_ALLOCATIONS`, otherwise `0`. Wraps around.
+ */
+std::uint32_t getAllocationCount();
+
+/**
+ * The state of the heap at one point in time, in bytes.
+ */
+struct HeapSnapshot {
+  std::uint32_t inUse{0};
+  std::uint32_t free{0};
+  // The largest block that one allocation could get. On the host, this is the top of glibc's main
+  // arena, and on a Teensy it is the whole of the free space, so it is only an upper bound there.
+  std::uint32_t largestFree{0};
+  std::uint32_t allocations{0};
+
+  /**
+   * @return The free bytes which one allocation could not get.
+   */
+  std::uint32_t getFragmented() const {
+    return free > largestFree ? free - largestFree : 0;
+  }
+};
+
+/**
+ * @return The current state of the heap.
+ */
+inline HeapSnapshot takeHeapSnapshot() {
+  HeapSnapshot snapshot;
+#if defined(PLATFORM_ESP32)
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+  snapshot.inUse = info.total_allocated_bytes;
+  snapshot.free = info.total_free_bytes;
+  snapshot.largestFree = info.largest_free_block;
+#elif defined(PLATFORM_TEENSY)
+  const struct mallinfo info = mallinfo();
+  snapshot.inUse = info.uordblks;
+  snapshot.free = info.fordblks;
+  snapshot.largestFree = info.fordblks;
+#elif defined(PLATFORM_NATIVE)
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  const struct mallinfo2 info = mallinfo2();
+#else
+  const struct mallinfo info = mallinfo();
+#endif
+  snapshot.inUse = info.uordblks;
+  snapshot.free = info.fordblks;
+  snapshot.largestFree = info.keepcost;
+#endif
+  snapshot.allocations = getAllocationCount();
+  return snapshot;
+}
+
+/**
+ * The phases of a host reconnect which HeapStats follows.
+ */
+enum HeapPhase : std::uint8_t {
+  // OPERATION_DISCONNECT_ID, which frees the packets
+  heapPhaseDisconnect = 0,
+  // OPERATION_ADD_ENSURED_PACKETS, which allocates them again
+  heapPhaseAddEnsuredPackets = 1,
+  // OPERATION_DISCOVER, which builds the list of packet ids
+  heapPhaseDiscover = 2
+};
+
+/**
+ * What the heap did over every run of one HeapPhase.
+ */
+struct HeapPhaseStats {
+  std::uint32_t runs{0};
+  // Calls to `operator new` during the phase (see getAllocationCount)
+  std::uint32_t allocations{0};
+  // The most bytes in use at the end of a run
+  std::uint32_t peakInUse{0};
+  // The most fragmented bytes at the end of a run (see HeapSnapshot::getFragmented)
+  std::uint32_t peakFragmented{0};
+  // The change in bytes in use over the last run
+  std::int32_t lastDelta{0};
+};
+
+/**
+ * Follows the heap across the phases of a host reconnect, so that a device which slowly leaks or
+ * fragments its heap over days of reconnects shows it in a few numbers the host can read (see
+ * OPERATION_GET_HEAP). Taking a snapshot walks the allocator's bookkeeping, which is cheap next to
+ * a reconnect but not free, so only the management operations are measured.
+ *
+ * Collection is compiled out when `BOWLER_DISABLE_HEAP_STATS` is defined; the methods are then
+ * empty and serialize() fails with ENOTSUP.
+ *
+ * serialize() writes `<In use> <Free> <Largest free> <Allocations>`, the current snapshot, followed
+ * by `<Runs> <Allocations> <Peak in use> <Peak fragmented> <Last delta>` of one phase, each 4
+ * bytes, little endian.
+ */
+class HeapStats {
+  public:
+  static const std::size_t PHASES = 3;
+  static const std::size_t SERIALIZED_LENGTH = 9 * 4;
+
+  /**
+   * Starts measuring a run of a phase. Only call from the coms task.
+   */
+  void begin(HeapPhase iphase) {
+#if !defined(BOWLER_DISABLE_HEAP_STATS)
+    if (iphase < PHASES) {
+      starts[iphase] = takeHeapSnapshot();
+    }
+#else
+    (void)iphase;
+#endif
+  }
+
+  /**
+   * Ends the run of a phase started by begin().
+   */
+  void end(HeapPhase iphase) {
+#if !defined(BOWLER_DISABLE_HEAP_STATS)
+    if (iphase >= PHASES) {
+      return;
+    }
+
+    const HeapSnapshot now = takeHeapSnapshot();
+    const HeapSnapshot &start = starts[iphase];
+    HeapPhaseStats &stats = phases[iphase];
+    stats.runs++;
+    stats.allocations += now.allocations - start.allocations;
+    stats.peakInUse = std::max(stats.peakInUse, now.inUse);
+    stats.peakFragmented = std::max(stats.peakFragmented, now.getFragmented());
+    stats.lastDelta = std::int32_t(now.inUse - start.inUse);
+#else
+    (void)iphase;
+#endif
+  }
+
+  /**
+   * @return The stats of a phase, or nullptr if there is no such phase.
+   */
+  const HeapPhaseStats *get(std::uint8_t iphase) const {
+    return iphase < PHASES ? &phases[iphase] : nullptr;
+  }
+
+  /**
+   * Forgets every run, to start a new measurement window.
+   */
+  void reset() {
+    phases = {};
+  }
+
+  /**
+   * Writes the current snapshot and the stats of a phase.
+   *
+   * @return The number of bytes written or BOWLER_ERROR on error.
+   */
+  std::int32_t serialize(std::uint8_t iphase, std::uint8_t *ibuffer, std::size_t ilength) const {
+#if !defined(BOWLER_DISABLE_HEAP_STATS)
+    const HeapPhaseStats *stats = get(iphase);
+    if (!stats) {
+      errno = EINVAL;
+      return BOWLER_ERROR;
+    }
+
+    if (ilength < SERIALIZED_LENGTH) {
+      errno = ENOBUFS;
+      return BOWLER_ERROR;
+    }
+
+    const HeapSnapshot now = takeHeapSnapshot();
+    const std::array<std::uint32_t, 9> values{{now.inUse,
+                                               now.free,
+                                               now.largestFree,
+                                               now.allocations,
+                                               stats->runs,
+                                               stats->allocations,
+                                               stats->peakInUse,
+                                               stats->peakFragmented,
+                                               std::uint32_t(stats->lastDelta)}};
+    std::size_t length = 0;
+    for (auto &&value : values) {
+      for (std::size_t i = 0; i < 4; i++) {
+        ibuffer[length++] = value >> (8 * i);
+      }
+    }
+
+    return length;
+#else
+    (void)iphase;
+    (void)ibuffer;
+    (void)ilength;
+    errno = ENOTSUP;
+    return BOWLER_ERROR;
+#endif
+  }
+
+  protected:
+  std::array<HeapPhaseStats, PHASES> phases{};
+  std::array<HeapSnapshot, PHASES> starts{};
+};
+
+/**
+ * @return The stats the server management packet records into.
+ */
+inline HeapStats &getHeapStats() {
+  static HeapStats stats;
+  return stats;
+}
+
+/**
+ * Measures a run of a HeapPhase from its construction to its destruction.
+ */
+class HeapPhaseScope {
+  public:
+  HeapPhaseScope(HeapPhase iphase, HeapStats &istats = getHeapStats())
+    : stats(istats), phase(iphase) {
+    stats.begin(phase);
+  }
+
+  HeapPhaseScope(const HeapPhaseScope &) = delete;
+  HeapPhaseScope &operator=(const HeapPhaseScope &) = delete;
+
+  ~HeapPhaseScope() {
+    stats.end(phase);
+  }
+
+  protected:
+  HeapStats &stats;
+  HeapPhase phase;
+};
+} // namespace bowlerserver
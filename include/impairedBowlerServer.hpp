@@ -0,0 +1,323 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+
+namespace bowlerserver {
+/**
+ * How ImpairedBowlerServer treats the frames going one way. Probabilities are from `0` to `1` and
+ * are drawn once per frame; times are in the units of the server's Clock.
+ *
+ * Loss follows a Gilbert-Elliott model: the link is either in the good state, where it loses a
+ * frame with probability `loss`, or in the bad state, where it loses one with probability
+ * `burstLoss`, and before each frame it moves from good to bad with probability `goodToBad` and
+ * back with probability `badToGood`. The defaults never leave the good state, which makes `loss`
+ * independent per frame.
+ */
+struct ImpairmentConfig {
+  double loss{0};
+  double burstLoss{1};
+  double goodToBad{0};
+  double badToGood{1};
+  // Every frame waits `delay` plus a uniform draw from [0, jitter], so jitter alone can reorder
+  // frames
+  time_t delay{0};
+  time_t jitter{0};
+  // The chance of delivering a frame twice, the copy with its own delay
+  double duplicate{0};
+  // The chance of holding a frame back for another `reorderDelay`, so that later frames pass it
+  double reorder{0};
+  time_t reorderDelay{0};
+
+  /**
+   * @param ilossRate The long run fraction of frames lost.
+   * @param imeanBurstLength The mean number of frames lost in a row, at least `1`.
+   * @return A Gilbert-Elliott config whose bad state loses everything and whose good state loses
+   * nothing, with that loss rate and mean burst length.
+   */
+  static ImpairmentConfig bursty(double ilossRate, double imeanBurstLength) {
+    ImpairmentConfig config;
+    const double lossRate = std::min(std::max(ilossRate, 0.0), 1.0);
+    if (lossRate >= 1) {
+      config.goodToBad = 1;
+      config.badToGood = 0;
+      return config;
+    }
+
+    // The bad state's share of the frames is goodToBad / (goodToBad + badToGood)
+    config.badToGood = 1 / std::max(imeanBurstLength, 1.0);
+    config.goodToBad = std::min(1.0, lossRate * config.badToGood / (1 - lossRate));
+    return config;
+  }
+};
+
+/**
+ * Counters kept by ImpairedBowlerServer for each direction.
+ */
+struct ImpairmentStats {
+  // Frames handed to the impairment
+  std::uint32_t frames{0};
+  std::uint32_t dropped{0};
+  std::uint32_t duplicated{0};
+  std::uint32_t reordered{0};
+  // Frames dropped because the queue of delayed frames was full
+  std::uint32_t overflowed{0};
+  // Frames, counting copies, which came out the other side
+  std::uint32_t delivered{0};
+};
+
+/**
+ * A BowlerServer which makes the link to another one worse: it loses, delays, duplicates and
+ * reorders the frames read from it and written to it, each direction with its own
+ * ImpairmentConfig, so that the reliable path can be tested and measured under the conditions of a
+ * busy WiFi network on the bench.
+ *
+ * Frames wait in a queue ordered by the time they are due and come out once the clock reaches it;
+ * frames due at the same time keep their order. Written frames reach the other server from write()
+ * and isDataAvailable(), so the coms loop keeps them moving. Draws come from a xorshift generator
+ * seeded at construction, not from `<random>`, whose distributions differ between standard
+ * libraries, so a seed and a VirtualClock replay the same run on every platform.
+ *
+ * The link is never lossless, whatever the other server is. Not thread safe, and meant for tests
+ * and benchmarks: each queued frame is an allocation.
+ */
+template <std::size_t N> class ImpairedBowlerServer : public BowlerServer<N> {
+  public:
+  /**
+   * @param iserver The server to impair the link to.
+   * @param iconfig The impairment of both directions, until set otherwise.
+   * @param iseed The seed of the generator.
+   * @param iclock The clock delays are measured with.
+   * @param icapacity The number of delayed frames each direction holds before dropping more.
+   */
+  ImpairedBowlerServer(std::unique_ptr<BowlerServer<N>> iserver,
+                       const ImpairmentConfig &iconfig = ImpairmentConfig(),
+                       std::uint64_t iseed = 1,
+                       Clock &iclock = getSystemClock(),
+                       std::size_t icapacity = 256)
+    : server(std::move(iserver)),
+      clock(&iclock),
+      capacity(std::max<std::size_t>(icapacity, 1)),
+      state(iseed ? iseed : 1) {
+    incoming.config = iconfig;
+    outgoing.config = iconfig;
+  }
+
+  virtual ~ImpairedBowlerServer() = default;
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    impair(outgoing, payload, writeRoute);
+    return deliver();
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    if (!isDue(incoming)) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    const auto first = incoming.queue.begin();
+    payload = first->second.payload;
+    readRoute = first->second.route;
+    readMulticast = first->second.multicast;
+    writeRoute = readRoute;
+    incoming.queue.erase(first);
+    incoming.stats.delivered++;
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    // Move everything the other server has into the queue. Servers such as LinuxUDPServer fail
+    // with EWOULDBLOCK once they are empty, so a failure only ends the pull.
+    bool serverAvailable = false;
+    while (server->isDataAvailable(serverAvailable) != BOWLER_ERROR && serverAvailable) {
+      std::array<std::uint8_t, N> payload;
+      if (server->read(payload) == BOWLER_ERROR) {
+        break;
+      }
+      impair(incoming, payload, server->getRoute(), server->isMulticast());
+    }
+
+    // A reply the other server fails to write is lost like any other, so it does not stop the
+    // requests that are due from being read
+    deliver();
+    available = isDue(incoming);
+    return 1;
+  }
+
+  bool isLossless() const override {
+    return false;
+  }
+
+  bool isMulticast() const override {
+    return readMulticast;
+  }
+
+  std::uint32_t getRoute() const override {
+    return readRoute;
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    writeRoute = iroute;
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    return server->takeClosedRoute(iroute);
+  }
+
+  /**
+   * Changes the impairment of the frames read from the other server. Frames already queued keep
+   * their time.
+   */
+  void setIncomingConfig(const ImpairmentConfig &iconfig) {
+    incoming.config = iconfig;
+  }
+
+  /**
+   * Changes the impairment of the frames written to the other server.
+   */
+  void setOutgoingConfig(const ImpairmentConfig &iconfig) {
+    outgoing.config = iconfig;
+  }
+
+  const ImpairmentStats &getIncomingStats() const {
+    return incoming.stats;
+  }
+
+  const ImpairmentStats &getOutgoingStats() const {
+    return outgoing.stats;
+  }
+
+  /**
+   * @return The number of frames waiting in both directions.
+   */
+  std::size_t getQueued() const {
+    return incoming.queue.size() + outgoing.queue.size();
+  }
+
+  protected:
+  struct Frame {
+    std::array<std::uint8_t, N> payload;
+    std::uint32_t route;
+    // Whether the other server received it through a multicast group
+    bool multicast;
+  };
+
+  struct Direction {
+    ImpairmentConfig config;
+    ImpairmentStats stats;
+    bool bad{false};
+    std::multimap<time_t, Frame> queue;
+  };
+
+  /**
+   * @return A uniform draw from [0, 1).
+   */
+  double uniform() {
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return double((state * 2685821657736338717ULL) >> 11) / double(1ULL << 53);
+  }
+
+  bool chance(double iprobability) {
+    return iprobability > 0 && uniform() < iprobability;
+  }
+
+  time_t drawDelay(const ImpairmentConfig &iconfig) {
+    return iconfig.delay + time_t(uniform() * double(iconfig.jitter + 1));
+  }
+
+  void impair(Direction &idirection,
+              const std::array<std::uint8_t, N> &ipayload,
+              std::uint32_t iroute,
+              bool imulticast = false) {
+    const ImpairmentConfig &config = idirection.config;
+    idirection.stats.frames++;
+
+    idirection.bad = idirection.bad ? !chance(config.badToGood) : chance(config.goodToBad);
+    if (chance(idirection.bad ? config.burstLoss : config.loss)) {
+      idirection.stats.dropped++;
+      return;
+    }
+
+    const int copies = chance(config.duplicate) ? 2 : 1;
+    if (copies == 2) {
+      idirection.stats.duplicated++;
+    }
+
+    const time_t now = clock->now();
+    for (int i = 0; i < copies; i++) {
+      time_t due = now + drawDelay(config);
+      if (chance(config.reorder)) {
+        idirection.stats.reordered++;
+        due += config.reorderDelay;
+      }
+
+      if (idirection.queue.size() >= capacity) {
+        idirection.stats.overflowed++;
+        continue;
+      }
+      idirection.queue.emplace(due, Frame{ipayload, iroute, imulticast});
+    }
+  }
+
+  bool isDue(const Direction &idirection) const {
+    return !idirection.queue.empty() && idirection.queue.begin()->first <= clock->now();
+  }
+
+  /**
+   * Writes the outgoing frames which are due to the other server.
+   *
+   * @return `1` on success or BOWLER_ERROR if the other server failed to write one.
+   */
+  std::int32_t deliver() {
+    std::int32_t result = 1;
+    while (isDue(outgoing)) {
+      const auto first = outgoing.queue.begin();
+      server->setRoute(first->second.route);
+      if (server->write(first->second.payload) == BOWLER_ERROR) {
+        result = BOWLER_ERROR;
+      } else {
+        outgoing.stats.delivered++;
+      }
+      outgoing.queue.erase(first);
+    }
+
+    return result;
+  }
+
+  std::unique_ptr<BowlerServer<N>> server;
+  Clock *clock;
+  std::size_t capacity;
+  std::uint64_t state;
+  Direction incoming;
+  Direction outgoing;
+  std::uint32_t readRoute{0};
+  std::uint32_t writeRoute{0};
+  bool readMulticast{false};
+};
+} // namespace bowlerserver
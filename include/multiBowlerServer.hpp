@@ -0,0 +1,213 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Counters kept by MultiBowlerServer for each of its servers.
+ */
+struct MultiServerStats {
+  // Calls to the server's isDataAvailable
+  std::uint32_t polls{0};
+  std::uint32_t framesReceived{0};
+  // How long the server is currently left alone between polls, in the units of the Clock
+  time_t idleBackoff{0};
+};
+
+/**
+ * A BowlerServer which serves requests from several servers, for example a wireless and a wired
+ * link at the same time, with one DefaultBowlerComs and one set of packets.
+ *
+ * Servers are polled round-robin and one request is read per turn, so a busy server cannot starve
+ * the others. A server that has no data is polled less and less often, up to once per
+ * `maxIdleBackoff`, which bounds the cost of idle transports; it is polled on every call again as
+ * soon as it has data. Each reply goes back to the server its request came from: a route (see
+ * BowlerServer::getRoute) holds the index of the server in its top 8 bits and the route of that
+ * server in the low 24 bits.
+ */
+template <std::size_t N> class MultiBowlerServer : public BowlerServer<N> {
+  public:
+  static const std::size_t MAX_SERVERS = 256;
+  static const std::uint32_t INNER_ROUTE_MASK = 0xFFFFFF;
+  // The first backoff of a server that went idle
+  static const time_t MIN_IDLE_BACKOFF = 16;
+
+  /**
+   * @param imaxIdleBackoff The longest time an idle server is left alone between polls, in the
+   * units of the clock. `0` polls every server on every call.
+   * @param iclock The clock to time the backoff with.
+   */
+  explicit MultiBowlerServer(time_t imaxIdleBackoff = 1000, Clock &iclock = getSystemClock())
+    : maxIdleBackoff(imaxIdleBackoff), clock(&iclock) {
+  }
+
+  /**
+   * Adds a server to poll.
+   *
+   * @param iserver The server.
+   * @return The index of the server on success or BOWLER_ERROR on error.
+   */
+  std::int32_t addServer(std::unique_ptr<BowlerServer<N>> iserver) {
+    if (servers.size() == MAX_SERVERS) {
+      errno = ENOSPC;
+      return BOWLER_ERROR;
+    }
+
+    servers.push_back(Transport{std::move(iserver), 0, {}});
+    return servers.size() - 1;
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    if (writeIndex >= servers.size()) {
+      errno = EDESTADDRREQ;
+      return BOWLER_ERROR;
+    }
+
+    return servers[writeIndex].server->write(payload);
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    if (readIndex >= servers.size()) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    Transport &transport = servers[readIndex];
+    const auto error = transport.server->read(payload);
+    if (error != BOWLER_ERROR) {
+      transport.stats.framesReceived++;
+      writeIndex = readIndex;
+    }
+
+    // Give the next server the first turn
+    next = (readIndex + 1) % servers.size();
+    readIndex = SIZE_MAX;
+    return error;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    available = false;
+    if (readIndex < servers.size()) {
+      available = true;
+      return 1;
+    }
+
+    const time_t now = clock->now();
+    for (std::size_t i = 0; i < servers.size(); i++) {
+      const std::size_t index = (next + i) % servers.size();
+      Transport &transport = servers[index];
+      if (transport.stats.idleBackoff > 0 &&
+          now - transport.lastPoll < transport.stats.idleBackoff) {
+        continue;
+      }
+
+      transport.lastPoll = now;
+      transport.stats.polls++;
+      bool hasData = false;
+      if (transport.server->isDataAvailable(hasData) == BOWLER_ERROR) {
+        // Typically EWOULDBLOCK. A server that keeps failing is treated like an idle one.
+        hasData = false;
+      }
+
+      if (hasData) {
+        transport.stats.idleBackoff = 0;
+        readIndex = index;
+        available = true;
+        return 1;
+      }
+
+      transport.stats.idleBackoff = std::min(
+        maxIdleBackoff, std::max(time_t(MIN_IDLE_BACKOFF), transport.stats.idleBackoff * 2));
+    }
+
+    return 1;
+  }
+
+  /**
+   * @return Whether the server the last request came from is lossless.
+   */
+  bool isLossless() const override {
+    return writeIndex < servers.size() && servers[writeIndex].server->isLossless();
+  }
+
+  /**
+   * @return Whether the last request arrived through a multicast group of its server.
+   */
+  bool isMulticast() const override {
+    return writeIndex < servers.size() && servers[writeIndex].server->isMulticast();
+  }
+
+  std::uint32_t getRoute() const override {
+    if (writeIndex >= servers.size()) {
+      return 0;
+    }
+
+    return std::uint32_t(writeIndex) << 24 |
+           (servers[writeIndex].server->getRoute() & INNER_ROUTE_MASK);
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    writeIndex = iroute >> 24;
+    if (writeIndex < servers.size()) {
+      servers[writeIndex].server->setRoute(iroute & INNER_ROUTE_MASK);
+    }
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    for (std::size_t i = 0; i < servers.size(); i++) {
+      std::uint32_t route;
+      if (servers[i].server->takeClosedRoute(route)) {
+        iroute = std::uint32_t(i) << 24 | (route & INNER_ROUTE_MASK);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::size_t getServerCount() const {
+    return servers.size();
+  }
+
+  /**
+   * @param iindex The index returned by addServer().
+   */
+  const MultiServerStats &getStats(std::size_t iindex) const {
+    return servers.at(iindex).stats;
+  }
+
+  protected:
+  struct Transport {
+    std::unique_ptr<BowlerServer<N>> server;
+    time_t lastPoll;
+    MultiServerStats stats;
+  };
+
+  std::vector<Transport> servers;
+  time_t maxIdleBackoff;
+  Clock *clock;
+  std::size_t next{0};
+  std::size_t readIndex{SIZE_MAX};
+  std::size_t writeIndex{SIZE_MAX};
+};
+} // namespace bowlerserver
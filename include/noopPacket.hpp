@@ -17,7 +17,6 @@
 #pragma once
 
 #include "bowlerPacket.hpp"
-#include <Arduino.h>
 
 namespace bowlerserver {
 /**
@@ -26,6 +25,7 @@ namespace bowlerserver {
 class NoopPacket : public Packet {
   public:
   NoopPacket(std::uint8_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+    m_leavesTimestampFree = true;
   }
 
   std::int32_t event(std::uint8_t *payload) override {
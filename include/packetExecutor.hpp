@@ -0,0 +1,215 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerPacket.hpp"
+#include "comsMetrics.hpp"
+#include "traceEvents.hpp"
+#include <array>
+#include <bitset>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Runs the events of independent packets on a pool of worker threads. Requests for different ids
+ * run concurrently, requests for the same id run one at a time in the order they were submitted.
+ * Finished replies are collected so that the coms can write them from its own thread, which keeps
+ * every write to the BowlerServer on one thread.
+ *
+ * On the ESP32, the core and priority of the workers can be chosen with `esp_pthread_set_cfg`
+ * before constructing the executor.
+ */
+template <std::size_t N> class PacketExecutor {
+  public:
+  /**
+   * @param iworkerCount The number of worker threads to start.
+   */
+  explicit PacketExecutor(std::size_t iworkerCount) {
+    workers.reserve(iworkerCount);
+    for (std::size_t i = 0; i < iworkerCount; i++) {
+      workers.emplace_back(&PacketExecutor::work, this);
+    }
+  }
+
+  virtual ~PacketExecutor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+
+    readyCondition.notify_all();
+    for (auto &&worker : workers) {
+      worker.join();
+    }
+  }
+
+  PacketExecutor(const PacketExecutor &) = delete;
+  PacketExecutor &operator=(const PacketExecutor &) = delete;
+
+  /**
+   * Queues a request. The event runs on a worker thread and the reply (the same buffer, with the
+   * payload filled in by the event) becomes available from pollCompleted().
+   *
+   * @param ipacket The packet event handler.
+   * @param idata The entire request, including the header.
+   * @param iroute The route the request came from (see BowlerServer::getRoute), handed back with
+   * the reply.
+   */
+  void submit(std::shared_ptr<Packet> ipacket,
+              const std::array<std::uint8_t, N> &idata,
+              std::uint32_t iroute = 0) {
+    const std::uint8_t id = ipacket->getId();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      lanes[id].push_back(Job{std::move(ipacket), idata, iroute});
+      inFlight++;
+
+      if (active[id]) {
+        // A worker already owns this id and will pick the job up when it finishes the current one
+        return;
+      }
+
+      active[id] = true;
+      ready.push_back(id);
+    }
+
+    readyCondition.notify_one();
+  }
+
+  /**
+   * Takes one finished reply, if there is one.
+   *
+   * @param idata The buffer to write the reply into.
+   * @param iroute Set to the route the request was submitted with.
+   * @return Whether a reply was written into `idata`.
+   */
+  bool pollCompleted(std::array<std::uint8_t, N> &idata, std::uint32_t &iroute) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (completed.empty()) {
+      return false;
+    }
+
+    idata = completed.front().data;
+    iroute = completed.front().route;
+    completed.pop_front();
+    inFlight--;
+    return true;
+  }
+
+  /**
+   * @return The number of requests that have been submitted but not yet taken with
+   * pollCompleted().
+   */
+  std::size_t getInFlight() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return inFlight;
+  }
+
+  std::size_t getWorkerCount() const {
+    return workers.size();
+  }
+
+  /**
+   * Records the time each event takes, and its errors, in `imetrics`. Call before submitting
+   * anything.
+   */
+  void setMetrics(ComsMetrics *imetrics) {
+    std::lock_guard<std::mutex> lock(mutex);
+    metrics = imetrics;
+  }
+
+  protected:
+  struct Job {
+    std::shared_ptr<Packet> packet;
+    std::array<std::uint8_t, N> data;
+    std::uint32_t route;
+  };
+
+  struct Reply {
+    std::array<std::uint8_t, N> data;
+    std::uint32_t route;
+  };
+
+  void work() {
+    BOWLER_TRACE_THREAD_NAME("executor");
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      readyCondition.wait(lock, [this] { return stopping || !ready.empty(); });
+      if (stopping) {
+        return;
+      }
+
+      const std::uint8_t id = ready.front();
+      ready.pop_front();
+
+      auto &lane = lanes[id];
+      Job job = std::move(lane.front());
+      lane.pop_front();
+
+      ComsMetrics *jobMetrics = metrics;
+      lock.unlock();
+      const time_t start = ComsMetrics::now();
+      std::int32_t error;
+      {
+        BOWLER_TRACE_SCOPE_ID("handler", "event", id);
+        error = job.packet->event(job.data.data() + HEADER_LENGTH);
+      }
+      if (jobMetrics) {
+        jobMetrics->onHandled(id, ComsMetrics::now() - start);
+      }
+
+      if (error == BOWLER_ERROR) {
+        if (jobMetrics) {
+          jobMetrics->onError(id);
+        }
+        BOWLER_LOG("Error handling packet event: %d %s\n", errno, strerror(errno));
+      }
+      lock.lock();
+
+      completed.push_back(Reply{job.data, job.route});
+
+      if (lane.empty()) {
+        lanes.erase(id);
+        active[id] = false;
+      } else {
+        // Give other ids a turn before running the next job for this id
+        ready.push_back(id);
+        readyCondition.notify_one();
+      }
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable readyCondition;
+  std::map<std::uint8_t, std::deque<Job>> lanes;
+  std::deque<std::uint8_t> ready;
+  std::bitset<256> active;
+  std::deque<Reply> completed;
+  std::size_t inFlight{0};
+  bool stopping{false};
+  ComsMetrics *metrics{nullptr};
+  std::vector<std::thread> workers;
+};
+} // namespace bowlerserver
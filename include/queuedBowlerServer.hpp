@@ -0,0 +1,321 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace bowlerserver {
+/**
+ * Counters kept by QueuedBowlerServer. Latencies are measured from write() to the moment the
+ * underlying server finished sending the frame, in the units of the server's Clock.
+ */
+struct WriteQueueStats {
+  std::uint32_t enqueued{0};
+  std::uint32_t sent{0};
+  std::uint32_t dropped{0};
+  std::uint32_t writeErrors{0};
+  std::uint32_t maxDepth{0};
+  time_t minLatency{0};
+  time_t maxLatency{0};
+  time_t totalLatency{0};
+};
+
+/**
+ * A BowlerServer which queues written frames and sends them from a separate drain path, so that
+ * the coms loop only pays for a copy into the queue instead of the time the transport takes to
+ * send. Reads are passed straight through to the underlying server.
+ *
+ * The queue is drained either by the sender task (see startSenderTask()) or by calling drain(), so
+ * the underlying server is written from a different thread than it is read from. Every call to it
+ * is made holding one lock, so it is never read and written at once; a slow write delays reads by
+ * at most one frame.
+ */
+template <std::size_t N> class QueuedBowlerServer : public BowlerServer<N> {
+  public:
+  /**
+   * What write() does when the queue is full.
+   */
+  enum QueueFullPolicy {
+    // Reject the new frame with ENOBUFS.
+    dropNewest,
+    // Discard the oldest queued frame to make room for the new one.
+    dropOldest,
+    // Wait for the sender to make room, up to the configured timeout, then reject with ENOBUFS.
+    block
+  };
+
+  /**
+   * @param iserver The server to send the queued frames with.
+   * @param icapacity The maximum number of queued frames, at least `1`.
+   * @param ipolicy What to do when the queue is full.
+   * @param iblockTimeout How long write() waits for room under the `block` policy, in
+   * microseconds.
+   * @param iclock The clock to measure the latencies with.
+   */
+  QueuedBowlerServer(std::unique_ptr<BowlerServer<N>> iserver,
+                     std::size_t icapacity,
+                     QueueFullPolicy ipolicy = dropNewest,
+                     time_t iblockTimeout = 1000,
+                     Clock &iclock = getSystemClock())
+    : server(std::move(iserver)),
+      frames(std::max<std::size_t>(icapacity, 1)),
+      policy(ipolicy),
+      blockTimeout(iblockTimeout),
+      clock(&iclock) {
+  }
+
+  virtual ~QueuedBowlerServer() {
+    stopSenderTask();
+  }
+
+  /**
+   * Queues a frame to be sent later.
+   *
+   * @return `1` on success or BOWLER_ERROR with ENOBUFS if the frame was dropped.
+   */
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (count == frames.size()) {
+      switch (policy) {
+      case dropNewest: {
+        stats.dropped++;
+        errno = ENOBUFS;
+        return BOWLER_ERROR;
+      }
+
+      case dropOldest: {
+        stats.dropped++;
+        head = (head + 1) % frames.size();
+        count--;
+        break;
+      }
+
+      case block: {
+        const bool hasRoom =
+          notFull.wait_for(lock, std::chrono::microseconds(blockTimeout), [this] {
+            return count < frames.size();
+          });
+        if (!hasRoom) {
+          stats.dropped++;
+          errno = ENOBUFS;
+          return BOWLER_ERROR;
+        }
+        break;
+      }
+      }
+    }
+
+    Entry &entry = frames[(head + count) % frames.size()];
+    entry.frame = payload;
+    entry.enqueueTime = clock->now();
+    entry.route = writeRoute;
+    count++;
+
+    stats.enqueued++;
+    stats.maxDepth = std::max<std::uint32_t>(stats.maxDepth, count);
+
+    lock.unlock();
+    notEmpty.notify_one();
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    std::lock_guard<std::mutex> lock(serverMutex);
+    const auto error = server->read(payload);
+    if (error != BOWLER_ERROR) {
+      writeRoute = server->getRoute();
+    }
+
+    return error;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    std::lock_guard<std::mutex> lock(serverMutex);
+    return server->isDataAvailable(available);
+  }
+
+  bool isLossless() const override {
+    return server->isLossless();
+  }
+
+  bool isMulticast() const override {
+    return server->isMulticast();
+  }
+
+  std::uint32_t getRoute() const override {
+    return writeRoute;
+  }
+
+  /**
+   * Sets the route of the frames written after this. Each frame is sent to the route it was
+   * queued with.
+   */
+  void setRoute(std::uint32_t iroute) override {
+    writeRoute = iroute;
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    std::lock_guard<std::mutex> lock(serverMutex);
+    return server->takeClosedRoute(iroute);
+  }
+
+  /**
+   * Sends queued frames using the underlying server.
+   *
+   * @param imaxFrames The maximum number of frames to send.
+   * @return The number of frames taken from the queue.
+   */
+  std::size_t drain(std::size_t imaxFrames = SIZE_MAX) {
+    // Only one drain at a time so that frames are sent in the order they were queued
+    std::lock_guard<std::mutex> drainLock(drainMutex);
+
+    std::size_t drained = 0;
+    Entry entry;
+    while (drained < imaxFrames && pop(entry)) {
+      std::int32_t error;
+      {
+        std::lock_guard<std::mutex> serverLock(serverMutex);
+        server->setRoute(entry.route);
+        error = server->write(entry.frame);
+      }
+      const time_t latency = clock->now() - entry.enqueueTime;
+      drained++;
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (error == BOWLER_ERROR) {
+        stats.writeErrors++;
+      } else {
+        if (stats.sent == 0 || latency < stats.minLatency) {
+          stats.minLatency = latency;
+        }
+        stats.maxLatency = std::max(stats.maxLatency, latency);
+        stats.totalLatency += latency;
+        stats.sent++;
+      }
+    }
+
+    return drained;
+  }
+
+  /**
+   * Starts a thread which drains the queue whenever it has frames. On the ESP32, the core and
+   * priority of the thread can be chosen with `esp_pthread_set_cfg` before calling this.
+   */
+  void startSenderTask() {
+    if (sender.joinable()) {
+      return;
+    }
+
+    stopping = false;
+    sender = std::thread([this] {
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          notEmpty.wait(lock, [this] { return stopping || count > 0; });
+          if (stopping && count == 0) {
+            return;
+          }
+        }
+
+        drain();
+      }
+    });
+  }
+
+  /**
+   * Stops the sender thread after it has sent every queued frame.
+   */
+  void stopSenderTask() {
+    if (!sender.joinable()) {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+
+    notEmpty.notify_one();
+    sender.join();
+  }
+
+  /**
+   * @return The number of queued frames.
+   */
+  std::size_t getDepth() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+  }
+
+  WriteQueueStats getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+  }
+
+  protected:
+  struct Entry {
+    std::array<std::uint8_t, N> frame;
+    time_t enqueueTime;
+    std::uint32_t route;
+  };
+
+  bool pop(Entry &entry) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (count == 0) {
+        return false;
+      }
+
+      entry = frames[head];
+      head = (head + 1) % frames.size();
+      count--;
+    }
+
+    notFull.notify_one();
+    return true;
+  }
+
+  std::unique_ptr<BowlerServer<N>> server;
+  std::vector<Entry> frames;
+  std::size_t head{0};
+  std::size_t count{0};
+  QueueFullPolicy policy;
+  time_t blockTimeout;
+  Clock *clock;
+  // Only used by the coms thread
+  std::uint32_t writeRoute{0};
+  WriteQueueStats stats;
+  std::mutex mutex;
+  std::mutex drainMutex;
+  // Held for every call to the underlying server
+  std::mutex serverMutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+  std::thread sender;
+  bool stopping{false};
+};
+} // namespace bowlerserver
@@ -0,0 +1,119 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace bowlerserver {
+/**
+ * @return The smallest power of two which is at least `ivalue`.
+ */
+constexpr std::size_t nextPowerOfTwo(std::size_t ivalue, std::size_t ipower = 1) {
+  return ipower >= ivalue ? ipower : nextPowerOfTwo(ivalue, ipower * 2);
+}
+
+/**
+ * A lock-free single-producer single-consumer byte ring. One task (or an interrupt) may write while
+ * another reads. Neither side ever blocks: writes take as many bytes as fit and reads take as many
+ * bytes as are available.
+ *
+ * @tparam Capacity The size of the ring. Must be a power of two.
+ */
+template <std::size_t Capacity> class RingBuffer {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "Ring buffer capacity must be a power of two.");
+
+  public:
+  /**
+   * Copies as many bytes as fit into the ring.
+   *
+   * @return The number of bytes copied.
+   */
+  std::size_t write(const std::uint8_t *idata, std::size_t ilength) {
+    const std::size_t writeIndex = head.load(std::memory_order_relaxed);
+    const std::size_t readIndex = tail.load(std::memory_order_acquire);
+    const std::size_t count = std::min(ilength, Capacity - (writeIndex - readIndex));
+
+    const std::size_t offset = writeIndex & (Capacity - 1);
+    const std::size_t first = std::min(count, Capacity - offset);
+    std::copy_n(idata, first, buffer.begin() + offset);
+    std::copy_n(idata + first, count - first, buffer.begin());
+
+    head.store(writeIndex + count, std::memory_order_release);
+    return count;
+  }
+
+  /**
+   * Copies as many bytes as are available out of the ring.
+   *
+   * @return The number of bytes copied.
+   */
+  std::size_t read(std::uint8_t *idata, std::size_t ilength) {
+    const std::size_t count = peek(idata, ilength);
+    skip(count);
+    return count;
+  }
+
+  /**
+   * Copies bytes out of the ring without removing them.
+   *
+   * @return The number of bytes copied.
+   */
+  std::size_t peek(std::uint8_t *idata, std::size_t ilength) const {
+    const std::size_t readIndex = tail.load(std::memory_order_relaxed);
+    const std::size_t writeIndex = head.load(std::memory_order_acquire);
+    const std::size_t count = std::min(ilength, writeIndex - readIndex);
+
+    const std::size_t offset = readIndex & (Capacity - 1);
+    const std::size_t first = std::min(count, Capacity - offset);
+    std::copy_n(buffer.begin() + offset, first, idata);
+    std::copy_n(buffer.begin(), count - first, idata + first);
+    return count;
+  }
+
+  /**
+   * Removes bytes from the ring. Must not be more than size().
+   */
+  void skip(std::size_t ilength) {
+    tail.store(tail.load(std::memory_order_relaxed) + ilength, std::memory_order_release);
+  }
+
+  /**
+   * @return The number of bytes that can be read.
+   */
+  std::size_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+  /**
+   * @return The number of bytes that can be written.
+   */
+  std::size_t available() const {
+    return Capacity - size();
+  }
+
+  private:
+  std::array<std::uint8_t, Capacity> buffer;
+  // Free-running indices; only their difference and their low bits are used
+  std::atomic<std::size_t> head{0};
+  std::atomic<std::size_t> tail{0};
+};
+} // namespace bowlerserver
@@ -16,13 +16,64 @@
  */
 #pragma once
 
+#include "bowlerComs.hpp"
 #include "bowlerDeviceServerUtil.hpp"
 #include "bowlerPacket.hpp"
-#include <Arduino.h>
+#include "bowlerScheduler.hpp"
+#include "captureBowlerServer.hpp"
+#include "clockSync.hpp"
+#include "heapStats.hpp"
+#include <algorithm>
+#include <cstring>
 
 namespace bowlerserver {
 /**
  * A Packet which performs server management operations.
+ *
+ * OPERATION_DISCOVER replies with what a host needs to know about the device:
+ * `<Status (1 byte)> <Packet size (2 bytes, little endian)> <ID count (1 byte)> <IDs>`. The list of
+ * ids is cut short if it does not fit in the payload, in which case the count is that of the ids
+ * listed.
+ *
+ * OPERATION_GET_METRICS takes `<ID (1 byte)> <First bucket (1 byte)>` and replies with the status
+ * followed by the metrics of that id in the form written by ComsMetrics::serialize().
+ *
+ * OPERATION_CLOCK_SYNC is one NTP-style exchange. It takes the time the host sent it,
+ * `<t1 (8 bytes)>`, and replies with `<Status (1 byte)> <t1> <t2> <t3>`, where `t2` is when the
+ * device read the request and `t3` when it replied, on the device's clock. Timestamps are as
+ * written by writeTimestamp(); a ClockSyncEstimator turns the exchanges into an offset and a drift.
+ *
+ * OPERATION_SET_TIMESTAMP_MODE takes `<Enable (1 byte)> <Offset (8 bytes)>` (see
+ * BowlerComs::setTimestampMode), and OPERATION_GET_LATENCY takes
+ * `<Histogram (1 byte)> <First bucket (1 byte)>` and replies with the status followed by the
+ * histogram in the form written by ComsMetrics::serializeLatency().
+ *
+ * OPERATION_READ_LOG takes `<Next record (4 bytes, little endian)>`, which acknowledges the records
+ * before it, and copies the oldest records of the BinaryLog left into the reply, after the status,
+ * in the form written by BinaryLog::readRecords(). OPERATION_GET_LOG_FORMAT takes
+ * `<Format id (2 bytes, little endian)>` and replies with `<Status (1 byte)> <Line (2 bytes)>
+ * <File length (1 byte)> <File> <Format string>`, the string cut short to fit. A BinaryLogDecoder
+ * formats the records with them.
+ *
+ * OPERATION_GET_PROFILE takes `<Task (1 byte)> <Reset (1 byte)>` and replies with the status
+ * followed by the profile of that task of the scheduler the coms runs on, or of its loop for
+ * Scheduler::LOOP_PROFILE, in the form written by Scheduler::serializeStats(). A non-zero reset
+ * clears every profile after it is read, to start a new measurement window.
+ *
+ * OPERATION_READ_CAPTURE takes `<Offset (4 bytes, little endian)>` and replies with
+ * `<Status (1 byte)> <Length (1 byte)> <Bytes>`, the chunk of the pcap stream of the coms'
+ * CaptureBowlerServer at that offset (see CaptureBowlerServer::readPcap). The host starts at `0`
+ * and appends the chunks to a file, asking for the offset after the last one, until one is empty;
+ * the device frees the data of a chunk only when it is asked for the next, so the host can send a
+ * request again with the same offset if its reply is lost.
+ *
+ * OPERATION_GET_HEAP takes `<Phase (1 byte)> <Reset (1 byte)>` and replies with the status followed
+ * by the state of the heap and what it did over that HeapPhase, in the form written by
+ * HeapStats::serialize(). A non-zero reset clears the stats of every phase after they are read.
+ * Disconnecting, adding the ensured packets and discovery are measured as those phases.
+ *
+ * Operations whose request or reply does not fit in the frames of the coms are rejected with
+ * EMSGSIZE.
  */
 template <std::size_t N> class ServerManagementPacket : public Packet {
   public:
@@ -34,6 +85,7 @@ template <std::size_t N> class ServerManagementPacket : public Packet {
     const std::uint8_t operation = payload[0];
     switch (operation) {
     case OPERATION_DISCONNECT_ID: {
+      HeapPhaseScope heapPhase(heapPhaseDisconnect);
       for (auto &&id : coms->getAllPacketIDs()) {
         coms->removePacket(id);
       }
@@ -43,6 +95,7 @@ template <std::size_t N> class ServerManagementPacket : public Packet {
     }
 
     case OPERATION_ADD_ENSURED_PACKETS: {
+      HeapPhaseScope heapPhase(heapPhaseAddEnsuredPackets);
       if (coms->addEnsuredPackets() == BOWLER_ERROR) {
         payload[0] = STATUS_REJECTED_GENERIC;
         return BOWLER_ERROR;
@@ -52,6 +105,207 @@ template <std::size_t N> class ServerManagementPacket : public Packet {
       }
     }
 
+    case OPERATION_DISCOVER: {
+      HeapPhaseScope heapPhase(heapPhaseDiscover);
+      if (rejectShortPayload(payload, 4)) {
+        return BOWLER_ERROR;
+      }
+
+      const std::size_t maxIds = N - HEADER_LENGTH - 4;
+      const auto ids = coms->getAllPacketIDs();
+      const std::size_t count = std::min(ids.size(), maxIds);
+
+      payload[0] = STATUS_ACCEPTED;
+      payload[1] = N & 0xFF;
+      payload[2] = (N >> 8) & 0xFF;
+      payload[3] = count;
+      std::copy_n(ids.begin(), count, payload + 4);
+      return 1;
+    }
+
+    case OPERATION_GET_METRICS: {
+      if (rejectShortPayload(payload, 3)) {
+        return BOWLER_ERROR;
+      }
+
+      const std::uint8_t id = payload[1];
+      const std::uint8_t firstBucket = payload[2];
+      const ComsMetrics *metrics = coms->getMetrics();
+      if (!metrics ||
+          metrics->serialize(id, firstBucket, payload + 1, N - HEADER_LENGTH - 1) == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_CLOCK_SYNC: {
+      if (rejectShortPayload(payload, 1 + 3 * TIMESTAMP_LENGTH)) {
+        return BOWLER_ERROR;
+      }
+
+      // t1 stays where it is
+      payload[0] = STATUS_ACCEPTED;
+      writeTimestamp(payload + 1 + TIMESTAMP_LENGTH, coms->getRequestTime());
+      writeTimestamp(payload + 1 + 2 * TIMESTAMP_LENGTH, coms->getCurrentTime());
+      return 1;
+    }
+
+    case OPERATION_SET_TIMESTAMP_MODE: {
+      if (rejectShortPayload(payload, 2 + TIMESTAMP_LENGTH)) {
+        return BOWLER_ERROR;
+      }
+
+      if (coms->setTimestampMode(payload[1] != 0, readTimestamp(payload + 2)) == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_GET_LATENCY: {
+      if (rejectShortPayload(payload, 3)) {
+        return BOWLER_ERROR;
+      }
+
+      const std::uint8_t histogram = payload[1];
+      const std::uint8_t firstBucket = payload[2];
+      const ComsMetrics *metrics = coms->getMetrics();
+      if (!metrics ||
+          metrics->serializeLatency(
+            histogram, firstBucket, payload + 1, N - HEADER_LENGTH - 1) == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_READ_LOG: {
+      if (rejectShortPayload(payload, 5)) {
+        return BOWLER_ERROR;
+      }
+
+      const std::uint32_t next =
+        payload[1] | (payload[2] << 8) | (payload[3] << 16) | (std::uint32_t(payload[4]) << 24);
+      if (getBinaryLog().readRecords(next, payload + 1, N - HEADER_LENGTH - 1) == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_GET_LOG_FORMAT: {
+      // The reply needs more room than the request
+      if (rejectShortPayload(payload, 4)) {
+        return BOWLER_ERROR;
+      }
+
+      const LogFormat *format = getBinaryLog().getFormat(payload[1] | (payload[2] << 8));
+      const std::size_t length = N - HEADER_LENGTH;
+      if (!format) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = EINVAL;
+        return BOWLER_ERROR;
+      }
+
+      std::fill(payload, payload + length, 0);
+      payload[0] = STATUS_ACCEPTED;
+      payload[1] = format->line & 0xFF;
+      payload[2] = format->line >> 8;
+      // Keep the end of a long path, and room for the format string
+      const std::size_t pathLength = std::strlen(format->file);
+      const std::size_t fileLength = std::min(pathLength, (length - 4) / 2);
+      payload[3] = fileLength;
+      std::memcpy(payload + 4, format->file + pathLength - fileLength, fileLength);
+      // The frame is zero-filled, so the string is terminated unless it fills the rest
+      const std::size_t offset = 4 + fileLength;
+      std::memcpy(payload + offset,
+                  format->format,
+                  std::min(std::strlen(format->format), length - offset));
+      return 1;
+    }
+
+    case OPERATION_GET_PROFILE: {
+      if (rejectShortPayload(payload, 3)) {
+        return BOWLER_ERROR;
+      }
+
+      const std::uint8_t task = payload[1];
+      const bool reset = payload[2] != 0;
+      Scheduler *scheduler = coms->getScheduler();
+      if (!scheduler) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = ENOTSUP;
+        return BOWLER_ERROR;
+      }
+
+      if (scheduler->serializeStats(task, payload + 1, N - HEADER_LENGTH - 1) == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      if (reset) {
+        scheduler->resetStats();
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
+    case OPERATION_READ_CAPTURE: {
+      if (rejectShortPayload(payload, 5)) {
+        return BOWLER_ERROR;
+      }
+
+      CaptureBowlerServer<N> *capture = coms->getCapture();
+      if (!capture) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        errno = ENOTSUP;
+        return BOWLER_ERROR;
+      }
+
+      const std::uint32_t offset =
+        payload[1] | (payload[2] << 8) | (payload[3] << 16) | (std::uint32_t(payload[4]) << 24);
+      const std::int32_t length = capture->readPcap(
+        offset, payload + 2, std::min<std::size_t>(N - HEADER_LENGTH - 2, 0xFF));
+      if (length == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      payload[1] = length;
+      return 1;
+    }
+
+    case OPERATION_GET_HEAP: {
+      if (rejectShortPayload(payload, 3)) {
+        return BOWLER_ERROR;
+      }
+
+      const std::uint8_t phase = payload[1];
+      const bool reset = payload[2] != 0;
+      if (getHeapStats().serialize(phase, payload + 1, N - HEADER_LENGTH - 1) == BOWLER_ERROR) {
+        payload[0] = STATUS_REJECTED_GENERIC;
+        return BOWLER_ERROR;
+      }
+
+      if (reset) {
+        getHeapStats().reset();
+      }
+
+      payload[0] = STATUS_ACCEPTED;
+      return 1;
+    }
+
     default: {
       errno = EINVAL;
       return BOWLER_ERROR;
@@ -60,6 +314,23 @@ template <std::size_t N> class ServerManagementPacket : public Packet {
   }
 
   private:
+  /**
+   * Rejects a request with EMSGSIZE if frames are too short for the payload of its operation.
+   * Call before reading the payload past the operation byte.
+   *
+   * @param ilength The length of the payload the operation needs, counting the operation byte.
+   * @return Whether the request was rejected.
+   */
+  static bool rejectShortPayload(std::uint8_t *payload, std::size_t ilength) {
+    if (N - HEADER_LENGTH >= ilength) {
+      return false;
+    }
+
+    payload[0] = STATUS_REJECTED_GENERIC;
+    errno = EMSGSIZE;
+    return true;
+  }
+
   BowlerComs<N> *coms;
 };
 } // namespace bowlerserver
@@ -0,0 +1,320 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#if defined(PLATFORM_NATIVE)
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+#endif
+
+#if !defined(BOWLER_TRACE_CAPACITY)
+#if defined(PLATFORM_NATIVE)
+#define BOWLER_TRACE_CAPACITY 65536
+#else
+#define BOWLER_TRACE_CAPACITY 256
+#endif
+#endif
+
+#define BOWLER_TRACE_CONCAT_INNER(a, b) a##b
+#define BOWLER_TRACE_CONCAT(a, b) BOWLER_TRACE_CONCAT_INNER(a, b)
+
+/**
+ * Traces the rest of the enclosing scope as one event in getTraceLog(). `icategory` and `iname`
+ * must be string literals. Compiles to nothing unless `BOWLER_TRACE` is defined.
+ */
+#if defined(BOWLER_TRACE)
+#define BOWLER_TRACE_SCOPE(icategory, iname)                                                       \
+  ::bowlerserver::TraceScope BOWLER_TRACE_CONCAT(bowlerTraceScope, __LINE__)(icategory, iname)
+#define BOWLER_TRACE_SCOPE_ID(icategory, iname, iid)                                               \
+  ::bowlerserver::TraceScope BOWLER_TRACE_CONCAT(bowlerTraceScope, __LINE__)(icategory, iname, iid)
+#define BOWLER_TRACE_THREAD_NAME(iname) ::bowlerserver::getTraceLog().setThreadName(iname)
+#else
+#define BOWLER_TRACE_SCOPE(icategory, iname)                                                       \
+  do {                                                                                             \
+  } while (0)
+#define BOWLER_TRACE_SCOPE_ID(icategory, iname, iid)                                               \
+  do {                                                                                             \
+  } while (0)
+#define BOWLER_TRACE_THREAD_NAME(iname)                                                            \
+  do {                                                                                             \
+  } while (0)
+#endif
+
+namespace bowlerserver {
+/**
+ * Records timed scopes (see BOWLER_TRACE_SCOPE) to be loaded into a trace viewer such as Perfetto
+ * or chrome://tracing as Chrome trace-event JSON. Each scope becomes a complete (`X`) event on the
+ * thread it ran on, so nested scopes show up as a call stack over time.
+ *
+ * Events go into a fixed array of `BOWLER_TRACE_CAPACITY` slots, claimed with an atomic increment,
+ * so any thread may record. Once the array is full, new events are dropped and counted; a trace is
+ * meant to cover a bounded run. Times come from the clock given to setClock(), so a simulation on a
+ * VirtualClock produces a timeline in simulated time.
+ */
+class TraceLog {
+  public:
+  static const std::size_t CAPACITY = BOWLER_TRACE_CAPACITY;
+  static const std::size_t MAX_THREADS = 16;
+  // The argument of an event which has none
+  static const std::int32_t NO_ARGUMENT = -1;
+
+  explicit TraceLog(Clock &iclock = getSystemClock())
+    : events(new Event[CAPACITY]), clock(&iclock) {
+    for (auto &&name : threadNames) {
+      name.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Sets the clock events are timed with. Only call while nothing is being recorded.
+   */
+  void setClock(Clock &iclock) {
+    clock = &iclock;
+  }
+
+  time_t now() {
+    return clock->now();
+  }
+
+  /**
+   * Records a complete event.
+   *
+   * @param icategory The category, a string literal.
+   * @param iname The name, a string literal.
+   * @param istart When the event started.
+   * @param iargument An id to show with the event, or NO_ARGUMENT.
+   */
+  void record(const char *icategory, const char *iname, time_t istart, std::int32_t iargument) {
+    const time_t end = clock->now();
+    const std::size_t index = next.fetch_add(1, std::memory_order_relaxed);
+    if (index >= CAPACITY) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    Event &event = events[index];
+    event.category = icategory;
+    event.name = iname;
+    event.start = istart;
+    event.duration = end - istart;
+    event.argument = iargument;
+    event.thread = getThreadId();
+    event.ready.store(true, std::memory_order_release);
+  }
+
+  /**
+   * Names the calling thread in the trace.
+   *
+   * @param iname The name, a string literal.
+   */
+  void setThreadName(const char *iname) {
+    const std::uint32_t thread = getThreadId();
+    if (thread < MAX_THREADS) {
+      threadNames[thread].store(iname, std::memory_order_release);
+    }
+  }
+
+  /**
+   * @return The number of events recorded, up to CAPACITY.
+   */
+  std::size_t size() const {
+    const std::size_t count = next.load(std::memory_order_relaxed);
+    return count < CAPACITY ? count : CAPACITY;
+  }
+
+  /**
+   * @return The number of events dropped because the log was full.
+   */
+  std::uint32_t getDropped() const {
+    return dropped.load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Forgets every event. Only call while nothing is being recorded.
+   */
+  void reset() {
+    const std::size_t count = size();
+    for (std::size_t i = 0; i < count; i++) {
+      events[i].ready.store(false, std::memory_order_relaxed);
+    }
+    next.store(0, std::memory_order_relaxed);
+    dropped.store(0, std::memory_order_relaxed);
+  }
+
+#if defined(PLATFORM_NATIVE)
+  /**
+   * Appends the trace as Chrome trace-event JSON, with times in microseconds.
+   */
+  void toJson(std::string &ijson) const {
+    ijson += "{\"traceEvents\":[";
+    bool first = true;
+    char buffer[96];
+    for (std::size_t i = 0; i < MAX_THREADS; i++) {
+      const char *name = threadNames[i].load(std::memory_order_acquire);
+      if (!name) {
+        continue;
+      }
+
+      ijson += first ? "\n" : ",\n";
+      first = false;
+      std::snprintf(buffer, sizeof(buffer), ",\"tid\":%u,\"args\":{\"name\":\"", unsigned(i));
+      ijson += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1";
+      ijson += buffer;
+      appendEscaped(ijson, name);
+      ijson += "\"}}";
+    }
+
+    const std::size_t count = size();
+    for (std::size_t i = 0; i < count; i++) {
+      const Event &event = events[i];
+      if (!event.ready.load(std::memory_order_acquire)) {
+        continue;
+      }
+
+      ijson += first ? "\n" : ",\n";
+      first = false;
+      ijson += "{\"name\":\"";
+      appendEscaped(ijson, event.name);
+      ijson += "\",\"cat\":\"";
+      appendEscaped(ijson, event.category);
+      std::snprintf(buffer,
+                    sizeof(buffer),
+                    "\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64,
+                    std::int64_t(event.start),
+                    std::int64_t(event.duration));
+      ijson += buffer;
+      std::snprintf(buffer, sizeof(buffer), ",\"pid\":1,\"tid\":%u", unsigned(event.thread));
+      ijson += buffer;
+      if (event.argument != NO_ARGUMENT) {
+        std::snprintf(buffer, sizeof(buffer), ",\"args\":{\"id\":%d}", int(event.argument));
+        ijson += buffer;
+      }
+      ijson += "}";
+    }
+
+    ijson += "\n],\"displayTimeUnit\":\"ns\"}\n";
+  }
+
+  /**
+   * Writes the trace to a JSON file.
+   *
+   * @return `1` on success or BOWLER_ERROR on error.
+   */
+  std::int32_t writeJson(const char *ipath) const {
+    std::string json;
+    toJson(json);
+
+    std::FILE *file = std::fopen(ipath, "wb");
+    if (!file) {
+      return BOWLER_ERROR;
+    }
+
+    const bool written = std::fwrite(json.data(), 1, json.size(), file) == json.size();
+    if (std::fclose(file) != 0 || !written) {
+      return BOWLER_ERROR;
+    }
+    return 1;
+  }
+#endif
+
+  protected:
+  struct Event {
+    const char *category;
+    const char *name;
+    time_t start;
+    time_t duration;
+    std::int32_t argument;
+    std::uint32_t thread;
+    std::atomic<bool> ready{false};
+  };
+
+  /**
+   * @return A small number for the calling thread, assigned the first time it records.
+   */
+  static std::uint32_t getThreadId() {
+    static std::atomic<std::uint32_t> nextThread{0};
+    static thread_local std::uint32_t thread = nextThread.fetch_add(1, std::memory_order_relaxed);
+    return thread;
+  }
+
+#if defined(PLATFORM_NATIVE)
+  static void appendEscaped(std::string &ijson, const char *itext) {
+    for (; *itext; itext++) {
+      if (*itext == '"' || *itext == '\\') {
+        ijson += '\\';
+      }
+      ijson += *itext;
+    }
+  }
+#endif
+
+  std::unique_ptr<Event[]> events;
+  Clock *clock;
+  std::atomic<std::size_t> next{0};
+  std::atomic<std::uint32_t> dropped{0};
+  std::atomic<const char *> threadNames[MAX_THREADS];
+};
+
+/**
+ * @return The log BOWLER_TRACE_SCOPE records into.
+ */
+inline TraceLog &getTraceLog() {
+  static TraceLog log;
+  return log;
+}
+
+/**
+ * Records the time from its construction to its destruction as an event in a TraceLog.
+ */
+class TraceScope {
+  public:
+  /**
+   * @param icategory The category, a string literal.
+   * @param iname The name, a string literal.
+   * @param iargument An id to show with the event, or TraceLog::NO_ARGUMENT.
+   * @param ilog The log to record into.
+   */
+  TraceScope(const char *icategory,
+             const char *iname,
+             std::int32_t iargument = TraceLog::NO_ARGUMENT,
+             TraceLog &ilog = getTraceLog())
+    : log(ilog), category(icategory), name(iname), argument(iargument), start(ilog.now()) {
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+  ~TraceScope() {
+    log.record(category, name, start, argument);
+  }
+
+  protected:
+  TraceLog &log;
+  const char *category;
+  const char *name;
+  std::int32_t argument;
+  time_t start;
+};
+} // namespace bowlerserver
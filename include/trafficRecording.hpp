@@ -0,0 +1,478 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "bowlerClock.hpp"
+#include "bowlerDeviceServerUtil.hpp"
+#include "bowlerServer.hpp"
+#include "byteStream.hpp"
+#include "comsMetrics.hpp"
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#if defined(PLATFORM_NATIVE)
+#include <cstdio>
+#endif
+
+namespace bowlerserver {
+/**
+ * The format of a traffic recording. A recording starts with `<Magic (4 bytes)> <Version (1 byte)>
+ * <Frame size (2 bytes, little endian)>` and is followed by one record per frame read:
+ * `<Gap> <Route> <Length> <Frame>`, where the gap is the time since the previous frame in the
+ * units of getTime() and the frame is cut after its last non-zero byte, `Length` bytes long.
+ * Numbers in records are unsigned LEB128, so a typical request takes a few bytes more than its
+ * payload.
+ */
+namespace traffic {
+const std::array<std::uint8_t, 4> MAGIC{{'B', 'W', 'T', 'R'}};
+const std::uint8_t VERSION = 1;
+const std::size_t HEADER_LENGTH = 7;
+// The longest a record header can be: a 64-bit gap, a 32-bit route and a 16-bit length
+const std::size_t MAX_RECORD_HEADER_LENGTH = 10 + 5 + 3;
+
+inline std::size_t writeVarint(std::uint8_t *idata, std::uint64_t ivalue) {
+  std::size_t length = 0;
+  do {
+    idata[length++] = (ivalue & 0x7F) | (ivalue > 0x7F ? 0x80 : 0);
+    ivalue >>= 7;
+  } while (ivalue > 0);
+  return length;
+}
+
+/**
+ * @return The number of bytes read, or `0` if the number does not end before `iend`.
+ */
+inline std::size_t
+readVarint(const std::uint8_t *idata, const std::uint8_t *iend, std::uint64_t &ivalue) {
+  ivalue = 0;
+  for (std::size_t i = 0; idata + i < iend && i < 10; i++) {
+    ivalue |= std::uint64_t(idata[i] & 0x7F) << (7 * i);
+    if ((idata[i] & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+inline std::size_t writeHeader(std::uint8_t *idata, std::size_t iframeSize) {
+  std::copy(MAGIC.begin(), MAGIC.end(), idata);
+  idata[4] = VERSION;
+  idata[5] = iframeSize & 0xFF;
+  idata[6] = (iframeSize >> 8) & 0xFF;
+  return HEADER_LENGTH;
+}
+} // namespace traffic
+
+/**
+ * Counters kept by RecordingBowlerServer.
+ */
+struct RecordingStats {
+  std::uint32_t recorded{0};
+  // Records dropped because the sink could not keep up
+  std::uint32_t dropped{0};
+  std::uint64_t bytes{0};
+};
+
+/**
+ * A BowlerServer which records the frames read from another one, with the time between them, to a
+ * ByteStream in the format of the traffic namespace. On the host, an FdByteStream over a file
+ * makes a recording file; on a device, any stream with a host on the other end will do. Writes
+ * pass straight through.
+ *
+ * Encoded records wait in a buffer of bounded size until the sink takes them, so a slow sink never
+ * blocks the coms. Records which do not fit are dropped and counted.
+ */
+template <std::size_t N> class RecordingBowlerServer : public BowlerServer<N> {
+  public:
+  /**
+   * @param iserver The server to record the frames of.
+   * @param isink Where the recording is written.
+   * @param ibufferSize The most bytes waiting for the sink.
+   * @param iclock The clock to time the frames with.
+   */
+  RecordingBowlerServer(std::unique_ptr<BowlerServer<N>> iserver,
+                        std::unique_ptr<ByteStream> isink,
+                        std::size_t ibufferSize = 4096,
+                        Clock &iclock = getSystemClock())
+    : server(std::move(iserver)), sink(std::move(isink)), bufferSize(ibufferSize), clock(&iclock) {
+    std::array<std::uint8_t, traffic::HEADER_LENGTH> header;
+    traffic::writeHeader(header.data(), N);
+    pending.insert(pending.end(), header.begin(), header.end());
+    flush();
+  }
+
+  virtual ~RecordingBowlerServer() {
+    flush();
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    return server->write(payload);
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    const auto error = server->read(payload);
+    if (error != BOWLER_ERROR) {
+      record(payload);
+    }
+
+    return error;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    flush();
+    return server->isDataAvailable(available);
+  }
+
+  bool isLossless() const override {
+    return server->isLossless();
+  }
+
+  bool isMulticast() const override {
+    return server->isMulticast();
+  }
+
+  std::uint32_t getRoute() const override {
+    return server->getRoute();
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    server->setRoute(iroute);
+  }
+
+  bool takeClosedRoute(std::uint32_t &iroute) override {
+    return server->takeClosedRoute(iroute);
+  }
+
+  /**
+   * Writes as much of the waiting recording to the sink as it takes now.
+   *
+   * @return `1` on success or BOWLER_ERROR if the sink failed.
+   */
+  std::int32_t flush() {
+    while (!pending.empty()) {
+      // The deque is not contiguous, so move it in chunks
+      std::array<std::uint8_t, 256> chunk;
+      const std::size_t length = std::min(pending.size(), chunk.size());
+      std::copy_n(pending.begin(), length, chunk.begin());
+
+      std::size_t written = 0;
+      if (sink->write(chunk.data(), length, written) == BOWLER_ERROR) {
+        return BOWLER_ERROR;
+      }
+
+      pending.erase(pending.begin(), pending.begin() + written);
+      if (written < length) {
+        break;
+      }
+    }
+
+    return 1;
+  }
+
+  const RecordingStats &getStats() const {
+    return stats;
+  }
+
+  protected:
+  void record(const std::array<std::uint8_t, N> &iframe) {
+    const time_t now = clock->now();
+    const time_t gap = hasRecorded && now > lastTime ? now - lastTime : 0;
+    hasRecorded = true;
+    lastTime = now;
+
+    std::size_t length = N;
+    while (length > 0 && iframe[length - 1] == 0) {
+      length--;
+    }
+
+    std::array<std::uint8_t, traffic::MAX_RECORD_HEADER_LENGTH> header;
+    std::size_t headerLength = traffic::writeVarint(header.data(), gap);
+    headerLength += traffic::writeVarint(header.data() + headerLength, server->getRoute());
+    headerLength += traffic::writeVarint(header.data() + headerLength, length);
+
+    if (pending.size() + headerLength + length > bufferSize) {
+      stats.dropped++;
+      return;
+    }
+
+    pending.insert(pending.end(), header.begin(), header.begin() + headerLength);
+    pending.insert(pending.end(), iframe.begin(), iframe.begin() + length);
+    stats.recorded++;
+    stats.bytes += headerLength + length;
+  }
+
+  std::unique_ptr<BowlerServer<N>> server;
+  std::unique_ptr<ByteStream> sink;
+  std::size_t bufferSize;
+  Clock *clock;
+  std::deque<std::uint8_t> pending;
+  bool hasRecorded{false};
+  time_t lastTime{0};
+  RecordingStats stats;
+};
+
+/**
+ * The latency of the replies to one packet id during a replay, in the units of getTime().
+ */
+struct ReplayLatency {
+  std::uint32_t replies{0};
+  time_t totalLatency{0};
+  time_t maxLatency{0};
+  LatencyHistogram histogram;
+};
+
+/**
+ * A BowlerServer which plays a recording made by RecordingBowlerServer back as incoming frames, to
+ * turn real traffic into a repeatable benchmark for a DefaultBowlerComs on the host.
+ *
+ * Each reply written is matched with the oldest unanswered request of its packet id, and the time
+ * between the two is counted in the latency of that id. With originalTiming, that time runs from
+ * when the request was due rather than when it was read, so it includes any time the request
+ * waited for a busy coms. Replies go nowhere; routes are those of the recording.
+ */
+template <std::size_t N> class ReplayBowlerServer : public BowlerServer<N> {
+  public:
+  /**
+   * How the frames of the recording are paced.
+   */
+  enum ReplayTiming {
+    // Each frame becomes readable after the gap it was recorded with.
+    originalTiming,
+    // Each frame is readable as soon as the one before was read.
+    asFastAsPossible
+  };
+
+  /**
+   * @param irecording The recording, with its header.
+   * @param itiming How to pace the frames.
+   * @param iclock The clock to pace and time the frames with.
+   */
+  ReplayBowlerServer(std::vector<std::uint8_t> irecording,
+                     ReplayTiming itiming = asFastAsPossible,
+                     Clock &iclock = getSystemClock())
+    : recording(std::move(irecording)), timing(itiming), clock(&iclock) {
+    valid = recording.size() >= traffic::HEADER_LENGTH &&
+            std::equal(traffic::MAGIC.begin(), traffic::MAGIC.end(), recording.begin()) &&
+            recording[4] == traffic::VERSION &&
+            std::size_t(recording[5] | (recording[6] << 8)) == N;
+    offset = valid ? traffic::HEADER_LENGTH : recording.size();
+    parseNext();
+  }
+
+  std::int32_t write(std::array<std::uint8_t, N> payload) override {
+    const time_t now = clock->now();
+    std::deque<time_t> &outstanding = requests[payload[0]];
+    if (!outstanding.empty()) {
+      const time_t latency = now - outstanding.front();
+      outstanding.pop_front();
+
+      ReplayLatency &entry = latencies[payload[0]];
+      entry.replies++;
+      entry.totalLatency += latency;
+      entry.maxLatency = std::max(entry.maxLatency, latency);
+      entry.histogram.record(latency);
+    }
+
+    replies++;
+    lastReply = now;
+    return 1;
+  }
+
+  std::int32_t read(std::array<std::uint8_t, N> &payload) override {
+    bool available = false;
+    isDataAvailable(available);
+    if (!available) {
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
+
+    const time_t now = clock->now();
+    if (framesRead == 0) {
+      start = now;
+      due = now;
+    } else {
+      due += nextGap;
+    }
+
+    payload = next;
+    route = nextRoute;
+    requests[payload[0]].push_back(timing == originalTiming ? due : now);
+    framesRead++;
+    parseNext();
+    return 1;
+  }
+
+  std::int32_t isDataAvailable(bool &available) override {
+    if (!hasNext) {
+      available = false;
+    } else if (timing == asFastAsPossible || framesRead == 0) {
+      available = true;
+    } else {
+      available = clock->now() - due >= nextGap;
+    }
+
+    return 1;
+  }
+
+  std::uint32_t getRoute() const override {
+    return route;
+  }
+
+  /**
+   * @return Whether the recording is valid for this frame size.
+   */
+  bool isValid() const {
+    return valid;
+  }
+
+  /**
+   * @return Whether every frame was read.
+   */
+  bool isFinished() const {
+    return !hasNext;
+  }
+
+  /**
+   * @return How long until the next frame is due, or `0` if it is due or there is none.
+   */
+  time_t getTimeUntilNextFrame() const {
+    if (!hasNext || timing == asFastAsPossible || framesRead == 0) {
+      return 0;
+    }
+
+    const time_t elapsed = clock->now() - due;
+    return elapsed >= nextGap ? 0 : nextGap - elapsed;
+  }
+
+  std::uint64_t getFramesRead() const {
+    return framesRead;
+  }
+
+  std::uint64_t getReplies() const {
+    return replies;
+  }
+
+  /**
+   * @return The time from the first frame read to the last reply written.
+   */
+  time_t getElapsed() const {
+    return framesRead == 0 || replies == 0 ? 0 : lastReply - start;
+  }
+
+  /**
+   * @return The latency of the replies to an id.
+   */
+  const ReplayLatency &getLatency(std::uint8_t iid) const {
+    return latencies[iid];
+  }
+
+  /**
+   * @return The packet ids the recording contains, so that a coms can be given a packet for each.
+   */
+  static std::vector<std::uint8_t> getPacketIds(const std::vector<std::uint8_t> &irecording) {
+    ReplayBowlerServer<N> replay(irecording);
+    std::array<bool, 256> seen{};
+    std::vector<std::uint8_t> ids;
+    std::array<std::uint8_t, N> frame;
+    while (replay.read(frame) != BOWLER_ERROR) {
+      if (!seen[frame[0]]) {
+        seen[frame[0]] = true;
+        ids.push_back(frame[0]);
+      }
+    }
+    return ids;
+  }
+
+  protected:
+  void parseNext() {
+    hasNext = false;
+    const std::uint8_t *end = recording.data() + recording.size();
+    const std::uint8_t *data = recording.data() + offset;
+    std::uint64_t gap, nextRouteValue, length;
+    std::size_t read;
+    if ((read = traffic::readVarint(data, end, gap)) == 0) {
+      return;
+    }
+    data += read;
+    if ((read = traffic::readVarint(data, end, nextRouteValue)) == 0) {
+      return;
+    }
+    data += read;
+    if ((read = traffic::readVarint(data, end, length)) == 0 || length > N ||
+        length > std::uint64_t(end - data - read)) {
+      return;
+    }
+    data += read;
+
+    next.fill(0);
+    std::copy_n(data, length, next.begin());
+    nextGap = gap;
+    nextRoute = nextRouteValue;
+    offset = data + length - recording.data();
+    hasNext = true;
+  }
+
+  std::vector<std::uint8_t> recording;
+  ReplayTiming timing;
+  Clock *clock;
+  bool valid{false};
+  std::size_t offset{0};
+
+  bool hasNext{false};
+  std::array<std::uint8_t, N> next;
+  time_t nextGap{0};
+  std::uint32_t nextRoute{0};
+  std::uint32_t route{0};
+
+  std::uint64_t framesRead{0};
+  std::uint64_t replies{0};
+  time_t start{0};
+  // When the last frame read was due
+  time_t due{0};
+  time_t lastReply{0};
+  std::array<std::deque<time_t>, 256> requests;
+  std::array<ReplayLatency, 256> latencies;
+};
+
+#if defined(PLATFORM_NATIVE)
+/**
+ * Reads a whole recording file.
+ *
+ * @return `1` on success or BOWLER_ERROR on error.
+ */
+inline std::int32_t loadRecording(const char *ipath, std::vector<std::uint8_t> &irecording) {
+  std::FILE *file = std::fopen(ipath, "rb");
+  if (!file) {
+    return BOWLER_ERROR;
+  }
+
+  irecording.clear();
+  std::array<std::uint8_t, 4096> buffer;
+  std::size_t length;
+  while ((length = std::fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+    irecording.insert(irecording.end(), buffer.begin(), buffer.begin() + length);
+  }
+
+  const bool failed = std::ferror(file) != 0;
+  std::fclose(file);
+  return failed ? BOWLER_ERROR : 1;
+}
+#endif
+} // namespace bowlerserver
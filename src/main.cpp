@@ -14,7 +14,33 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
  */
-#if !defined(UNIT_TEST)
+#if !defined(UNIT_TEST) && defined(PLATFORM_NATIVE)
+
+#include "bowlerLinuxUdpServer.hpp"
+#include "defaultBowlerComs.hpp"
+#include "noopPacket.hpp"
+
+using namespace bowlerserver;
+
+// The host build runs the coms over a Linux UDP socket, as a device simulator and load-test target
+int main() {
+  auto *server = new LinuxUDPServer<DEFAULT_PACKET_SIZE>();
+  if (server->begin() == BOWLER_ERROR) {
+    BOWLER_LOG("Error opening the UDP server: %d %s\n", errno, strerror(errno));
+    return 1;
+  }
+
+  DefaultBowlerComs<DEFAULT_PACKET_SIZE> coms{
+    std::unique_ptr<LinuxUDPServer<DEFAULT_PACKET_SIZE>>(server)};
+  coms.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, true)));
+
+  while (true) {
+    server->waitForData(-1);
+    coms.loop();
+  }
+}
+
+#elif !defined(UNIT_TEST)
 
 #include "bowlerComsController.hpp"
 #include <Arduino.h>
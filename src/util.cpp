@@ -15,6 +15,39 @@
  * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
  */
 #include "bowlerDeviceServerUtil.hpp"
+#include "heapStats.hpp"
+
+#if defined(PLATFORM_NATIVE)
+#include <chrono>
+#endif
+
+#if defined(BOWLER_COUNT_ALLOCATIONS)
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<std::uint32_t> allocationCount{0};
+}
+
+// Every other form of `new` and `delete` forwards to these two
+void *operator new(std::size_t isize) {
+  allocationCount.fetch_add(1, std::memory_order_relaxed);
+  void *pointer = std::malloc(isize > 0 ? isize : 1);
+  if (!pointer) {
+#if defined(__cpp_exceptions)
+    throw std::bad_alloc();
+#else
+    std::abort();
+#endif
+  }
+  return pointer;
+}
+
+void operator delete(void *ipointer) noexcept {
+  std::free(ipointer);
+}
+#endif
 
 namespace bowlerserver {
 #if defined(PLATFORM_ESP32)
@@ -25,5 +58,19 @@ time_t getTime() {
 time_t getTime() {
   return micros();
 }
+#elif defined(PLATFORM_NATIVE)
+time_t getTime() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+#endif
+
+std::uint32_t getAllocationCount() {
+#if defined(BOWLER_COUNT_ALLOCATIONS)
+  return allocationCount.load(std::memory_order_relaxed);
+#else
+  return 0;
 #endif
+}
 } // namespace bowlerserver
@@ -35,9 +35,34 @@ template <std::size_t N> class MockBowlerServer : public BowlerServer<N> {
 
   std::int32_t isDataAvailable(bool &available) override {
     available = readsToSend.size() > 0;
+    if (!available && failWhenEmpty) {
+      // As LinuxUDPServer does
+      errno = EWOULDBLOCK;
+      return BOWLER_ERROR;
+    }
     return 1;
   }
 
+  bool isLossless() const override {
+    return lossless;
+  }
+
+  bool isMulticast() const override {
+    return multicast;
+  }
+
+  std::uint32_t getRoute() const override {
+    return route;
+  }
+
+  void setRoute(std::uint32_t iroute) override {
+    route = iroute;
+  }
+
+  bool lossless{false};
+  bool multicast{false};
+  bool failWhenEmpty{false};
+  std::uint32_t route{0};
   std::queue<std::array<std::uint8_t, N>> writesReceived;
   std::queue<std::array<std::uint8_t, N>> readsToSend;
 };
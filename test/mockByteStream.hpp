@@ -0,0 +1,58 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "byteStream.hpp"
+#include <deque>
+
+namespace bowlerserver {
+/**
+ * A ByteStream backed by two queues. Reads return at most `chunkSize` bytes at a time to exercise
+ * partial reads.
+ */
+class MockByteStream : public ByteStream {
+  public:
+  explicit MockByteStream(std::size_t ichunkSize = 7) : chunkSize(ichunkSize) {
+  }
+
+  std::int32_t read(std::uint8_t *idata, std::size_t ilength, std::size_t &icount) override {
+    icount = 0;
+    while (icount < ilength && icount < chunkSize && !bytesToRead.empty()) {
+      idata[icount++] = bytesToRead.front();
+      bytesToRead.pop_front();
+    }
+    return 1;
+  }
+
+  std::int32_t write(const std::uint8_t *idata, std::size_t ilength, std::size_t &icount) override {
+    if (failWrites) {
+      icount = 0;
+      errno = EIO;
+      return BOWLER_ERROR;
+    }
+
+    bytesWritten.insert(bytesWritten.end(), idata, idata + ilength);
+    icount = ilength;
+    return 1;
+  }
+
+  std::size_t chunkSize;
+  bool failWrites{false};
+  std::deque<std::uint8_t> bytesToRead;
+  std::deque<std::uint8_t> bytesWritten;
+};
+} // namespace bowlerserver
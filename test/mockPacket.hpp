@@ -18,8 +18,12 @@
 
 #include "bowlerDeviceServerUtil.hpp"
 #include "bowlerPacket.hpp"
+#include "deferredPacket.hpp"
 #include <array>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <mutex>
 #include <vector>
 
 namespace bowlerserver {
@@ -28,7 +32,8 @@ namespace bowlerserver {
  */
 class MockPacket : public Packet {
   public:
-  MockPacket(std::uint8_t iid, bool iisReliable = false) : Packet(iid, iisReliable) {
+  MockPacket(std::uint8_t iid, bool iisReliable = false, bool iisIndependent = false)
+    : Packet(iid, iisReliable, iisIndependent) {
   }
 
   std::int32_t event(std::uint8_t *payload) override {
@@ -40,4 +45,69 @@ class MockPacket : public Packet {
 
   std::vector<std::array<std::uint8_t, DEFAULT_PAYLOAD_SIZE>> payloads;
 };
+
+/**
+ * An independent Packet whose events wait until the test opens it, and which records the first
+ * payload byte of each event in the order they ran. Events give up waiting after a few seconds, so
+ * that a failed test does not hang in the executor's destructor.
+ */
+class BlockingPacket : public Packet {
+  public:
+  BlockingPacket(std::uint8_t iid) : Packet(iid, false, true) {
+  }
+
+  std::int32_t event(std::uint8_t *payload) override {
+    std::unique_lock<std::mutex> lock(mutex);
+    started++;
+    condition.notify_all();
+    condition.wait_for(lock, std::chrono::seconds(5), [this] { return isOpen; });
+    order.push_back(payload[0]);
+    return 1;
+  }
+
+  void open() {
+    std::lock_guard<std::mutex> lock(mutex);
+    isOpen = true;
+    condition.notify_all();
+  }
+
+  /**
+   * @return Whether an event started within about a second.
+   */
+  bool waitForStart() {
+    std::unique_lock<std::mutex> lock(mutex);
+    return condition.wait_for(lock, std::chrono::seconds(1), [this] { return started > 0; });
+  }
+
+  std::vector<std::uint8_t> getOrder() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return order;
+  }
+
+  protected:
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool isOpen{false};
+  int started{0};
+  std::vector<std::uint8_t> order;
+};
+
+/**
+ * A DeferredPacket which keeps the replies it is given so the test can complete them.
+ */
+class MockDeferredPacket : public DeferredPacket {
+  public:
+  MockDeferredPacket(std::uint8_t iid, bool iisReliable = false)
+    : DeferredPacket(iid, iisReliable) {
+  }
+
+  using DeferredPacket::event;
+
+  std::int32_t event(std::uint8_t *payload, DeferredReply reply) override {
+    replies.push_back(reply);
+    return BOWLER_PENDING;
+  }
+
+  std::vector<DeferredReply> replies;
+};
 } // namespace bowlerserver
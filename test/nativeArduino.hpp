@@ -0,0 +1,49 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/**
+ * The few Arduino functions the tests and benchmarks use, so that they build for
+ * `PLATFORM_NATIVE` without an Arduino core. On a device, Arduino.h provides them.
+ */
+#if defined(PLATFORM_NATIVE)
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+inline void delay(std::uint32_t ims) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ims));
+}
+
+inline void delayMicroseconds(std::uint32_t ius) {
+  std::this_thread::sleep_for(std::chrono::microseconds(ius));
+}
+
+inline std::uint32_t micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+
+inline std::uint32_t millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+#else
+#include <Arduino.h>
+#endif
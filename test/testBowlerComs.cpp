@@ -14,10 +14,32 @@
  * You should have received a copy of the GNU Lesser General Public License
  * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
  */
+#include "bowlerGateway.hpp"
+#if defined(PLATFORM_NATIVE)
+#include "bowlerLinuxUdpServer.hpp"
+#include "bowlerShmServer.hpp"
+#include "bowlerTcpServer.hpp"
+#include "deviceSimulator.hpp"
+#endif
+#include "bowlerScheduler.hpp"
+#include "bowlerStreamServer.hpp"
+#include "busyPacket.hpp"
+#include "captureBowlerServer.hpp"
+#include "channelDemux.hpp"
 #include "defaultBowlerComs.hpp"
+#include "heapStats.hpp"
+#include "impairedBowlerServer.hpp"
 #include "mockBowlerServer.hpp"
+#include "mockByteStream.hpp"
 #include "mockPacket.hpp"
+#include "nativeArduino.hpp"
+#include "multiBowlerServer.hpp"
 #include "noopPacket.hpp"
+#include "queuedBowlerServer.hpp"
+#include "traceEvents.hpp"
+#include "trafficRecording.hpp"
+#include <algorithm>
+#include <cmath>
 #include <unity.h>
 
 using namespace bowlerserver;
@@ -197,8 +219,1657 @@ template <std::size_t N> void disconnect_before_add_ensured_packets() {
   assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 0});
 }
 
-void setup() {
-  delay(2000);
+template <std::size_t N> void independent_packets_run_on_executor() {
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server),
+                            std::unique_ptr<PacketExecutor<N>>(new PacketExecutor<N>(2))};
+  std::shared_ptr<MockPacket> mockPacket(new MockPacket(2, true, true));
+  coms.addPacket(mockPacket);
+
+  // The reply is written by a later loop once a worker has run the event
+  server->readsToSend.push({2, 0, 1, 42});
+  for (int i = 0; i < 1000 && server->writesReceived.empty(); i++) {
+    coms.loop();
+    delay(1);
+  }
+
+  std::array<std::uint8_t, N> expected{2, 0, 0, 42};
+  TEST_ASSERT_EQUAL_INT(1, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), server->writesReceived.front().data(), N);
+  TEST_ASSERT_EQUAL_INT(1, mockPacket->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(42, mockPacket->payloads[0][0]);
+}
+
+template <std::size_t N> void executor_keeps_order_of_one_id() {
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server),
+                            std::unique_ptr<PacketExecutor<N>>(new PacketExecutor<N>(4))};
+  std::shared_ptr<BlockingPacket> blockingPacket(new BlockingPacket(2));
+  coms.addPacket(blockingPacket);
+
+  // The first event holds its worker, so the rest queue up behind it while other workers are idle
+  const std::uint8_t count = 5;
+  for (std::uint8_t i = 0; i < count; i++) {
+    server->readsToSend.push({2, 0, 0, i});
+    coms.loop();
+  }
+  TEST_ASSERT_TRUE(blockingPacket->waitForStart());
+  blockingPacket->open();
+
+  for (int i = 0; i < 1000 && server->writesReceived.size() < count; i++) {
+    coms.loop();
+    delay(1);
+  }
+
+  TEST_ASSERT_EQUAL_INT(count, server->writesReceived.size());
+  for (std::uint8_t i = 0; i < count; i++) {
+    TEST_ASSERT_EQUAL_UINT8(i, server->writesReceived.front()[HEADER_LENGTH]);
+    server->writesReceived.pop();
+  }
+  const std::vector<std::uint8_t> expected{0, 1, 2, 3, 4};
+  TEST_ASSERT_TRUE(blockingPacket->getOrder() == expected);
+}
+
+template <std::size_t N> void executor_runs_other_ids_while_one_blocks() {
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server),
+                            std::unique_ptr<PacketExecutor<N>>(new PacketExecutor<N>(2))};
+  std::shared_ptr<BlockingPacket> blockingPacket(new BlockingPacket(2));
+  coms.addPacket(blockingPacket);
+  std::shared_ptr<MockPacket> mockPacket(new MockPacket(3, false, true));
+  coms.addPacket(mockPacket);
+
+  server->readsToSend.push({2, 0, 0, 1});
+  coms.loop();
+  TEST_ASSERT_TRUE(blockingPacket->waitForStart());
+
+  // Id 3 completes on the other worker while id 2 still holds the first
+  server->readsToSend.push({3, 0, 0, 42});
+  for (int i = 0; i < 1000 && server->writesReceived.empty(); i++) {
+    coms.loop();
+    delay(1);
+  }
+
+  std::array<std::uint8_t, N> expected{3, 0, 0, 42};
+  TEST_ASSERT_EQUAL_INT(1, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), server->writesReceived.front().data(), N);
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_INT(0, blockingPacket->getOrder().size());
+
+  blockingPacket->open();
+  for (int i = 0; i < 1000 && server->writesReceived.empty(); i++) {
+    coms.loop();
+    delay(1);
+  }
+
+  expected = {2, 0, 0, 1};
+  TEST_ASSERT_EQUAL_INT(1, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), server->writesReceived.front().data(), N);
+}
+
+template <std::size_t N> void write_queue_drop_newest() {
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  QueuedBowlerServer<N> queue{
+    std::unique_ptr<MockBowlerServer<N>>(server), 2, QueuedBowlerServer<N>::dropNewest};
+
+  TEST_ASSERT_EQUAL_INT(1, queue.write({2}));
+  TEST_ASSERT_EQUAL_INT(1, queue.write({3}));
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, queue.write({4}));
+  TEST_ASSERT_EQUAL_INT(ENOBUFS, errno);
+
+  // Nothing is sent until the queue is drained
+  TEST_ASSERT_EQUAL_INT(0, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_INT(2, queue.drain());
+  TEST_ASSERT_EQUAL_UINT8(2, server->writesReceived.front()[0]);
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_UINT8(3, server->writesReceived.front()[0]);
+
+  auto stats = queue.getStats();
+  TEST_ASSERT_EQUAL_INT(2, stats.enqueued);
+  TEST_ASSERT_EQUAL_INT(2, stats.sent);
+  TEST_ASSERT_EQUAL_INT(1, stats.dropped);
+  TEST_ASSERT_EQUAL_INT(2, stats.maxDepth);
+}
+
+template <std::size_t N> void write_queue_drop_oldest() {
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  QueuedBowlerServer<N> queue{
+    std::unique_ptr<MockBowlerServer<N>>(server), 2, QueuedBowlerServer<N>::dropOldest};
+
+  TEST_ASSERT_EQUAL_INT(1, queue.write({2}));
+  TEST_ASSERT_EQUAL_INT(1, queue.write({3}));
+  TEST_ASSERT_EQUAL_INT(1, queue.write({4}));
+
+  TEST_ASSERT_EQUAL_INT(2, queue.drain());
+  TEST_ASSERT_EQUAL_UINT8(3, server->writesReceived.front()[0]);
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_UINT8(4, server->writesReceived.front()[0]);
+  TEST_ASSERT_EQUAL_INT(1, queue.getStats().dropped);
+}
+
+template <std::size_t N> void write_queue_block() {
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  server->lossless = true;
+  // A queue of no frames holds one
+  QueuedBowlerServer<N> queue{
+    std::unique_ptr<MockBowlerServer<N>>(server), 0, QueuedBowlerServer<N>::block, 100 * 1000};
+  TEST_ASSERT_TRUE(queue.isLossless());
+
+  // Nothing makes room, so the write gives up after the timeout
+  TEST_ASSERT_EQUAL_INT(1, queue.write({2}));
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, queue.write({3}));
+  TEST_ASSERT_EQUAL_INT(ENOBUFS, errno);
+
+  // The sender makes room while the write waits
+  queue.startSenderTask();
+  TEST_ASSERT_EQUAL_INT(1, queue.write({4}));
+  TEST_ASSERT_EQUAL_INT(1, queue.write({5}));
+  queue.stopSenderTask();
+
+  TEST_ASSERT_EQUAL_INT(3, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8(2, server->writesReceived.front()[0]);
+  TEST_ASSERT_EQUAL_INT(1, queue.getStats().dropped);
+  TEST_ASSERT_EQUAL_INT(1, queue.getStats().maxDepth);
+}
+
+template <std::size_t N> void deferred_reply_holds_reliable_slot() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockDeferredPacket> deferredPacket(new MockDeferredPacket(2, true));
+  coms.addPacket(deferredPacket);
+  MAKE_PACKET(NoopPacket, 3, true);
+
+  // The request is pending, so nothing is written, and a retransmission is dropped
+  server->readsToSend.push({2, 0, 1});
+  coms.loop();
+  server->readsToSend.push({2, 0, 1});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(0, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_INT(1, deferredPacket->replies.size());
+
+  // Other ids are still served
+  assertReceiveSend(server, coms, {3, 0, 1}, {3, 0, 0});
+
+  // Completing the reply writes it (with the ACK) on the next loop
+  deferredPacket->replies[0].getPayload()[0] = 42;
+  deferredPacket->replies[0].complete();
+  coms.loop();
+  std::array<std::uint8_t, N> expected{2, 0, 0, 42};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), server->writesReceived.front().data(), N);
+  server->writesReceived.pop();
+
+  // The state machine moved on to the next sequence number
+  server->readsToSend.push({2, 1, 0});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(2, deferredPacket->replies.size());
+}
+
+template <std::size_t N> void deferred_reply_after_remove_is_ignored() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockDeferredPacket> deferredPacket(new MockDeferredPacket(2, false));
+  coms.addPacket(deferredPacket);
+
+  server->readsToSend.push({2, 0, 0});
+  coms.loop();
+  coms.removePacket(2);
+
+  deferredPacket->replies[0].complete();
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(0, server->writesReceived.size());
+}
+
+template <std::size_t N> void deferred_replies_pending_per_route() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockDeferredPacket> deferredPacket(new MockDeferredPacket(2, false));
+  coms.addPacket(deferredPacket);
+
+  // A reply pending to one peer does not hold up the same id for another
+  server->route = 1;
+  server->readsToSend.push({2, 0, 0, 1});
+  coms.loop();
+  server->route = 2;
+  server->readsToSend.push({2, 0, 0, 2});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(2, deferredPacket->replies.size());
+
+  // Each reply goes back to its own peer
+  deferredPacket->replies[1].complete();
+  server->route = 0;
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(2, server->route);
+  TEST_ASSERT_EQUAL_UINT8(2, server->writesReceived.back()[HEADER_LENGTH]);
+  deferredPacket->replies[0].complete();
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, server->route);
+  TEST_ASSERT_EQUAL_UINT8(1, server->writesReceived.back()[HEADER_LENGTH]);
+  TEST_ASSERT_EQUAL_INT(2, server->writesReceived.size());
+}
+
+void scheduler_runs_by_priority() {
+  Scheduler scheduler;
+  std::vector<int> runs;
+  scheduler.addTask("low", [&runs] { runs.push_back(0); }, 0, 1000, 0);
+  scheduler.addTask("high", [&runs] { runs.push_back(2); }, 0, 1000, 2);
+  scheduler.addTask("mid", [&runs] { runs.push_back(1); }, 0, 1000, 1);
+  scheduler.addTask("low2", [&runs] { runs.push_back(3); }, 0, 1000, 0);
+
+  TEST_ASSERT_EQUAL_INT(4, scheduler.loop());
+  std::array<int, 4> expected{2, 1, 0, 3};
+  TEST_ASSERT_EQUAL_INT(expected.size(), runs.size());
+  TEST_ASSERT_TRUE(std::equal(expected.begin(), expected.end(), runs.begin()));
+}
+
+void scheduler_counts_overruns() {
+  VirtualClock clock;
+  Scheduler scheduler{clock};
+  std::size_t overrunTask = SIZE_MAX;
+  scheduler.setOverrunCallback([&overrunTask](std::size_t task, time_t) { overrunTask = task; });
+  const std::size_t task = scheduler.addTask("slow", [&clock] { clock.advance(150); }, 1000, 100);
+
+  scheduler.loop();
+  TEST_ASSERT_EQUAL_INT(1, scheduler.getStats(task).runs);
+  TEST_ASSERT_EQUAL_INT(1, scheduler.getStats(task).overruns);
+  TEST_ASSERT_EQUAL_INT(150, scheduler.getStats(task).maxRuntime);
+  TEST_ASSERT_EQUAL_INT(task, overrunTask);
+}
+
+void scheduler_waits_for_period() {
+  VirtualClock clock;
+  Scheduler scheduler{clock};
+  const std::size_t task = scheduler.addTask("periodic", [] {}, 1000, 100);
+
+  TEST_ASSERT_EQUAL_INT(1, scheduler.loop());
+  clock.advance(999);
+  TEST_ASSERT_EQUAL_INT(0, scheduler.loop());
+  TEST_ASSERT_EQUAL_INT(1, scheduler.getTimeUntilNextTask());
+
+  // Started 20 late
+  clock.advance(21);
+  TEST_ASSERT_EQUAL_INT(1, scheduler.loop());
+  TEST_ASSERT_EQUAL_INT(20, scheduler.getStats(task).maxLateness);
+}
+
+void scheduler_adapts_period() {
+  VirtualClock clock;
+  Scheduler scheduler{clock};
+  bool busy = false;
+  const std::size_t task =
+    scheduler.addAdaptiveTask("adaptive", [&busy] { return busy; }, 0, 8, 100);
+
+  // Idle: the period doubles up to the maximum
+  std::array<time_t, 5> expected{1, 2, 4, 8, 8};
+  for (auto &&period : expected) {
+    simulate(scheduler, clock, scheduler.getPeriod(task) + 1);
+    TEST_ASSERT_EQUAL_INT(period, scheduler.getPeriod(task));
+  }
+
+  // Busy: straight back to the minimum
+  busy = true;
+  simulate(scheduler, clock, 9);
+  TEST_ASSERT_EQUAL_INT(0, scheduler.getPeriod(task));
+}
+
+template <std::size_t N> void stream_server_round_trip() {
+  MockByteStream *stream = new MockByteStream();
+  MockByteStream *peer = new MockByteStream();
+  StreamServer<N> server{std::unique_ptr<ByteStream>(stream)};
+  StreamServer<N> client{std::unique_ptr<ByteStream>(peer)};
+
+  // Log text between frames must not corrupt them
+  const char *noise = "log line\n";
+  stream->bytesToRead.insert(stream->bytesToRead.end(), noise, noise + std::strlen(noise));
+
+  client.write({2, 0, 1, 0, 42});
+  stream->bytesToRead.insert(
+    stream->bytesToRead.end(), peer->bytesWritten.begin(), peer->bytesWritten.end());
+
+  bool available = false;
+  server.isDataAvailable(available);
+  TEST_ASSERT_TRUE(available);
+
+  std::array<std::uint8_t, N> frame;
+  TEST_ASSERT_EQUAL_INT(1, server.read(frame));
+  std::array<std::uint8_t, N> expected{2, 0, 1, 0, 42};
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), frame.data(), N);
+  TEST_ASSERT_EQUAL_INT(1, server.getStats().framingErrors);
+}
+
+template <std::size_t N> void stream_server_drops_bad_crc() {
+  MockByteStream *stream = new MockByteStream();
+  MockByteStream *peer = new MockByteStream();
+  StreamServer<N> server{std::unique_ptr<ByteStream>(stream)};
+  StreamServer<N> client{std::unique_ptr<ByteStream>(peer)};
+
+  client.write({2, 0, 1});
+  // Flip a bit in the middle of the encoded frame
+  peer->bytesWritten[peer->bytesWritten.size() / 2] ^= 0x10;
+  stream->bytesToRead.insert(
+    stream->bytesToRead.end(), peer->bytesWritten.begin(), peer->bytesWritten.end());
+
+  bool available = true;
+  server.isDataAvailable(available);
+  TEST_ASSERT_FALSE(available);
+  TEST_ASSERT_EQUAL_INT(1, server.getStats().crcErrors + server.getStats().framingErrors);
+}
+
+void crc32_known_answer() {
+  const char *check = "123456789";
+  TEST_ASSERT_EQUAL_UINT32(0xCBF43926, crc32(reinterpret_cast<const std::uint8_t *>(check), 9));
+}
+
+template <std::size_t N> void stream_server_reports_stream_errors() {
+  MockByteStream *stream = new MockByteStream();
+  StreamServer<N> server{std::unique_ptr<ByteStream>(stream)};
+
+  // The frame is queued even though the stream fails to take it
+  stream->failWrites = true;
+  TEST_ASSERT_EQUAL_INT(1, server.write({2}));
+  TEST_ASSERT_TRUE(server.getPendingTxBytes() > 0);
+  bool available = true;
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, server.isDataAvailable(available));
+  TEST_ASSERT_EQUAL_INT(EIO, errno);
+  TEST_ASSERT_FALSE(available);
+
+  // And sent once it recovers
+  stream->failWrites = false;
+  TEST_ASSERT_EQUAL_INT(1, server.pump());
+  TEST_ASSERT_EQUAL_INT(0, server.getPendingTxBytes());
+  TEST_ASSERT_TRUE(stream->bytesWritten.size() > N);
+}
+
+template <std::size_t N> void lossless_server_skips_ack_state_machine() {
+  SETUP_BOWLER_COMS;
+  server->lossless = true;
+  std::shared_ptr<MockPacket> mockPacket(new MockPacket(2, true));
+  coms.addPacket(mockPacket);
+
+  // Every request is handled and ACKed with its own sequence number, even out of alternation
+  assertReceiveSend(server, coms, {2, 1, 0, 7}, {2, 1, 1, 7});
+  assertReceiveSend(server, coms, {2, 1, 0, 8}, {2, 1, 1, 8});
+  assertReceiveSend(server, coms, {2, 0, 1, 9}, {2, 0, 0, 9});
+  TEST_ASSERT_EQUAL_INT(3, mockPacket->payloads.size());
+}
+
+template <std::size_t N> void multi_server_routes_replies() {
+  VirtualClock clock;
+  MockBowlerServer<N> *wireless = new MockBowlerServer<N>();
+  MockBowlerServer<N> *wired = new MockBowlerServer<N>();
+  MultiBowlerServer<N> *multi = new MultiBowlerServer<N>(0, clock);
+  multi->addServer(std::unique_ptr<MockBowlerServer<N>>(wireless));
+  multi->addServer(std::unique_ptr<MockBowlerServer<N>>(wired));
+  DefaultBowlerComs<N> coms{std::unique_ptr<MultiBowlerServer<N>>(multi), clock};
+  MAKE_PACKET(NoopPacket, 2, true);
+  std::shared_ptr<MockDeferredPacket> deferredPacket(new MockDeferredPacket(3));
+  coms.addPacket(deferredPacket);
+
+  // Both links start their own sequence at 0 and take turns, even though one has more queued
+  wireless->readsToSend.push({2, 0, 1});
+  wireless->readsToSend.push({2, 1, 0});
+  wired->readsToSend.push({2, 0, 1});
+  coms.loop();
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, wireless->writesReceived.size());
+  TEST_ASSERT_EQUAL_INT(1, wired->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8(0, wired->writesReceived.front()[2]);
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(2, wireless->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8(1, wireless->writesReceived.back()[2]);
+
+  // A deferred reply goes back to the link its request came from
+  wired->readsToSend.push({3, 0, 0});
+  coms.loop();
+  wireless->readsToSend.push({2, 0, 1});
+  coms.loop();
+  deferredPacket->replies[0].complete();
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(3, wireless->writesReceived.size());
+  TEST_ASSERT_EQUAL_INT(2, wired->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8(3, wired->writesReceived.back()[0]);
+}
+
+template <std::size_t N> void multi_server_backs_off_idle_servers() {
+  VirtualClock clock;
+  MockBowlerServer<N> *idle = new MockBowlerServer<N>();
+  MultiBowlerServer<N> multi{64, clock};
+  multi.addServer(std::unique_ptr<MockBowlerServer<N>>(idle));
+
+  // Polled once, then left alone for 16, 32, and at most 64 time units
+  bool available;
+  multi.isDataAvailable(available);
+  TEST_ASSERT_EQUAL_INT(1, multi.getStats(0).polls);
+  std::array<time_t, 4> waits{16, 32, 64, 64};
+  std::uint32_t polls = 1;
+  for (auto &&wait : waits) {
+    clock.advance(wait - 1);
+    multi.isDataAvailable(available);
+    TEST_ASSERT_EQUAL_INT(polls, multi.getStats(0).polls);
+    clock.advance(1);
+    multi.isDataAvailable(available);
+    TEST_ASSERT_EQUAL_INT(++polls, multi.getStats(0).polls);
+  }
+
+  // Data resets the backoff
+  idle->readsToSend.push({2});
+  clock.advance(64);
+  multi.isDataAvailable(available);
+  TEST_ASSERT_TRUE(available);
+  TEST_ASSERT_EQUAL_INT(0, multi.getStats(0).idleBackoff);
+}
+
+template <std::size_t N> void channel_demux_routes_by_channel() {
+  MockBowlerServer<N + 1> *server = new MockBowlerServer<N + 1>();
+  ChannelDemux<N> demux{std::unique_ptr<MockBowlerServer<N + 1>>(server)};
+  DefaultBowlerComs<N> motion{demux.openChannel(0)};
+  DefaultBowlerComs<N> diagnostics{demux.openChannel(1)};
+  TEST_ASSERT_TRUE(demux.openChannel(1) == nullptr);
+  std::shared_ptr<MockPacket> motionPacket(new MockPacket(2));
+  std::shared_ptr<MockPacket> diagnosticsPacket(new MockPacket(2));
+  motion.addPacket(motionPacket);
+  diagnostics.addPacket(diagnosticsPacket);
+
+  // Both requests arrive before the motion coms runs; it queues the diagnostics one
+  server->readsToSend.push({1, 2, 0, 0, 7});
+  server->readsToSend.push({0, 2, 0, 0, 8});
+  server->readsToSend.push({5, 2, 0, 0, 9});
+  motion.loop();
+  TEST_ASSERT_EQUAL_INT(1, motionPacket->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(8, motionPacket->payloads[0][0]);
+  TEST_ASSERT_EQUAL_UINT8(0, server->writesReceived.front()[0]);
+  server->writesReceived.pop();
+
+  diagnostics.loop();
+  TEST_ASSERT_EQUAL_INT(1, diagnosticsPacket->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(7, diagnosticsPacket->payloads[0][0]);
+  TEST_ASSERT_EQUAL_UINT8(1, server->writesReceived.front()[0]);
+  TEST_ASSERT_EQUAL_UINT8(2, server->writesReceived.front()[1]);
+
+  // Nobody opened channel 5
+  TEST_ASSERT_EQUAL_INT(1, demux.getStats().unknownChannel);
+  server->writesReceived.pop();
+
+  // A multicast request is handled without a reply, even when the next frame is unicast
+  server->multicast = true;
+  server->readsToSend.push({0, 2, 0, 0, 10});
+  diagnostics.loop();
+  server->multicast = false;
+  motion.loop();
+  TEST_ASSERT_EQUAL_INT(2, motionPacket->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(10, motionPacket->payloads[1][0]);
+  TEST_ASSERT_EQUAL_INT(0, server->writesReceived.size());
+
+  auto channel = demux.openChannel(2);
+  TEST_ASSERT_FALSE(channel->isLossless());
+  server->lossless = true;
+  TEST_ASSERT_TRUE(channel->isLossless());
+}
+
+template <std::size_t N> void gateway_routes_by_device_address() {
+  MockBowlerServer<N + 1> *upstream = new MockBowlerServer<N + 1>();
+  MockBowlerServer<N> *arm = new MockBowlerServer<N>();
+  MockBowlerServer<N> *base = new MockBowlerServer<N>();
+  BowlerGateway<N> gateway{std::unique_ptr<MockBowlerServer<N + 1>>(upstream)};
+  gateway.addDevice(4, std::unique_ptr<MockBowlerServer<N>>(arm));
+  gateway.addDevice(9, std::unique_ptr<MockBowlerServer<N>>(base));
+  TEST_ASSERT_TRUE(gateway.addDevice(9, std::unique_ptr<MockBowlerServer<N>>(
+                     new MockBowlerServer<N>())) == BOWLER_ERROR);
+
+  upstream->route = 3;
+  upstream->readsToSend.push({9, 2, 0, 1, 7});
+  upstream->readsToSend.push({5, 2, 0, 1, 8});
+  TEST_ASSERT_EQUAL_INT(2, gateway.poll());
+  TEST_ASSERT_EQUAL_INT(0, arm->writesReceived.size());
+  TEST_ASSERT_EQUAL_INT(1, base->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8(2, base->writesReceived.front()[0]);
+  TEST_ASSERT_EQUAL_UINT8(7, base->writesReceived.front()[3]);
+  TEST_ASSERT_EQUAL_INT(1, gateway.getStats().unknownDevice);
+
+  // The reply goes back to the route its request came from, prefixed with the device's address
+  upstream->route = 0;
+  base->readsToSend.push({2, 0, 0, 7});
+  TEST_ASSERT_EQUAL_INT(1, gateway.poll());
+  TEST_ASSERT_EQUAL_INT(3, upstream->route);
+  TEST_ASSERT_EQUAL_UINT8(9, upstream->writesReceived.front()[0]);
+  TEST_ASSERT_EQUAL_UINT8(2, upstream->writesReceived.front()[1]);
+  TEST_ASSERT_EQUAL_UINT8(7, upstream->writesReceived.front()[4]);
+}
+
+template <std::size_t N> void multicast_runs_commands_without_replying() {
+  SETUP_BOWLER_COMS;
+  std::shared_ptr<MockPacket> mockPacket(new MockPacket(2, true));
+  coms.addPacket(mockPacket);
+  server->multicast = true;
+
+  // Fan-out commands run on every copy, regardless of the sequence number, and are not answered
+  server->readsToSend.push({2, 1, 0, 7});
+  coms.loop();
+  server->readsToSend.push({2, 1, 0, 8});
+  coms.loop();
+  server->readsToSend.push({9, 0, 0});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(2, mockPacket->payloads.size());
+  TEST_ASSERT_EQUAL_INT(0, server->writesReceived.size());
+
+  // A disconnect must not reach every device at once
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_DISCONNECT_ID});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, coms.getAllPacketIDs().size());
+
+  // Discovery is answered with the packet size and the ids
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_DISCOVER});
+  coms.loop();
+  std::array<std::uint8_t, 8> expected{
+    SERVER_MANAGEMENT_PACKET_ID, 0, 0, STATUS_ACCEPTED, N & 0xFF, N >> 8, 1, 2};
+  TEST_ASSERT_EQUAL_INT(1, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(
+    expected.data(), server->writesReceived.front().data(), expected.size());
+}
+
+#if defined(PLATFORM_NATIVE)
+template <std::size_t N> void multicast_discovery_on_loopback() {
+  const std::size_t deviceCount = 3;
+  std::vector<LinuxUDPServer<N> *> servers;
+  std::vector<std::unique_ptr<DefaultBowlerComs<N>>> devices;
+  std::vector<std::shared_ptr<MockPacket>> packets;
+  for (std::size_t i = 0; i < deviceCount; i++) {
+    LinuxUDPServer<N> *server = new LinuxUDPServer<N>(0);
+    TEST_ASSERT_EQUAL_INT(1, server->begin(htonl(INADDR_LOOPBACK)));
+    TEST_ASSERT_EQUAL_INT(1,
+                          server->joinMulticastGroup(htonl(BOWLER_SERVER_MULTICAST_GROUP),
+                                                     BOWLER_SERVER_MULTICAST_PORT,
+                                                     htonl(INADDR_LOOPBACK)));
+    servers.push_back(server);
+    devices.emplace_back(new DefaultBowlerComs<N>(std::unique_ptr<LinuxUDPServer<N>>(server)));
+    packets.emplace_back(new MockPacket(2 + i));
+    devices.back()->addPacket(packets.back());
+  }
+
+  const int host = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  in_addr loopback{htonl(INADDR_LOOPBACK)};
+  setsockopt(host, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback));
+  sockaddr_in group{};
+  group.sin_family = AF_INET;
+  group.sin_port = htons(BOWLER_SERVER_MULTICAST_PORT);
+  group.sin_addr.s_addr = htonl(BOWLER_SERVER_MULTICAST_GROUP);
+  auto sendToGroup = [&](const std::array<std::uint8_t, N> &iframe) {
+    sendto(host, iframe.data(), N, 0, reinterpret_cast<sockaddr *>(&group), sizeof(group));
+    for (int i = 0; i < 10; i++) {
+      for (auto &&device : devices) {
+        device->loop();
+      }
+      delay(1);
+    }
+  };
+
+  // One datagram reaches every device, and each answers from its own unicast port
+  sendToGroup({SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_DISCOVER});
+  std::vector<std::uint16_t> ports;
+  std::array<std::uint8_t, N> reply;
+  sockaddr_in from{};
+  socklen_t fromLength = sizeof(from);
+  while (recvfrom(host, reply.data(), N, 0, reinterpret_cast<sockaddr *>(&from), &fromLength) ==
+         ssize_t(N)) {
+    TEST_ASSERT_EQUAL_UINT8(1, reply[HEADER_LENGTH + 3]);
+    ports.push_back(ntohs(from.sin_port));
+    fromLength = sizeof(from);
+  }
+
+  TEST_ASSERT_EQUAL_INT(deviceCount, ports.size());
+  for (auto &&server : servers) {
+    TEST_ASSERT_TRUE(std::find(ports.begin(), ports.end(), server->getPort()) != ports.end());
+  }
+
+  // A fan-out command runs on the device that has the packet
+  sendToGroup({3, 0, 0, 42});
+  TEST_ASSERT_EQUAL_INT(0, packets[0]->payloads.size());
+  TEST_ASSERT_EQUAL_INT(1, packets[1]->payloads.size());
+  TEST_ASSERT_EQUAL_UINT8(42, packets[1]->payloads[0][0]);
+  close(host);
+}
+
+template <std::size_t N> void device_simulator_serves_many_devices() {
+  const std::size_t deviceCount = 24;
+  DeviceSimulator<N> simulator(3);
+  // Each device has a different packet
+  auto setup = [](std::size_t idevice, DefaultBowlerComs<N> &icoms) {
+    icoms.addPacket(std::shared_ptr<BusyPacket>(new BusyPacket(2 + idevice % 3, false, 10)));
+  };
+  for (std::size_t i = 0; i < deviceCount; i++) {
+    TEST_ASSERT_EQUAL_INT(i, simulator.addDevice(htonl(INADDR_LOOPBACK), 0, setup));
+  }
+  TEST_ASSERT_EQUAL_INT(1, simulator.start());
+
+  const int host = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (std::size_t i = 0; i < deviceCount; i++) {
+    const std::array<std::uint8_t, N> request{std::uint8_t(2 + i % 3), 0, 0, std::uint8_t(i)};
+    address.sin_port = htons(simulator.getPort(i));
+    sendto(host, request.data(), N, 0, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  }
+
+  // Every device echoes its own request from its own port
+  std::vector<bool> replied(deviceCount);
+  pollfd pollFd{host, POLLIN, 0};
+  std::array<std::uint8_t, N> reply;
+  sockaddr_in from{};
+  socklen_t fromLength = sizeof(from);
+  for (std::size_t i = 0; i < deviceCount && poll(&pollFd, 1, 1000) > 0; i++) {
+    fromLength = sizeof(from);
+    TEST_ASSERT_EQUAL_INT(
+      N, recvfrom(host, reply.data(), N, 0, reinterpret_cast<sockaddr *>(&from), &fromLength));
+    const std::size_t device = reply[3];
+    TEST_ASSERT_TRUE(device < deviceCount);
+    TEST_ASSERT_EQUAL_UINT8(2 + device % 3, reply[0]);
+    TEST_ASSERT_EQUAL_UINT16(simulator.getPort(device), ntohs(from.sin_port));
+    replied[device] = true;
+  }
+
+  TEST_ASSERT_EQUAL_INT(deviceCount, std::count(replied.begin(), replied.end(), true));
+  TEST_ASSERT_EQUAL_INT(deviceCount, simulator.getStats().requests);
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, simulator.addDevice(htonl(INADDR_LOOPBACK), 0, setup));
+  TEST_ASSERT_EQUAL_INT(EBUSY, errno);
+  simulator.stop();
+  close(host);
+}
+#endif
+
+#if !defined(BOWLER_DISABLE_METRICS)
+template <std::size_t N> void metrics_count_requests_and_duplicates() {
+  SETUP_BOWLER_COMS;
+  MAKE_PACKET(NoopPacket, 2, true);
+
+  assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 0});
+  // A retransmission of seqnum 0
+  assertReceiveSend(server, coms, {2, 0, 1}, {2, 0, 0});
+
+  const PacketMetrics *metrics = coms.getMetrics()->get(2);
+  TEST_ASSERT_EQUAL_INT(2, metrics->requests.load());
+  TEST_ASSERT_EQUAL_INT(2, metrics->replies.load());
+  TEST_ASSERT_EQUAL_INT(1, metrics->duplicates.load());
+  TEST_ASSERT_EQUAL_INT(2 * N, metrics->bytesSent.load());
+
+  // The management packet returns them in compact form; the one event landed in one bucket
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_GET_METRICS, 2, 0});
+  coms.loop();
+  const auto &reply = server->writesReceived.front();
+  const std::size_t histogram = HEADER_LENGTH + 1 + ComsMetrics::FIXED_LENGTH - 2;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, reply[HEADER_LENGTH]);
+  TEST_ASSERT_EQUAL_UINT8(2, reply[HEADER_LENGTH + 1]);
+  TEST_ASSERT_EQUAL_UINT8(2, reply[HEADER_LENGTH + 2]);
+  TEST_ASSERT_EQUAL_UINT8(1, reply[HEADER_LENGTH + 14]);
+  TEST_ASSERT_EQUAL_UINT8(ComsMetrics::NO_MORE_BUCKETS, reply[histogram]);
+  TEST_ASSERT_EQUAL_UINT8(1, reply[histogram + 1]);
+  TEST_ASSERT_EQUAL_UINT8(1, reply[histogram + 3]);
+}
+#endif
+
+void latency_histogram_buckets() {
+  TEST_ASSERT_EQUAL_INT(3, LatencyHistogram::getBucket(3));
+  for (time_t value : {4, 5, 7, 8, 100, 1000, 123456, 1 << 24}) {
+    const std::size_t bucket = LatencyHistogram::getBucket(value);
+    TEST_ASSERT_TRUE(LatencyHistogram::getLowerBound(bucket) <= value);
+    TEST_ASSERT_TRUE(LatencyHistogram::getLowerBound(bucket + 1) > value);
+  }
+
+  TEST_ASSERT_EQUAL_INT(LatencyHistogram::BUCKET_COUNT - 1,
+                        LatencyHistogram::getBucket(time_t(1) << 40));
+}
+
+template <std::size_t N> void clock_sync_echoes_device_times() {
+  VirtualClock clock(1000);
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server), clock};
+
+  std::array<std::uint8_t, N> request{SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_CLOCK_SYNC};
+  writeTimestamp(request.data() + HEADER_LENGTH + 1, 123456789012LL);
+  server->readsToSend.push(request);
+  coms.loop();
+
+  const auto &reply = server->writesReceived.front();
+  const std::uint8_t *payload = reply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+  TEST_ASSERT_TRUE(readTimestamp(payload + 1) == 123456789012LL);
+  TEST_ASSERT_TRUE(readTimestamp(payload + 1 + TIMESTAMP_LENGTH) == 1000);
+  TEST_ASSERT_TRUE(readTimestamp(payload + 1 + 2 * TIMESTAMP_LENGTH) == 1000);
+}
+
+void clock_sync_estimator_finds_offset_and_drift() {
+  // The device runs 100 ppm fast and 5000 ahead. The uplink is 50 and the downlink 50, except
+  // that every other request queues for an extra 400 on the way up.
+  ClockSyncEstimator estimator(8);
+  const auto device = [](std::int64_t ihost) { return 5000 + ihost + ihost / 10000; };
+  for (std::int64_t t1 = 0; t1 < 80000; t1 += 10000) {
+    const std::int64_t uplink = (t1 / 10000) % 2 == 0 ? 50 : 450;
+    const std::int64_t t2 = device(t1 + uplink);
+    const std::int64_t t3 = t2 + 10;
+    const std::int64_t t4 = t1 + uplink + 10 + 50;
+    estimator.addSample(t1, t2, t3, t4);
+  }
+
+  TEST_ASSERT_EQUAL_INT(8, estimator.getSampleCount());
+  TEST_ASSERT_EQUAL_INT(100, estimator.getDelay());
+  TEST_ASSERT_TRUE(std::abs(estimator.getDriftPpm() - 100) < 5);
+  TEST_ASSERT_TRUE(std::abs(estimator.getOffsetAt(100000) - (device(100000) - 100000)) < 5);
+}
+
+#if !defined(BOWLER_DISABLE_METRICS)
+template <std::size_t N> void timestamp_mode_measures_link_latency() {
+  VirtualClock clock(10000);
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(server), clock};
+  MAKE_PACKET(NoopPacket, 2, false);
+  std::shared_ptr<MockPacket> mockPacket(new MockPacket(3, false));
+  coms.addPacket(mockPacket);
+
+  // The device is 2000 ahead of the host
+  std::array<std::uint8_t, N> enable{
+    SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_SET_TIMESTAMP_MODE, 1};
+  writeTimestamp(enable.data() + HEADER_LENGTH + 2, 2000);
+  server->readsToSend.push(enable);
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, server->writesReceived.front()[HEADER_LENGTH]);
+  server->writesReceived.pop();
+
+  // Sent at host time 7970, so it took 30 to arrive
+  std::array<std::uint8_t, N> request{2, 0, 0};
+  writeTimestamp(request.data() + N - TIMESTAMP_LENGTH, 7970);
+  server->readsToSend.push(request);
+  coms.loop();
+
+  const auto &reply = server->writesReceived.front();
+  TEST_ASSERT_TRUE(readTimestamp(reply.data() + N - TIMESTAMP_LENGTH) == 8000);
+  const ComsMetrics *metrics = coms.getMetrics();
+  TEST_ASSERT_EQUAL_INT(1, metrics->getUplinkLatency()->getCount(LatencyHistogram::getBucket(30)));
+  TEST_ASSERT_EQUAL_INT(1, metrics->getResidenceTime()->getCount(0));
+  server->writesReceived.pop();
+
+  // A packet which does not leave the trailer free keeps its whole payload
+  std::array<std::uint8_t, N> untouched{3, 0, 0};
+  std::fill(untouched.begin() + HEADER_LENGTH, untouched.end(), 0x5A);
+  server->readsToSend.push(untouched);
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(untouched.data(), server->writesReceived.front().data(), N);
+  TEST_ASSERT_EQUAL_INT(1, metrics->getUplinkLatency()->getTotal());
+}
+#endif
+
+void binary_log_formats_when_drained() {
+  BinaryLog log;
+  const std::uint16_t format = log.intern("file.cpp", 12, "id %u: %d %s %.1f %lx%%\n");
+  TEST_ASSERT_TRUE(log.log(format, std::uint8_t(7), -3, "oops", 2.5, 0xABCDu));
+
+  std::vector<std::string> messages;
+  const auto print = [&](const char *imessage) { messages.push_back(imessage); };
+  TEST_ASSERT_EQUAL_INT(1, log.drain(print, 8));
+  TEST_ASSERT_EQUAL_STRING("file.cpp:12: id 7: -3 oops 2.5 abcd%\n", messages[0].c_str());
+
+  // A full ring drops new records instead of blocking
+  for (std::size_t i = 0; i < BinaryLog::CAPACITY + 3; i++) {
+    log.log(format, 1, 2, "x", 3.0, 4);
+  }
+  TEST_ASSERT_EQUAL_INT(3, log.getDropped());
+}
+
+template <std::size_t N> void binary_log_read_by_host() {
+  SETUP_BOWLER_COMS;
+  BinaryLog &log = getBinaryLog();
+  const std::uint16_t format = log.intern("dir/file.cpp", 34, "write failed: %d %s\n");
+  log.log(format, 5, "I/O error");
+
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_READ_LOG});
+  coms.loop();
+  const auto records = server->writesReceived.front();
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, records[HEADER_LENGTH]);
+
+  BinaryLogDecoder decoder;
+  std::vector<BinaryLogDecoder::Record> decoded;
+  TEST_ASSERT_EQUAL_INT(
+    0, decoder.parseRecords(records.data() + HEADER_LENGTH + 1, N - HEADER_LENGTH - 1, decoded));
+  TEST_ASSERT_EQUAL_INT(1, decoded.size());
+  TEST_ASSERT_FALSE(decoder.hasFormat(format));
+
+  // The management packet is reliable, so the next request has the next seqnum
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID,
+                            1,
+                            0,
+                            OPERATION_GET_LOG_FORMAT,
+                            std::uint8_t(format & 0xFF),
+                            std::uint8_t(format >> 8)});
+  coms.loop();
+  const auto &reply = server->writesReceived.front();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, reply[HEADER_LENGTH]);
+  decoder.addFormat(format, reply.data() + HEADER_LENGTH + 1, N - HEADER_LENGTH - 1);
+  TEST_ASSERT_EQUAL_STRING("dir/file.cpp:34: write failed: 5 I/O error\n",
+                           decoder.format(decoded[0]).c_str());
+  server->writesReceived.pop();
+
+  // A lost reply is read again, as the host has not acknowledged it, and the decoder skips what it
+  // already has
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_READ_LOG});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(1, server->writesReceived.front()[HEADER_LENGTH + 1 + 8]);
+  decoder.parseRecords(
+    server->writesReceived.front().data() + HEADER_LENGTH + 1, N - HEADER_LENGTH - 1, decoded);
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_INT(1, decoded.size());
+
+  // Acknowledged records are gone
+  TEST_ASSERT_EQUAL_INT(1, decoder.getNextRecord());
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID, 1, 0, OPERATION_READ_LOG, 1});
+  coms.loop();
+  TEST_ASSERT_EQUAL_UINT8(0, server->writesReceived.front()[HEADER_LENGTH + 1 + 8]);
+  TEST_ASSERT_TRUE(log.peek() == nullptr);
+}
+
+template <std::size_t N> void scheduler_profile_over_protocol() {
+  VirtualClock clock;
+  Scheduler scheduler{clock};
+  scheduler.setTargetPeriod(500);
+  // A task that takes 100 on every loop, and 300 of caller code between loops
+  const std::size_t task = scheduler.addTask("work", [&clock] { clock.advance(100); }, 0, 1000);
+  for (int i = 0; i < 10; i++) {
+    scheduler.loop();
+    clock.advance(300);
+  }
+
+  const LoopStats &loop = scheduler.getLoopStats();
+  TEST_ASSERT_EQUAL_INT(10, loop.loops);
+  TEST_ASSERT_EQUAL_INT(400, loop.minInterval);
+  TEST_ASSERT_EQUAL_INT(100, loop.maxJitter);
+  TEST_ASSERT_EQUAL_INT(300, loop.maxGap);
+  TEST_ASSERT_EQUAL_INT(100, scheduler.getStats(task).minRuntime);
+  TEST_ASSERT_EQUAL_INT(LatencyHistogram::getLowerBound(LatencyHistogram::getBucket(100)),
+                        scheduler.getRuntimes(task).getPercentile(0.99));
+
+  SETUP_BOWLER_COMS;
+  coms.setScheduler(&scheduler);
+  server->readsToSend.push(
+    {SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_GET_PROFILE, Scheduler::LOOP_PROFILE, 0});
+  coms.loop();
+  const auto loopReply = server->writesReceived.front();
+  server->writesReceived.pop();
+  const std::uint8_t *payload = loopReply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+  TEST_ASSERT_EQUAL_UINT8(1, payload[1]);
+  TEST_ASSERT_EQUAL_UINT8(10, payload[2]);
+  // A quarter of the time is spent in the task
+  TEST_ASSERT_EQUAL_INT(250, payload[6] | (payload[7] << 8));
+
+  server->readsToSend.push(
+    {SERVER_MANAGEMENT_PACKET_ID, 1, 0, OPERATION_GET_PROFILE, std::uint8_t(task), 1});
+  coms.loop();
+  const auto &taskReply = server->writesReceived.front();
+  payload = taskReply.data() + HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, payload[0]);
+  TEST_ASSERT_EQUAL_UINT8(10, payload[1]);
+  TEST_ASSERT_EQUAL_UINT8(4, payload[1 + Scheduler::TASK_PROFILE_LENGTH - 1]);
+  TEST_ASSERT_EQUAL_UINT8('w', payload[1 + Scheduler::TASK_PROFILE_LENGTH]);
+
+  // The reset flag started a new window
+  TEST_ASSERT_EQUAL_INT(0, scheduler.getLoopStats().loops);
+  TEST_ASSERT_EQUAL_INT(0, scheduler.getRuntimes(task).getTotal());
+}
+
+#if !defined(BOWLER_DISABLE_CAPTURE)
+template <std::size_t N> void capture_streams_pcap_through_coms() {
+  VirtualClock clock(2500000);
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  auto *capture = new CaptureBowlerServer<N>(std::unique_ptr<BowlerServer<N>>(server), 4, clock);
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(capture), clock};
+  coms.setCapture(capture);
+  MAKE_PACKET(NoopPacket, 2, false);
+
+  server->readsToSend.push({2, 0, 0, 42});
+  coms.loop();
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_INT(2, capture->size());
+
+  // Pull the pcap stream in chunks until an empty one ends it
+  std::vector<std::uint8_t> pcap;
+  for (std::uint8_t seq = 0;; seq ^= 1) {
+    const std::uint32_t offset = pcap.size();
+    server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID,
+                              seq,
+                              0,
+                              OPERATION_READ_CAPTURE,
+                              std::uint8_t(offset),
+                              std::uint8_t(offset >> 8)});
+    coms.loop();
+    const auto reply = server->writesReceived.front();
+    server->writesReceived.pop();
+    TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, reply[HEADER_LENGTH]);
+    const std::uint8_t length = reply[HEADER_LENGTH + 1];
+    if (length == 0) {
+      break;
+    }
+    const auto chunk = reply.begin() + HEADER_LENGTH + 2;
+    pcap.insert(pcap.end(), chunk, chunk + length);
+  }
+
+  // The first request for the capture was recorded before the dump paused capture
+  const std::size_t record = CaptureBowlerServer<N>::PCAP_RECORD_HEADER_LENGTH + 5 + N;
+  TEST_ASSERT_EQUAL_INT(CaptureBowlerServer<N>::PCAP_HEADER_LENGTH + 3 * record, pcap.size());
+  TEST_ASSERT_EQUAL_UINT8(0xD4, pcap[0]);
+  TEST_ASSERT_EQUAL_UINT8(BOWLER_PCAP_LINKTYPE, pcap[20]);
+
+  // The request, at 2.5 s
+  const std::uint8_t *first = pcap.data() + CaptureBowlerServer<N>::PCAP_HEADER_LENGTH;
+  TEST_ASSERT_EQUAL_UINT8(2, first[0]);
+  TEST_ASSERT_EQUAL_INT(500000, first[4] | (first[5] << 8) | (first[6] << 16));
+  TEST_ASSERT_EQUAL_UINT8(CAPTURE_IN, first[16]);
+  TEST_ASSERT_EQUAL_UINT8(2, first[21]);
+  TEST_ASSERT_EQUAL_UINT8(42, first[24]);
+  TEST_ASSERT_EQUAL_UINT8(CAPTURE_OUT, first[record + 16]);
+}
+
+template <std::size_t N> void capture_dump_rereads_and_times_out() {
+  VirtualClock clock(0);
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  CaptureBowlerServer<N> capture{std::unique_ptr<BowlerServer<N>>(server), 4, clock, 1000};
+  capture.write({2});
+  capture.write({3});
+  const std::uint32_t header = CaptureBowlerServer<N>::PCAP_HEADER_LENGTH;
+  const std::uint32_t record = CaptureBowlerServer<N>::PCAP_RECORD_HEADER_LENGTH + 5 + N;
+
+  // A chunk can be read again until the next read starts past it
+  std::array<std::uint8_t, 512> first;
+  std::array<std::uint8_t, 512> again;
+  TEST_ASSERT_EQUAL_INT(header + 10, capture.readPcap(0, first.data(), header + 10));
+  TEST_ASSERT_EQUAL_INT(10, capture.readPcap(header, again.data(), 10));
+  TEST_ASSERT_EQUAL_INT(10, capture.readPcap(header, again.data(), 10));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(first.data() + header, again.data(), 10);
+  TEST_ASSERT_EQUAL_INT(2, capture.size());
+  TEST_ASSERT_EQUAL_INT(record, capture.readPcap(header + record, again.data(), again.size()));
+  TEST_ASSERT_EQUAL_UINT8(3, again[21]);
+  TEST_ASSERT_EQUAL_INT(1, capture.size());
+
+  // Freed data is gone, and nothing is captured during the dump
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, capture.readPcap(header, again.data(), again.size()));
+  TEST_ASSERT_EQUAL_INT(EINVAL, errno);
+  capture.write({4});
+  TEST_ASSERT_EQUAL_INT(1, capture.size());
+
+  // The host went away, so capture resumes
+  clock.advance(1000);
+  capture.write({5});
+  TEST_ASSERT_EQUAL_INT(2, capture.size());
+  TEST_ASSERT_EQUAL_INT(1, capture.getStats().abandoned);
+
+  // The end of a dump can be asked for again
+  const std::uint32_t end = header + 2 * record;
+  TEST_ASSERT_EQUAL_INT(header, capture.readPcap(0, again.data(), header));
+  TEST_ASSERT_EQUAL_INT(0, capture.readPcap(end, again.data(), again.size()));
+  TEST_ASSERT_EQUAL_INT(0, capture.readPcap(end, again.data(), again.size()));
+  TEST_ASSERT_EQUAL_INT(0, capture.size());
+}
+#endif
+
+#if defined(PLATFORM_NATIVE)
+template <std::size_t N> void trace_log_writes_chrome_json() {
+  VirtualClock clock(1000);
+  TraceLog log{clock};
+  {
+    TraceScope outer("coms", "request", TraceLog::NO_ARGUMENT, log);
+    clock.advance(5);
+    TraceScope inner("handler", "event", 2, log);
+    clock.advance(20);
+  }
+  TEST_ASSERT_EQUAL_INT(2, log.size());
+
+  // Inner scopes end first
+  std::string json;
+  log.toJson(json);
+  TEST_ASSERT_EQUAL_INT(0, json.find("{\"traceEvents\":["));
+  const auto inner = json.find("{\"name\":\"event\",\"cat\":\"handler\",\"ph\":\"X\","
+                               "\"ts\":1005,\"dur\":20,");
+  const auto outer = json.find("{\"name\":\"request\",\"cat\":\"coms\",\"ph\":\"X\","
+                               "\"ts\":1000,\"dur\":25,");
+  TEST_ASSERT_TRUE(inner != std::string::npos);
+  TEST_ASSERT_TRUE(outer != std::string::npos && outer > inner);
+  TEST_ASSERT_TRUE(json.find("\"args\":{\"id\":2}") != std::string::npos);
+
+  log.reset();
+  TEST_ASSERT_EQUAL_INT(0, log.size());
+
+#if defined(BOWLER_TRACE)
+  // The coms traces the request, its dispatch, the handler and the reply
+  getTraceLog().setClock(clock);
+  getTraceLog().reset();
+  SETUP_BOWLER_COMS;
+  MAKE_PACKET(NoopPacket, 2, false);
+  server->readsToSend.push({2, 0, 0});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(4, getTraceLog().size());
+  getTraceLog().setClock(getSystemClock());
+#endif
+}
+#endif
+
+template <std::size_t N> void traffic_record_and_replay() {
+  VirtualClock clock(1000);
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  MockByteStream *sink = new MockByteStream();
+  auto *recorder = new RecordingBowlerServer<N>(
+    std::unique_ptr<BowlerServer<N>>(server), std::unique_ptr<ByteStream>(sink), 4096, clock);
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(recorder), clock};
+  MAKE_PACKET(NoopPacket, 2, false);
+  MAKE_PACKET(NoopPacket, 3, false);
+
+  server->readsToSend.push({2, 0, 0, 42});
+  coms.loop();
+  clock.advance(300);
+  server->readsToSend.push({3, 0, 0, 0, 7});
+  coms.loop();
+  recorder->flush();
+  TEST_ASSERT_EQUAL_INT(2, recorder->getStats().recorded);
+
+  // The header, then each frame cut after its last non-zero byte
+  std::vector<std::uint8_t> recording(sink->bytesWritten.begin(), sink->bytesWritten.end());
+  const std::vector<std::uint8_t> expected{
+    'B', 'W', 'T', 'R', traffic::VERSION, N & 0xFF, N >> 8, 0, 0, 4, 2, 0, 0, 42,
+    0xAC, 0x02, 0, 5, 3, 0, 0, 0, 7};
+  TEST_ASSERT_EQUAL_INT(expected.size(), recording.size());
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected.data(), recording.data(), expected.size());
+
+  const auto ids = ReplayBowlerServer<N>::getPacketIds(recording);
+  TEST_ASSERT_EQUAL_INT(2, ids.size());
+  TEST_ASSERT_EQUAL_UINT8(3, ids[1]);
+
+  // At the original timing, the second frame waits for its gap
+  VirtualClock replayClock(5000);
+  auto *replay =
+    new ReplayBowlerServer<N>(recording, ReplayBowlerServer<N>::originalTiming, replayClock);
+  TEST_ASSERT_TRUE(replay->isValid());
+  DefaultBowlerComs<N> replayComs{std::unique_ptr<BowlerServer<N>>(replay), replayClock};
+  replayComs.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(2, false)));
+  replayComs.addPacket(std::shared_ptr<NoopPacket>(new NoopPacket(3, false)));
+
+  replayComs.loop();
+  TEST_ASSERT_EQUAL_INT(1, replay->getFramesRead());
+  TEST_ASSERT_EQUAL_INT(300, replay->getTimeUntilNextFrame());
+  replayClock.advance(200);
+  replayComs.loop();
+  TEST_ASSERT_EQUAL_INT(1, replay->getFramesRead());
+
+  // A late frame counts the time it waited in its latency
+  replayClock.advance(150);
+  replayComs.loop();
+  TEST_ASSERT_TRUE(replay->isFinished());
+  TEST_ASSERT_EQUAL_INT(2, replay->getReplies());
+  TEST_ASSERT_EQUAL_INT(0, replay->getLatency(2).maxLatency);
+  TEST_ASSERT_EQUAL_INT(1, replay->getLatency(3).replies);
+  TEST_ASSERT_EQUAL_INT(50, replay->getLatency(3).maxLatency);
+  TEST_ASSERT_EQUAL_INT(350, replay->getElapsed());
+}
+
+#if defined(PLATFORM_NATIVE) && !defined(BOWLER_DISABLE_HEAP_STATS)
+#if !defined(BOWLER_SOAK_CYCLES)
+#define BOWLER_SOAK_CYCLES 1000000
+#endif
+
+template <std::size_t N> void heap_stable_across_reconnects() {
+  SETUP_BOWLER_COMS;
+  for (std::uint8_t id = 2; id < 6; id++) {
+    coms.addEnsuredPacket([id]() { return std::shared_ptr<NoopPacket>(new NoopPacket(id, true)); });
+  }
+  coms.addEnsuredPackets();
+
+  // A disconnect leaves the management packet waiting for seqnum 0
+  const std::array<std::array<std::uint8_t, N>, 3> reconnect{
+    {{SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_DISCONNECT_ID},
+     {SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_ADD_ENSURED_PACKETS},
+     {SERVER_MANAGEMENT_PACKET_ID, 1, 0, OPERATION_DISCOVER}}};
+  auto runCycles = [&](std::uint32_t icycles) {
+    for (std::uint32_t i = 0; i < icycles; i++) {
+      for (auto &&request : reconnect) {
+        server->readsToSend.push(request);
+        coms.loop();
+        server->writesReceived.pop();
+      }
+    }
+  };
+
+  // Let the allocator settle, then measure a window to compare the soak against
+  const std::uint32_t window = 1000;
+  runCycles(window);
+  getHeapStats().reset();
+  runCycles(window);
+  std::array<HeapPhaseStats, HeapStats::PHASES> baseline;
+  for (std::uint8_t phase = 0; phase < HeapStats::PHASES; phase++) {
+    baseline[phase] = *getHeapStats().get(phase);
+  }
+
+  getHeapStats().reset();
+  runCycles(BOWLER_SOAK_CYCLES);
+  for (std::uint8_t phase = 0; phase < HeapStats::PHASES; phase++) {
+    const HeapPhaseStats &stats = *getHeapStats().get(phase);
+    TEST_ASSERT_EQUAL_INT(BOWLER_SOAK_CYCLES, stats.runs);
+    TEST_ASSERT_TRUE(stats.peakInUse <= baseline[phase].peakInUse);
+    TEST_ASSERT_TRUE(stats.peakFragmented <= baseline[phase].peakFragmented);
+  }
+
+  if (getAllocationCount() != 0) {
+    TEST_ASSERT_TRUE(getHeapStats().get(heapPhaseAddEnsuredPackets)->allocations > 0);
+  }
+
+  // The host reads the same numbers, and can start a new window
+  server->readsToSend.push({SERVER_MANAGEMENT_PACKET_ID, 0, 0, OPERATION_GET_HEAP, 0, 1});
+  coms.loop();
+  const auto reply = server->writesReceived.front();
+  server->writesReceived.pop();
+  TEST_ASSERT_EQUAL_UINT8(STATUS_ACCEPTED, reply[HEADER_LENGTH]);
+  const std::uint8_t *runs = reply.data() + HEADER_LENGTH + 1 + 16;
+  TEST_ASSERT_EQUAL_INT(BOWLER_SOAK_CYCLES,
+                        runs[0] | (runs[1] << 8) | (runs[2] << 16) | (runs[3] << 24));
+  TEST_ASSERT_EQUAL_INT(0, getHeapStats().get(heapPhaseDisconnect)->runs);
+}
+#endif
+
+template <std::size_t N> void impaired_link_delivers_reliable_packets_once() {
+  VirtualClock clock(1000);
+  ImpairmentConfig delayed;
+  delayed.delay = 100;
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  auto *link = new ImpairedBowlerServer<N>(
+    std::unique_ptr<BowlerServer<N>>(server), delayed, 42, clock);
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(link), clock};
+  std::shared_ptr<MockPacket> packet(new MockPacket(2, true));
+  coms.addPacket(packet);
+
+  // The request and then its reply each wait out the delay
+  server->readsToSend.push({2, 0, 0, 7});
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(0, packet->payloads.size());
+  clock.advance(100);
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, packet->payloads.size());
+  TEST_ASSERT_EQUAL_INT(0, server->writesReceived.size());
+  clock.advance(100);
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, server->writesReceived.size());
+  server->writesReceived.pop();
+
+  // A duplicated request is ACKed twice but runs once
+  ImpairmentConfig duplicated;
+  duplicated.duplicate = 1;
+  link->setIncomingConfig(duplicated);
+  link->setOutgoingConfig(ImpairmentConfig());
+  server->readsToSend.push({2, 1, 0, 8});
+  coms.loop();
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(2, packet->payloads.size());
+  TEST_ASSERT_EQUAL_INT(2, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_INT(1, link->getIncomingStats().duplicated);
+  while (!server->writesReceived.empty()) {
+    server->writesReceived.pop();
+  }
+
+  // Under bursty loss both ways, a host which retransmits until it is ACKed gets every request run
+  // exactly once, in order
+  link->setIncomingConfig(ImpairmentConfig::bursty(0.3, 3));
+  link->setOutgoingConfig(ImpairmentConfig::bursty(0.3, 3));
+  packet->payloads.clear();
+  for (std::size_t i = 0; i < 200; i++) {
+    const std::uint8_t seq = i & 1;
+    bool acked = false;
+    while (!acked) {
+      server->readsToSend.push({2, seq, 0, std::uint8_t(i)});
+      coms.loop();
+      while (!server->writesReceived.empty()) {
+        acked |= server->writesReceived.front()[2] == seq;
+        server->writesReceived.pop();
+      }
+    }
+  }
+
+  TEST_ASSERT_EQUAL_INT(200, packet->payloads.size());
+  for (std::size_t i = 0; i < 200; i++) {
+    TEST_ASSERT_EQUAL_UINT8(i, packet->payloads[i][0]);
+  }
+  TEST_ASSERT_TRUE(link->getIncomingStats().dropped > 0);
+  TEST_ASSERT_TRUE(link->getOutgoingStats().dropped > 0);
+}
+
+template <std::size_t N> void impaired_link_over_server_that_fails_when_empty() {
+  VirtualClock clock(1000);
+  ImpairmentConfig delayed;
+  delayed.delay = 100;
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  server->failWhenEmpty = true;
+  auto *link = new ImpairedBowlerServer<N>(
+    std::unique_ptr<BowlerServer<N>>(server), delayed, 42, clock);
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(link), clock};
+  std::shared_ptr<MockPacket> packet(new MockPacket(2, false));
+  coms.addPacket(packet);
+
+  // The other server fails with EWOULDBLOCK on every poll once it is empty, yet queued frames
+  // still come out when they are due
+  server->readsToSend.push({2, 0, 0, 7});
+  coms.loop();
+  clock.advance(100);
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, packet->payloads.size());
+  clock.advance(100);
+  coms.loop();
+  TEST_ASSERT_EQUAL_INT(1, server->writesReceived.size());
+  TEST_ASSERT_EQUAL_UINT8(7, server->writesReceived.front()[3]);
+}
+
+template <std::size_t N> void impaired_link_keeps_multicast_flag_of_each_frame() {
+  VirtualClock clock(1000);
+  ImpairmentConfig delayed;
+  delayed.delay = 100;
+  MockBowlerServer<N> *server = new MockBowlerServer<N>();
+  ImpairedBowlerServer<N> link{std::unique_ptr<BowlerServer<N>>(server), delayed, 42, clock};
+
+  // A multicast frame is still queued when a unicast one arrives
+  bool available = false;
+  server->multicast = true;
+  server->readsToSend.push({2, 0, 0, 1});
+  link.isDataAvailable(available);
+  clock.advance(50);
+  server->multicast = false;
+  server->readsToSend.push({2, 0, 0, 2});
+  link.isDataAvailable(available);
+
+  std::array<std::uint8_t, N> frame;
+  clock.advance(50);
+  TEST_ASSERT_EQUAL_INT(1, link.read(frame));
+  TEST_ASSERT_EQUAL_UINT8(1, frame[3]);
+  TEST_ASSERT_TRUE(link.isMulticast());
+
+  server->multicast = true;
+  clock.advance(50);
+  TEST_ASSERT_EQUAL_INT(1, link.read(frame));
+  TEST_ASSERT_EQUAL_UINT8(2, frame[3]);
+  TEST_ASSERT_FALSE(link.isMulticast());
+}
+
+/**
+ * Runs a server management operation in frames too short for its payload, and checks that it is
+ * rejected without touching the bytes past the frame.
+ */
+static void assertRejectsShortPayload(std::uint8_t ioperation) {
+  const std::size_t N = HEADER_LENGTH + 1;
+  DefaultBowlerComs<N> coms{std::unique_ptr<MockBowlerServer<N>>(new MockBowlerServer<N>())};
+  ServerManagementPacket<N> packet(&coms);
+  std::array<std::uint8_t, 16> payload;
+  payload.fill(0xAA);
+  payload[0] = ioperation;
+
+  errno = 0;
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, packet.event(payload.data()));
+  TEST_ASSERT_EQUAL_INT(EMSGSIZE, errno);
+  TEST_ASSERT_EQUAL_UINT8(STATUS_REJECTED_GENERIC, payload[0]);
+  for (std::size_t i = 1; i < payload.size(); i++) {
+    TEST_ASSERT_EQUAL_UINT8(0xAA, payload[i]);
+  }
+}
+
+void server_management_rejects_short_payloads() {
+  assertRejectsShortPayload(OPERATION_DISCOVER);
+  assertRejectsShortPayload(OPERATION_GET_METRICS);
+  assertRejectsShortPayload(OPERATION_SET_TIMESTAMP_MODE);
+  assertRejectsShortPayload(OPERATION_GET_LATENCY);
+  assertRejectsShortPayload(OPERATION_READ_LOG);
+  assertRejectsShortPayload(OPERATION_GET_LOG_FORMAT);
+  assertRejectsShortPayload(OPERATION_CLOCK_SYNC);
+  assertRejectsShortPayload(OPERATION_GET_PROFILE);
+  assertRejectsShortPayload(OPERATION_READ_CAPTURE);
+  assertRejectsShortPayload(OPERATION_GET_HEAP);
+}
+
+#if defined(PLATFORM_NATIVE)
+/**
+ * @return A blocking TCP socket connected to a port on loopback.
+ */
+static int connectTcp(std::uint16_t iport) {
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(iport);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  return fd;
+}
+
+/**
+ * @return A UDP socket bound to a free port on loopback.
+ */
+static int bindUdp() {
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  return fd;
+}
+
+template <std::size_t N> void reliable_state_forgotten_when_connection_closes() {
+  auto *server = new TCPServer<N>(0);
+  TEST_ASSERT_EQUAL_INT(1, server->begin(htonl(INADDR_LOOPBACK)));
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(server)};
+  MAKE_PACKET(NoopPacket, 2, true);
+
+  for (int i = 0; i < 50; i++) {
+    const int fd = connectTcp(server->getPort());
+    std::array<std::uint8_t, 2 + N> frame{N & 0xFF, N >> 8, 2};
+    TEST_ASSERT_EQUAL_INT(frame.size(), send(fd, frame.data(), frame.size(), 0));
+    while (coms.getRequestCount() != std::uint32_t(i + 1)) {
+      coms.loop();
+    }
+    server->flush();
+    TEST_ASSERT_EQUAL_INT(frame.size(), recv(fd, frame.data(), frame.size(), MSG_WAITALL));
+    close(fd);
+  }
+
+  // Every connection is gone, and so is the state kept for it
+  for (int i = 0; i < 100 && (server->getConnectionCount() > 0 || coms.getReliableStateCount() > 0);
+       i++) {
+    coms.loop();
+    delay(1);
+  }
+  TEST_ASSERT_EQUAL_INT(0, server->getConnectionCount());
+  TEST_ASSERT_EQUAL_INT(0, coms.getReliableStateCount());
+}
+
+template <std::size_t N> void reliable_state_reset_when_peer_evicted() {
+  auto *server = new LinuxUDPServer<N>(0);
+  TEST_ASSERT_EQUAL_INT(1, server->begin(htonl(INADDR_LOOPBACK)));
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(server)};
+  std::shared_ptr<MockPacket> packet(new MockPacket(2, true));
+  coms.addPacket(packet);
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(server->getPort());
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const std::array<std::uint8_t, N> request{2, 0, 0, 42};
+  // Clients stay open, so that a new one cannot get the port of an old one
+  std::vector<int> clients;
+  auto sendFromNewClient = [&] {
+    clients.push_back(bindUdp());
+    sendto(clients.back(),
+           request.data(),
+           N,
+           0,
+           reinterpret_cast<sockaddr *>(&address),
+           sizeof(address));
+    for (int i = 0; i < 10; i++) {
+      coms.loop();
+    }
+  };
+
+  // Fill the peer table, with every route now waiting for seqnum 1
+  for (std::size_t i = 0; i < LinuxUDPServer<N>::MAX_PEERS; i++) {
+    sendFromNewClient();
+  }
+  TEST_ASSERT_EQUAL_INT(LinuxUDPServer<N>::MAX_PEERS, packet->payloads.size());
+
+  // The next client takes over the oldest route, and its first request is new to it
+  sendFromNewClient();
+  TEST_ASSERT_EQUAL_INT(LinuxUDPServer<N>::MAX_PEERS + 1, packet->payloads.size());
+  TEST_ASSERT_EQUAL_INT(LinuxUDPServer<N>::MAX_PEERS, coms.getReliableStateCount());
+  for (int fd : clients) {
+    close(fd);
+  }
+}
+
+/**
+ * Waits for the server to have a frame to read.
+ *
+ * @return Whether it has one.
+ */
+template <std::size_t N> static bool waitForFrame(TCPServer<N> &iserver) {
+  bool available = false;
+  for (int i = 0; i < 100 && !available; i++) {
+    iserver.waitForData(10);
+    iserver.isDataAvailable(available);
+  }
+  return available;
+}
+
+template <std::size_t N> void tcp_server_reassembles_partial_frames() {
+  TCPServer<N> server{0};
+  TEST_ASSERT_EQUAL_INT(1, server.begin(htonl(INADDR_LOOPBACK)));
+  const int fd = connectTcp(server.getPort());
+
+  // The prefix and half of a short frame are not a frame yet
+  const std::uint8_t start[] = {4, 0, 2, 1};
+  send(fd, start, sizeof(start), 0);
+  bool available = true;
+  server.waitForData(100);
+  server.isDataAvailable(available);
+  TEST_ASSERT_FALSE(available);
+
+  // The rest of it arrives with a whole frame after it
+  std::array<std::uint8_t, 4 + N> rest{0, 42, N & 0xFF, N >> 8, 3};
+  rest.back() = 7;
+  send(fd, rest.data(), rest.size(), 0);
+  TEST_ASSERT_TRUE(waitForFrame(server));
+
+  std::array<std::uint8_t, N> frame;
+  const std::array<std::uint8_t, N> shortFrame{2, 1, 0, 42};
+  TEST_ASSERT_EQUAL_INT(1, server.read(frame));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(shortFrame.data(), frame.data(), N);
+  TEST_ASSERT_TRUE(waitForFrame(server));
+  TEST_ASSERT_EQUAL_INT(1, server.read(frame));
+  TEST_ASSERT_EQUAL_UINT8(3, frame[0]);
+  TEST_ASSERT_EQUAL_UINT8(7, frame[N - 1]);
+  TEST_ASSERT_EQUAL_INT(2, server.getStats().framesReceived);
+  close(fd);
+}
+
+template <std::size_t N> void tcp_server_drops_oversize_frames() {
+  TCPServer<N> server{0};
+  TEST_ASSERT_EQUAL_INT(1, server.begin(htonl(INADDR_LOOPBACK)));
+  const int bad = connectTcp(server.getPort());
+  const int good = connectTcp(server.getPort());
+
+  const std::uint8_t oversize[] = {(N + 1) & 0xFF, (N + 1) >> 8, 2, 0, 0};
+  send(bad, oversize, sizeof(oversize), 0);
+  const std::uint8_t frame[] = {1, 0, 2};
+  send(good, frame, sizeof(frame), 0);
+
+  // The stream with the bad length is closed, and the other is served
+  TEST_ASSERT_TRUE(waitForFrame(server));
+  std::array<std::uint8_t, N> payload;
+  TEST_ASSERT_EQUAL_INT(1, server.read(payload));
+  TEST_ASSERT_EQUAL_UINT8(2, payload[0]);
+  TEST_ASSERT_EQUAL_INT(1, server.getStats().framingErrors);
+  TEST_ASSERT_EQUAL_INT(1, server.getConnectionCount());
+  std::uint8_t byte;
+  TEST_ASSERT_EQUAL_INT(0, recv(bad, &byte, 1, 0));
+  close(bad);
+  close(good);
+}
+
+template <std::size_t N> void tcp_server_resumes_partial_writes() {
+  // More than the socket buffers hold, which grow to megabytes on loopback
+  const std::size_t replies = 100000;
+  TCPServer<N> server{0, true, 32, replies};
+  TEST_ASSERT_EQUAL_INT(1, server.begin(htonl(INADDR_LOOPBACK)));
+
+  // A small receive window backs the replies up into the server
+  const int fd = socket(AF_INET, SOCK_STREAM, 0);
+  const int bufferSize = 4096;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(server.getPort());
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+  const std::uint8_t request[] = {1, 0, 2};
+  send(fd, request, sizeof(request), 0);
+  TEST_ASSERT_TRUE(waitForFrame(server));
+  std::array<std::uint8_t, N> payload;
+  server.read(payload);
+
+  for (std::size_t i = 0; i < replies; i++) {
+    TEST_ASSERT_EQUAL_INT(
+      1, server.write({std::uint8_t(i), std::uint8_t(i >> 8), std::uint8_t(i >> 16)}));
+  }
+  server.flush();
+  TEST_ASSERT_TRUE(server.getStats().framesSent < replies);
+
+  // Every reply arrives whole and in order as the client reads them
+  std::vector<std::uint8_t> stream;
+  std::array<std::uint8_t, 65536> chunk;
+  for (int i = 0; i < 100000 && stream.size() < replies * (2 + N); i++) {
+    const ssize_t count = recv(fd, chunk.data(), chunk.size(), MSG_DONTWAIT);
+    if (count > 0) {
+      stream.insert(stream.end(), chunk.begin(), chunk.begin() + count);
+    } else {
+      delay(1);
+    }
+    server.flush();
+  }
+
+  TEST_ASSERT_EQUAL_INT(replies * (2 + N), stream.size());
+  for (std::size_t i = 0; i < replies; i++) {
+    const std::uint8_t *frame = stream.data() + i * (2 + N);
+    TEST_ASSERT_EQUAL_INT(N, frame[0] | (frame[1] << 8));
+    TEST_ASSERT_EQUAL_INT(i, frame[2] | (frame[3] << 8) | (frame[4] << 16));
+  }
+  TEST_ASSERT_EQUAL_INT(replies, server.getStats().framesSent);
+  close(fd);
+}
+
+template <std::size_t N> void tcp_server_drops_client_which_does_not_read() {
+  TCPServer<N> server{0, true, 1, 4};
+  TEST_ASSERT_EQUAL_INT(1, server.begin(htonl(INADDR_LOOPBACK)));
+  const int fd = connectTcp(server.getPort());
+  const std::uint8_t request[] = {1, 0, 2};
+  send(fd, request, sizeof(request), 0);
+  TEST_ASSERT_TRUE(waitForFrame(server));
+  std::array<std::uint8_t, N> payload;
+  server.read(payload);
+
+  // Once the socket buffers are full, the queue of unsent replies stops growing at its limit
+  std::int32_t error = 1;
+  for (int i = 0; i < 1000000 && error != BOWLER_ERROR; i++) {
+    error = server.write(payload);
+  }
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, error);
+  TEST_ASSERT_EQUAL_INT(ENOBUFS, errno);
+  TEST_ASSERT_EQUAL_INT(1, server.getStats().txOverflows);
+  server.flush();
+  TEST_ASSERT_EQUAL_INT(0, server.getConnectionCount());
+  close(fd);
+}
+
+template <std::size_t N> void tcp_server_routes_replies_to_their_connections() {
+  auto *server = new TCPServer<N>(0);
+  TEST_ASSERT_EQUAL_INT(1, server->begin(htonl(INADDR_LOOPBACK)));
+  DefaultBowlerComs<N> coms{std::unique_ptr<BowlerServer<N>>(server)};
+  MAKE_PACKET(NoopPacket, 2, false);
+
+  std::array<int, 3> clients;
+  for (std::size_t i = 0; i < clients.size(); i++) {
+    clients[i] = connectTcp(server->getPort());
+  }
+
+  // The first client has two requests in flight
+  const std::uint8_t tags[] = {0, 1, 2, 10};
+  for (std::size_t i = 0; i < sizeof(tags); i++) {
+    const std::uint8_t frame[] = {4, 0, 2, 0, 0, tags[i]};
+    send(clients[i % clients.size()], frame, sizeof(frame), 0);
+  }
+  for (int i = 0; i < 1000 && coms.getRequestCount() < sizeof(tags); i++) {
+    server->waitForData(10);
+    coms.loop();
+  }
+  server->flush();
+
+  std::array<std::uint8_t, 2 + N> reply;
+  for (std::size_t i = 0; i < sizeof(tags); i++) {
+    const int fd = clients[i % clients.size()];
+    TEST_ASSERT_EQUAL_INT(reply.size(), recv(fd, reply.data(), reply.size(), MSG_WAITALL));
+    TEST_ASSERT_EQUAL_UINT8(tags[i], reply[2 + HEADER_LENGTH]);
+  }
+  for (auto &&fd : clients) {
+    TEST_ASSERT_EQUAL_INT(-1, recv(fd, reply.data(), reply.size(), MSG_DONTWAIT));
+    close(fd);
+  }
+}
+
+template <std::size_t N> void shm_ring_drops_frames_when_full() {
+  ShmFrameRing<N, 4> ring;
+  bool woke;
+  for (std::uint8_t i = 0; i < 4; i++) {
+    TEST_ASSERT_TRUE(ring.push({i}, woke));
+  }
+  TEST_ASSERT_FALSE(ring.push({4}, woke));
+
+  std::array<std::uint8_t, N> frame;
+  TEST_ASSERT_TRUE(ring.pop(frame));
+  TEST_ASSERT_EQUAL_UINT8(0, frame[0]);
+  TEST_ASSERT_TRUE(ring.push({5}, woke));
+
+  // The server drops replies the host does not read, as a datagram server would
+  ShmServer<N, 4> server{"/bowler-test-full"};
+  TEST_ASSERT_EQUAL_INT(1, server.begin());
+  ShmClient<N, 4> client{"/bowler-test-full"};
+  TEST_ASSERT_EQUAL_INT(1, client.begin());
+  for (std::uint8_t i = 0; i < 4; i++) {
+    TEST_ASSERT_EQUAL_INT(1, server.write({i}));
+  }
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, server.write({4}));
+  TEST_ASSERT_EQUAL_INT(ENOBUFS, errno);
+  TEST_ASSERT_EQUAL_INT(1, server.getStats().framesDropped);
+  TEST_ASSERT_EQUAL_INT(1, client.read(frame));
+  TEST_ASSERT_EQUAL_UINT8(0, frame[0]);
+}
+
+template <std::size_t N> void shm_client_rejects_other_layouts() {
+  ShmServer<N, 8> server{"/bowler-test-layout"};
+  TEST_ASSERT_EQUAL_INT(1, server.begin());
+
+  ShmClient<N, 16> otherSlots{"/bowler-test-layout"};
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, otherSlots.begin());
+  TEST_ASSERT_EQUAL_INT(EPROTO, errno);
+  ShmClient<N + 1, 8> otherLength{"/bowler-test-layout"};
+  TEST_ASSERT_EQUAL_INT(BOWLER_ERROR, otherLength.begin());
+  TEST_ASSERT_EQUAL_INT(EPROTO, errno);
+
+  ShmClient<N, 8> client{"/bowler-test-layout"};
+  TEST_ASSERT_EQUAL_INT(1, client.begin());
+}
+
+template <std::size_t N> void shm_futex_wakes_sleeping_side() {
+  ShmServer<N> server{"/bowler-test-futex"};
+  TEST_ASSERT_EQUAL_INT(1, server.begin());
+  ShmClient<N> client{"/bowler-test-futex"};
+  TEST_ASSERT_EQUAL_INT(1, client.begin());
+
+  // Nothing arrives, so the wait times out
+  TEST_ASSERT_FALSE(server.waitForData(10));
+
+  // A request wakes the server up well before the timeout
+  std::thread host([&client] {
+    delay(20);
+    client.write({2});
+  });
+  const unsigned long start = millis();
+  TEST_ASSERT_TRUE(server.waitForData(5000));
+  TEST_ASSERT_TRUE(millis() - start < 2500);
+  host.join();
+
+  // And its reply wakes the host up
+  std::thread device([&server] {
+    delay(20);
+    server.write({3});
+  });
+  std::array<std::uint8_t, N> reply;
+  TEST_ASSERT_EQUAL_INT(1, client.read(reply, 5000));
+  TEST_ASSERT_EQUAL_UINT8(3, reply[0]);
+  device.join();
+  TEST_ASSERT_EQUAL_INT(1, server.getStats().wakeups);
+}
+#endif
+
+int runUnityTests() {
   UNITY_BEGIN();
   RUN_TEST(receive_seqnum_0<DEFAULT_PACKET_SIZE>);
   RUN_TEST(receive_seqnum_1<DEFAULT_PACKET_SIZE>);
@@ -213,8 +1884,84 @@ void setup() {
   RUN_TEST(add_ensured_packets<DEFAULT_PACKET_SIZE>);
   RUN_TEST(two_rdt_packets<DEFAULT_PACKET_SIZE>);
   RUN_TEST(disconnect_before_add_ensured_packets<DEFAULT_PACKET_SIZE>);
-  UNITY_END();
+  RUN_TEST(independent_packets_run_on_executor<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(executor_keeps_order_of_one_id<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(executor_runs_other_ids_while_one_blocks<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(write_queue_drop_newest<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(write_queue_drop_oldest<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(write_queue_block<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(deferred_reply_holds_reliable_slot<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(deferred_reply_after_remove_is_ignored<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(deferred_replies_pending_per_route<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(scheduler_runs_by_priority);
+  RUN_TEST(scheduler_counts_overruns);
+  RUN_TEST(scheduler_waits_for_period);
+  RUN_TEST(scheduler_adapts_period);
+  RUN_TEST(scheduler_profile_over_protocol<DEFAULT_PACKET_SIZE>);
+#if !defined(BOWLER_DISABLE_CAPTURE)
+  RUN_TEST(capture_streams_pcap_through_coms<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(capture_dump_rereads_and_times_out<DEFAULT_PACKET_SIZE>);
+#endif
+#if defined(PLATFORM_NATIVE)
+  RUN_TEST(trace_log_writes_chrome_json<DEFAULT_PACKET_SIZE>);
+#endif
+  RUN_TEST(traffic_record_and_replay<DEFAULT_PACKET_SIZE>);
+#if defined(PLATFORM_NATIVE) && !defined(BOWLER_DISABLE_HEAP_STATS)
+  RUN_TEST(heap_stable_across_reconnects<DEFAULT_PACKET_SIZE>);
+#endif
+  RUN_TEST(impaired_link_delivers_reliable_packets_once<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(impaired_link_over_server_that_fails_when_empty<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(impaired_link_keeps_multicast_flag_of_each_frame<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(server_management_rejects_short_payloads);
+  RUN_TEST(stream_server_round_trip<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(stream_server_drops_bad_crc<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(crc32_known_answer);
+  RUN_TEST(stream_server_reports_stream_errors<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(lossless_server_skips_ack_state_machine<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(multi_server_routes_replies<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(multi_server_backs_off_idle_servers<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(channel_demux_routes_by_channel<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(gateway_routes_by_device_address<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(multicast_runs_commands_without_replying<DEFAULT_PACKET_SIZE>);
+#if !defined(BOWLER_DISABLE_METRICS)
+  RUN_TEST(metrics_count_requests_and_duplicates<DEFAULT_PACKET_SIZE>);
+#endif
+  RUN_TEST(latency_histogram_buckets);
+  RUN_TEST(clock_sync_echoes_device_times<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(clock_sync_estimator_finds_offset_and_drift);
+  RUN_TEST(binary_log_formats_when_drained);
+  RUN_TEST(binary_log_read_by_host<DEFAULT_PACKET_SIZE>);
+#if !defined(BOWLER_DISABLE_METRICS)
+  RUN_TEST(timestamp_mode_measures_link_latency<DEFAULT_PACKET_SIZE>);
+#endif
+#if defined(PLATFORM_NATIVE)
+  RUN_TEST(multicast_discovery_on_loopback<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(device_simulator_serves_many_devices<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(reliable_state_forgotten_when_connection_closes<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(reliable_state_reset_when_peer_evicted<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(tcp_server_reassembles_partial_frames<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(tcp_server_drops_oversize_frames<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(tcp_server_resumes_partial_writes<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(tcp_server_drops_client_which_does_not_read<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(tcp_server_routes_replies_to_their_connections<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(shm_ring_drops_frames_when_full<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(shm_client_rejects_other_layouts<DEFAULT_PACKET_SIZE>);
+  RUN_TEST(shm_futex_wakes_sleeping_side<DEFAULT_PACKET_SIZE>);
+#endif
+  return UNITY_END();
+}
+
+void setup() {
+  // Give the serial monitor time to attach
+  delay(2000);
+  runUnityTests();
 }
 
 void loop() {
 }
+
+#if defined(PLATFORM_NATIVE)
+int main() {
+  return runUnityTests();
+}
+#endif
@@ -0,0 +1,54 @@
+-- This file is part of bowler-device-server.
+--
+-- bowler-device-server is free software: you can redistribute it and/or modify
+-- it under the terms of the GNU Lesser General Public License as published by
+-- the Free Software Foundation, either version 3 of the License, or
+-- (at your option) any later version.
+--
+-- bowler-device-server is distributed in the hope that it will be useful,
+-- but WITHOUT ANY WARRANTY; without even the implied warranty of
+-- MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+-- GNU Lesser General Public License for more details.
+--
+-- You should have received a copy of the GNU Lesser General Public License
+-- along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+
+-- Wireshark dissector for captures written by CaptureBowlerServer (link type USER0). Copy it into
+-- the Wireshark plugins folder, or run `wireshark -X lua_script:tools/bowler.lua capture.pcap`.
+
+local bowler = Proto("bowler", "Bowler RPC")
+
+local directions = { [0] = "Request", [1] = "Reply" }
+
+local fields = bowler.fields
+fields.direction = ProtoField.uint8("bowler.direction", "Direction", base.DEC, directions)
+fields.route = ProtoField.uint32("bowler.route", "Route", base.HEX)
+fields.id = ProtoField.uint8("bowler.id", "Packet ID", base.DEC)
+fields.seq = ProtoField.uint8("bowler.seq", "Seq Num", base.DEC)
+fields.ack = ProtoField.uint8("bowler.ack", "ACK Num", base.DEC)
+fields.payload = ProtoField.bytes("bowler.payload", "Payload")
+
+function bowler.dissector(buffer, pinfo, tree)
+    if buffer:len() < 8 then
+        return 0
+    end
+
+    pinfo.cols.protocol = "Bowler"
+    local direction = buffer(0, 1):uint()
+    local id = buffer(5, 1):uint()
+    pinfo.cols.info = string.format("%s id=%d seq=%d ack=%d", directions[direction] or "?", id,
+        buffer(6, 1):uint(), buffer(7, 1):uint())
+
+    local subtree = tree:add(bowler, buffer(), "Bowler RPC")
+    subtree:add(fields.direction, buffer(0, 1))
+    subtree:add_le(fields.route, buffer(1, 4))
+    subtree:add(fields.id, buffer(5, 1))
+    subtree:add(fields.seq, buffer(6, 1))
+    subtree:add(fields.ack, buffer(7, 1))
+    if buffer:len() > 8 then
+        subtree:add(fields.payload, buffer(8))
+    end
+    return buffer:len()
+end
+
+DissectorTable.get("wtap_encap"):add((wtap_encaps or wtap).USER0, bowler)
@@ -0,0 +1,136 @@
+/*
+ * This file is part of bowler-device-server.
+ *
+ * bowler-device-server is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * bowler-device-server is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bowler-device-server.  If not, see <https://www.gnu.org/licenses/>.
+ */
+/*
+ * Runs a fleet of virtual devices for testing host software at scale:
+ *
+ *   deviceSimulator [--devices=<n>] [--threads=<n>] [--address=<a.b.c.d>] [--port=<p>]
+ *                   [--by-address] [--packets=<n>] [--cost=<us>] [--unreliable]
+ *
+ * Device i listens on port `port + i` at `address`, or with --by-address on `port` at the i-th
+ * address after `address`, which suits hosts that find devices by address; loopback answers on
+ * all of 127.0.0.0/8. Each device has packets 2 to `packets + 1`, which echo their payload after
+ * spinning for `cost` microseconds. Prints the devices, then the request rate every second, until
+ * interrupted.
+ */
+#include "busyPacket.hpp"
+#include "deviceSimulator.hpp"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace bowlerserver;
+
+namespace {
+volatile std::sig_atomic_t interrupted = 0;
+
+void onInterrupt(int) {
+  interrupted = 1;
+}
+
+/**
+ * @return The value of `--<iname>=<value>` if iarg is that option, otherwise nullptr.
+ */
+const char *getOption(const char *iarg, const char *iname) {
+  const std::size_t length = std::strlen(iname);
+  if (std::strncmp(iarg, "--", 2) == 0 && std::strncmp(iarg + 2, iname, length) == 0 &&
+      iarg[2 + length] == '=') {
+    return iarg + 3 + length;
+  }
+  return nullptr;
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  std::size_t devices = 100;
+  std::size_t threads = 4;
+  std::uint32_t address = INADDR_LOOPBACK;
+  std::uint16_t port = BOWLER_SERVER_UDP_PORT;
+  bool byAddress = false;
+  std::size_t packets = 4;
+  time_t cost = 0;
+  bool reliable = true;
+
+  for (int i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = getOption(argv[i], "devices"))) {
+      devices = std::strtoul(value, nullptr, 10);
+    } else if ((value = getOption(argv[i], "threads"))) {
+      threads = std::strtoul(value, nullptr, 10);
+    } else if ((value = getOption(argv[i], "address"))) {
+      in_addr parsed;
+      if (inet_pton(AF_INET, value, &parsed) != 1) {
+        std::fprintf(stderr, "Bad address: %s\n", value);
+        return 1;
+      }
+      address = ntohl(parsed.s_addr);
+    } else if ((value = getOption(argv[i], "port"))) {
+      port = std::strtoul(value, nullptr, 10);
+    } else if (std::strcmp(argv[i], "--by-address") == 0) {
+      byAddress = true;
+    } else if ((value = getOption(argv[i], "packets"))) {
+      packets = std::min<std::size_t>(std::strtoul(value, nullptr, 10), 253);
+    } else if ((value = getOption(argv[i], "cost"))) {
+      cost = std::strtoll(value, nullptr, 10);
+    } else if (std::strcmp(argv[i], "--unreliable") == 0) {
+      reliable = false;
+    } else {
+      std::fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  DeviceSimulator<DEFAULT_PACKET_SIZE> simulator(threads);
+  auto setup = [&](std::size_t, DefaultBowlerComs<DEFAULT_PACKET_SIZE> &icoms) {
+    for (std::size_t id = 2; id < 2 + packets; id++) {
+      icoms.addPacket(std::shared_ptr<BusyPacket>(new BusyPacket(id, reliable, cost)));
+    }
+  };
+
+  for (std::size_t i = 0; i < devices; i++) {
+    const std::uint32_t deviceAddress = byAddress ? address + i : address;
+    const std::uint16_t devicePort = byAddress ? port : port + i;
+    if (simulator.addDevice(htonl(deviceAddress), devicePort, setup) == BOWLER_ERROR) {
+      std::fprintf(stderr, "Device %zu: %s\n", i, std::strerror(errno));
+      return 1;
+    }
+
+    char text[INET_ADDRSTRLEN];
+    const in_addr printed{htonl(deviceAddress)};
+    inet_ntop(AF_INET, &printed, text, sizeof(text));
+    std::printf("device %zu %s:%u\n", i, text, simulator.getPort(i));
+  }
+
+  std::signal(SIGINT, onInterrupt);
+  std::signal(SIGTERM, onInterrupt);
+  if (simulator.start() == BOWLER_ERROR) {
+    std::fprintf(stderr, "Starting: %s\n", std::strerror(errno));
+    return 1;
+  }
+
+  std::uint64_t lastRequests = 0;
+  while (!interrupted) {
+    sleep(1);
+    const DeviceSimulatorStats stats = simulator.getStats();
+    std::printf("%llu requests/s\n", (unsigned long long)(stats.requests - lastRequests));
+    std::fflush(stdout);
+    lastRequests = stats.requests;
+  }
+
+  simulator.stop();
+  return 0;
+}